@@ -0,0 +1,508 @@
+/* Benchmarks
+   Drives the engine through the library API in db.h and prints the
+   results as JSON, so runs can be compared across changes. Built by
+   make bench.
+
+   Every workload is seeded, so the same options give the same keys and
+   the same operations in the same order on every run */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "db.h"
+
+#define BENCH_MAX_THREADS 64
+
+typedef struct BenchOptions_Struct {
+    const char* filename;
+    uint32_t rows;
+    uint32_t ops;
+    uint32_t threads;
+    uint32_t range;
+    uint32_t write_percent;
+    uint32_t scans;
+    uint64_t seed;
+    const char* workloads;
+    PagerOptions pager;
+} BenchOptions;
+
+/* One thread's share of a workload, and the latency of each operation */
+typedef struct BenchWorker_Struct {
+    Table* table;
+    const BenchOptions* options;
+    uint32_t index;
+    uint32_t ops;
+
+    /* Index of the worker's next operation in the whole workload */
+    uint32_t next;
+    uint64_t* latencies;
+    uint64_t rows_seen;
+    uint64_t (*run)(struct BenchWorker_Struct* worker, uint64_t* random);
+} BenchWorker;
+
+uint64_t bench_random(uint64_t* state){
+    /* xorshift64*, fixed by the seed so runs repeat */
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+uint64_t bench_now(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+int compare_latencies(const void* a, const void* b){
+    uint64_t latency_a = *(const uint64_t*) a;
+    uint64_t latency_b = *(const uint64_t*) b;
+
+    return (latency_a > latency_b) - (latency_a < latency_b);
+}
+
+double bench_percentile(const uint64_t* sorted, uint64_t count, double fraction){
+    /* In microseconds, taking the nearest rank */
+    if (count == 0){
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t) (fraction * count);
+    return sorted[rank < count ? rank : count - 1] / 1000.0;
+}
+
+void bench_make_row(uint32_t id, Row* row){
+    sprintf(row->username, "user%u", id);
+    sprintf(row->email, "user%u@example.com", id);
+    row->id = id;
+}
+
+Table* bench_open_empty(const BenchOptions* options){
+    unlink(options->filename);
+
+    char wal_name[4096];
+    snprintf(wal_name, sizeof(wal_name), "%s-wal", options->filename);
+    unlink(wal_name);
+
+    PagerOptions pager = options->pager;
+    Table* table = db_open(options->filename, &pager);
+
+    /* db_open() has said why */
+    if (table == NULL){
+        exit(1);
+    }
+
+    return table;
+}
+
+uint32_t* bench_shuffled_ids(uint32_t count, uint64_t seed){
+    /* 1 to count in a random order */
+    uint32_t* ids = malloc(count * sizeof(uint32_t));
+    uint64_t random = seed;
+
+    for (uint32_t i = 0; i < count; i++){
+        ids[i] = i + 1;
+    }
+
+    for (uint32_t i = count - 1; i > 0; i--){
+        uint32_t j = bench_random(&random) % (i + 1);
+        uint32_t id = ids[i];
+        ids[i] = ids[j];
+        ids[j] = id;
+    }
+
+    return ids;
+}
+
+void bench_report(const char* workload, const BenchOptions* options, uint32_t threads, uint64_t* latencies,
+                  uint64_t count, uint64_t rows_seen, uint64_t elapsed, Table* table, const DbStats* before,
+                  bool* first){
+    DbStats after;
+    db_stats(table, &after);
+    qsort(latencies, count, sizeof(uint64_t), compare_latencies);
+
+    double seconds = elapsed / 1e9;
+
+    printf("%s    {\"workload\": \"%s\", \"rows\": %u, \"threads\": %u, \"ops\": %llu, ",
+           *first ? "" : ",\n", workload, options->rows, threads, (unsigned long long) count);
+    printf("\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"rows_per_sec\": %.1f, ", seconds,
+           seconds > 0 ? count / seconds : 0, seconds > 0 ? rows_seen / seconds : 0);
+    printf("\"latency_us\": {\"p50\": %.2f, \"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f}, ",
+           bench_percentile(latencies, count, 0.50), bench_percentile(latencies, count, 0.99),
+           bench_percentile(latencies, count, 0.999), count > 0 ? latencies[count - 1] / 1000.0 : 0);
+    printf("\"pages_read\": %llu, \"pages_written\": %llu, \"log_frames_written\": %llu, ",
+           (unsigned long long) (after.pages_read - before->pages_read),
+           (unsigned long long) (after.pages_written - before->pages_written),
+           (unsigned long long) (after.log_frames_written - before->log_frames_written));
+    printf("\"pool_hits\": %llu, \"pool_misses\": %llu, \"pages\": %u, \"tree_depth\": %u}",
+           (unsigned long long) (after.pool_hits - before->pool_hits),
+           (unsigned long long) (after.pool_misses - before->pool_misses), after.num_pages, after.tree_depth);
+
+    *first = false;
+}
+
+/* Inserts, reads and mixed work, spread over threads */
+
+uint64_t bench_op_lookup(BenchWorker* worker, uint64_t* random){
+    Row row;
+    uint32_t id = bench_random(random) % worker->options->rows + 1;
+
+    if (!db_get(worker->table, id, &row)){
+        printf("Lookup of %u found nothing\n", id);
+        exit(1);
+    }
+
+    return 1;
+}
+
+uint64_t bench_op_range(BenchWorker* worker, PreparedStatement* select, uint64_t* random){
+    const BenchOptions* options = worker->options;
+    uint32_t low = bench_random(random) % options->rows + 1;
+    uint64_t rows = 0;
+
+    db_bind_int(select, 0, low);
+    db_bind_int(select, 1, (uint64_t) low + options->range - 1);
+
+    while (db_step(select) == STEP_ROW){
+        rows += 1;
+    }
+
+    db_reset(select);
+
+    return rows;
+}
+
+void* bench_worker_run(void* arg){
+    BenchWorker* worker = arg;
+    uint64_t random = worker->options->seed + 0x9E3779B97F4A7C15ULL * (worker->index + 1);
+
+    for (uint32_t i = 0; i < worker->ops; i++){
+        uint64_t op_start = bench_now();
+        worker->rows_seen += worker->run(worker, &random);
+        worker->latencies[i] = bench_now() - op_start;
+        worker->next += 1;
+    }
+
+    return NULL;
+}
+
+/* Each thread prepares its own statements on first use */
+_Thread_local PreparedStatement* bench_range_select = NULL;
+_Thread_local PreparedStatement* bench_scan_select = NULL;
+_Thread_local PreparedStatement* bench_update = NULL;
+_Thread_local PreparedStatement* bench_insert_statement = NULL;
+
+/* The order random_insert adds rows in, NULL for increasing ids */
+uint32_t* bench_insert_ids = NULL;
+
+PreparedStatement* bench_statement(BenchWorker* worker, PreparedStatement** statement, const char* sql){
+    if (*statement == NULL){
+        PrepareResult prepare_result;
+        *statement = db_prepare(worker->table, sql, &prepare_result);
+    }
+
+    return *statement;
+}
+
+void bench_finalize_statements(){
+    db_finalize(bench_range_select);
+    db_finalize(bench_scan_select);
+    db_finalize(bench_update);
+    db_finalize(bench_insert_statement);
+    bench_range_select = bench_scan_select = bench_update = bench_insert_statement = NULL;
+}
+
+uint64_t bench_run_insert(BenchWorker* worker, uint64_t* random){
+    /* Each worker adds its own slice of the ids, one statement per row */
+    (void) random;
+    PreparedStatement* insert = bench_statement(worker, &bench_insert_statement, "insert ? ? ?");
+    Row row;
+
+    bench_make_row(bench_insert_ids ? bench_insert_ids[worker->next] : worker->next + 1, &row);
+    db_bind_int(insert, 0, row.id);
+    db_bind_text(insert, 1, row.username);
+    db_bind_text(insert, 2, row.email);
+
+    if (db_step(insert) != STEP_DONE){
+        printf("Insert of %u failed: %s\n", row.id, execute_result_message(db_statement_result(insert)));
+        exit(1);
+    }
+
+    db_reset(insert);
+
+    return 1;
+}
+
+uint64_t bench_run_lookup(BenchWorker* worker, uint64_t* random){
+    return bench_op_lookup(worker, random);
+}
+
+uint64_t bench_run_range(BenchWorker* worker, uint64_t* random){
+    PreparedStatement* select = bench_statement(worker, &bench_range_select,
+                                                "select * where id between ? and ?");
+    return bench_op_range(worker, select, random);
+}
+
+uint64_t bench_run_scan(BenchWorker* worker, uint64_t* random){
+    (void) random;
+    PreparedStatement* select = bench_statement(worker, &bench_scan_select, "select *");
+    uint64_t rows = 0;
+
+    while (db_step(select) == STEP_ROW){
+        rows += 1;
+    }
+
+    db_reset(select);
+
+    if (rows != worker->options->rows){
+        printf("Scan saw %llu rows of %u\n", (unsigned long long) rows, worker->options->rows);
+        exit(1);
+    }
+
+    return rows;
+}
+
+uint64_t bench_run_mixed(BenchWorker* worker, uint64_t* random){
+    /* write_percent of the operations rewrite a row's email, the rest
+       look a row up */
+    if (bench_random(random) % 100 >= worker->options->write_percent){
+        return bench_op_lookup(worker, random);
+    }
+
+    PreparedStatement* update = bench_statement(worker, &bench_update, "update set email = ? where id = ?");
+    uint32_t id = bench_random(random) % worker->options->rows + 1;
+    char email[64];
+
+    sprintf(email, "user%u.%llu@example.com", id, (unsigned long long) (bench_random(random) % 1000));
+    db_bind_text(update, 0, email);
+    db_bind_int(update, 1, id);
+
+    if (db_step(update) != STEP_DONE){
+        printf("Update of %u failed: %s\n", id, execute_result_message(db_statement_result(update)));
+        exit(1);
+    }
+
+    db_reset(update);
+
+    return 1;
+}
+
+void* bench_thread(void* arg){
+    bench_worker_run(arg);
+    bench_finalize_statements();
+    return NULL;
+}
+
+void bench_parallel(const char* workload, const BenchOptions* options, Table* table, uint32_t total_ops,
+                    uint64_t (*run)(BenchWorker* worker, uint64_t* random), bool* first){
+    /* Split total_ops over the threads and time them from the first start
+       to the last finish */
+    uint32_t threads = options->threads;
+    BenchWorker workers[BENCH_MAX_THREADS];
+    pthread_t handles[BENCH_MAX_THREADS];
+    uint64_t* latencies = malloc((uint64_t) total_ops * sizeof(uint64_t));
+    uint64_t offset = 0;
+    DbStats before;
+
+    for (uint32_t i = 0; i < threads; i++){
+        workers[i].table = table;
+        workers[i].options = options;
+        workers[i].index = i;
+        workers[i].ops = total_ops / threads + (i < total_ops % threads);
+        workers[i].next = offset;
+        workers[i].latencies = latencies + offset;
+        workers[i].rows_seen = 0;
+        workers[i].run = run;
+        offset += workers[i].ops;
+    }
+
+    db_stats(table, &before);
+    uint64_t start = bench_now();
+
+    for (uint32_t i = 0; i < threads; i++){
+        pthread_create(&handles[i], NULL, bench_thread, &workers[i]);
+    }
+
+    uint64_t rows_seen = 0;
+
+    for (uint32_t i = 0; i < threads; i++){
+        pthread_join(handles[i], NULL);
+        rows_seen += workers[i].rows_seen;
+    }
+
+    uint64_t elapsed = bench_now() - start;
+    bench_report(workload, options, threads, latencies, total_ops, rows_seen, elapsed, table, &before, first);
+    free(latencies);
+}
+
+void bench_insert(const char* workload, const BenchOptions* options, bool shuffled, bool* first){
+    Table* table = bench_open_empty(options);
+    bench_insert_ids = shuffled ? bench_shuffled_ids(options->rows, options->seed) : NULL;
+
+    bench_parallel(workload, options, table, options->rows, bench_run_insert, first);
+
+    db_close(table);
+    free(bench_insert_ids);
+    bench_insert_ids = NULL;
+}
+
+Table* bench_load(const BenchOptions* options){
+    /* The table the read workloads run on: ids 1 to rows, inserted as
+       one batch */
+    Table* table = bench_open_empty(options);
+    Row* rows = malloc(options->rows * sizeof(Row));
+
+    for (uint32_t i = 0; i < options->rows; i++){
+        bench_make_row(i + 1, &rows[i]);
+    }
+
+    if (table_insert_batch(table, rows, options->rows) != EXECUTE_SUCCESS){
+        printf("Load failed\n");
+        exit(1);
+    }
+
+    free(rows);
+
+    return table;
+}
+
+bool bench_selected(const BenchOptions* options, const char* workload){
+    /* Whether workload is named in the comma separated list */
+    size_t length = strlen(workload);
+    const char* list = options->workloads;
+
+    while (*list){
+        size_t item = strcspn(list, ",");
+
+        if (item == length && strncmp(list, workload, length) == 0){
+            return true;
+        }
+
+        list += item + (list[item] == ',');
+    }
+
+    return false;
+}
+
+void print_usage(){
+    printf("Usage: bench [--file PATH] [--rows N] [--ops N] [--threads N] [--range N]\n"
+           "             [--write-percent N] [--scans N] [--seed N] [--frames N]\n"
+           "             [--no-wal] [--mmap] [--no-uring] [--compress] [--page-size N]\n"
+           "             [--direct] [--workloads LIST]\n"
+           "Workloads: seq_insert,random_insert,lookup,scan,range_scan,mixed\n");
+}
+
+int main(int argc, char* argv[]){
+    BenchOptions options = {
+        .filename = "bench.db",
+        .rows = 100000,
+        .ops = 100000,
+        .threads = 1,
+        .range = 100,
+        .write_percent = 10,
+        .scans = 10,
+        .seed = 42,
+        .workloads = "seq_insert,random_insert,lookup,scan,range_scan,mixed",
+        .pager = { .max_frames = PAGER_DEFAULT_MAX_FRAMES, .use_wal = true, .use_uring = true }
+    };
+
+    for (int i = 1; i < argc; i++){
+        bool has_value = i + 1 < argc;
+
+        if (strcmp(argv[i], "--file") == 0 && has_value){
+            options.filename = argv[++i];
+        } else if (strcmp(argv[i], "--rows") == 0 && has_value){
+            options.rows = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--ops") == 0 && has_value){
+            options.ops = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--threads") == 0 && has_value){
+            options.threads = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--range") == 0 && has_value){
+            options.range = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--write-percent") == 0 && has_value){
+            options.write_percent = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--scans") == 0 && has_value){
+            options.scans = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--seed") == 0 && has_value){
+            options.seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--frames") == 0 && has_value){
+            options.pager.max_frames = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--workloads") == 0 && has_value){
+            options.workloads = argv[++i];
+        } else if (strcmp(argv[i], "--no-wal") == 0){
+            options.pager.use_wal = false;
+        } else if (strcmp(argv[i], "--mmap") == 0){
+            options.pager.use_mmap = true;
+            options.pager.use_wal = false;
+        } else if (strcmp(argv[i], "--no-uring") == 0){
+            options.pager.use_uring = false;
+        } else if (strcmp(argv[i], "--compress") == 0){
+            options.pager.use_compression = true;
+        } else if (strcmp(argv[i], "--page-size") == 0 && has_value){
+            options.pager.page_size = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--direct") == 0){
+            options.pager.use_direct_io = true;
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (options.rows == 0 || options.threads == 0 || options.threads > BENCH_MAX_THREADS ||
+        options.write_percent > 100 || options.seed == 0){
+        print_usage();
+        return 1;
+    }
+
+    bool first = true;
+
+    printf("{\n  \"config\": {\"rows\": %u, \"ops\": %u, \"threads\": %u, \"range\": %u, "
+           "\"write_percent\": %u, \"scans\": %u, \"seed\": %llu, \"frames\": %u, "
+           "\"wal\": %s, \"mmap\": %s, \"uring\": %s, \"compress\": %s, \"page_size\": %u, \"direct\": %s},\n  \"results\": [\n",
+           options.rows, options.ops, options.threads, options.range, options.write_percent, options.scans,
+           (unsigned long long) options.seed, options.pager.max_frames, options.pager.use_wal ? "true" : "false",
+           options.pager.use_mmap ? "true" : "false", options.pager.use_uring ? "true" : "false",
+           options.pager.use_compression ? "true" : "false", options.pager.page_size,
+           options.pager.use_direct_io ? "true" : "false");
+
+    if (bench_selected(&options, "seq_insert")){
+        bench_insert("seq_insert", &options, false, &first);
+    }
+
+    if (bench_selected(&options, "random_insert")){
+        bench_insert("random_insert", &options, true, &first);
+    }
+
+    if (bench_selected(&options, "lookup") || bench_selected(&options, "scan") ||
+        bench_selected(&options, "range_scan") || bench_selected(&options, "mixed")){
+        Table* table = bench_load(&options);
+
+        if (bench_selected(&options, "lookup")){
+            bench_parallel("lookup", &options, table, options.ops, bench_run_lookup, &first);
+        }
+
+        if (bench_selected(&options, "scan")){
+            bench_parallel("scan", &options, table, options.scans, bench_run_scan, &first);
+        }
+
+        if (bench_selected(&options, "range_scan")){
+            bench_parallel("range_scan", &options, table, options.ops, bench_run_range, &first);
+        }
+
+        if (bench_selected(&options, "mixed")){
+            bench_parallel("mixed", &options, table, options.ops, bench_run_mixed, &first);
+        }
+
+        db_close(table);
+    }
+
+    printf("\n  ]\n}\n");
+
+    return 0;
+}
@@ -0,0 +1,185 @@
+/* Library API
+   The database can run inside another program: build main.c with
+   -DDB_NO_MAIN and drive it through the calls below. The wire protocol
+   that --server speaks is described at the bottom */
+#ifndef DB_H
+#define DB_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct Table_Struct Table;
+
+#define PAGER_DEFAULT_MAX_FRAMES 1024
+
+typedef struct PagerOptions_Struct {
+    uint32_t max_frames;
+    bool use_mmap;
+    bool use_wal;
+    bool use_uring;
+
+    /* Create the file compressed, see "Compressed files" in main.c. An
+       existing file keeps the format it was created with */
+    bool use_compression;
+
+    /* Page size for a new file, 0 for the default. An existing file
+       keeps the size it was created with. The page layout is kept per
+       process rather than per database, so databases open at the same
+       time must share a page size; db_open() of one that does not, or of
+       a size that is not a power of two from 4 KB to 64 KB, returns NULL */
+    uint32_t page_size;
+
+    /* Read and write the db file with O_DIRECT, bypassing the page cache */
+    bool use_direct_io;
+} PagerOptions;
+
+#define COLUMN_USERNAME_SIZE 32
+#define COLUMN_EMAIL_SIZE 255
+
+typedef struct Row_Struct{
+    uint32_t id;
+    char username[COLUMN_USERNAME_SIZE + 1];
+    char email[COLUMN_EMAIL_SIZE + 1];
+} Row;
+
+typedef enum {
+    EXECUTE_SUCCESS,
+    EXECUTE_DUPLICATE_KEY,
+    EXECUTE_TABLE_FULL,
+    EXECUTE_TABLE_NOT_EMPTY,
+    EXECUTE_UNSORTED,
+    EXECUTE_INVALID_ROW,
+    EXECUTE_INDEX_EXISTS,
+    EXECUTE_PREPARE_FAILED,
+    EXECUTE_UNBOUND_PARAMETER
+} ExecuteResult;
+
+typedef enum {
+    PREPARE_SUCCESS,
+    PREPARE_NEGATIVE_ID,
+    PREPARE_STRING_TOO_LONG,
+    PREPARE_UNRECOGNIZED,
+    PREPARE_SYNTAX_ERROR
+} PrepareResult;
+
+/* How selected rows are written out: as the prompt prints them, or
+   encoded as in wire protocol responses */
+typedef enum {
+    OUTPUT_TEXT,
+    OUTPUT_WIRE
+} OutputFormat;
+
+/* Returns NULL, having printed why, when the page size cannot be used,
+   see PagerOptions.page_size. Other failures to open exit */
+Table* db_open(const char* filename, PagerOptions* options);
+void db_close(Table* table);
+void db_set_scan_threads(Table* table, uint32_t scan_threads);
+
+/* Parse and run one statement written as at the prompt, sending any rows
+   to output. A statement that does not parse returns
+   EXECUTE_PREPARE_FAILED with the reason in *prepare_result */
+ExecuteResult db_execute(Table* table, const char* sql, FILE* output, OutputFormat format,
+                         PrepareResult* prepare_result);
+
+/* Prepared statements
+   db_prepare() parses a statement once, with ? standing for any id or
+   value, into a plan that is kept until db_finalize(). Each run binds the
+   placeholders, numbered from 0 in the order they appear, and calls
+   db_step() until it stops returning STEP_ROW. A select of rows reads
+   them from one snapshot as it steps, holding it until STEP_DONE or
+   db_reset(). db_reset() readies the statement for another run and keeps
+   the bindings */
+typedef struct PreparedStatement_Struct PreparedStatement;
+
+typedef enum {
+    STEP_ROW,
+    STEP_DONE,
+    STEP_ERROR
+} StepResult;
+
+PreparedStatement* db_prepare(Table* table, const char* sql, PrepareResult* prepare_result);
+uint32_t db_param_count(PreparedStatement* stmt);
+PrepareResult db_bind_int(PreparedStatement* stmt, uint32_t index, int64_t value);
+PrepareResult db_bind_text(PreparedStatement* stmt, uint32_t index, const char* value);
+StepResult db_step(PreparedStatement* stmt);
+
+/* After STEP_DONE or STEP_ERROR: how the run ended */
+ExecuteResult db_statement_result(PreparedStatement* stmt);
+
+/* The row db_step() stopped at. For count(*) there is one row whose only
+   column is the count; db_column_text() is NULL for an id column or an
+   aggregate, and db_column_int() is -1 for the min, max or sum of no rows */
+uint32_t db_column_count(PreparedStatement* stmt);
+int64_t db_column_int(PreparedStatement* stmt, uint32_t index);
+const char* db_column_text(PreparedStatement* stmt, uint32_t index);
+
+void db_reset(PreparedStatement* stmt);
+void db_finalize(PreparedStatement* stmt);
+
+const char* prepare_result_message(PrepareResult result);
+const char* execute_result_message(ExecuteResult result);
+
+/* Look up the row with id without going through the parser. Returns
+   false when there is none */
+bool db_get(Table* table, uint32_t id, Row* row);
+
+/* Counters since the database was opened, and the shape of the table */
+typedef struct DbStats_Struct {
+    uint64_t pages_read;
+    uint64_t pages_written;
+    uint64_t log_frames_written;
+    uint64_t pool_hits;
+    uint64_t pool_misses;
+    uint32_t num_pages;
+    uint32_t tree_depth;
+} DbStats;
+
+void db_stats(Table* table, DbStats* stats);
+
+/* Write a consistent copy of the database to fd, a file or a socket, as
+   a plain db file, while statements carry on. Returns the number of
+   pages written, or -1 if a write failed, with errno set */
+int64_t db_backup(Table* table, int fd);
+
+/* Insert rows straight from memory as one statement */
+ExecuteResult table_insert_batch(Table* table, Row* rows, uint32_t num_rows);
+
+/* Load rows into an empty table, building the tree bottom-up */
+ExecuteResult table_bulk_load(Table* table, Row* rows, uint32_t num_rows, uint32_t fill_percent);
+
+/* Serve the database on a TCP port until SIGINT or SIGTERM */
+int db_serve(Table* table, uint16_t port);
+
+/* Wire protocol
+   Each message in either direction is a 4-byte payload length followed
+   by the payload. A client may send any number of requests without
+   waiting for replies; responses come back in request order.
+
+   A request payload is an opcode byte followed by:
+     DB_OP_QUERY   a statement as typed at the prompt, without a NUL
+     DB_OP_GET     a 4-byte id, looking up that row
+     DB_OP_INSERT  a 4-byte id, then username and email, each NUL terminated
+
+   A response payload is a status byte followed by:
+     DB_STATUS_OK     the selected rows back to back, or for count(*) the
+                      8-byte count. Nothing for other statements
+     DB_STATUS_ROWS   some of the selected rows, with more responses to
+                      the same request following. The last one is
+                      DB_STATUS_OK with the rows left, possibly none
+     DB_STATUS_ERROR  the error message, without a NUL
+
+   A row is its projected columns in order: an id as 4 bytes, a string as
+   a 2-byte length and then its bytes, an aggregate as 8 bytes, all ones
+   for the min, max or sum of no rows. All integers are little-endian */
+#define DB_OP_QUERY 1
+#define DB_OP_GET 2
+#define DB_OP_INSERT 3
+
+#define DB_STATUS_OK 0
+#define DB_STATUS_ERROR 1
+#define DB_STATUS_ROWS 2
+
+#define DB_MAX_REQUEST_SIZE (1 << 20)
+
+#endif
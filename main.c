@@ -1,4 +1,5 @@
 /* Imports */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -8,6 +9,37 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <linux/io_uring.h>
+
+#include "db.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KEY_SEARCH_X86
+#endif
+
+#if defined(__x86_64__)
+#define CRC32C_X86
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#define CRC32C_ARM
+#endif
 
 typedef struct InputBuffer_Struct{
     char* buffer;
@@ -15,89 +47,233 @@ typedef struct InputBuffer_Struct{
     ssize_t input_length;
 } InputBuffer;
 
-typedef enum {
-    EXECUTE_SUCCESS,
-    EXECUTE_DUPLICATE_KEY,
-    EXECUTE_TABLE_FULL
-} ExecuteResult;
-
 typedef enum {
     META_COMMAND_SUCCESS,
     META_COMMAND_UNRECOGNIZED
 } MetaCommandResult;
 
-typedef enum {
-    PREPARE_SUCCESS,
-    PREPARE_NEGATIVE_ID,
-    PREPARE_STRING_TOO_LONG,
-    PREPARE_UNRECOGNIZED,
-    PREPARE_SYNTAX_ERROR
-} PrepareResult;
-
 typedef enum {
     STATEMENT_INSERT,
-    STATEMENT_SELECT
+    STATEMENT_SELECT,
+    STATEMENT_DELETE,
+    STATEMENT_UPDATE,
+    STATEMENT_CREATE_INDEX
 } StatementType;
 
+#define NUM_STATEMENT_TYPES (STATEMENT_CREATE_INDEX + 1)
+
 typedef enum {
     NODE_INTERNAL,
     NODE_LEAF
 } NodeType;
 
-#define COLUMN_USERNAME_SIZE 32
-#define COLUMN_EMAIL_SIZE 255
+typedef struct Predicate_Struct{
+    /* Inclusive id range; the range is empty when id_low > id_high */
+    int64_t id_low;
+    int64_t id_high;
 
-typedef struct Row_Struct{
-    uint32_t id;
+    bool match_username;
+    bool match_email;
     char username[COLUMN_USERNAME_SIZE + 1];
     char email[COLUMN_EMAIL_SIZE + 1];
-} Row;
+} Predicate;
+
+typedef enum {
+    COLUMN_ID,
+    COLUMN_USERNAME,
+    COLUMN_EMAIL
+} Column;
+
+/* Columns that can have a secondary index, from COLUMN_USERNAME on */
+#define NUM_INDEXED_COLUMNS 2
+
+/* Ids an index cell names itself, and the length of a cell that names
+   an overflow chain after them, see Secondary indexes */
+#define INDEX_MAX_IDS 64
+#define INDEX_OVERFLOW_LENGTH ((INDEX_MAX_IDS + 1) * sizeof(uint32_t))
+
+#define MAX_PROJECTED_COLUMNS 8
+
+/* What a select computes for a projected column: the column itself, or
+   an aggregate over the ids of the rows in a group */
+typedef enum {
+    AGGREGATE_NONE,
+    AGGREGATE_COUNT,
+    AGGREGATE_MIN,
+    AGGREGATE_MAX,
+    AGGREGATE_SUM
+} Aggregate;
+#define MAX_STATEMENT_PARAMS 32
+
+/* What a ? placeholder stands for: an id bound, a value compared in the
+   where clause, a value set by an update, or a field of an inserted row */
+typedef enum {
+    PARAM_ID_EQUAL,
+    PARAM_ID_ABOVE,
+    PARAM_ID_AT_LEAST,
+    PARAM_ID_BELOW,
+    PARAM_ID_AT_MOST,
+    PARAM_WHERE_USERNAME,
+    PARAM_WHERE_EMAIL,
+    PARAM_SET_USERNAME,
+    PARAM_SET_EMAIL,
+    PARAM_ROW_ID,
+    PARAM_ROW_USERNAME,
+    PARAM_ROW_EMAIL
+} ParamTarget;
+
+typedef struct StatementParam_Struct {
+    ParamTarget target;
+
+    /* Inserts: the row in rows, or UINT32_MAX for the single row */
+    uint32_t row;
+} StatementParam;
 
 typedef struct Statement_Struct{
     StatementType type;
     Row row;
+    Predicate where;
+
+    /* Select output: the projected columns in order, or just a count */
+    Column columns[MAX_PROJECTED_COLUMNS];
+    uint32_t num_columns;
+    bool count_only;
+
+    /* Aggregating selects: what each projected column computes, and the
+       column rows are grouped on, if any. Without group by all the rows
+       form one group */
+    Aggregate aggregates[MAX_PROJECTED_COLUMNS];
+    bool aggregate;
+    bool group_by;
+    Column group_column;
+
+    /* Trailing "unordered": a parallel scan may print rows as each
+       worker finishes instead of in key order */
+    bool unordered;
+
+    /* Multi-row inserts; NULL when the statement carries a single row */
+    Row* rows;
+    uint32_t num_rows;
+
+    /* Update: which columns to set, with the new values in row */
+    bool set_username;
+    bool set_email;
+
+    /* Create index: the column to index */
+    Column index_column;
+
+    /* Where selected rows go, and how they are written */
+    FILE* output;
+    OutputFormat format;
+
+    /* Placeholders in the order they appear, see db_prepare() */
+    StatementParam params[MAX_STATEMENT_PARAMS];
+    uint32_t num_params;
 } Statement;
 
+typedef struct RowView_Struct{
+    /* A stored row read in place from its page: the key, and the value
+       holding username and email as consecutive NUL terminated strings */
+    uint32_t id;
+    const char* data;
+} RowView;
+
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
 
-#define TABLE_MAX_PAGES 100
 #define INVALID_PAGE_NUM UINT32_MAX
-const uint32_t PAGE_SIZE = 4096;
+#define INVALID_FRAME -1
+#define PAGER_MMAP_RESERVE ((size_t) 1 << 40)
+#define PAGER_MMAP_MIN_GROWTH 256
+#define WAL_MAGIC 0x57414c31
+#define WAL_CHECKPOINT_FRAMES 1000
+#define WAL_CHECKPOINT_INTERVAL_MS 1000
+#define WAL_COPY_BATCH 64
+
+/* Page size
+   Chosen when a database is created and kept in its header. Everything
+   laid out in proportion to a page is set from it by page_layout_init()
+   when the database is opened, so all databases open in one process at
+   once share a page size. Value pointers in a leaf are 16 bits, which
+   caps the size at 64 KB */
+#define PAGE_DEFAULT_SIZE 4096
+#define PAGE_MIN_SIZE 4096
+#define PAGE_MAX_SIZE 65536
+uint32_t PAGE_SIZE;
+
+/* Guards the layout, and counts the pagers open that use it */
+pthread_mutex_t page_layout_mutex = PTHREAD_MUTEX_INITIALIZER;
+uint32_t open_pagers = 0;
+
+/* The last bytes of every page hold its checksum, see page_checksum() */
+const uint32_t PAGE_CHECKSUM_SIZE = sizeof(uint32_t);
+uint32_t PAGE_USABLE_SIZE;
 
 const uint32_t ID_SIZE = size_of_attribute(Row, id);
 const uint32_t USERNAME_SIZE = size_of_attribute(Row, username);
 const uint32_t EMAIL_SIZE = size_of_attribute(Row, email);
-const uint32_t ID_OFFSET = 0;
-const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
-const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
 const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
 
-/* Node Header Layout */
+/* Db Header Layout
+   Page 0 describes the file: where the tree's root lives, the list of
+   pages freed for reuse, and the root of each secondary index, or
+   INVALID_PAGE_NUM for a column without one. Each free page holds the
+   number of the next. The page count is the file's size as of the last
+   commit, and the schema version counts the indexes ever created, so
+   opening a file reads only this page */
+#define DB_HEADER_MAGIC 0x44424832
+const uint32_t DB_HEADER_PAGE_NUM = 0;
+const uint32_t DB_HEADER_MAGIC_OFFSET = 0;
+const uint32_t DB_HEADER_ROOT_PAGE_OFFSET = DB_HEADER_MAGIC_OFFSET + sizeof(uint32_t);
+const uint32_t DB_HEADER_FREELIST_HEAD_OFFSET = DB_HEADER_ROOT_PAGE_OFFSET + sizeof(uint32_t);
+const uint32_t DB_HEADER_FREELIST_COUNT_OFFSET = DB_HEADER_FREELIST_HEAD_OFFSET + sizeof(uint32_t);
+const uint32_t DB_HEADER_INDEX_ROOTS_OFFSET = DB_HEADER_FREELIST_COUNT_OFFSET + sizeof(uint32_t);
+/* Zero in files from before the page size was stored: PAGE_DEFAULT_SIZE */
+const uint32_t DB_HEADER_PAGE_SIZE_OFFSET = DB_HEADER_INDEX_ROOTS_OFFSET + NUM_INDEXED_COLUMNS * sizeof(uint32_t);
+/* Zero in files from before the page count was stored */
+const uint32_t DB_HEADER_PAGE_COUNT_OFFSET = DB_HEADER_PAGE_SIZE_OFFSET + sizeof(uint32_t);
+const uint32_t DB_HEADER_SCHEMA_VERSION_OFFSET = DB_HEADER_PAGE_COUNT_OFFSET + sizeof(uint32_t);
+const uint32_t FREE_PAGE_NEXT_OFFSET = 0;
+
+/* Node Header Layout
+   The reserved word once held the parent's page number. Nodes no longer
+   point up, see table_find_parent(), and it is kept so existing files
+   keep their layout */
 const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
 const uint32_t NODE_TYPE_OFFSET = 0;
 const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
 const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE;
-const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
-const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
-const uint8_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
+const uint32_t NODE_RESERVED_SIZE = sizeof(uint32_t);
+const uint32_t NODE_RESERVED_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
+const uint8_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE + NODE_RESERVED_SIZE;
 
 /* Leaf Node Header Layout */
 const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE;
-
-/* Leaf Node Body Layout */
+const uint32_t LEAF_NODE_HEAP_START_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_HEAP_START_OFFSET = LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_FRAGMENTED_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_FRAGMENTED_OFFSET = LEAF_NODE_HEAP_START_OFFSET + LEAF_NODE_HEAP_START_SIZE;
+/* Rounded up so the key array after the header is 4-byte aligned */
+const uint32_t LEAF_NODE_HEADER_SIZE = (LEAF_NODE_FRAGMENTED_OFFSET + LEAF_NODE_FRAGMENTED_SIZE + 3) & ~3u;
+
+/* Leaf Node Body Layout
+   A slot directory grows up from the header and a heap of values grows
+   down from the end of the page. The directory is two arrays: all keys
+   first, contiguous for searching, then one value pointer (heap offset
+   and length) per key. Both stay sorted by key */
 const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_KEY_OFFSET = 0;
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-const uint32_t LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+const uint32_t LEAF_NODE_VALUE_POINTER_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_VALUE_POINTER_OFFSET = 0;
+const uint32_t LEAF_NODE_VALUE_LENGTH_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_VALUE_LENGTH_OFFSET = LEAF_NODE_VALUE_POINTER_OFFSET + LEAF_NODE_VALUE_POINTER_SIZE;
+const uint32_t LEAF_NODE_POINTER_ENTRY_SIZE = LEAF_NODE_VALUE_LENGTH_OFFSET + LEAF_NODE_VALUE_LENGTH_SIZE;
+const uint32_t LEAF_NODE_SLOT_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_POINTER_ENTRY_SIZE;
+const uint32_t LEAF_NODE_MAX_VALUE_SIZE = USERNAME_SIZE + EMAIL_SIZE;
+uint32_t LEAF_NODE_SPACE_FOR_CELLS;
+/* A leaf using less than this after a delete borrows or merges */
+uint32_t LEAF_NODE_MIN_USED;
 
 /* Internal Node Header Layout */
 const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE   = sizeof(uint32_t);
@@ -106,59 +282,760 @@ const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE   = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET =
     INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
+/* Rounded up so the key array after the header is 4-byte aligned */
 const uint32_t INTERNAL_NODE_HEADER_SIZE =
-    INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE + COMMON_NODE_HEADER_SIZE;
+    (INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE + COMMON_NODE_HEADER_SIZE + 3) & ~3u;
 
-/* Internal Node Body Layout */
+/* Internal Node Body Layout
+   Keys and children live in two separate arrays, each sized for
+   INTERNAL_NODE_MAX_CELLS, so the keys are contiguous for searching */
 const uint32_t INTERNAL_NODE_KEY_SIZE   = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CELL_SIZE =
     INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
-const uint32_t INTERNAL_NODE_MAX_CELLS = 3;
+uint32_t INTERNAL_NODE_SPACE_FOR_CELLS;
+uint32_t INTERNAL_NODE_MAX_CELLS;
+#define INTERNAL_NODE_MIN_KEYS (INTERNAL_NODE_MAX_CELLS / 2)
+#define INTERNAL_NODE_CHILDREN_OFFSET (INTERNAL_NODE_HEADER_SIZE + INTERNAL_NODE_MAX_CELLS * INTERNAL_NODE_KEY_SIZE)
+
+
+/* Image of a page as it was before a write, kept while a snapshot older
+   than the write may still read it */
+typedef struct PageImage_Struct {
+    uint64_t version;
+    struct PageImage_Struct* next;
+    char page[];
+} PageImage;
+
+/* Saved images of one page, newest first. live_version is the write that
+   produced the page's current contents */
+typedef struct PageVersions_Struct {
+    uint32_t page_num;
+    uint64_t live_version;
+    PageImage* images;
+    struct PageVersions_Struct* next;
+} PageVersions;
+
+#define VERSION_TABLE_SIZE 256
+
+typedef struct DirtyPage_Struct {
+    uint32_t page_num;
+    int32_t frame_index;
+    void* page;
+} DirtyPage;
+
+/* An io_uring instance driven through the raw system calls: the
+   submission and completion rings are shared with the kernel, so queuing
+   requests and reaping results costs no system call, and one
+   io_uring_enter submits a whole batch */
+typedef struct Ring_Struct {
+    int fd;
+    uint32_t entries;
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t* sq_array;
+    uint32_t sq_mask;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* ring_map;
+    size_t ring_map_size;
+    size_t sqes_map_size;
+
+    uint32_t to_submit;
+    uint32_t in_flight;
+} Ring;
+
+#define RING_ENTRIES 64
+
+/* Registering a buffer pins its memory, so only this much of the pool is
+   registered; frames past it use the unregistered operations */
+#define PAGER_MAX_REGISTERED_BYTES (256u << 20)
+
+/* Frames the pool may allocate past its budget while every frame is
+   pinned, as by threads each holding a descent. Running out of them
+   ends the program rather than letting the pool grow without bound */
+#define PAGER_MAX_EXTRA_FRAMES 256
+
+typedef struct WalHeader_Struct {
+    uint32_t magic;
+    uint32_t page_size;
+    uint32_t salt;
+    uint32_t reserved;
+} WalHeader;
+
+/* Every frame holds one page image. The last frame of a commit carries
+   the database size in pages; the checksum chains through all previous
+   frames so a torn append invalidates everything after it */
+typedef struct WalFrameHeader_Struct {
+    uint32_t page_num;
+    uint32_t commit_num_pages;
+    uint32_t salt;
+    uint32_t reserved;
+    uint32_t checksum[2];
+} WalFrameHeader;
+
+/* A page whose newest image is in the log and possibly nowhere else,
+   see pager_spill() */
+typedef struct WalPage_Struct {
+    uint32_t page_num;
+    off_t offset;
+} WalPage;
+
+typedef struct Wal_Struct {
+    int file_descriptor;
+    char* path;
+    uint32_t salt;
+    uint32_t checksum[2];
+    off_t offset;
+    uint32_t num_frames;
+
+    /* LSNs count bytes ever appended and keep growing across checkpoints */
+    uint64_t end_lsn;
+    uint64_t synced_lsn;
+    bool syncing;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t synced_cond;
+    pthread_cond_t checkpoint_cond;
+    pthread_t checkpointer;
+    bool checkpointer_running;
+    bool stop;
+
+    /* Pages a statement spilled, by where the log holds their newest
+       image. Their frames may be dropped without writing them back, so
+       they are read from the log until a checkpoint copies them into the
+       main file. Open addressing on the page number, guarded by the pool
+       mutex */
+    WalPage* spilled;
+    uint32_t num_spilled;
+    uint32_t spilled_capacity;
+
+    uint64_t commits;
+    uint64_t syncs;
+    uint64_t checkpoints;
+    uint64_t frames_written;
+} Wal;
+
+typedef struct Frame_Struct {
+    uint32_t page_num;
+    uint32_t pin_count;
+    bool dirty;
+    bool referenced;
+    bool in_txn;
+
+    /* A read into the frame is in flight, see pager_read_wait() */
+    bool loading;
+    uint64_t wal_lsn;
+    int32_t hash_next;
+    void* page;
+
+    /* Operation that last pinned the frame, see pager_pin_for_operation() */
+    uint64_t pin_stamp;
+
+    /* Page latch, allocated apart from the frame because the frames array
+       moves when it grows. Only taken while the frame is pinned */
+    pthread_rwlock_t* latch;
+} Frame;
+
+/* One of the two header slots at the start of a compressed file, see
+   store_open(). The one with the higher generation and a good checksum
+   is current */
+typedef struct StoreHeader_Struct {
+    uint32_t magic;
+    uint32_t page_size;
+    uint64_t generation;
+    uint32_t map_sector;
+    uint32_t map_bytes;
+    uint32_t num_pages;
+    uint32_t map_checksum;
+    uint32_t reserved;
+    uint32_t checksum;
+} StoreHeader;
+
+/* Where a page is stored in a compressed file. bytes is 0 for a page
+   never written and PAGE_SIZE for one stored uncompressed */
+typedef struct PageExtent_Struct {
+    uint32_t sector;
+    uint32_t bytes;
+} PageExtent;
+
+typedef struct PageStore_Struct {
+    int file_descriptor;
 
+    /* Guards everything below. Taken inside the pool mutex, never
+       held across I/O */
+    pthread_mutex_t mutex;
+    uint64_t generation;
+    bool modified;
+
+    /* The page map, indexed by page number */
+    PageExtent* extents;
+    uint32_t num_pages;
+    uint32_t extents_capacity;
+
+    /* A bit per sector, set while anything, durable or not, points at
+       it. Extents let go of since the last commit stay set in the bitmap
+       and listed in freed until the next map is durable. The file spans
+       num_sectors, and no sector below first_free is free */
+    uint64_t* used;
+    uint32_t used_words;
+    uint32_t num_sectors;
+    uint32_t first_free;
+    PageExtent* freed;
+    uint32_t num_freed;
+    uint32_t freed_capacity;
+    PageExtent map;
+
+    uint64_t stored_bytes;
+} PageStore;
 
 typedef struct Pager_Struct {
     int file_descriptor;
     uint32_t file_length;
     uint32_t num_pages;
-    void* pages[TABLE_MAX_PAGES];
+
+    /* Buffer pool: frames are allocated lazily up to max_frames, then
+       recycled with CLOCK. page_table hashes a page number to the head
+       of a chain of frame indices linked through Frame.hash_next */
+    Frame* frames;
+    uint32_t num_frames;
+    uint32_t max_frames;
+    int32_t* page_table;
+    uint32_t page_table_mask;
+    uint32_t clock_hand;
+
+    /* Guards the frames, the page table, pin counts, the transaction list
+       and the file size. Recursive, since pager functions call each other.
+       Never held while waiting for a page latch */
+    pthread_mutex_t pool_mutex;
+
+    /* I/O backend: io_uring rings when the kernel provides them, blocking
+       pread and pwritev otherwise. Reads go through read_ring under the
+       pool mutex; writes through write_ring under write_ring_mutex, so
+       flushing runs without the pool mutex. The first max_frames pages
+       come from one slab, of which registered_frames pages are
+       registered with both rings */
+    Ring* read_ring;
+    Ring* write_ring;
+    pthread_mutex_t write_ring_mutex;
+    char* slab;
+    uint32_t registered_frames;
+
+    /* Compressed files: where each page lives, see store_open(). NULL
+       for a plain file, which holds page n at n * PAGE_SIZE */
+    PageStore* store;
+
+    /* The file is open with O_DIRECT: reads and writes bypass the page
+       cache, so every buffer given to them must be page aligned */
+    bool direct_io;
+
+    /* Pages the header counted when the file was opened. All were written
+       stamped, so below this a zero checksum means a lost write */
+    uint32_t stamped_pages;
+
+    /* Pages modified since the last commit, logged by pager_commit().
+       txn_spilled is set once the statement in progress has logged some
+       of them early, see pager_spill() */
+    Wal* wal;
+    int32_t* txn_frames;
+    uint32_t num_txn_frames;
+    uint32_t txn_frames_capacity;
+    bool txn_spilled;
+
+    /* mmap mode: the file is mapped at the start of a reserved address
+       range, so growing the mapping never moves pages callers point into */
+    bool use_mmap;
+    char* map;
+    uint32_t mapped_pages;
+    int advice;
+
+    /* mmap mode: pages modified since the last commit, which stamps their
+       checksums since no write-back passes through the pager */
+    uint32_t* map_dirty;
+    uint32_t num_map_dirty;
+    uint32_t map_dirty_capacity;
+
+    /* Snapshots: version counts published writes. While a snapshot is
+       open, the first write to a page saves the page's old image, see
+       pager_save_version(). write_unversioned is set while the write in
+       progress has changed pages without saving them, and new snapshots
+       wait for it to be published */
+    pthread_mutex_t version_mutex;
+    pthread_cond_t version_cond;
+    uint64_t version;
+    bool write_unversioned;
+    uint64_t* snapshots;
+    uint32_t num_snapshots;
+    uint32_t snapshots_capacity;
+    PageVersions* version_table[VERSION_TABLE_SIZE];
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t prefetches;
+    uint64_t pages_read;
+    uint64_t pages_written;
+
+    /* Writes to the main file started and finished, so a check reading
+       the file back can tell whether a write overlapped its read */
+    uint64_t writes_begun;
+    uint64_t writes_done;
 } Pager;
 
-typedef struct Table_Struct {
+#define TABLE_MAX_PATH 32
+
+struct Table_Struct {
     uint32_t root_page_num;
     Pager* pager;
-} Table;
+
+    /* The pages the writer's last descent went through, root first, so a
+       split finds each parent without descending again. Only the writer
+       reads or writes it, see table_find_parent() */
+    uint32_t path[TABLE_MAX_PATH];
+    uint32_t path_length;
+
+    /* Last known rightmost leaf, so appends of increasing keys can skip
+       the descent. Checked before use, INVALID_PAGE_NUM when unknown */
+    uint32_t rightmost_leaf;
+
+    /* Worker threads for range scans, see execute_select_parallel() */
+    uint32_t scan_threads;
+
+    /* Held by writers while a statement runs, so there is one writer at a
+       time and the checkpointer only ever sees the pager between writes.
+       Readers go through page latches instead, except in mmap mode where
+       there are no frames to latch and they take this lock as well */
+    pthread_mutex_t lock;
+
+    /* Secondary index trees on username and email, sharing the pager. An
+       index exists once its root_page_num is valid. Only the writer looks
+       here; readers find the roots in the header as of their snapshot, see
+       execute_select_indexed(). NULL in the index tables themselves */
+    struct Table_Struct* indexes[NUM_INDEXED_COLUMNS];
+
+    /* The background integrity check, NULL while none runs */
+    struct Scrubber_Struct* scrubber;
+};
 
 typedef struct Cursor_Struct {
     Table *table;
     uint32_t page_num;
     uint32_t cell_num;
     bool end_of_table;
+
+    /* Snapshot cursors read private copies of their leaves as of the
+       snapshot version, see table_snapshot_seek(). NULL otherwise */
+    void* node;
+    uint64_t snapshot;
+
+    /* Read-ahead for scans: a copy of the leaf's parent, the leaf's index
+       in it, and the index up to which the following leaves have been
+       requested. depth counts the internal levels. NULL when the cursor
+       does not read ahead */
+    void* parent;
+    uint32_t depth;
+    uint32_t child_index;
+    uint32_t prefetched;
+
+    /* Other cursors keep a handle on their leaf in the pool: the page as
+       get_page() returned it, which page that was, and the thread's pin
+       stamp at the time, see cursor_node() */
+    void* leaf;
+    uint32_t leaf_page_num;
+    uint64_t leaf_pin_stamp;
 } Cursor;
 
+#define CURSOR_READAHEAD 16
+
+typedef enum {
+    LATCH_NONE,         /* the writer reading: nothing else modifies pages */
+    LATCH_SHARED,
+    LATCH_EXCLUSIVE
+} LatchMode;
+
+#define MAX_HELD_LATCHES 64
+#define SCAN_MAX_THREADS 64
+
+typedef struct HeldPin_Struct {
+    Pager* pager;
+    int32_t frame_index;
+} HeldPin;
+
+typedef struct HeldLatch_Struct {
+    Pager* pager;
+    uint32_t page_num;
+    int32_t frame_index;
+} HeldLatch;
+
+/* Pins and latches are per thread: each thread runs its own operation */
+typedef struct ThreadState_Struct {
+    HeldPin* pins;
+    uint32_t num_pins;
+    uint32_t pins_capacity;
+    uint64_t pin_stamp;
+
+    HeldLatch latches[MAX_HELD_LATCHES];
+    uint32_t num_latches;
+} ThreadState;
+
+_Thread_local ThreadState thread_state;
+uint64_t next_pin_stamp = 0;
+pthread_key_t thread_state_key;
+pthread_once_t thread_state_once = PTHREAD_ONCE_INIT;
+
+/* Statistics
+   Each thread counts into its own block, so the hot paths neither share
+   a cache line nor take a lock. Readers sum the live blocks and what
+   exited threads left behind. Latencies are histograms with power of two
+   buckets: bucket 0 is under a microsecond, bucket b up to 2^b */
+#define STATS_MAX_DEPTH 16
+#define STATS_LATENCY_BUCKETS 32
+
+typedef struct StatsCounters_Struct {
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t leaf_splits;
+    uint64_t internal_splits;
+    uint64_t descents;
+    uint64_t descent_depths[STATS_MAX_DEPTH];
+    uint64_t latencies[NUM_STATEMENT_TYPES][STATS_LATENCY_BUCKETS];
+} StatsCounters;
+
+typedef struct ThreadStats_Struct {
+    StatsCounters counters;
+    bool registered;
+    struct ThreadStats_Struct* next;
+    struct ThreadStats_Struct* prev;
+} ThreadStats;
+
+_Thread_local ThreadStats thread_stats;
+ThreadStats* live_stats = NULL;
+StatsCounters retired_stats;
+pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t stats_key;
+pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+void stats_thread_exit(void* arg){
+    /* Fold an exiting thread's counts into the retired totals */
+    ThreadStats* stats = arg;
+    uint64_t* from = (uint64_t*) &(stats->counters);
+    uint64_t* to = (uint64_t*) &retired_stats;
+
+    pthread_mutex_lock(&stats_mutex);
+
+    for (size_t i = 0; i < sizeof(StatsCounters) / sizeof(uint64_t); i++){
+        to[i] += from[i];
+    }
+
+    if (stats->prev != NULL){
+        stats->prev->next = stats->next;
+    } else {
+        live_stats = stats->next;
+    }
+
+    if (stats->next != NULL){
+        stats->next->prev = stats->prev;
+    }
+
+    pthread_mutex_unlock(&stats_mutex);
+
+    memset(&(stats->counters), 0, sizeof(StatsCounters));
+    stats->registered = false;
+}
+
+void stats_key_init(){
+    pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+StatsCounters* stats_counters(){
+    /* The calling thread's counters, registered on first use */
+    ThreadStats* stats = &thread_stats;
+
+    if (!stats->registered){
+        pthread_once(&stats_once, stats_key_init);
+        pthread_setspecific(stats_key, stats);
+
+        pthread_mutex_lock(&stats_mutex);
+        stats->prev = NULL;
+        stats->next = live_stats;
+
+        if (live_stats != NULL){
+            live_stats->prev = stats;
+        }
+
+        live_stats = stats;
+        pthread_mutex_unlock(&stats_mutex);
+
+        stats->registered = true;
+    }
+
+    return &(stats->counters);
+}
+
+void stats_add(uint64_t* counter, uint64_t amount){
+    /* Only the owning thread writes a counter, so a plain load and store
+       will do; being atomic lets readers see whole values without paying
+       for a locked add */
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+void stats_count_descent(uint32_t depth){
+    /* depth counts the nodes visited, the leaf included */
+    StatsCounters* counters = stats_counters();
+
+    stats_add(&(counters->descents), 1);
+    stats_add(&(counters->descent_depths[depth < STATS_MAX_DEPTH ? depth : STATS_MAX_DEPTH - 1]), 1);
+}
+
+uint64_t stats_now(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void stats_count_statement(StatementType type, uint64_t nanoseconds){
+    uint64_t micros = nanoseconds / 1000;
+    uint32_t bucket = micros == 0 ? 0 : 64 - __builtin_clzll(micros);
+
+    if (bucket >= STATS_LATENCY_BUCKETS){
+        bucket = STATS_LATENCY_BUCKETS - 1;
+    }
+
+    stats_add(&(stats_counters()->latencies[type][bucket]), 1);
+}
+
+void stats_collect(StatsCounters* total){
+    uint64_t* to = (uint64_t*) total;
+
+    pthread_mutex_lock(&stats_mutex);
+    *total = retired_stats;
+
+    for (ThreadStats* stats = live_stats; stats != NULL; stats = stats->next){
+        uint64_t* from = (uint64_t*) &(stats->counters);
+
+        for (size_t i = 0; i < sizeof(StatsCounters) / sizeof(uint64_t); i++){
+            to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+        }
+    }
+
+    pthread_mutex_unlock(&stats_mutex);
+}
+
 void internal_node_split_and_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num);
+void leaf_node_split_finish(Cursor* cursor, uint32_t new_page_num, uint32_t old_max);
+void* cursor_node(Cursor* cursor);
+ExecuteResult execute_statement(Statement* statement, Table* table);
+int compare_rows_by_id(const void* a, const void* b);
+ExecuteResult load_file(Table* table, FILE* input, uint32_t fill_percent, uint64_t* num_loaded);
+void* get_page(Pager* pager, uint32_t page_num);
+void pager_flush(Pager* pager, uint32_t page_num);
+void pager_flush_dirty(Pager* pager);
+uint32_t get_unused_page_num(Pager* pager);
+void pager_free_page(Pager* pager, uint32_t page_num);
+void wal_wait_durable(Wal* wal, uint64_t lsn);
+off_t wal_spilled_lookup(Wal* wal, uint32_t page_num);
+void wal_read_page(Wal* wal, off_t offset, void* page);
 void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num);
+bool table_has_indexes(Table* table);
+void index_add_row(Table* table, Row* row);
+void index_remove_row(Table* table, Row* row);
+void index_update_row(Table* table, Row* old_row, Row* new_row);
+void index_populate_all(Table* table);
+void table_statement_checkpoint(Pager* pager);
+void check_stop_background(Table* table);
+
+uint32_t* db_header_magic(void* header){
+    return header + DB_HEADER_MAGIC_OFFSET;
+}
+
+uint32_t* db_header_root_page(void* header){
+    return header + DB_HEADER_ROOT_PAGE_OFFSET;
+}
+
+uint32_t* db_header_freelist_head(void* header){
+    return header + DB_HEADER_FREELIST_HEAD_OFFSET;
+}
+
+uint32_t* db_header_freelist_count(void* header){
+    return header + DB_HEADER_FREELIST_COUNT_OFFSET;
+}
+
+uint32_t* db_header_index_root(void* header, Column column){
+    return header + DB_HEADER_INDEX_ROOTS_OFFSET + (column - COLUMN_USERNAME) * sizeof(uint32_t);
+}
+
+uint32_t* db_header_page_size(void* header){
+    return header + DB_HEADER_PAGE_SIZE_OFFSET;
+}
+
+uint32_t* db_header_page_count(void* header){
+    return header + DB_HEADER_PAGE_COUNT_OFFSET;
+}
+
+uint32_t* db_header_schema_version(void* header){
+    return header + DB_HEADER_SCHEMA_VERSION_OFFSET;
+}
+
+void page_layout_init(uint32_t page_size){
+    PAGE_SIZE = page_size;
+    PAGE_USABLE_SIZE = PAGE_SIZE - PAGE_CHECKSUM_SIZE;
+    LEAF_NODE_SPACE_FOR_CELLS = PAGE_USABLE_SIZE - LEAF_NODE_HEADER_SIZE;
+    LEAF_NODE_MIN_USED = LEAF_NODE_SPACE_FOR_CELLS / 3;
+    INTERNAL_NODE_SPACE_FOR_CELLS = PAGE_USABLE_SIZE - INTERNAL_NODE_HEADER_SIZE;
+    INTERNAL_NODE_MAX_CELLS = INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE;
+}
+
+uint32_t* free_page_next(void* page){
+    return page + FREE_PAGE_NEXT_OFFSET;
+}
 
 uint32_t* leaf_node_num_cells(void* node){
     return node + LEAF_NODE_NUM_CELLS_OFFSET;
 }
 
-void* leaf_node_cell(void* node, uint32_t cell_num) {
-    return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+uint32_t* leaf_node_keys(void* node){
+    return node + LEAF_NODE_HEADER_SIZE;
 }
 
 uint32_t* leaf_node_key(void* node, uint32_t cell_num){
-    return leaf_node_cell(node, cell_num);
+    return leaf_node_keys(node) + cell_num;
+}
+
+void* leaf_node_pointer_entry(void* node, uint32_t cell_num){
+    /* The pointer array starts right after the last key, so it moves
+       whenever the number of cells changes */
+    return (void*) leaf_node_key(node, *leaf_node_num_cells(node)) + cell_num * LEAF_NODE_POINTER_ENTRY_SIZE;
+}
+
+uint16_t* leaf_node_value_pointer(void* node, uint32_t cell_num){
+    return leaf_node_pointer_entry(node, cell_num) + LEAF_NODE_VALUE_POINTER_OFFSET;
+}
+
+uint16_t* leaf_node_value_length(void* node, uint32_t cell_num){
+    return leaf_node_pointer_entry(node, cell_num) + LEAF_NODE_VALUE_LENGTH_OFFSET;
 }
 
 void* leaf_node_value(void* node, uint32_t cell_num){
-    return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+    return node + *leaf_node_value_pointer(node, cell_num);
 }
 
 uint32_t* leaf_node_next_leaf(void* node){
     return node + LEAF_NODE_NEXT_LEAF_OFFSET;
 }
 
+uint32_t* leaf_node_heap_start(void* node){
+    return node + LEAF_NODE_HEAP_START_OFFSET;
+}
+
+uint32_t* leaf_node_fragmented(void* node){
+    return node + LEAF_NODE_FRAGMENTED_OFFSET;
+}
+
+uint32_t leaf_node_free_space(void* node){
+    /* Bytes between the slots and the heap, plus holes inside the heap */
+    uint32_t slots_end = LEAF_NODE_HEADER_SIZE + *leaf_node_num_cells(node) * LEAF_NODE_SLOT_SIZE;
+    return *leaf_node_heap_start(node) - slots_end + *leaf_node_fragmented(node);
+}
+
+void leaf_node_compact(void* node){
+    /* Rewrite the heap without holes, keeping the slot order */
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    char* scratch = malloc(PAGE_SIZE);
+    memcpy(scratch, node, PAGE_SIZE);
+
+    uint32_t heap_start = PAGE_USABLE_SIZE;
+
+    for (uint32_t i = 0; i < num_cells; i++){
+        uint32_t length = *leaf_node_value_length(node, i);
+        heap_start -= length;
+        memcpy(node + heap_start, scratch + *leaf_node_value_pointer(node, i), length);
+        *leaf_node_value_pointer(node, i) = heap_start;
+    }
+
+    *leaf_node_heap_start(node) = heap_start;
+    *leaf_node_fragmented(node) = 0;
+    free(scratch);
+}
+
+void* leaf_node_allocate(void* node, uint32_t cell_num, uint32_t key, uint32_t length){
+    /* Open slot cell_num for key and reserve length heap bytes for its
+       value, which the caller fills in. The caller checks that it fits */
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t slots_end = LEAF_NODE_HEADER_SIZE + (num_cells + 1) * LEAF_NODE_SLOT_SIZE;
+
+    assert(leaf_node_free_space(node) >= LEAF_NODE_SLOT_SIZE + length);
+
+    if (*leaf_node_heap_start(node) < slots_end + length){
+        leaf_node_compact(node);
+    }
+
+    /* Open the gap in the pointer array first, from the top down: it
+       moves up one key width as a whole, and one more above cell_num */
+    void* old_pointers = leaf_node_pointer_entry(node, 0);
+    void* new_pointers = old_pointers + LEAF_NODE_KEY_SIZE;
+    uint32_t* keys = leaf_node_keys(node);
+
+    memmove(new_pointers + (cell_num + 1) * LEAF_NODE_POINTER_ENTRY_SIZE,
+            old_pointers + cell_num * LEAF_NODE_POINTER_ENTRY_SIZE,
+            (num_cells - cell_num) * LEAF_NODE_POINTER_ENTRY_SIZE);
+    memmove(new_pointers, old_pointers, cell_num * LEAF_NODE_POINTER_ENTRY_SIZE);
+    memmove(keys + cell_num + 1, keys + cell_num, (num_cells - cell_num) * LEAF_NODE_KEY_SIZE);
+
+    *leaf_node_num_cells(node) = num_cells + 1;
+    *leaf_node_heap_start(node) -= length;
+    keys[cell_num] = key;
+    *leaf_node_value_pointer(node, cell_num) = *leaf_node_heap_start(node);
+    *leaf_node_value_length(node, cell_num) = length;
+
+    return node + *leaf_node_heap_start(node);
+}
+
+void leaf_node_remove(void* node, uint32_t cell_num){
+    /* Close slot cell_num, the reverse of leaf_node_allocate(). The value
+       gives its bytes back to the heap if it starts the heap, otherwise
+       it leaves a hole for leaf_node_compact() to reclaim */
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t length = *leaf_node_value_length(node, cell_num);
+
+    assert(cell_num < num_cells);
+
+    if (*leaf_node_value_pointer(node, cell_num) == *leaf_node_heap_start(node)){
+        *leaf_node_heap_start(node) += length;
+    } else {
+        *leaf_node_fragmented(node) += length;
+    }
+
+    /* Close the gaps from the bottom up: the pointer array moves down one
+       key width as a whole, and one more above cell_num */
+    void* old_pointers = leaf_node_pointer_entry(node, 0);
+    void* new_pointers = old_pointers - LEAF_NODE_KEY_SIZE;
+    uint32_t* keys = leaf_node_keys(node);
+
+    memmove(keys + cell_num, keys + cell_num + 1, (num_cells - cell_num - 1) * LEAF_NODE_KEY_SIZE);
+    memmove(new_pointers, old_pointers, cell_num * LEAF_NODE_POINTER_ENTRY_SIZE);
+    memmove(new_pointers + cell_num * LEAF_NODE_POINTER_ENTRY_SIZE,
+            old_pointers + (cell_num + 1) * LEAF_NODE_POINTER_ENTRY_SIZE,
+            (num_cells - cell_num - 1) * LEAF_NODE_POINTER_ENTRY_SIZE);
+
+    *leaf_node_num_cells(node) = num_cells - 1;
+}
+
+uint32_t leaf_node_used_space(void* node){
+    return LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(node);
+}
+
+void leaf_node_move_cell(void* source, uint32_t source_cell, void* dest, uint32_t dest_cell){
+    uint32_t length = *leaf_node_value_length(source, source_cell);
+    memcpy(leaf_node_allocate(dest, dest_cell, *leaf_node_key(source, source_cell), length),
+           leaf_node_value(source, source_cell), length);
+    leaf_node_remove(source, source_cell);
+}
+
 NodeType get_node_type(void* node){
     uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET));
     return (NodeType)value;
@@ -173,7 +1050,9 @@ uint32_t* internal_node_num_keys(void* node){ return node + INTERNAL_NODE_NUM_KE
 
 uint32_t* internal_node_right_child(void* node){ return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET; }
 
-uint32_t* internal_node_cell(void* node, uint32_t cell_num){ return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE; }
+uint32_t* internal_node_keys(void* node){ return node + INTERNAL_NODE_HEADER_SIZE; }
+
+uint32_t* internal_node_children(void* node){ return node + INTERNAL_NODE_CHILDREN_OFFSET; }
 
 uint32_t* internal_node_child(void* node, uint32_t child_num){
     uint32_t num_keys = *internal_node_num_keys(node);
@@ -191,7 +1070,7 @@ uint32_t* internal_node_child(void* node, uint32_t child_num){
 
         return right_child;
     } else {
-        uint32_t* child = internal_node_cell(node, child_num);
+        uint32_t* child = internal_node_children(node) + child_num;
 
         if (*child == INVALID_PAGE_NUM){
             printf("Tried to access child of node %d, but was invalid page\n", child_num);
@@ -202,7 +1081,7 @@ uint32_t* internal_node_child(void* node, uint32_t child_num){
     }
 }
 
-uint32_t* internal_node_key(void* node, uint32_t key_num){ return (void*) internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE; }
+uint32_t* internal_node_key(void* node, uint32_t key_num){ return internal_node_keys(node) + key_num; }
 
 bool is_node_root(void* node){
     uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
@@ -214,761 +1093,9235 @@ void set_node_root(void* node, bool is_root){
     *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
 }
 
-uint32_t* node_parent(void* node){
-    return node + PARENT_POINTER_OFFSET;
+uint32_t pager_hash(Pager* pager, uint32_t page_num){
+    /* Fibonacci hashing spreads sequential page numbers across buckets */
+    return (page_num * 2654435761u) & pager->page_table_mask;
 }
 
-void* get_page(Pager* pager, uint32_t page_num){
-    if (page_num > TABLE_MAX_PAGES){
-        printf("Tried to fetch page number out of bounds. %d > %d\n", page_num, TABLE_MAX_PAGES);
-        exit(0);
-    }
-
-    if (pager->pages[page_num] == NULL){
-        void* page = malloc(PAGE_SIZE);
-        uint32_t num_pages = pager->file_length / PAGE_SIZE;
-
-        if (pager->file_length % PAGE_SIZE){
-            num_pages += 1;
-        }
-
-        if (page_num <= num_pages){
-            lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-            ssize_t bytes = read(pager->file_descriptor, page, PAGE_SIZE);
+int32_t pager_lookup(Pager* pager, uint32_t page_num){
+    int32_t frame_index = pager->page_table[pager_hash(pager, page_num)];
 
-            if (bytes == -1){
-                printf("Error reading from file: %d\n", errno);
-                exit(0);
-            }
+    while (frame_index != INVALID_FRAME){
+        if (pager->frames[frame_index].page_num == page_num){
+            return frame_index;
         }
 
-        pager->pages[page_num] = page;
-
-        if (page_num >= pager->num_pages){
-            pager->num_pages = page_num + 1;
-        }
+        frame_index = pager->frames[frame_index].hash_next;
     }
 
-    return pager->pages[page_num];
+    return INVALID_FRAME;
 }
 
-uint32_t get_node_max_key(Pager* pager, void* node){
-    if (get_node_type(node) == NODE_LEAF){
-        uint32_t num_cells = *leaf_node_num_cells(node);
+void pager_hash_insert(Pager* pager, int32_t frame_index){
+    uint32_t bucket = pager_hash(pager, pager->frames[frame_index].page_num);
+    pager->frames[frame_index].hash_next = pager->page_table[bucket];
+    pager->page_table[bucket] = frame_index;
+}
 
-        if (num_cells == 0){
-            return 0;
-        }
+void pager_hash_remove(Pager* pager, int32_t frame_index){
+    int32_t* link = &(pager->page_table[pager_hash(pager, pager->frames[frame_index].page_num)]);
 
-        return *leaf_node_key(node, num_cells - 1);
+    while (*link != frame_index){
+        link = &(pager->frames[*link].hash_next);
     }
 
-    void* right_child = get_page(pager, *internal_node_right_child(node));
-    return get_node_max_key(pager, right_child);
+    *link = pager->frames[frame_index].hash_next;
 }
 
-Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key){
-    void* node = get_page(table->pager, page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
+int32_t pager_new_frame(Pager* pager){
+    /* Frames live in a growable array so that the pool can exceed its
+       budget when every frame is pinned; pages themselves never move */
+    uint32_t frame_index = pager->num_frames;
+    pager->frames = realloc(pager->frames, (frame_index + 1) * sizeof(Frame));
+    pager->frames[frame_index].page = frame_index < pager->max_frames
+        ? pager->slab + (size_t) frame_index * PAGE_SIZE
+        : aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+    pager->frames[frame_index].loading = false;
+    pager->frames[frame_index].latch = malloc(sizeof(pthread_rwlock_t));
+
+    /* glibc favours readers by default, which lets a steady stream of
+       scans through the root starve the writer */
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(pager->frames[frame_index].latch, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+    pager->num_frames += 1;
+
+    return frame_index;
+}
 
-    Cursor* cursor = malloc(sizeof(Cursor));
-    cursor->table = table;
-    cursor->page_num = page_num;
+Ring* ring_open(Pager* pager){
+    /* Set up a ring and register the pool slab with it, or return NULL
+       when io_uring is unavailable */
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
 
-    /* Perform a binary search to find the leaf node */
-    uint32_t min = 0;
-    uint32_t max = num_cells;
-
-    while (max != min){
-        uint32_t index = (min + max) / 2;
-        uint32_t key_at_index = *leaf_node_key(node, index);
-
-        if (key == key_at_index){
-            cursor->cell_num = index;
-            return cursor;
-        } 
-        
-        if (key < key_at_index){
-            max = index;
-        } else {
-            min = index + 1;
-        }
+    int fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+
+    if (fd < 0){
+        return NULL;
     }
 
-    cursor->cell_num = min;
-    return cursor;
-}
+    /* Kernels since 5.4 map both rings at once */
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)){
+        close(fd);
+        return NULL;
+    }
 
-uint32_t internal_node_find_child(void* node, uint32_t key){
-    /* Return the index of the child which should contain the given key */
-    uint32_t num_keys = *internal_node_num_keys(node);
+    Ring* ring = malloc(sizeof(Ring));
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_map_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->sqes_map_size = params.sq_entries * sizeof(struct io_uring_sqe);
 
-    /* Binary Search */
-    uint32_t min = 0;
-    uint32_t max = num_keys;
+    char* map = mmap(NULL, ring->ring_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     fd, IORING_OFF_SQ_RING);
+    void* sqes = mmap(NULL, ring->sqes_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
 
-    while (min != max){
-        uint32_t mid = (min + max) / 2;
-        uint32_t key_to_right = *internal_node_key(node, mid);
+    if (map == MAP_FAILED || sqes == MAP_FAILED){
+        printf("Unable to map io_uring rings.\n");
+        exit(0);
+    }
 
-        if (key_to_right >= key){
-            max = mid;
-        } else {
-            min = mid + 1;
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    ring->ring_map = map;
+    ring->sq_head = (uint32_t*) (map + params.sq_off.head);
+    ring->sq_tail = (uint32_t*) (map + params.sq_off.tail);
+    ring->sq_array = (uint32_t*) (map + params.sq_off.array);
+    ring->sq_mask = *(uint32_t*) (map + params.sq_off.ring_mask);
+    ring->cq_head = (uint32_t*) (map + params.cq_off.head);
+    ring->cq_tail = (uint32_t*) (map + params.cq_off.tail);
+    ring->cq_mask = *(uint32_t*) (map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (map + params.cq_off.cqes);
+    ring->sqes = sqes;
+    ring->to_submit = 0;
+    ring->in_flight = 0;
+
+    if (pager->registered_frames > 0){
+        struct iovec slab = { pager->slab, (size_t) pager->registered_frames * PAGE_SIZE };
+
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, &slab, 1) < 0){
+            pager->registered_frames = 0;
         }
     }
 
-    return min;
+    return ring;
 }
 
-Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key){
-    void* node = get_page(table->pager, page_num);
-
-    uint32_t child_index = internal_node_find_child(node, key);
-    uint32_t child_num = *internal_node_child(node, child_index);
-    void* child = get_page(table->pager, child_num);
-
-    switch(get_node_type(child)){
-        case NODE_INTERNAL:
-            return internal_node_find(table, child_num, key);
-        case NODE_LEAF:
-            return leaf_node_find(table, child_num, key);
+void ring_close(Ring* ring){
+    if (ring == NULL){
+        return;
     }
-}
 
-void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key){
-    uint32_t old_child_index = internal_node_find_child(node, old_key);
-    *internal_node_key(node, old_child_index) = new_key;
+    munmap(ring->sqes, ring->sqes_map_size);
+    munmap(ring->ring_map, ring->ring_map_size);
+    close(ring->fd);
+    free(ring);
 }
 
-void init_internal_node(void* node){
-    set_node_type(node, NODE_INTERNAL);
-    set_node_root(node, false);
-    *internal_node_num_keys(node) = 0;
+struct io_uring_sqe* ring_sqe(Ring* ring){
+    /* Queue a blank request, or return NULL when the ring is full. Keeping
+       in_flight within the submission ring's size means the completion
+       ring, twice as large, cannot overflow */
+    if (ring->in_flight == ring->entries){
+        return NULL;
+    }
 
-    *internal_node_right_child(node) = INVALID_PAGE_NUM;
-}
+    uint32_t tail = *ring->sq_tail;
+    uint32_t index = tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &(ring->sqes[index]);
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit += 1;
+    ring->in_flight += 1;
 
-void init_leaf_node(void* node){
-    set_node_type(node, NODE_LEAF);
-    set_node_root(node, false);
-    *leaf_node_num_cells(node) = 0;
-    *leaf_node_next_leaf(node) = INVALID_PAGE_NUM;
+    return sqe;
 }
 
-void print_row(Row* row){
-    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
-}
+void ring_prepare(Pager* pager, struct io_uring_sqe* sqe, bool write, void* page, uint32_t page_num, uint64_t user_data){
+    /* One page, through the registered slab when the page lies in it */
+    uint64_t slab_offset = (char*) page - pager->slab;
+    bool fixed = pager->slab != NULL && (char*) page >= pager->slab &&
+                 slab_offset < (uint64_t) pager->registered_frames * PAGE_SIZE;
 
-void serialize_row(Row* row, void* dest){
-    memcpy(dest + ID_OFFSET, &(row->id), ID_SIZE);
-    strncpy(dest + USERNAME_OFFSET, row->username, USERNAME_SIZE);
-    strncpy(dest + EMAIL_OFFSET, row->email, EMAIL_SIZE);
-}
+    if (fixed){
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = 0;
+    } else {
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
 
-void deserialize_row(void* source, Row* dest){
-    memcpy(&(dest->id), source + ID_OFFSET, ID_SIZE);
-    memcpy(&(dest->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-    memcpy(&(dest->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+    sqe->fd = pager->file_descriptor;
+    sqe->off = (uint64_t) page_num * PAGE_SIZE;
+    sqe->addr = (uint64_t) (uintptr_t) page;
+    sqe->len = PAGE_SIZE;
+    sqe->user_data = user_data;
 }
 
-Cursor* table_find(Table* table, uint32_t key){
-    uint32_t root_page_num = table->root_page_num;
-    void* root_node = get_page(table->pager, root_page_num);
+void ring_enter(Ring* ring, uint32_t min_complete){
+    /* Submit everything queued, waiting for min_complete results */
+    while (ring->to_submit > 0 || min_complete > 0){
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete,
+                                min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
 
-    if (get_node_type(root_node) == NODE_LEAF){
-        return leaf_node_find(table, root_page_num, key);
-    } else {
-        return internal_node_find(table, root_page_num, key);
+        if (submitted < 0){
+            if (errno == EINTR){
+                continue;
+            }
+
+            printf("Error submitting I/O: %d\n", errno);
+            exit(0);
+        }
+
+        ring->to_submit -= submitted;
+        return;
     }
 }
 
-Cursor* table_start(Table* table){
-    Cursor* cursor = table_find(table, 0);
+bool ring_complete(Ring* ring, struct io_uring_cqe* cqe){
+    uint32_t head = *ring->cq_head;
 
-    void* node = get_page(table->pager, cursor->page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
-    cursor->end_of_table = (num_cells == 0);
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)){
+        return false;
+    }
 
-    return cursor;
-}
+    *cqe = ring->cqes[head & ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    ring->in_flight -= 1;
 
-void* cursor_value(Cursor* cursor){
-    uint32_t page_num = cursor->page_num;
-    void* page = get_page(cursor->table->pager, page_num);
-    
-    return leaf_node_value(page, cursor->cell_num);
+    return true;
 }
 
-void cursor_advance(Cursor* cursor){
-    uint32_t page_num = cursor->page_num;
-    void* node = get_page(cursor->table->pager, page_num);
-    cursor->cell_num += 1;
+/* Page checksums
+   A CRC32C of each page's first PAGE_USABLE_SIZE bytes, kept in its last
+   four. Pages are stamped on their way to disk and verified when read
+   back into the pool. A stored zero means the page was never stamped, so
+   a checksum that comes out as zero is stored as all ones instead. Only
+   pages past the header's page count may be unstamped: an all-zero page
+   within it is a write the disk lost */
+typedef uint32_t (*Crc32cFunction)(uint32_t crc, const void* data, size_t length);
 
-    if (cursor->cell_num >= (*leaf_node_num_cells(node))){
-        uint32_t next_page_num = *leaf_node_next_leaf(node);
-        if (next_page_num == 0){
-            cursor->end_of_table = true;
-        } else {
-            cursor->page_num = next_page_num;
-            cursor->cell_num = 0;
-        }
+uint32_t crc32c_table[256];
+Crc32cFunction crc32c_update = NULL;
+pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+uint32_t crc32c_software(uint32_t crc, const void* data, size_t length){
+    const uint8_t* bytes = data;
+
+    for (size_t i = 0; i < length; i++){
+        crc = crc32c_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
     }
-}
 
-Pager* pager_open(const char* filename){
-    int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    return crc;
+}
 
-    if (fd == -1){
-        printf("Unable to open file\n");
-        exit(0);
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const void* data, size_t length){
+    const uint8_t* bytes = data;
+    uint64_t wide = crc;
+    size_t i = 0;
+
+    for (; i + 8 <= length; i += 8){
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        wide = _mm_crc32_u64(wide, word);
     }
 
-    off_t file_length = lseek(fd, 0, SEEK_END);
+    crc = (uint32_t) wide;
 
-    Pager* pager = malloc(sizeof(Pager));
-    pager->file_descriptor = fd;
-    pager->file_length = file_length;
-    pager->num_pages = (file_length / PAGE_SIZE);
+    for (; i < length; i++){
+        crc = _mm_crc32_u8(crc, bytes[i]);
+    }
 
-    if (file_length % PAGE_SIZE != 0){
-        printf("Db file is not a whole number of pages. Corrupt file.\n");
-        exit(0);
+    return crc;
+}
+#endif
+
+#ifdef CRC32C_ARM
+__attribute__((target("+crc")))
+uint32_t crc32c_armv8(uint32_t crc, const void* data, size_t length){
+    const uint8_t* bytes = data;
+    size_t i = 0;
+
+    for (; i + 8 <= length; i += 8){
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        crc = __crc32cd(crc, word);
     }
 
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++){
-        pager->pages[i] = NULL;
+    for (; i < length; i++){
+        crc = __crc32cb(crc, bytes[i]);
     }
 
-    return pager;
+    return crc;
 }
+#endif
 
-Table* db_open(const char* filename){
-    Pager* pager = pager_open(filename);
+void crc32c_init(){
+    /* Use the CPU's CRC32C instruction where there is one. The table is
+       for the fallback: the reflected Castagnoli polynomial */
+    for (uint32_t i = 0; i < 256; i++){
+        uint32_t crc = i;
 
-    Table* table = (Table*) malloc(sizeof(table));
-    table->pager = pager;
-    table->root_page_num = 0;
+        for (uint32_t bit = 0; bit < 8; bit++){
+            crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78 : 0);
+        }
 
-    if (pager->num_pages == 0){
-        void* root_node = get_page(pager, 0);
-        init_leaf_node(root_node);
-        set_node_root(root_node, true);
+        crc32c_table[i] = crc;
     }
 
-    return table;
+    crc32c_update = crc32c_software;
+
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse4.2")){
+        crc32c_update = crc32c_sse42;
+    }
+#endif
+
+#ifdef CRC32C_ARM
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32){
+        crc32c_update = crc32c_armv8;
+    }
+#endif
 }
 
-InputBuffer* init_input_buffer(){
-    InputBuffer* ib = (InputBuffer*) malloc(sizeof(InputBuffer));
-    ib->buffer = NULL;
-    ib->buffer_length = 0;
-    ib->input_length = 0;
+uint32_t* page_stored_checksum(void* page){
+    return page + PAGE_USABLE_SIZE;
+}
 
-    return ib;
+uint32_t page_checksum(const void* page){
+    uint32_t crc = ~crc32c_update(~0u, page, PAGE_USABLE_SIZE);
+    return crc == 0 ? UINT32_MAX : crc;
 }
 
-void print_prompt() {
-    printf("db > ");
+void page_stamp_checksum(void* page){
+    /* Only store when the checksum changed: a page stamped at commit is
+       written back as it is, and readers may be copying it meanwhile */
+    uint32_t checksum = page_checksum(page);
+
+    if (*page_stored_checksum(page) != checksum){
+        *page_stored_checksum(page) = checksum;
+    }
 }
 
-void read_input(InputBuffer* ib){
-    ssize_t bytes = getline(&(ib->buffer), &(ib->buffer_length), stdin);
+bool page_checksum_valid(Pager* pager, void* page, uint32_t page_num){
+    uint32_t stored = *page_stored_checksum(page);
 
-    if (bytes <= 0){
-        printf("Error, please try again");
-        exit(0);
+    if (stored == 0){
+        return page_num >= pager->stamped_pages;
     }
 
-    ib->input_length = bytes - 1;
-    ib->buffer[bytes - 1] = 0;
+    return stored == page_checksum(page);
 }
 
-void close_input_buffer(InputBuffer* ib){
-    free(ib->buffer);
-    free(ib);
+bool page_is_blank(void* page){
+    /* A free page holds nothing but its link, a page never written not
+       even that */
+    const uint8_t* bytes = page;
+
+    for (uint32_t i = FREE_PAGE_NEXT_OFFSET + sizeof(uint32_t); i < PAGE_USABLE_SIZE; i++){
+        if (bytes[i] != 0){
+            return false;
+        }
+    }
+
+    return true;
 }
 
-void pager_flush(Pager* pager, uint32_t page_num){
-    if (pager->pages[page_num] == NULL){
-        printf("Tried to flush null page.\n");
-        exit(0);
+bool page_node_valid(void* page, uint32_t page_num){
+    /* Whether the counts and offsets of a node stay inside its page, which
+       the tree code indexes by without checking. A checksum only says the
+       page is the one written, and a file overwritten whole, as by a
+       backup onto itself, has valid checksums over foreign pages */
+    if (page_num == DB_HEADER_PAGE_NUM || page_is_blank(page)){
+        return true;
+    }
+
+    if (get_node_type(page) == NODE_INTERNAL){
+        return *internal_node_num_keys(page) <= INTERNAL_NODE_MAX_CELLS;
+    }
+
+    if (get_node_type(page) != NODE_LEAF){
+        return false;
+    }
+
+    uint32_t num_cells = *leaf_node_num_cells(page);
+    uint32_t heap_start = *leaf_node_heap_start(page);
+
+    if (LEAF_NODE_HEADER_SIZE + (uint64_t) num_cells * LEAF_NODE_SLOT_SIZE > heap_start ||
+        heap_start > PAGE_USABLE_SIZE){
+        return false;
+    }
+
+    for (uint32_t i = 0; i < num_cells; i++){
+        uint32_t value_start = *leaf_node_value_pointer(page, i);
+
+        if (value_start < heap_start || value_start + *leaf_node_value_length(page, i) > PAGE_USABLE_SIZE){
+            return false;
+        }
     }
 
-    off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+    return true;
+}
 
-    if (offset == -1){
-        printf("Error seeking.\n");
+void page_verify(Pager* pager, void* page, uint32_t page_num){
+    /* A page read back from the file must be the page that was written,
+       and readable as a node */
+    if (!page_checksum_valid(pager, page, page_num)){
+        printf("Page %d failed its checksum. The db file is corrupt.\n", page_num);
         exit(0);
     }
 
-    ssize_t bytes = write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
-    
-    if (bytes == -1){
-        printf("Error writing.\n");
+    if (!page_node_valid(page, page_num)){
+        printf("Page %d is not a valid node. The db file is corrupt.\n", page_num);
         exit(0);
     }
 }
 
-void db_close(Table* table){
-    Pager* pager = table->pager;
+/* Compressed files
+   A compressed file does not keep page n at n * PAGE_SIZE. Each page is
+   compressed on its way to disk, in the LZ4 block format, and stored in
+   an extent of whole sectors that a page map, held in memory, points to.
+   Pages stay decompressed in the buffer pool, so only misses and
+   write-back pay for the codec. A page that does not shrink by at least
+   a sector is stored as it is.
+
+   Extents are never overwritten: a page written again goes to free
+   sectors, and its old extent only comes free once a map that no longer
+   points at it is durable. The map is written out the same way by
+   store_commit(), at each checkpoint, after which one of two header
+   slots in the first sectors, alternately, is pointed at it. A crash
+   therefore finds the last committed map and every extent it names as
+   they were, and the log holds whatever came after.
+
+   Free sectors are taken lowest first, and each commit cuts the file
+   back to its last used sector. Closing the file also moves the pages
+   furthest out into the holes rewrites left, see store_compact() */
+#define STORE_MAGIC 0x44425a31
+#define STORE_SECTOR_SIZE 512
+#define STORE_HEADER_SLOTS 2
+
+/* The header slots get a page's worth of sectors, so a compressed file
+   never reads as a plain one */
+#define STORE_FIRST_DATA_SECTOR 8
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+#define LZ_MAX_OFFSET 65535
+
+uint32_t lz_read32(const uint8_t* bytes){
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+bool lz_put_length(uint8_t* dst, uint32_t* out, uint32_t capacity, uint32_t length){
+    /* The part of a length past the token's 15, in bytes of up to 255 */
+    for (; length >= 255; length -= 255){
+        if (*out == capacity){
+            return false;
+        }
+
+        dst[(*out)++] = 255;
+    }
+
+    if (*out == capacity){
+        return false;
+    }
+
+    dst[(*out)++] = length;
+    return true;
+}
+
+bool lz_put_sequence(uint8_t* dst, uint32_t* out, uint32_t capacity, const uint8_t* literals,
+                     uint32_t num_literals, uint32_t offset, uint32_t match_length){
+    /* A token, the literals, then the match unless match_length is 0,
+       which ends the block */
+    uint32_t match_code = match_length > 0 ? match_length - LZ_MIN_MATCH : 0;
+
+    if (*out == capacity){
+        return false;
+    }
+
+    dst[(*out)++] = (num_literals < 15 ? num_literals : 15) << 4 | (match_code < 15 ? match_code : 15);
+
+    if (num_literals >= 15 && !lz_put_length(dst, out, capacity, num_literals - 15)){
+        return false;
+    }
+
+    if (capacity - *out < num_literals){
+        return false;
+    }
+
+    memcpy(dst + *out, literals, num_literals);
+    *out += num_literals;
+
+    if (match_length == 0){
+        return true;
+    }
+
+    if (capacity - *out < 2){
+        return false;
+    }
+
+    dst[(*out)++] = offset & 0xff;
+    dst[(*out)++] = offset >> 8;
+
+    return match_code < 15 || lz_put_length(dst, out, capacity, match_code - 15);
+}
+
+uint32_t lz_compress(const uint8_t* src, uint32_t length, uint8_t* dst, uint32_t capacity){
+    /* Greedy LZ4: look each 4-byte sequence up in a hash of where it was
+       last seen and take the longest match there. Returns the compressed
+       size, or 0 if it would not fit in capacity */
+    uint32_t table[1 << LZ_HASH_BITS];
+    uint32_t in = 0;
+    uint32_t anchor = 0;
+    uint32_t out = 0;
+
+    memset(table, 0, sizeof(table));
+
+    if (length > LZ_MATCH_LIMIT){
+        uint32_t limit = length - LZ_MATCH_LIMIT;
+
+        while (in < limit){
+            uint32_t sequence = lz_read32(src + in);
+            uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+
+            /* Positions are stored plus one, so zero is an empty slot */
+            uint32_t candidate = table[hash];
+            table[hash] = in + 1;
+
+            if (candidate == 0 || in - (candidate - 1) > LZ_MAX_OFFSET
+                || lz_read32(src + candidate - 1) != sequence){
+                in++;
+                continue;
+            }
+
+            uint32_t match = candidate - 1;
+            uint32_t match_length = LZ_MIN_MATCH;
+
+            while (in + match_length < length - LZ_LAST_LITERALS
+                   && src[match + match_length] == src[in + match_length]){
+                match_length++;
+            }
+
+            if (!lz_put_sequence(dst, &out, capacity, src + anchor, in - anchor, in - match, match_length)){
+                return 0;
+            }
+
+            in += match_length;
+            anchor = in;
+        }
+    }
+
+    if (!lz_put_sequence(dst, &out, capacity, src + anchor, length - anchor, 0, 0)){
+        return 0;
+    }
+
+    return out;
+}
+
+bool lz_get_length(const uint8_t* src, uint32_t length, uint32_t* in, uint32_t* value){
+    uint8_t byte;
+
+    do {
+        if (*in == length){
+            return false;
+        }
+
+        byte = src[(*in)++];
+        *value += byte;
+    } while (byte == 255 && *value < UINT32_MAX - 255);
+
+    return byte != 255;
+}
+
+bool lz_decompress(const uint8_t* src, uint32_t length, uint8_t* dst, uint32_t size){
+    /* Decode a block that must come out at exactly size bytes. Everything
+       read from the block is checked, so a damaged extent fails here
+       instead of writing past the page */
+    uint32_t in = 0;
+    uint32_t out = 0;
+
+    while (in < length){
+        uint8_t token = src[in++];
+        uint32_t num_literals = token >> 4;
+
+        if (num_literals == 15 && !lz_get_length(src, length, &in, &num_literals)){
+            return false;
+        }
+
+        if (num_literals > length - in || num_literals > size - out){
+            return false;
+        }
+
+        memcpy(dst + out, src + in, num_literals);
+        in += num_literals;
+        out += num_literals;
+
+        /* The last sequence has no match */
+        if (in == length){
+            break;
+        }
+
+        if (length - in < 2){
+            return false;
+        }
+
+        uint32_t offset = src[in] | (uint32_t) src[in + 1] << 8;
+        uint32_t match_length = token & 15;
+        in += 2;
+
+        if (match_length == 15 && !lz_get_length(src, length, &in, &match_length)){
+            return false;
+        }
+
+        match_length += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > out || match_length > size - out){
+            return false;
+        }
+
+        /* Byte by byte, the match may overlap what it produces */
+        for (uint32_t i = 0; i < match_length; i++){
+            dst[out + i] = dst[out - offset + i];
+        }
+
+        out += match_length;
+    }
+
+    return out == size;
+}
+
+uint32_t store_sectors(uint32_t bytes){
+    return (bytes + STORE_SECTOR_SIZE - 1) / STORE_SECTOR_SIZE;
+}
 
-    for (uint32_t i = 0; i < pager->num_pages; i++){
-        if (pager->pages[i] == NULL){
+bool store_sector_used(PageStore* store, uint32_t sector){
+    return sector / 64 < store->used_words && (store->used[sector / 64] >> (sector % 64) & 1);
+}
+
+void store_mark(PageStore* store, uint32_t sector, uint32_t count, bool used){
+    uint32_t words = (sector + count + 63) / 64;
+
+    if (words > store->used_words){
+        uint32_t capacity = store->used_words ? store->used_words : 64;
+
+        while (capacity < words){
+            capacity *= 2;
+        }
+
+        store->used = realloc(store->used, capacity * sizeof(uint64_t));
+        memset(store->used + store->used_words, 0, (capacity - store->used_words) * sizeof(uint64_t));
+        store->used_words = capacity;
+    }
+
+    for (uint32_t i = sector; i < sector + count; i++){
+        if (used){
+            store->used[i / 64] |= (uint64_t) 1 << (i % 64);
+        } else {
+            store->used[i / 64] &= ~((uint64_t) 1 << (i % 64));
+        }
+    }
+
+    if (!used && count > 0 && sector < store->first_free){
+        store->first_free = sector;
+    }
+
+    if (sector + count > store->num_sectors){
+        store->num_sectors = sector + count;
+    }
+}
+
+uint32_t store_allocate(PageStore* store, uint32_t count){
+    /* First fit: the lowest count free sectors in a row, else the end of
+       the file, so pages settle towards the start and the end of the file
+       comes free for store_trim() */
+    uint32_t first_free = UINT32_MAX;
+    uint32_t run = 0;
+    uint32_t first = store->num_sectors;
+
+    for (uint32_t sector = store->first_free; sector < store->num_sectors; sector++){
+        if (sector % 64 == 0 && sector / 64 < store->used_words && store->used[sector / 64] == UINT64_MAX){
+            run = 0;
+            sector += 63;
+            continue;
+        }
+
+        if (store_sector_used(store, sector)){
+            run = 0;
             continue;
         }
 
-        pager_flush(pager, i);
-        free(pager->pages[i]);
-        pager->pages[i] = NULL;
+        if (first_free == UINT32_MAX){
+            first_free = sector;
+        }
+
+        if (++run == count){
+            first = sector + 1 - count;
+            break;
+        }
     }
 
-    int res = close(pager->file_descriptor);
+    store_mark(store, first, count, true);
+    store->first_free = first_free == UINT32_MAX || first_free == first ? first + count : first_free;
 
-    if (res == -1){
-        printf("Error closing the db file.\n");
+    return first;
+}
+
+void store_trim(PageStore* store){
+    /* Cut the file back to its last used sector */
+    uint32_t num_sectors = store->num_sectors;
+
+    while (num_sectors > STORE_FIRST_DATA_SECTOR && !store_sector_used(store, num_sectors - 1)){
+        num_sectors -= 1;
+    }
+
+    if (num_sectors == store->num_sectors){
+        return;
+    }
+
+    if (ftruncate(store->file_descriptor, (off_t) num_sectors * STORE_SECTOR_SIZE) == -1){
+        printf("Error truncating the db file: %d\n", errno);
         exit(0);
     }
 
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++){
-        void* page = pager->pages[i];
-        if (page) {
-            free(page);
-            pager->pages[i] = NULL;
+    store->num_sectors = num_sectors;
+
+    if (store->first_free > num_sectors){
+        store->first_free = num_sectors;
+    }
+}
+
+void store_release(PageStore* store, PageExtent extent){
+    /* Let go of an extent once the next commit is durable */
+    if (store->num_freed == store->freed_capacity){
+        store->freed_capacity = store->freed_capacity ? store->freed_capacity * 2 : 16;
+        store->freed = realloc(store->freed, store->freed_capacity * sizeof(PageExtent));
+    }
+
+    store->freed[store->num_freed++] = extent;
+}
+
+void store_pwrite(int fd, const void* data, uint32_t length, off_t offset){
+    for (uint32_t done = 0; done < length; ){
+        ssize_t bytes = pwrite(fd, (const char*) data + done, length - done, offset + done);
+
+        if (bytes == -1){
+            printf("Error writing.\n");
+            exit(0);
+        }
+
+        done += bytes;
+    }
+}
+
+bool store_pread(int fd, void* data, uint32_t length, off_t offset){
+    /* Returns false if the file ends first */
+    for (uint32_t done = 0; done < length; ){
+        ssize_t bytes = pread(fd, (char*) data + done, length - done, offset + done);
+
+        if (bytes == -1){
+            printf("Error reading from file: %d\n", errno);
+            exit(0);
+        }
+
+        if (bytes == 0){
+            return false;
         }
+
+        done += bytes;
     }
 
-    free(pager);
-    free(table);
+    return true;
 }
 
-void print_constants(){
-    printf("Constants:\n");
-    printf("ROW_SIZE: %d\n", ROW_SIZE);
-    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+uint32_t store_write_page(PageStore* store, uint32_t page_num, const void* page){
+    /* Compress a page into a fresh extent and point the map at it.
+       Returns the bytes written */
+    uint8_t* compressed = malloc(PAGE_SIZE);
+    uint32_t bytes = lz_compress(page, PAGE_SIZE, compressed, PAGE_SIZE - STORE_SECTOR_SIZE);
+    const void* data = compressed;
+
+    if (bytes == 0){
+        bytes = PAGE_SIZE;
+        data = page;
+    }
+
+    pthread_mutex_lock(&store->mutex);
+
+    if (page_num >= store->extents_capacity){
+        uint32_t capacity = store->extents_capacity ? store->extents_capacity : 64;
+
+        while (capacity <= page_num){
+            capacity *= 2;
+        }
+
+        store->extents = realloc(store->extents, capacity * sizeof(PageExtent));
+        store->extents_capacity = capacity;
+    }
+
+    if (page_num >= store->num_pages){
+        memset(store->extents + store->num_pages, 0, (page_num + 1 - store->num_pages) * sizeof(PageExtent));
+        store->num_pages = page_num + 1;
+    }
+
+    PageExtent* extent = &(store->extents[page_num]);
+
+    if (extent->bytes != 0){
+        store_release(store, *extent);
+        store->stored_bytes -= extent->bytes;
+    }
+
+    extent->sector = store_allocate(store, store_sectors(bytes));
+    extent->bytes = bytes;
+    store->stored_bytes += bytes;
+    store->modified = true;
+    off_t offset = (off_t) extent->sector * STORE_SECTOR_SIZE;
+    pthread_mutex_unlock(&store->mutex);
+
+    store_pwrite(store->file_descriptor, data, bytes, offset);
+    free(compressed);
+
+    return bytes;
 }
 
-void indent(uint32_t level){
-    for (uint32_t i = 0; i < level; i++){
-        printf("   ");
+bool store_read_page(PageStore* store, uint32_t page_num, void* page, uint32_t* bytes_read){
+    /* Read a page back out of its extent. A page the map has no extent
+       for reads as zeros. Returns false if the extent is cut short or
+       does not decompress to a page */
+    pthread_mutex_lock(&store->mutex);
+    PageExtent extent = { 0, 0 };
+
+    if (page_num < store->num_pages){
+        extent = store->extents[page_num];
+    }
+
+    pthread_mutex_unlock(&store->mutex);
+
+    *bytes_read = extent.bytes;
+    off_t offset = (off_t) extent.sector * STORE_SECTOR_SIZE;
+
+    if (extent.bytes == 0){
+        memset(page, 0, PAGE_SIZE);
+        return true;
     }
+
+    if (extent.bytes == PAGE_SIZE){
+        return store_pread(store->file_descriptor, page, PAGE_SIZE, offset);
+    }
+
+    uint8_t* compressed = malloc(extent.bytes);
+    bool decoded = store_pread(store->file_descriptor, compressed, extent.bytes, offset)
+        && lz_decompress(compressed, extent.bytes, page, PAGE_SIZE);
+    free(compressed);
+
+    return decoded;
 }
 
-void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level){
-    void* node = get_page(pager, page_num);
-    uint32_t num_keys, child;
+uint32_t store_header_checksum(StoreHeader* header){
+    return ~crc32c_update(~0u, header, offsetof(StoreHeader, checksum));
+}
 
-    switch(get_node_type(node)){
-        case(NODE_LEAF):
-            num_keys = *leaf_node_num_cells(node);
-            indent(indentation_level);
-            printf("- leaf (size %d)\n", num_keys);
+void store_write_header(PageStore* store, StoreHeader* header){
+    header->checksum = store_header_checksum(header);
+    store_pwrite(store->file_descriptor, header, sizeof(StoreHeader),
+                 (off_t) (header->generation % STORE_HEADER_SLOTS) * STORE_SECTOR_SIZE);
 
-            for (uint32_t i = 0; i < num_keys; i++){
-                indent(indentation_level + 1);
-                printf("- %d\n", *leaf_node_key(node, i));
-            }
+    if (fdatasync(store->file_descriptor) == -1){
+        printf("Error syncing the db file: %d\n", errno);
+        exit(0);
+    }
+}
 
-            break;
-        case(NODE_INTERNAL):
-            num_keys = *internal_node_num_keys(node);
-            indent(indentation_level);
-            printf("- internal (size %d)\n", num_keys);
+void store_commit(PageStore* store){
+    /* Make the pages written since the last commit durable, then a map
+       naming them, then a header naming the map. Only then can the
+       extents let go of meanwhile be reused. The map is copied out under
+       the mutex and written without it, so reads carry on */
+    pthread_mutex_lock(&store->mutex);
 
-            if (num_keys > 0){
-                for (uint32_t i = 0; i < num_keys; i++){
-                    child = *internal_node_child(node, i);
-                    print_tree(pager, child, indentation_level + 1);
+    if (!store->modified){
+        pthread_mutex_unlock(&store->mutex);
+        return;
+    }
+
+    uint32_t map_bytes = store->num_pages * sizeof(PageExtent);
+    void* map = malloc(map_bytes > 0 ? map_bytes : 1);
+
+    if (map_bytes > 0){
+        memcpy(map, store->extents, map_bytes);
+    }
+
+    PageExtent previous_map = store->map;
+    PageExtent new_map = { store_allocate(store, store_sectors(map_bytes)), map_bytes };
+    uint32_t num_freed = store->num_freed;
+
+    StoreHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = STORE_MAGIC;
+    header.page_size = PAGE_SIZE;
+    header.generation = store->generation + 1;
+    header.map_sector = new_map.sector;
+    header.map_bytes = map_bytes;
+    header.num_pages = store->num_pages;
+    header.map_checksum = ~crc32c_update(~0u, map, map_bytes);
+    store->modified = false;
+    pthread_mutex_unlock(&store->mutex);
+
+    if (fdatasync(store->file_descriptor) == -1){
+        printf("Error syncing the db file: %d\n", errno);
+        exit(0);
+    }
+
+    store_pwrite(store->file_descriptor, map, map_bytes, (off_t) new_map.sector * STORE_SECTOR_SIZE);
+    free(map);
+
+    if (fdatasync(store->file_descriptor) == -1){
+        printf("Error syncing the db file: %d\n", errno);
+        exit(0);
+    }
+
+    store_write_header(store, &header);
+
+    pthread_mutex_lock(&store->mutex);
+    store->generation = header.generation;
+    store->map = new_map;
+    store_mark(store, previous_map.sector, store_sectors(previous_map.bytes), false);
+
+    for (uint32_t i = 0; i < num_freed; i++){
+        store_mark(store, store->freed[i].sector, store_sectors(store->freed[i].bytes), false);
+    }
+
+    /* Extents let go of while the map was being written wait for the
+       next commit */
+    if (num_freed > 0){
+        memmove(store->freed, store->freed + num_freed, (store->num_freed - num_freed) * sizeof(PageExtent));
+        store->num_freed -= num_freed;
+    }
+
+    /* Nothing durable lies past the last used sector any more */
+    store_trim(store);
+    pthread_mutex_unlock(&store->mutex);
+}
+
+/* A page's extent, for sorting pages by where they are stored */
+typedef struct StoredPage_Struct {
+    uint32_t page_num;
+    uint32_t sector;
+} StoredPage;
+
+int compare_stored_pages_descending(const void* a, const void* b){
+    uint32_t sector_a = ((const StoredPage*) a)->sector;
+    uint32_t sector_b = ((const StoredPage*) b)->sector;
+
+    return (sector_a < sector_b) - (sector_a > sector_b);
+}
+
+void store_compact(PageStore* store){
+    /* Rewrites leave holes that only pages written later can fill. When
+       over a quarter of the file is holes, move the extents furthest out
+       into the first holes that take them and commit, which cuts the file
+       back. Copies go to free sectors and the old extents stay put until
+       the map is durable, so a crash midway loses nothing. Called with
+       nothing else using the file */
+    uint64_t used_sectors = 0;
+
+    for (uint32_t i = 0; i < store->used_words; i++){
+        used_sectors += __builtin_popcountll(store->used[i]);
+    }
+
+    if (used_sectors * 4 >= (uint64_t) store->num_sectors * 3){
+        return;
+    }
+
+    StoredPage* pages = malloc((store->num_pages > 0 ? store->num_pages : 1) * sizeof(StoredPage));
+    uint32_t num_pages = 0;
+
+    for (uint32_t i = 0; i < store->num_pages; i++){
+        if (store->extents[i].bytes != 0){
+            pages[num_pages].page_num = i;
+            pages[num_pages].sector = store->extents[i].sector;
+            num_pages += 1;
+        }
+    }
+
+    qsort(pages, num_pages, sizeof(StoredPage), compare_stored_pages_descending);
+    void* data = malloc(PAGE_SIZE);
+
+    for (uint32_t i = 0; i < num_pages; i++){
+        PageExtent* extent = &(store->extents[pages[i].page_num]);
+        uint32_t count = store_sectors(extent->bytes);
+        uint32_t sector = store_allocate(store, count);
+
+        if (sector > extent->sector){
+            store_mark(store, sector, count, false);
+            continue;
+        }
+
+        if (!store_pread(store->file_descriptor, data, extent->bytes, (off_t) extent->sector * STORE_SECTOR_SIZE)){
+            printf("Page %d has no valid extent. The db file is corrupt.\n", pages[i].page_num);
+            exit(0);
+        }
+
+        store_pwrite(store->file_descriptor, data, extent->bytes, (off_t) sector * STORE_SECTOR_SIZE);
+        store_release(store, *extent);
+        extent->sector = sector;
+        store->modified = true;
+    }
+
+    free(data);
+    free(pages);
+    store_commit(store);
+
+    /* That map had to find room before the moved extents came free, so
+       it may sit past them. Written again it lands in the room they left,
+       and the file is cut back past both */
+    store->modified = true;
+    store_commit(store);
+}
+
+bool store_read_header(int fd, uint32_t slot, StoreHeader* header){
+    /* Returns false for a slot that is not a compressed file's header */
+    return pread(fd, header, sizeof(StoreHeader), (off_t) slot * STORE_SECTOR_SIZE) == sizeof(StoreHeader)
+        && header->magic == STORE_MAGIC;
+}
+
+PageStore* store_new(int fd){
+    PageStore* store = malloc(sizeof(PageStore));
+    memset(store, 0, sizeof(PageStore));
+    store->file_descriptor = fd;
+    pthread_mutex_init(&store->mutex, NULL);
+    store_mark(store, 0, STORE_FIRST_DATA_SECTOR, true);
+    store->first_free = STORE_FIRST_DATA_SECTOR;
+
+    return store;
+}
+
+PageStore* store_open(int fd, bool create){
+    /* Load the page map of a compressed file, or make an empty file a
+       compressed one if create is set. Returns NULL for a plain file */
+    off_t file_length = lseek(fd, 0, SEEK_END);
+
+    if (file_length == 0){
+        if (!create){
+            return NULL;
+        }
+
+        PageStore* store = store_new(fd);
+        StoreHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = STORE_MAGIC;
+        header.page_size = PAGE_SIZE;
+        header.map_checksum = ~crc32c_update(~0u, NULL, 0);
+        store_write_header(store, &header);
+
+        return store;
+    }
+
+    StoreHeader headers[STORE_HEADER_SLOTS];
+    int32_t current = -1;
+    bool compressed = false;
+
+    for (uint32_t slot = 0; slot < STORE_HEADER_SLOTS; slot++){
+        if (!store_read_header(fd, slot, &headers[slot])){
+            continue;
+        }
+
+        /* A slot torn by a crash while being written fails its checksum */
+        compressed = true;
+
+        if (headers[slot].checksum == store_header_checksum(&headers[slot])
+            && (current == -1 || headers[slot].generation > headers[current].generation)){
+            current = slot;
+        }
+    }
+
+    if (!compressed){
+        return NULL;
+    }
+
+    if (current == -1){
+        printf("Compressed db file has no valid header. Corrupt file.\n");
+        exit(0);
+    }
+
+    StoreHeader* header = &headers[current];
+
+    if (header->page_size != PAGE_SIZE){
+        printf("Db file was written with %d byte pages.\n", header->page_size);
+        exit(0);
+    }
+
+    PageStore* store = store_new(fd);
+    store->generation = header->generation;
+    store->num_pages = header->num_pages;
+    store->extents_capacity = header->num_pages;
+    store->extents = malloc((header->num_pages > 0 ? header->num_pages : 1) * sizeof(PageExtent));
+    store->map.sector = header->map_sector;
+    store->map.bytes = header->map_bytes;
+
+    uint32_t file_sectors = (file_length + STORE_SECTOR_SIZE - 1) / STORE_SECTOR_SIZE;
+
+    if (header->map_bytes != header->num_pages * sizeof(PageExtent)
+        || !store_pread(fd, store->extents, header->map_bytes, (off_t) header->map_sector * STORE_SECTOR_SIZE)
+        || header->map_checksum != ~crc32c_update(~0u, store->extents, header->map_bytes)){
+        printf("The page map failed its checksum. The db file is corrupt.\n");
+        exit(0);
+    }
+
+    store_mark(store, store->map.sector, store_sectors(store->map.bytes), true);
+
+    for (uint32_t i = 0; i < store->num_pages; i++){
+        PageExtent* extent = &(store->extents[i]);
+
+        if (extent->bytes == 0){
+            continue;
+        }
+
+        if (extent->bytes > PAGE_SIZE || extent->sector < STORE_FIRST_DATA_SECTOR
+            || extent->sector + store_sectors(extent->bytes) > file_sectors){
+            printf("Page %d has no valid extent. The db file is corrupt.\n", i);
+            exit(0);
+        }
+
+        store_mark(store, extent->sector, store_sectors(extent->bytes), true);
+        store->stored_bytes += extent->bytes;
+    }
+
+    /* Sectors past the last extent, left by writes a crash cut off from
+       the map, are free */
+    if (file_sectors > store->num_sectors){
+        store->num_sectors = file_sectors;
+    }
+
+    return store;
+}
+
+void store_close(PageStore* store){
+    if (store == NULL){
+        return;
+    }
+
+    pthread_mutex_destroy(&store->mutex);
+    free(store->extents);
+    free(store->used);
+    free(store->freed);
+    free(store);
+}
+
+void pread_page(Pager* pager, uint32_t page_num, void* page, size_t done){
+    /* Blocking read of the rest of a page, from done bytes in */
+    while (done < PAGE_SIZE){
+        ssize_t bytes = pread(pager->file_descriptor, (char*) page + done, PAGE_SIZE - done,
+                              (off_t) page_num * PAGE_SIZE + done);
+
+        if (bytes == -1){
+            printf("Error reading from file: %d\n", errno);
+            exit(0);
+        }
+
+        if (bytes == 0){
+            memset((char*) page + done, 0, PAGE_SIZE - done);
+            return;
+        }
+
+        done += bytes;
+    }
+}
+
+void pwrite_page(Pager* pager, uint32_t page_num, const void* page, size_t done){
+    while (done < PAGE_SIZE){
+        ssize_t bytes = pwrite(pager->file_descriptor, (const char*) page + done, PAGE_SIZE - done,
+                               (off_t) page_num * PAGE_SIZE + done);
+
+        if (bytes == -1){
+            printf("Error writing.\n");
+            exit(0);
+        }
+
+        done += bytes;
+    }
+}
+
+void pager_read_reap(Pager* pager, uint32_t min_complete){
+    /* Submit queued reads and finish every completed one: the frame is
+       loaded and its read pin dropped. Called with the pool mutex held */
+    Ring* ring = pager->read_ring;
+    struct io_uring_cqe cqe;
+
+    ring_enter(ring, min_complete);
+
+    while (ring_complete(ring, &cqe)){
+        Frame* frame = &(pager->frames[cqe.user_data]);
+
+        if (cqe.res < 0){
+            printf("Error reading from file: %d\n", -cqe.res);
+            exit(0);
+        }
+
+        if (cqe.res < (int32_t) PAGE_SIZE){
+            pread_page(pager, frame->page_num, frame->page, cqe.res);
+        }
+
+        page_verify(pager, frame->page, frame->page_num);
+        frame->loading = false;
+        frame->pin_count -= 1;
+    }
+}
+
+void pager_read_start(Pager* pager, int32_t frame_index){
+    /* Queue a read of the frame's page. The frame stays pinned and marked
+       loading until the read completes */
+    Frame* frame = &(pager->frames[frame_index]);
+    struct io_uring_sqe* sqe;
+
+    while ((sqe = ring_sqe(pager->read_ring)) == NULL){
+        pager_read_reap(pager, 1);
+    }
+
+    ring_prepare(pager, sqe, false, frame->page, frame->page_num, frame_index);
+    frame->loading = true;
+    frame->pin_count += 1;
+    pager->pages_read += 1;
+    stats_add(&(stats_counters()->bytes_read), PAGE_SIZE);
+}
+
+void pager_read_wait(Pager* pager, int32_t frame_index){
+    while (pager->frames[frame_index].loading){
+        pager_read_reap(pager, 1);
+    }
+}
+
+void pager_write_pages(Pager* pager, DirtyPage* pages, uint32_t count);
+
+void pager_frame_assign(Pager* pager, int32_t frame_index, uint32_t page_num){
+    /* Give a claimed frame to page_num, not yet loaded */
+    Frame* frame = &(pager->frames[frame_index]);
+    frame->page_num = page_num;
+    frame->pin_count = 0;
+    frame->pin_stamp = 0;
+    frame->in_txn = false;
+    frame->wal_lsn = 0;
+    frame->dirty = false;
+    frame->loading = false;
+    pager_hash_insert(pager, frame_index);
+}
+
+void pager_frame_drop(Pager* pager, int32_t frame_index){
+    /* Take an unpinned frame's page out of the pool, writing it back first
+       if needed. A spilled page is dropped: its image stays in the log,
+       and the main file must not see it before its statement commits */
+    Frame* frame = &(pager->frames[frame_index]);
+
+    if (frame->dirty && wal_spilled_lookup(pager->wal, frame->page_num) == -1){
+        /* The main file may only see a page once its log record is durable */
+        if (pager->wal != NULL){
+            wal_wait_durable(pager->wal, frame->wal_lsn);
+        }
+
+        pager_flush(pager, frame->page_num);
+    }
+
+    pager_hash_remove(pager, frame_index);
+    pager->evictions += 1;
+}
+
+int32_t pager_evict(Pager* pager){
+    /* CLOCK: sweep the frames, giving each referenced frame a second
+       chance. Two full sweeps without a victim means everything is pinned */
+    for (uint32_t i = 0; i < 2 * pager->num_frames; i++){
+        uint32_t frame_index = pager->clock_hand;
+        Frame* frame = &(pager->frames[frame_index]);
+        pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+
+        /* Pages modified by the open transaction stay put until logged */
+        if (frame->pin_count > 0 || frame->in_txn){
+            continue;
+        }
+
+        if (frame->referenced){
+            frame->referenced = false;
+            continue;
+        }
+
+        pager_frame_drop(pager, frame_index);
+
+        return frame_index;
+    }
+
+    return INVALID_FRAME;
+}
+
+int32_t pager_claim_frame(Pager* pager){
+    /* Past its budget the pool only grows while every frame is pinned or
+       awaiting the log, and never past PAGER_MAX_EXTRA_FRAMES more */
+    if (pager->num_frames < pager->max_frames){
+        return pager_new_frame(pager);
+    }
+
+    int32_t frame_index = pager_evict(pager);
+
+    if (frame_index != INVALID_FRAME){
+        return frame_index;
+    }
+
+    if (pager->num_frames >= pager->max_frames + PAGER_MAX_EXTRA_FRAMES){
+        printf("Buffer pool exhausted: all %d frames are in use.\n", pager->num_frames);
+        exit(0);
+    }
+
+    return pager_new_frame(pager);
+}
+
+void pager_trim_frames(Pager* pager){
+    /* Give back the frames allocated past the budget once nothing holds
+       them. Frame indices must stay put, so only the last frames can go;
+       one still in use stops the trim until a later release */
+    while (pager->num_frames > pager->max_frames){
+        int32_t frame_index = pager->num_frames - 1;
+        Frame* frame = &(pager->frames[frame_index]);
+
+        if (frame->pin_count > 0 || frame->in_txn || frame->loading){
+            break;
+        }
+
+        pager_frame_drop(pager, frame_index);
+        free(frame->page);
+        pthread_rwlock_destroy(frame->latch);
+        free(frame->latch);
+        pager->num_frames -= 1;
+    }
+
+    if (pager->clock_hand >= pager->num_frames){
+        pager->clock_hand = 0;
+    }
+}
+
+void thread_state_free(void* arg){
+    ThreadState* state = arg;
+    free(state->pins);
+    state->pins = NULL;
+    state->pins_capacity = 0;
+}
+
+void thread_state_key_init(){
+    pthread_key_create(&thread_state_key, thread_state_free);
+}
+
+void pager_pin_for_operation(Pager* pager, int32_t frame_index){
+    /* Each operation pins a frame once. The stamp identifies the thread's
+       current operation; if another thread pinned the frame since, it is
+       pinned twice, which release undoes just the same */
+    ThreadState* state = &thread_state;
+    Frame* frame = &(pager->frames[frame_index]);
+
+    if (state->pin_stamp == 0){
+        state->pin_stamp = __atomic_add_fetch(&next_pin_stamp, 1, __ATOMIC_RELAXED);
+    }
+
+    if (frame->pin_stamp == state->pin_stamp){
+        return;
+    }
+
+    if (state->num_pins == state->pins_capacity){
+        /* Free the pin list when the thread exits */
+        if (state->pins == NULL){
+            pthread_once(&thread_state_once, thread_state_key_init);
+            pthread_setspecific(thread_state_key, state);
+        }
+
+        state->pins_capacity = state->pins_capacity ? state->pins_capacity * 2 : 16;
+        state->pins = realloc(state->pins, state->pins_capacity * sizeof(HeldPin));
+    }
+
+    frame->pin_stamp = state->pin_stamp;
+    frame->pin_count += 1;
+    state->pins[state->num_pins].pager = pager;
+    state->pins[state->num_pins].frame_index = frame_index;
+    state->num_pins += 1;
+}
+
+void pager_release_pins(Pager* pager){
+    /* Every page returned by get_page stays resident until the operation
+       that fetched it ends, so node pointers held across get_page calls
+       cannot be evicted underneath their users */
+    ThreadState* state = &thread_state;
+    uint32_t kept = 0;
+
+    pthread_mutex_lock(&pager->pool_mutex);
+
+    for (uint32_t i = 0; i < state->num_pins; i++){
+        if (state->pins[i].pager != pager){
+            state->pins[kept++] = state->pins[i];
+            continue;
+        }
+
+        pager->frames[state->pins[i].frame_index].pin_count -= 1;
+    }
+
+    pager_trim_frames(pager);
+    pthread_mutex_unlock(&pager->pool_mutex);
+
+    state->num_pins = kept;
+    state->pin_stamp = __atomic_add_fetch(&next_pin_stamp, 1, __ATOMIC_RELAXED);
+}
+
+void* pager_latch(Pager* pager, uint32_t page_num, bool exclusive){
+    /* Fetch a page and latch it. The latch holds its own pin, so the page
+       stays put while latched even if the operation releases its pins */
+    void* page = get_page(pager, page_num);
+
+    if (pager->use_mmap){
+        return page;
+    }
+
+    ThreadState* state = &thread_state;
+
+    if (state->num_latches == MAX_HELD_LATCHES){
+        printf("Too many page latches held.\n");
+        exit(0);
+    }
+
+    pthread_mutex_lock(&pager->pool_mutex);
+    int32_t frame_index = pager_lookup(pager, page_num);
+    Frame* frame = &(pager->frames[frame_index]);
+    frame->pin_count += 1;
+    pthread_rwlock_t* latch = frame->latch;
+    pthread_mutex_unlock(&pager->pool_mutex);
+
+    if (exclusive){
+        pthread_rwlock_wrlock(latch);
+    } else {
+        pthread_rwlock_rdlock(latch);
+    }
+
+    HeldLatch* held = &(state->latches[state->num_latches++]);
+    held->pager = pager;
+    held->page_num = page_num;
+    held->frame_index = frame_index;
+
+    return page;
+}
+
+void pager_unlatch_at(uint32_t index){
+    ThreadState* state = &thread_state;
+    HeldLatch held = state->latches[index];
+
+    pthread_mutex_lock(&held.pager->pool_mutex);
+    Frame* frame = &(held.pager->frames[held.frame_index]);
+    pthread_rwlock_unlock(frame->latch);
+    frame->pin_count -= 1;
+    pthread_mutex_unlock(&held.pager->pool_mutex);
+
+    memmove(state->latches + index, state->latches + index + 1, (state->num_latches - index - 1) * sizeof(HeldLatch));
+    state->num_latches -= 1;
+}
+
+void pager_unlatch(Pager* pager, uint32_t page_num){
+    ThreadState* state = &thread_state;
+
+    for (uint32_t i = state->num_latches; i > 0; i--){
+        if (state->latches[i - 1].pager == pager && state->latches[i - 1].page_num == page_num){
+            pager_unlatch_at(i - 1);
+            return;
+        }
+    }
+}
+
+bool pager_holds_latch(Pager* pager, uint32_t page_num){
+    ThreadState* state = &thread_state;
+
+    for (uint32_t i = 0; i < state->num_latches; i++){
+        if (state->latches[i].pager == pager && state->latches[i].page_num == page_num){
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void pager_unlatch_ancestors(Pager* pager){
+    /* Release every latch on this pager except the most recent one: the
+       child a descent just latched */
+    ThreadState* state = &thread_state;
+
+    for (uint32_t i = state->num_latches; i > 1; i--){
+        if (state->latches[i - 2].pager == pager){
+            pager_unlatch_at(i - 2);
+        }
+    }
+}
+
+void pager_unlatch_all(Pager* pager){
+    ThreadState* state = &thread_state;
+
+    for (uint32_t i = state->num_latches; i > 0; i--){
+        if (state->latches[i - 1].pager == pager){
+            pager_unlatch_at(i - 1);
+        }
+    }
+}
+
+PageVersions** pager_versions_slot(Pager* pager, uint32_t page_num){
+    PageVersions** slot = &(pager->version_table[page_num % VERSION_TABLE_SIZE]);
+
+    while (*slot != NULL && (*slot)->page_num != page_num){
+        slot = &((*slot)->next);
+    }
+
+    return slot;
+}
+
+void pager_save_version(Pager* pager, uint32_t page_num, void* page){
+    /* Keep the page as it is now for open snapshots, once per write. A
+       page without saved images has not changed since before the oldest
+       snapshot, so its image is tagged 0 and is visible to every one */
+    pthread_mutex_lock(&pager->version_mutex);
+    uint64_t write_version = pager->version + 1;
+
+    if (pager->num_snapshots == 0){
+        pager->write_unversioned = true;
+        pthread_mutex_unlock(&pager->version_mutex);
+        return;
+    }
+
+    PageVersions** slot = pager_versions_slot(pager, page_num);
+    PageVersions* versions = *slot;
+
+    if (versions == NULL){
+        versions = malloc(sizeof(PageVersions));
+        versions->page_num = page_num;
+        versions->live_version = 0;
+        versions->images = NULL;
+        versions->next = NULL;
+        *slot = versions;
+    }
+
+    if (versions->live_version != write_version){
+        PageImage* image = malloc(sizeof(PageImage) + PAGE_SIZE);
+        image->version = versions->live_version;
+        image->next = versions->images;
+        memcpy(image->page, page, PAGE_SIZE);
+        versions->images = image;
+        versions->live_version = write_version;
+    }
+
+    pthread_mutex_unlock(&pager->version_mutex);
+}
+
+void pager_collect_versions(Pager* pager){
+    /* Free the images no snapshot can read. An image is read by snapshots
+       from its own version up to the version that replaced it, so it is
+       dead once the oldest snapshot is past the replacement. A snapshot
+       opened now gets the published version, so images replaced by the
+       write in progress stay until it is published. Called with
+       version_mutex held */
+    uint64_t oldest = pager->version;
+
+    for (uint32_t i = 0; i < pager->num_snapshots; i++){
+        if (pager->snapshots[i] < oldest){
+            oldest = pager->snapshots[i];
+        }
+    }
+
+    for (uint32_t bucket = 0; bucket < VERSION_TABLE_SIZE; bucket++){
+        PageVersions** slot = &(pager->version_table[bucket]);
+
+        while (*slot != NULL){
+            PageVersions* versions = *slot;
+            PageImage** image_slot = &(versions->images);
+            uint64_t replaced_by = versions->live_version;
+
+            while (*image_slot != NULL && replaced_by > oldest){
+                replaced_by = (*image_slot)->version;
+                image_slot = &((*image_slot)->next);
+            }
+
+            while (*image_slot != NULL){
+                PageImage* dead = *image_slot;
+                *image_slot = dead->next;
+                free(dead);
+            }
+
+            if (versions->images == NULL){
+                *slot = versions->next;
+                free(versions);
+            } else {
+                slot = &(versions->next);
+            }
+        }
+    }
+}
+
+void pager_publish(Pager* pager){
+    /* Make the write in progress visible to snapshots opened from now on */
+    if (pager->use_mmap){
+        return;
+    }
+
+    pthread_mutex_lock(&pager->version_mutex);
+    pager->version += 1;
+    pager->write_unversioned = false;
+    pthread_cond_broadcast(&pager->version_cond);
+
+    if (pager->num_snapshots == 0){
+        pager_collect_versions(pager);
+    }
+
+    pthread_mutex_unlock(&pager->version_mutex);
+}
+
+uint64_t pager_snapshot_begin(Pager* pager){
+    /* Open a snapshot of every published write */
+    if (pager->use_mmap){
+        return 0;
+    }
+
+    pthread_mutex_lock(&pager->version_mutex);
+
+    while (pager->write_unversioned){
+        pthread_cond_wait(&pager->version_cond, &pager->version_mutex);
+    }
+
+    if (pager->num_snapshots == pager->snapshots_capacity){
+        pager->snapshots_capacity = pager->snapshots_capacity ? pager->snapshots_capacity * 2 : 8;
+        pager->snapshots = realloc(pager->snapshots, pager->snapshots_capacity * sizeof(uint64_t));
+    }
+
+    uint64_t version = pager->version;
+    pager->snapshots[pager->num_snapshots++] = version;
+    pthread_mutex_unlock(&pager->version_mutex);
+
+    return version;
+}
+
+uint64_t pager_snapshot_share(Pager* pager, uint64_t version){
+    /* Register another reader of a snapshot the caller holds open */
+    if (pager->use_mmap){
+        return version;
+    }
+
+    pthread_mutex_lock(&pager->version_mutex);
+
+    if (pager->num_snapshots == pager->snapshots_capacity){
+        pager->snapshots_capacity = pager->snapshots_capacity * 2;
+        pager->snapshots = realloc(pager->snapshots, pager->snapshots_capacity * sizeof(uint64_t));
+    }
+
+    pager->snapshots[pager->num_snapshots++] = version;
+    pthread_mutex_unlock(&pager->version_mutex);
+
+    return version;
+}
+
+void pager_snapshot_end(Pager* pager, uint64_t version){
+    if (pager->use_mmap){
+        return;
+    }
+
+    pthread_mutex_lock(&pager->version_mutex);
+
+    for (uint32_t i = 0; i < pager->num_snapshots; i++){
+        if (pager->snapshots[i] == version){
+            pager->snapshots[i] = pager->snapshots[--pager->num_snapshots];
+            break;
+        }
+    }
+
+    pager_collect_versions(pager);
+    pthread_mutex_unlock(&pager->version_mutex);
+}
+
+void pager_read_version(Pager* pager, uint32_t page_num, uint64_t version, void* dest){
+    /* Copy out a page as of a snapshot. Writers save a page under
+       version_mutex before changing it, so holding it here means the live
+       page is either untouched or already has the image we need */
+    void* page = get_page(pager, page_num);
+
+    if (pager->use_mmap){
+        memcpy(dest, page, PAGE_SIZE);
+        return;
+    }
+
+    pthread_mutex_lock(&pager->version_mutex);
+    PageVersions* versions = *pager_versions_slot(pager, page_num);
+    const void* source = page;
+
+    if (versions != NULL && versions->live_version > version){
+        PageImage* image = versions->images;
+
+        while (image->version > version){
+            image = image->next;
+        }
+
+        source = image->page;
+    }
+
+    memcpy(dest, source, PAGE_SIZE);
+    pthread_mutex_unlock(&pager->version_mutex);
+}
+
+void pager_prefetch(Pager* pager, const uint32_t* page_nums, uint32_t count){
+    /* Start reading pages a scan will need soon, so the disk works ahead
+       of the scan instead of stalling it on every miss. With io_uring the
+       pages are read straight into frames, as far as the pool has frames
+       to spare; get_page waits for any read still in flight. Otherwise
+       this only warms the kernel's page cache, with runs of consecutive
+       pages going out as one request. Pages in the pool, past the end of
+       the file or spilled to the log are skipped */
+    uint32_t wanted[count];
+    uint32_t num_wanted = 0;
+
+    if (pager->use_mmap){
+        for (uint32_t i = 0; i < count; i++){
+            if (page_nums[i] < pager->mapped_pages){
+                madvise(pager->map + (size_t) page_nums[i] * PAGE_SIZE, PAGE_SIZE, MADV_WILLNEED);
+            }
+        }
+
+        return;
+    }
+
+    /* Compressed pages are not where the kernel would read ahead, and
+       with O_DIRECT there is no page cache to warm */
+    if (pager->store != NULL || (pager->direct_io && pager->read_ring == NULL)){
+        return;
+    }
+
+    pthread_mutex_lock(&pager->pool_mutex);
+    uint32_t file_pages = pager->file_length / PAGE_SIZE;
+
+    for (uint32_t i = 0; i < count; i++){
+        if (page_nums[i] < file_pages && pager_lookup(pager, page_nums[i]) == INVALID_FRAME &&
+            wal_spilled_lookup(pager->wal, page_nums[i]) == -1){
+            wanted[num_wanted++] = page_nums[i];
+        }
+    }
+
+    if (pager->read_ring != NULL){
+        for (uint32_t i = 0; i < num_wanted; i++){
+            /* Read-ahead never grows the pool past its budget */
+            int32_t frame_index = pager->num_frames < pager->max_frames
+                ? pager_new_frame(pager)
+                : pager_evict(pager);
+
+            if (frame_index == INVALID_FRAME){
+                break;
+            }
+
+            pager_frame_assign(pager, frame_index, wanted[i]);
+            pager->frames[frame_index].referenced = true;
+            pager_read_start(pager, frame_index);
+            pager->prefetches += 1;
+
+            if (wanted[i] >= pager->num_pages){
+                pager->num_pages = wanted[i] + 1;
+            }
+        }
+
+        /* Submit without waiting, and finish whatever already completed */
+        pager_read_reap(pager, 0);
+        pthread_mutex_unlock(&pager->pool_mutex);
+        return;
+    }
+
+    pthread_mutex_unlock(&pager->pool_mutex);
+
+    for (uint32_t i = 0; i < num_wanted; ){
+        uint32_t run = 1;
+
+        while (i + run < num_wanted && wanted[i + run] == wanted[i] + run){
+            run++;
+        }
+
+        posix_fadvise(pager->file_descriptor, (off_t) wanted[i] * PAGE_SIZE, (off_t) run * PAGE_SIZE,
+                      POSIX_FADV_WILLNEED);
+        i += run;
+    }
+}
+
+void pager_mark_dirty(Pager* pager, uint32_t page_num){
+    /* Called by writers before they modify a page they fetched */
+    if (pager->use_mmap){
+        /* Runs of changes to one page, as an append makes, list it once */
+        if (pager->num_map_dirty > 0 && pager->map_dirty[pager->num_map_dirty - 1] == page_num){
+            return;
+        }
+
+        if (pager->num_map_dirty == pager->map_dirty_capacity){
+            pager->map_dirty_capacity = pager->map_dirty_capacity ? pager->map_dirty_capacity * 2 : 16;
+            pager->map_dirty = realloc(pager->map_dirty, pager->map_dirty_capacity * sizeof(uint32_t));
+        }
+
+        pager->map_dirty[pager->num_map_dirty++] = page_num;
+        return;
+    }
+
+    pager_save_version(pager, page_num, get_page(pager, page_num));
+    pthread_mutex_lock(&pager->pool_mutex);
+    int32_t frame_index = pager_lookup(pager, page_num);
+    assert(frame_index != INVALID_FRAME);
+    Frame* frame = &(pager->frames[frame_index]);
+    frame->dirty = true;
+
+    if (pager->wal != NULL && !frame->in_txn){
+        if (pager->num_txn_frames == pager->txn_frames_capacity){
+            pager->txn_frames_capacity = pager->txn_frames_capacity ? pager->txn_frames_capacity * 2 : 16;
+            pager->txn_frames = realloc(pager->txn_frames, pager->txn_frames_capacity * sizeof(int32_t));
+        }
+
+        frame->in_txn = true;
+        pager->txn_frames[pager->num_txn_frames++] = frame_index;
+    }
+
+    pthread_mutex_unlock(&pager->pool_mutex);
+}
+
+void pager_advise(Pager* pager, int advice){
+    /* Tell the kernel how the next accesses will look: MADV_SEQUENTIAL for
+       scans, MADV_RANDOM for point lookups. The mapping is only advised when
+       the access pattern changes */
+    if (!pager->use_mmap || pager->advice == advice){
+        return;
+    }
+
+    pager->advice = advice;
+
+    if (pager->mapped_pages > 0){
+        madvise(pager->map, (size_t) pager->mapped_pages * PAGE_SIZE, advice);
+    }
+}
+
+void pager_map_grow(Pager* pager, uint32_t page_num){
+    uint32_t new_mapped_pages = pager->mapped_pages * 2;
+
+    if (new_mapped_pages < PAGER_MMAP_MIN_GROWTH){
+        new_mapped_pages = PAGER_MMAP_MIN_GROWTH;
+    }
+
+    if (new_mapped_pages <= page_num){
+        new_mapped_pages = page_num + 1;
+    }
+
+    size_t length = (size_t) new_mapped_pages * PAGE_SIZE;
+
+    if (length > PAGER_MMAP_RESERVE){
+        printf("Db file is too large to map.\n");
+        exit(0);
+    }
+
+    if (length > pager->file_length){
+        if (ftruncate(pager->file_descriptor, length) == -1){
+            printf("Error growing file: %d\n", errno);
+            exit(0);
+        }
+
+        pager->file_length = length;
+    }
+
+    /* Remap in place over the reservation. mremap would be free to move
+       the mapping, which would leave every held page pointer dangling */
+    void* map = mmap(pager->map, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, pager->file_descriptor, 0);
+
+    if (map == MAP_FAILED){
+        printf("Error mapping file: %d\n", errno);
+        exit(0);
+    }
+
+    pager->mapped_pages = new_mapped_pages;
+    madvise(pager->map, length, pager->advice);
+}
+
+void* get_page(Pager* pager, uint32_t page_num){
+    if (page_num == INVALID_PAGE_NUM){
+        printf("Tried to fetch invalid page number.\n");
+        exit(0);
+    }
+
+    if (pager->use_mmap){
+        if (page_num >= pager->mapped_pages){
+            pager_map_grow(pager, page_num);
+        }
+
+        if (page_num >= pager->num_pages){
+            pager->num_pages = page_num + 1;
+        }
+
+        return pager->map + (size_t) page_num * PAGE_SIZE;
+    }
+
+    pthread_mutex_lock(&pager->pool_mutex);
+    int32_t frame_index = pager_lookup(pager, page_num);
+
+    if (frame_index != INVALID_FRAME){
+        pager->hits += 1;
+        stats_add(&(stats_counters()->cache_hits), 1);
+
+        /* A read-ahead may still be filling the frame */
+        pager_read_wait(pager, frame_index);
+    } else {
+        pager->misses += 1;
+        stats_add(&(stats_counters()->cache_misses), 1);
+        frame_index = pager_claim_frame(pager);
+        pager_frame_assign(pager, frame_index, page_num);
+        Frame* frame = &(pager->frames[frame_index]);
+        off_t wal_offset = wal_spilled_lookup(pager->wal, page_num);
+
+        if (wal_offset != -1){
+            /* Still dirty: the main file has yet to get this image */
+            wal_read_page(pager->wal, wal_offset, frame->page);
+            page_verify(pager, frame->page, page_num);
+            frame->dirty = true;
+            pager->pages_read += 1;
+            stats_add(&(stats_counters()->bytes_read), PAGE_SIZE);
+        } else if (page_num >= pager->file_length / PAGE_SIZE){
+            memset(frame->page, 0, PAGE_SIZE);
+        } else if (pager->store != NULL){
+            uint32_t bytes_read;
+
+            if (!store_read_page(pager->store, page_num, frame->page, &bytes_read)){
+                printf("Page %d does not decompress. The db file is corrupt.\n", page_num);
+                exit(0);
+            }
+
+            page_verify(pager, frame->page, page_num);
+            pager->pages_read += 1;
+            stats_add(&(stats_counters()->bytes_read), bytes_read);
+        } else if (pager->read_ring != NULL){
+            pager_read_start(pager, frame_index);
+            pager_read_wait(pager, frame_index);
+        } else {
+            pread_page(pager, page_num, frame->page, 0);
+            page_verify(pager, frame->page, page_num);
+            pager->pages_read += 1;
+            stats_add(&(stats_counters()->bytes_read), PAGE_SIZE);
+        }
+
+        if (page_num >= pager->num_pages){
+            pager->num_pages = page_num + 1;
+        }
+    }
+
+    Frame* frame = &(pager->frames[frame_index]);
+    frame->referenced = true;
+    pager_pin_for_operation(pager, frame_index);
+    void* page = frame->page;
+    pthread_mutex_unlock(&pager->pool_mutex);
+
+    return page;
+}
+
+uint32_t get_node_max_key(Pager* pager, void* node){
+    if (get_node_type(node) == NODE_LEAF){
+        uint32_t num_cells = *leaf_node_num_cells(node);
+
+        if (num_cells == 0){
+            return 0;
+        }
+
+        return *leaf_node_key(node, num_cells - 1);
+    }
+
+    void* right_child = get_page(pager, *internal_node_right_child(node));
+    return get_node_max_key(pager, right_child);
+}
+
+/* Below this many keys, counting the whole window with vector compares
+   is cheaper than halving it further */
+#define KEY_SEARCH_WINDOW 32
+
+typedef uint32_t (*KeyCountFunction)(const uint32_t* keys, uint32_t count, uint32_t key);
+
+uint32_t key_count_below_scalar(const uint32_t* keys, uint32_t count, uint32_t key){
+    uint32_t below = 0;
+
+    for (uint32_t i = 0; i < count; i++){
+        below += keys[i] < key;
+    }
+
+    return below;
+}
+
+#ifdef KEY_SEARCH_X86
+/* SSE2 and AVX2 only compare signed integers, so flip the sign bit of
+   both sides to get an unsigned comparison */
+__attribute__((target("sse2")))
+uint32_t key_count_below_sse2(const uint32_t* keys, uint32_t count, uint32_t key){
+    const __m128i bias = _mm_set1_epi32(INT32_MIN);
+    const __m128i target = _mm_xor_si128(_mm_set1_epi32(key), bias);
+    uint32_t below = 0;
+    uint32_t i = 0;
+
+    for (; i + 4 <= count; i += 4){
+        __m128i lanes = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(keys + i)), bias);
+        below += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(target, lanes))));
+    }
+
+    return below + key_count_below_scalar(keys + i, count - i, key);
+}
+
+__attribute__((target("avx2")))
+uint32_t key_count_below_avx2(const uint32_t* keys, uint32_t count, uint32_t key){
+    const __m256i bias = _mm256_set1_epi32(INT32_MIN);
+    const __m256i target = _mm256_xor_si256(_mm256_set1_epi32(key), bias);
+    uint32_t below = 0;
+    uint32_t i = 0;
+
+    for (; i + 8 <= count; i += 8){
+        __m256i lanes = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(keys + i)), bias);
+        below += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(target, lanes))));
+    }
+
+    return below + key_count_below_scalar(keys + i, count - i, key);
+}
+#endif
+
+KeyCountFunction key_count_below = NULL;
+pthread_once_t key_search_once = PTHREAD_ONCE_INIT;
+
+void key_search_init(){
+    /* Pick the widest vector compare this CPU supports. Run once per
+       process, since searches on other threads read the choice */
+    key_count_below = key_count_below_scalar;
+
+#ifdef KEY_SEARCH_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")){
+        key_count_below = key_count_below_avx2;
+    } else if (__builtin_cpu_supports("sse2")){
+        key_count_below = key_count_below_sse2;
+    }
+#endif
+}
+
+uint32_t key_lower_bound(const uint32_t* keys, uint32_t count, uint32_t key){
+    /* Index of the first key >= key in a sorted array. Halve the range
+       until it fits the window, then count the keys below key in it */
+    if (key_count_below == NULL){
+        pthread_once(&key_search_once, key_search_init);
+    }
+
+    uint32_t low = 0;
+
+    while (count > KEY_SEARCH_WINDOW){
+        uint32_t half = count / 2;
+
+        if (keys[low + half - 1] < key){
+            low += half;
+            count -= half;
+        } else {
+            count = half;
+        }
+    }
+
+    return low + key_count_below(keys + low, count, key);
+}
+
+void cursor_init(Cursor* cursor, Table* table, uint32_t page_num){
+    /* Set up a cursor over the live tree, in storage the caller provides */
+    cursor->table = table;
+    cursor->page_num = page_num;
+    cursor->cell_num = 0;
+    cursor->end_of_table = false;
+    cursor->node = NULL;
+    cursor->parent = NULL;
+    cursor->leaf = NULL;
+    cursor->leaf_page_num = INVALID_PAGE_NUM;
+    cursor->leaf_pin_stamp = 0;
+}
+
+void leaf_node_find(Table* table, uint32_t page_num, uint32_t key, Cursor* cursor){
+    cursor_init(cursor, table, page_num);
+    void* node = cursor_node(cursor);
+    cursor->cell_num = key_lower_bound(leaf_node_keys(node), *leaf_node_num_cells(node), key);
+}
+
+uint32_t internal_node_find_child(void* node, uint32_t key){
+    /* Return the index of the child which should contain the given key */
+    return key_lower_bound(internal_node_keys(node), *internal_node_num_keys(node), key);
+}
+
+void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key){
+    uint32_t old_child_index = internal_node_find_child(node, old_key);
+
+    /* The right child has no key of its own */
+    if (old_child_index < *internal_node_num_keys(node)){
+        *internal_node_key(node, old_child_index) = new_key;
+    }
+}
+
+void init_internal_node(void* node){
+    set_node_type(node, NODE_INTERNAL);
+    set_node_root(node, false);
+    *internal_node_num_keys(node) = 0;
+
+    *internal_node_right_child(node) = INVALID_PAGE_NUM;
+}
+
+void init_leaf_node(void* node){
+    set_node_type(node, NODE_LEAF);
+    set_node_root(node, false);
+    *leaf_node_num_cells(node) = 0;
+    *leaf_node_next_leaf(node) = INVALID_PAGE_NUM;
+    *leaf_node_heap_start(node) = PAGE_USABLE_SIZE;
+    *leaf_node_fragmented(node) = 0;
+}
+
+void print_row(Row* row){
+    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+}
+
+uint32_t row_view_id(RowView view){
+    return view.id;
+}
+
+const char* row_view_username(RowView view){
+    return view.data;
+}
+
+const char* row_view_email(RowView view){
+    return view.data + strlen(view.data) + 1;
+}
+
+RowView leaf_node_row_view(void* node, uint32_t cell_num){
+    RowView view = { *leaf_node_key(node, cell_num), leaf_node_value(node, cell_num) };
+    return view;
+}
+
+void print_row_view(FILE* out, RowView view, const Column* columns, uint32_t num_columns){
+    /* Print the projected columns straight from the page */
+    putc('(', out);
+
+    for (uint32_t i = 0; i < num_columns; i++){
+        if (i > 0){
+            fputs(", ", out);
+        }
+
+        switch (columns[i]){
+            case (COLUMN_ID):
+                fprintf(out, "%d", row_view_id(view));
+                break;
+            case (COLUMN_USERNAME):
+                fputs(row_view_username(view), out);
+                break;
+            case (COLUMN_EMAIL):
+                fputs(row_view_email(view), out);
+                break;
+        }
+    }
+
+    fputs(")\n", out);
+}
+
+uint32_t wire_get_u32(const char* bytes){
+    const uint8_t* b = (const uint8_t*) bytes;
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+}
+
+void wire_put_u32(FILE* out, uint32_t value){
+    uint8_t bytes[4] = { value, value >> 8, value >> 16, value >> 24 };
+    fwrite(bytes, 1, sizeof(bytes), out);
+}
+
+void wire_put_u64(FILE* out, uint64_t value){
+    wire_put_u32(out, (uint32_t) value);
+    wire_put_u32(out, (uint32_t) (value >> 32));
+}
+
+void wire_put_string(FILE* out, const char* string){
+    uint16_t length = strlen(string);
+    uint8_t bytes[2] = { length, length >> 8 };
+    fwrite(bytes, 1, sizeof(bytes), out);
+    fwrite(string, 1, length, out);
+}
+
+void write_row_view(FILE* out, OutputFormat format, RowView view, const Column* columns, uint32_t num_columns){
+    /* Write the projected columns of a selected row, see db.h for the
+       wire encoding */
+    if (format == OUTPUT_TEXT){
+        print_row_view(out, view, columns, num_columns);
+        return;
+    }
+
+    for (uint32_t i = 0; i < num_columns; i++){
+        switch (columns[i]){
+            case (COLUMN_ID):
+                wire_put_u32(out, row_view_id(view));
+                break;
+            case (COLUMN_USERNAME):
+                wire_put_string(out, row_view_username(view));
+                break;
+            case (COLUMN_EMAIL):
+                wire_put_string(out, row_view_email(view));
+                break;
+        }
+    }
+}
+
+void write_count(FILE* out, OutputFormat format, uint64_t count){
+    if (format == OUTPUT_TEXT){
+        fprintf(out, "(%llu)\n", (unsigned long long) count);
+    } else {
+        wire_put_u64(out, count);
+    }
+}
+
+uint32_t row_value_size(Row* row){
+    /* The id is the key, so a stored value is just the two strings */
+    return strlen(row->username) + 1 + strlen(row->email) + 1;
+}
+
+void serialize_row(Row* row, void* dest){
+    uint32_t username_length = strlen(row->username) + 1;
+    memcpy(dest, row->username, username_length);
+    strcpy(dest + username_length, row->email);
+}
+
+void deserialize_row(RowView view, Row* dest){
+    dest->id = row_view_id(view);
+    strcpy(dest->username, row_view_username(view));
+    strcpy(dest->email, row_view_email(view));
+}
+
+bool row_matches(RowView view, const Predicate* where){
+    /* Compare the serialized columns in place, so rejected rows are never
+       copied out */
+    if (where->match_username && strcmp(row_view_username(view), where->username) != 0){
+        return false;
+    }
+
+    if (where->match_email && strcmp(row_view_email(view), where->email) != 0){
+        return false;
+    }
+
+    return true;
+}
+
+bool node_is_safe(void* node, uint32_t value_size){
+    /* A node is safe if inserting below it cannot change it: a leaf with
+       room for the value, or an internal node with room for another key
+       should its child split */
+    if (get_node_type(node) == NODE_LEAF){
+        return leaf_node_free_space(node) >= LEAF_NODE_SLOT_SIZE + value_size;
+    }
+
+    return *internal_node_num_keys(node) < INTERNAL_NODE_MAX_CELLS;
+}
+
+void* descend_to(Pager* pager, uint32_t page_num, LatchMode mode){
+    if (mode == LATCH_NONE){
+        return get_page(pager, page_num);
+    }
+
+    return pager_latch(pager, page_num, mode == LATCH_EXCLUSIVE);
+}
+
+void table_path_push(Table* table, uint32_t page_num){
+    /* Past TABLE_MAX_PATH levels parents are found by descending */
+    if (table->path_length < TABLE_MAX_PATH){
+        table->path[table->path_length] = page_num;
+    }
+
+    table->path_length += 1;
+}
+
+void table_descend(Table* table, uint32_t key, LatchMode mode, uint32_t value_size, uint32_t* upper_bound,
+                   Cursor* cursor){
+    /* Find the leaf for key, crabbing latches down the tree. A reader
+       lets go of the parent as soon as it holds the child. A writer keeps
+       every ancestor a split could reach, releasing them once it latches
+       a node that is safe for a value of value_size bytes, and records
+       the path for splits. Also reports the largest key that routes to
+       the same leaf: child i of an internal node holds keys up to key i */
+    Pager* pager = table->pager;
+    uint32_t page_num = table->root_page_num;
+    void* node = descend_to(pager, page_num, mode);
+    uint32_t bound = UINT32_MAX;
+    uint32_t depth = 1;
+    bool writer = mode != LATCH_SHARED;
+
+    pager_advise(pager, MADV_RANDOM);
+
+    if (writer){
+        table->path_length = 0;
+        table_path_push(table, page_num);
+    }
+
+    while (get_node_type(node) == NODE_INTERNAL){
+        uint32_t child_index = internal_node_find_child(node, key);
+
+        if (child_index < *internal_node_num_keys(node)){
+            bound = *internal_node_key(node, child_index);
+        }
+
+        page_num = *internal_node_child(node, child_index);
+        node = descend_to(pager, page_num, mode);
+        depth += 1;
+
+        if (writer){
+            table_path_push(table, page_num);
+        }
+
+        if (mode == LATCH_SHARED || (mode == LATCH_EXCLUSIVE && node_is_safe(node, value_size))){
+            pager_unlatch_ancestors(pager);
+        }
+    }
+
+    if (upper_bound != NULL){
+        *upper_bound = bound;
+    }
+
+    stats_count_descent(depth);
+    leaf_node_find(table, page_num, key, cursor);
+}
+
+void table_find(Table* table, uint32_t key, Cursor* cursor){
+    /* Unlatched lookup, for the writer, which has the tree to itself */
+    table_descend(table, key, LATCH_NONE, 0, NULL, cursor);
+}
+
+uint32_t table_find_parent(Table* table, uint32_t page_num, uint32_t key){
+    /* Nodes keep no pointer to their parent, which every split would have
+       to rewrite in each child it moves. The writer looks the parent up in
+       the path of its last descent, which key followed. Splits and merges
+       change the tree from the bottom up, so the path above the node is
+       still intact, and a node that is freed is cut from the path, see
+       table_free_node(). The parent found there must still route key to
+       page_num; when it does not, as after the root split, the writer
+       descends again along key, unlatched like table_find() */
+    Pager* pager = table->pager;
+    uint32_t length = table->path_length < TABLE_MAX_PATH ? table->path_length : TABLE_MAX_PATH;
+
+    for (uint32_t i = length; i > 1; i--){
+        if (table->path[i - 1] != page_num){
+            continue;
+        }
+
+        uint32_t parent_page_num = table->path[i - 2];
+        void* parent = get_page(pager, parent_page_num);
+
+        if (get_node_type(parent) == NODE_INTERNAL &&
+            *internal_node_child(parent, internal_node_find_child(parent, key)) == page_num){
+            return parent_page_num;
+        }
+
+        break;
+    }
+
+    uint32_t parent_page_num = table->root_page_num;
+    void* node = get_page(pager, parent_page_num);
+    table->path_length = 0;
+    table_path_push(table, parent_page_num);
+
+    while (get_node_type(node) == NODE_INTERNAL){
+        uint32_t child_page_num = *internal_node_child(node, internal_node_find_child(node, key));
+        table_path_push(table, child_page_num);
+
+        if (child_page_num == page_num){
+            return parent_page_num;
+        }
+
+        parent_page_num = child_page_num;
+        node = get_page(pager, parent_page_num);
+    }
+
+    printf("Page %d is not on the path to key %d.\n", page_num, key);
+    exit(0);
+}
+
+void table_seek(Table* table, uint32_t key, Cursor* cursor){
+    /* Position a cursor on the first cell with a key >= key, holding a
+       shared latch on its leaf. The descent may stop one past the last
+       cell of a leaf, so step to the next one */
+    Pager* pager = table->pager;
+    table_descend(table, key, LATCH_SHARED, 0, NULL, cursor);
+    void* node = cursor_node(cursor);
+
+    if (cursor->cell_num >= *leaf_node_num_cells(node)){
+        uint32_t next_page_num = *leaf_node_next_leaf(node);
+
+        if (next_page_num == INVALID_PAGE_NUM){
+            cursor->end_of_table = true;
+        } else {
+            pager_latch(pager, next_page_num, false);
+            pager_unlatch(pager, cursor->page_num);
+            cursor->page_num = next_page_num;
+            cursor->cell_num = 0;
+        }
+    }
+}
+
+void cursor_prefetch(Cursor* cursor){
+    /* Keep the leaves after the current one requested, CURSOR_READAHEAD
+       deep, topping the window up once half of it has been read */
+    void* parent = cursor->parent;
+    uint32_t num_children = *internal_node_num_keys(parent) + 1;
+    uint32_t end = cursor->child_index + 1 + CURSOR_READAHEAD;
+
+    if (end > num_children){
+        end = num_children;
+    }
+
+    if (cursor->prefetched >= end || cursor->prefetched > cursor->child_index + CURSOR_READAHEAD / 2){
+        return;
+    }
+
+    uint32_t page_nums[CURSOR_READAHEAD];
+    uint32_t count = 0;
+
+    for (uint32_t i = cursor->prefetched; i < end; i++){
+        page_nums[count++] = *internal_node_child(parent, i);
+    }
+
+    pager_prefetch(cursor->table->pager, page_nums, count);
+    cursor->prefetched = end;
+}
+
+void cursor_load_parent(Cursor* cursor, uint32_t key){
+    /* The scan has left the leaves of the parent it had: descend again to
+       the parent of the leaf holding key */
+    Pager* pager = cursor->table->pager;
+    uint32_t page_num = cursor->table->root_page_num;
+
+    for (uint32_t level = 0; level < cursor->depth; level++){
+        if (level > 0){
+            page_num = *internal_node_child(cursor->parent, internal_node_find_child(cursor->parent, key));
+        }
+
+        pager_read_version(pager, page_num, cursor->snapshot, cursor->parent);
+    }
+
+    cursor->child_index = internal_node_find_child(cursor->parent, key);
+    cursor->prefetched = cursor->child_index + 1;
+}
+
+void cursor_enter_leaf(Cursor* cursor, uint32_t page_num){
+    /* Step a snapshot cursor onto the first cell of the next leaf */
+    cursor->page_num = page_num;
+    cursor->cell_num = 0;
+    pager_read_version(cursor->table->pager, page_num, cursor->snapshot, cursor->node);
+
+    if (cursor->parent == NULL){
+        return;
+    }
+
+    cursor->child_index += 1;
+
+    if (cursor->child_index > *internal_node_num_keys(cursor->parent) ||
+        *internal_node_child(cursor->parent, cursor->child_index) != page_num){
+        cursor_load_parent(cursor, *leaf_node_key(cursor->node, 0));
+    }
+
+    cursor_prefetch(cursor);
+}
+
+void snapshot_seek(Table* table, uint64_t snapshot, uint32_t key, bool readahead, Cursor* cursor){
+    /* Position a cursor on the first cell with a key >= key as of an open
+       snapshot, which the cursor takes over. Each node is copied out as of
+       the snapshot version and no latch is held in between, so writers
+       carry on while the cursor moves and the cursor never sees their
+       changes. With readahead, the cursor requests the leaves ahead of it
+       as it goes. Close with cursor_close() to release the snapshot */
+    Pager* pager = table->pager;
+    cursor_init(cursor, table, table->root_page_num);
+    cursor->node = malloc(PAGE_SIZE);
+    cursor->parent = readahead ? malloc(PAGE_SIZE) : NULL;
+    cursor->depth = 0;
+    cursor->snapshot = snapshot;
+
+    pager_advise(pager, MADV_RANDOM);
+    pager_read_version(pager, cursor->page_num, cursor->snapshot, cursor->node);
+
+    while (get_node_type(cursor->node) == NODE_INTERNAL){
+        uint32_t child_index = internal_node_find_child(cursor->node, key);
+        cursor->page_num = *internal_node_child(cursor->node, child_index);
+
+        /* Keep the node as the parent and request the siblings after the
+           child, which a range scan reaches next */
+        if (cursor->parent != NULL){
+            void* parent = cursor->node;
+            cursor->node = cursor->parent;
+            cursor->parent = parent;
+            cursor->child_index = child_index;
+            cursor->prefetched = child_index + 1;
+            cursor_prefetch(cursor);
+        }
+
+        pager_read_version(pager, cursor->page_num, cursor->snapshot, cursor->node);
+        cursor->depth += 1;
+    }
+
+    stats_count_descent(cursor->depth + 1);
+
+    if (cursor->depth == 0){
+        free(cursor->parent);
+        cursor->parent = NULL;
+    }
+
+    uint32_t num_cells = *leaf_node_num_cells(cursor->node);
+    cursor->cell_num = key_lower_bound(leaf_node_keys(cursor->node), num_cells, key);
+
+    /* The key may sort after the last cell of the leaf */
+    if (cursor->cell_num >= num_cells){
+        uint32_t next_page_num = *leaf_node_next_leaf(cursor->node);
+
+        if (next_page_num == INVALID_PAGE_NUM){
+            cursor->end_of_table = true;
+        } else {
+            cursor_enter_leaf(cursor, next_page_num);
+        }
+    }
+}
+
+void table_snapshot_seek(Table* table, uint32_t key, bool readahead, Cursor* cursor){
+    snapshot_seek(table, pager_snapshot_begin(table->pager), key, readahead, cursor);
+}
+
+void table_start(Table* table, Cursor* cursor){
+    table_snapshot_seek(table, 0, true, cursor);
+}
+
+void cursor_close(Cursor* cursor){
+    /* Cursors live in their caller's storage; only what a snapshot cursor
+       holds needs letting go of */
+    if (cursor->node != NULL){
+        pager_snapshot_end(cursor->table->pager, cursor->snapshot);
+        free(cursor->node);
+        free(cursor->parent);
+        cursor->node = NULL;
+    }
+}
+
+void* cursor_node(Cursor* cursor){
+    /* The leaf under the cursor. get_page() pins a page until the thread
+       releases its pins, which moves the thread's pin stamp on, so the
+       last page fetched stays good to use for as long as the stamp and the
+       page number are the ones it was fetched under */
+    if (cursor->node != NULL){
+        return cursor->node;
+    }
+
+    if (cursor->leaf == NULL || cursor->leaf_page_num != cursor->page_num ||
+        cursor->leaf_pin_stamp != thread_state.pin_stamp){
+        cursor->leaf = get_page(cursor->table->pager, cursor->page_num);
+        cursor->leaf_page_num = cursor->page_num;
+        cursor->leaf_pin_stamp = thread_state.pin_stamp;
+    }
+
+    return cursor->leaf;
+}
+
+void* cursor_value(Cursor* cursor){
+    return leaf_node_value(cursor_node(cursor), cursor->cell_num);
+}
+
+void cursor_advance(Cursor* cursor){
+    void* node = cursor_node(cursor);
+    cursor->cell_num += 1;
+
+    if (cursor->cell_num >= (*leaf_node_num_cells(node))){
+        uint32_t next_page_num = *leaf_node_next_leaf(node);
+        if (next_page_num == INVALID_PAGE_NUM){
+            cursor->end_of_table = true;
+        } else {
+            if (cursor->node != NULL){
+                cursor_enter_leaf(cursor, next_page_num);
+            } else {
+                cursor->page_num = next_page_num;
+                cursor->cell_num = 0;
+            }
+        }
+    }
+}
+
+void wal_checksum(const void* data, uint32_t length, uint32_t* checksum){
+    /* Fletcher-style sum over pairs of 32-bit words */
+    const uint32_t* words = data;
+    uint32_t s1 = checksum[0];
+    uint32_t s2 = checksum[1];
+
+    for (uint32_t i = 0; i + 1 < length / sizeof(uint32_t); i += 2){
+        s1 += words[i] + s2;
+        s2 += words[i + 1] + s1;
+    }
+
+    checksum[0] = s1;
+    checksum[1] = s2;
+}
+
+void wal_frame_checksum(WalFrameHeader* header, const void* page, uint32_t* checksum){
+    wal_checksum(header, offsetof(WalFrameHeader, checksum), checksum);
+    wal_checksum(page, PAGE_SIZE, checksum);
+    header->checksum[0] = checksum[0];
+    header->checksum[1] = checksum[1];
+}
+
+void wal_reset(Wal* wal){
+    /* Start a new generation. Frames left over from the previous one carry
+       the old salt and are ignored by recovery */
+    wal->salt += 1;
+    wal->checksum[0] = wal->salt;
+    wal->checksum[1] = wal->salt;
+    wal->offset = sizeof(WalHeader);
+    wal->num_frames = 0;
+
+    WalHeader header = { WAL_MAGIC, PAGE_SIZE, wal->salt, 0 };
+
+    if (pwrite(wal->file_descriptor, &header, sizeof(header), 0) != sizeof(header)
+        || ftruncate(wal->file_descriptor, sizeof(header)) == -1
+        || fdatasync(wal->file_descriptor) == -1){
+        printf("Error resetting write-ahead log: %d\n", errno);
+        exit(0);
+    }
+}
+
+off_t wal_recover_scan(Wal* wal, WalHeader* header, void* page){
+    /* Return the offset just past the last intact commit frame */
+    uint32_t checksum[2] = { header->salt, header->salt };
+    off_t offset = sizeof(WalHeader);
+    off_t committed = offset;
+    WalFrameHeader frame;
+
+    while (pread(wal->file_descriptor, &frame, sizeof(frame), offset) == sizeof(frame)
+           && pread(wal->file_descriptor, page, PAGE_SIZE, offset + sizeof(frame)) == PAGE_SIZE){
+        uint32_t expected[2] = { frame.checksum[0], frame.checksum[1] };
+        wal_frame_checksum(&frame, page, checksum);
+
+        if (frame.salt != header->salt || expected[0] != checksum[0] || expected[1] != checksum[1]){
+            break;
+        }
+
+        offset += sizeof(frame) + PAGE_SIZE;
+
+        if (frame.commit_num_pages != 0){
+            committed = offset;
+        }
+    }
+
+    return committed;
+}
+
+void wal_recover(Wal* wal, int db_fd, PageStore* store){
+    /* Copy every committed page image back into the main file */
+    WalHeader header;
+
+    if (pread(wal->file_descriptor, &header, sizeof(header), 0) != sizeof(header)
+        || header.magic != WAL_MAGIC || header.page_size != PAGE_SIZE){
+        return;
+    }
+
+    wal->salt = header.salt;
+
+    void* page = malloc(PAGE_SIZE);
+    off_t committed = wal_recover_scan(wal, &header, page);
+    WalFrameHeader frame;
+
+    for (off_t offset = sizeof(WalHeader); offset < committed; offset += sizeof(frame) + PAGE_SIZE){
+        if (pread(wal->file_descriptor, &frame, sizeof(frame), offset) != sizeof(frame)
+            || pread(wal->file_descriptor, page, PAGE_SIZE, offset + sizeof(frame)) != PAGE_SIZE){
+            printf("Error recovering from write-ahead log: %d\n", errno);
+            exit(0);
+        }
+
+        if (store != NULL){
+            store_write_page(store, frame.page_num, page);
+        } else if (pwrite(db_fd, page, PAGE_SIZE, (off_t) frame.page_num * PAGE_SIZE) != PAGE_SIZE){
+            printf("Error recovering from write-ahead log: %d\n", errno);
+            exit(0);
+        }
+    }
+
+    free(page);
+
+    if (store != NULL){
+        store_commit(store);
+    } else if (committed > (off_t) sizeof(WalHeader) && fdatasync(db_fd) == -1){
+        printf("Error syncing recovered pages: %d\n", errno);
+        exit(0);
+    }
+}
+
+void wal_recover_leftover(const char* filename, int db_fd, PageStore* store){
+    /* Opening without a log: one left by an earlier run may hold commits
+       the main file lacks. Replay them and remove the log, or a later run
+       that uses one would replay the stale frames over newer pages */
+    char path[strlen(filename) + sizeof("-wal")];
+    sprintf(path, "%s-wal", filename);
+
+    Wal wal;
+    wal.file_descriptor = open(path, O_RDONLY);
+
+    if (wal.file_descriptor == -1){
+        return;
+    }
+
+    WalHeader header;
+
+    if (pread(wal.file_descriptor, &header, sizeof(header), 0) == sizeof(header)
+        && header.magic == WAL_MAGIC && header.page_size != PAGE_SIZE){
+        printf("The write-ahead log %s holds %d byte pages, not %d. Unable to recover it.\n", path,
+               header.page_size, PAGE_SIZE);
+        exit(0);
+    }
+
+    wal_recover(&wal, db_fd, store);
+    close(wal.file_descriptor);
+
+    if (unlink(path) == -1){
+        printf("Unable to remove the recovered write-ahead log %s: %d\n", path, errno);
+        exit(0);
+    }
+}
+
+Wal* wal_open(const char* filename, int db_fd, PageStore* store){
+    Wal* wal = malloc(sizeof(Wal));
+    wal->path = malloc(strlen(filename) + sizeof("-wal"));
+    sprintf(wal->path, "%s-wal", filename);
+    wal->file_descriptor = open(wal->path, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+
+    if (wal->file_descriptor == -1){
+        printf("Unable to open write-ahead log\n");
+        exit(0);
+    }
+
+    wal->salt = (uint32_t) time(NULL);
+    wal_recover(wal, db_fd, store);
+    wal_reset(wal);
+
+    wal->end_lsn = 0;
+    wal->synced_lsn = 0;
+    wal->syncing = false;
+    pthread_mutex_init(&wal->mutex, NULL);
+    pthread_cond_init(&wal->synced_cond, NULL);
+    pthread_cond_init(&wal->checkpoint_cond, NULL);
+    wal->checkpointer_running = false;
+    wal->stop = false;
+
+    wal->spilled = NULL;
+    wal->num_spilled = 0;
+    wal->spilled_capacity = 0;
+
+    wal->commits = 0;
+    wal->frames_written = 0;
+    wal->syncs = 0;
+    wal->checkpoints = 0;
+
+    return wal;
+}
+
+void wal_wait_durable(Wal* wal, uint64_t lsn){
+    /* Group commit: the first waiter becomes the leader and syncs everything
+       appended so far; commits that arrive meanwhile wait and are covered
+       by the leader's sync or the next one */
+    pthread_mutex_lock(&wal->mutex);
+
+    while (wal->synced_lsn < lsn){
+        if (wal->syncing){
+            pthread_cond_wait(&wal->synced_cond, &wal->mutex);
+            continue;
+        }
+
+        uint64_t target = wal->end_lsn;
+        wal->syncing = true;
+        pthread_mutex_unlock(&wal->mutex);
+
+        if (fdatasync(wal->file_descriptor) == -1){
+            printf("Error syncing write-ahead log: %d\n", errno);
+            exit(0);
+        }
+
+        pthread_mutex_lock(&wal->mutex);
+        wal->syncing = false;
+        wal->synced_lsn = target;
+        wal->syncs += 1;
+        pthread_cond_broadcast(&wal->synced_cond);
+    }
+
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+WalPage* wal_spilled_slot(Wal* wal, uint32_t page_num){
+    /* The slot holding page_num, or the empty one where it would go */
+    uint32_t mask = wal->spilled_capacity - 1;
+    uint32_t slot = (page_num * 2654435761u) & mask;
+
+    while (wal->spilled[slot].page_num != INVALID_PAGE_NUM && wal->spilled[slot].page_num != page_num){
+        slot = (slot + 1) & mask;
+    }
+
+    return &(wal->spilled[slot]);
+}
+
+off_t wal_spilled_lookup(Wal* wal, uint32_t page_num){
+    /* Where the log holds the newest image of a spilled page, or -1 */
+    if (wal == NULL || wal->num_spilled == 0){
+        return -1;
+    }
+
+    WalPage* entry = wal_spilled_slot(wal, page_num);
+
+    return entry->page_num == page_num ? entry->offset : -1;
+}
+
+void wal_spilled_record(Wal* wal, uint32_t page_num, off_t offset, bool add){
+    /* Note a newer image of page_num in the log. Pages not yet listed are
+       only added when add is set */
+    if (wal->num_spilled == 0 && !add){
+        return;
+    }
+
+    if (add && 2 * (wal->num_spilled + 1) > wal->spilled_capacity){
+        WalPage* old_pages = wal->spilled;
+        uint32_t old_capacity = wal->spilled_capacity;
+        wal->spilled_capacity = old_capacity ? old_capacity * 2 : 64;
+        wal->spilled = malloc(wal->spilled_capacity * sizeof(WalPage));
+
+        for (uint32_t i = 0; i < wal->spilled_capacity; i++){
+            wal->spilled[i].page_num = INVALID_PAGE_NUM;
+        }
+
+        for (uint32_t i = 0; i < old_capacity; i++){
+            if (old_pages[i].page_num != INVALID_PAGE_NUM){
+                *wal_spilled_slot(wal, old_pages[i].page_num) = old_pages[i];
+            }
+        }
+
+        free(old_pages);
+    }
+
+    WalPage* entry = wal_spilled_slot(wal, page_num);
+
+    if (entry->page_num == page_num){
+        entry->offset = offset;
+    } else if (add){
+        entry->page_num = page_num;
+        entry->offset = offset;
+        wal->num_spilled += 1;
+    }
+}
+
+void wal_read_page(Wal* wal, off_t offset, void* page){
+    size_t done = 0;
+
+    while (done < PAGE_SIZE){
+        ssize_t bytes = pread(wal->file_descriptor, (char*) page + done, PAGE_SIZE - done, offset + done);
+
+        if (bytes <= 0){
+            printf("Error reading from write-ahead log: %d\n", errno);
+            exit(0);
+        }
+
+        done += bytes;
+    }
+}
+
+void pager_stamp_modified(Pager* pager){
+    /* Stamp the pages the write in progress changed, while it is still
+       unpublished and no reader looks at their live copies. Without a log
+       or a mapping, pages are stamped when written back instead */
+    if (pager->use_mmap){
+        for (uint32_t i = 0; i < pager->num_map_dirty; i++){
+            page_stamp_checksum(pager->map + (size_t) pager->map_dirty[i] * PAGE_SIZE);
+        }
+
+        pager->num_map_dirty = 0;
+        return;
+    }
+
+    if (pager->wal == NULL){
+        return;
+    }
+
+    pthread_mutex_lock(&pager->pool_mutex);
+
+    for (uint32_t i = 0; i < pager->num_txn_frames; i++){
+        page_stamp_checksum(pager->frames[pager->txn_frames[i]].page);
+    }
+
+    pthread_mutex_unlock(&pager->pool_mutex);
+}
+
+void pager_record_page_count(Pager* pager){
+    /* Keep the header's page count in step with each write, so the file
+       reopens at the size the write left it, whatever was allocated past
+       that and never committed */
+    void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+    pthread_mutex_lock(&pager->pool_mutex);
+    uint32_t num_pages = pager->num_pages;
+    pthread_mutex_unlock(&pager->pool_mutex);
+
+    if (*db_header_page_count(header) != num_pages){
+        pager_mark_dirty(pager, DB_HEADER_PAGE_NUM);
+        *db_header_page_count(header) = num_pages;
+    }
+}
+
+uint64_t pager_log(Pager* pager, bool commit){
+    /* Append an image of every page modified since the last call and
+       return the LSN that covers them. Only a commit marks its last frame
+       with the database size: recovery replays up to the last marked
+       frame, so frames logged without one count only once a later commit
+       follows them */
+    Wal* wal = pager->wal;
+    uint32_t num_frames = pager->num_txn_frames;
+    WalFrameHeader* headers = malloc(num_frames * sizeof(WalFrameHeader));
+    struct iovec* iov = malloc(2 * num_frames * sizeof(struct iovec));
+
+    /* Only the frames array needs the pool lock: frames in the transaction
+       cannot be evicted, and only this writer modifies their pages */
+    pthread_mutex_lock(&pager->pool_mutex);
+
+    for (uint32_t i = 0; i < num_frames; i++){
+        Frame* frame = &(pager->frames[pager->txn_frames[i]]);
+        headers[i].page_num = frame->page_num;
+        iov[2 * i + 1].iov_base = frame->page;
+    }
+
+    pthread_mutex_unlock(&pager->pool_mutex);
+
+    for (uint32_t i = 0; i < num_frames; i++){
+        headers[i].commit_num_pages = (commit && i == num_frames - 1) ? pager->num_pages : 0;
+        headers[i].salt = wal->salt;
+        headers[i].reserved = 0;
+        wal_frame_checksum(&headers[i], iov[2 * i + 1].iov_base, wal->checksum);
+
+        iov[2 * i].iov_base = &headers[i];
+        iov[2 * i].iov_len = sizeof(WalFrameHeader);
+        iov[2 * i + 1].iov_len = PAGE_SIZE;
+    }
+
+    size_t frame_bytes = sizeof(WalFrameHeader) + PAGE_SIZE;
+    off_t first_offset = wal->offset;
+
+    for (uint32_t i = 0; i < 2 * num_frames; ){
+        uint32_t count = 2 * num_frames - i < IOV_MAX ? 2 * num_frames - i : IOV_MAX;
+        ssize_t expected = (ssize_t) (count / 2) * frame_bytes;
+
+        if (pwritev(wal->file_descriptor, iov + i, count, wal->offset) != expected){
+            printf("Error appending to write-ahead log: %d\n", errno);
+            exit(0);
+        }
+
+        wal->offset += expected;
+        i += count;
+    }
+
+    stats_add(&(stats_counters()->bytes_written), (uint64_t) num_frames * frame_bytes);
+
+    pthread_mutex_lock(&wal->mutex);
+    wal->end_lsn += (uint64_t) num_frames * frame_bytes;
+    wal->num_frames += num_frames;
+    wal->frames_written += num_frames;
+    uint64_t lsn = wal->end_lsn;
+
+    if (commit){
+        wal->commits += 1;
+    }
+
+    if (commit && wal->num_frames >= WAL_CHECKPOINT_FRAMES){
+        pthread_cond_signal(&wal->checkpoint_cond);
+    }
+
+    pthread_mutex_unlock(&wal->mutex);
+    pthread_mutex_lock(&pager->pool_mutex);
+
+    for (uint32_t i = 0; i < num_frames; i++){
+        Frame* frame = &(pager->frames[pager->txn_frames[i]]);
+        frame->in_txn = false;
+        frame->wal_lsn = lsn;
+
+        /* A spill lists its pages; any logging keeps listed ones current */
+        off_t offset = first_offset + (off_t) i * frame_bytes + sizeof(WalFrameHeader);
+        wal_spilled_record(wal, frame->page_num, offset, !commit);
+    }
+
+    pager->num_txn_frames = 0;
+    pthread_mutex_unlock(&pager->pool_mutex);
+    free(headers);
+    free(iov);
+
+    return lsn;
+}
+
+void pager_spill(Pager* pager){
+    /* A statement has modified more pages than the pool should hold:
+       log them without committing, so their frames can be reused. The
+       statement stays unpublished and uncommitted, so neither readers nor
+       recovery see any of it until pager_commit(). Spilled frames are
+       never written to the main file before then; evicting one just drops
+       it, and get_page() reads it back from the log */
+    if (pager->wal == NULL || pager->num_txn_frames < pager->max_frames / 2){
+        return;
+    }
+
+    pager_stamp_modified(pager);
+    pager_log(pager, false);
+    pager->txn_spilled = true;
+}
+
+uint64_t pager_commit(Pager* pager){
+    /* Append an image of every page the statement modified and return the
+       LSN that must be durable before the statement is acknowledged */
+    Wal* wal = pager->wal;
+
+    /* A statement that spilled every page it changed still needs a frame
+       to carry its commit */
+    if (pager->txn_spilled && pager->num_txn_frames == 0){
+        get_page(pager, DB_HEADER_PAGE_NUM);
+        pager_mark_dirty(pager, DB_HEADER_PAGE_NUM);
+    }
+
+    pager_record_page_count(pager);
+    pager_stamp_modified(pager);
+    pager_publish(pager);
+    pager->txn_spilled = false;
+
+    if (wal == NULL || pager->num_txn_frames == 0){
+        return 0;
+    }
+
+    return pager_log(pager, true);
+}
+
+int compare_wal_pages(const void* a, const void* b){
+    uint32_t page_a = ((const WalPage*) a)->page_num;
+    uint32_t page_b = ((const WalPage*) b)->page_num;
+
+    return (page_a > page_b) - (page_a < page_b);
+}
+
+void pager_copy_logged_pages(Pager* pager){
+    /* Part of a checkpoint: write the pages listed as spilled from the
+       log into the main file, since their frames may be gone. Any still
+       in the pool hold the same image and are written again with the
+       other dirty frames. Once copied, the pages are read from the main
+       file again */
+    Wal* wal = pager->wal;
+    pthread_mutex_lock(&pager->pool_mutex);
+    WalPage* logged = malloc(wal->num_spilled * sizeof(WalPage));
+    uint32_t num_logged = 0;
+
+    for (uint32_t i = 0; i < wal->spilled_capacity; i++){
+        if (wal->spilled[i].page_num != INVALID_PAGE_NUM){
+            logged[num_logged++] = wal->spilled[i];
+        }
+    }
+
+    pthread_mutex_unlock(&pager->pool_mutex);
+    qsort(logged, num_logged, sizeof(WalPage), compare_wal_pages);
+
+    /* Copy in batches through one buffer, aligned for O_DIRECT */
+    char* buffer = aligned_alloc(PAGE_SIZE, (size_t) WAL_COPY_BATCH * PAGE_SIZE);
+    DirtyPage pages[WAL_COPY_BATCH];
+
+    for (uint32_t start = 0; start < num_logged; start += WAL_COPY_BATCH){
+        uint32_t count = num_logged - start < WAL_COPY_BATCH ? num_logged - start : WAL_COPY_BATCH;
+
+        for (uint32_t i = 0; i < count; i++){
+            pages[i].page_num = logged[start + i].page_num;
+            pages[i].frame_index = INVALID_FRAME;
+            pages[i].page = buffer + (size_t) i * PAGE_SIZE;
+            wal_read_page(wal, logged[start + i].offset, pages[i].page);
+        }
+
+        pager_write_pages(pager, pages, count);
+    }
+
+    free(buffer);
+    free(logged);
+
+    pthread_mutex_lock(&pager->pool_mutex);
+    free(wal->spilled);
+    wal->spilled = NULL;
+    wal->num_spilled = 0;
+    wal->spilled_capacity = 0;
+    pthread_mutex_unlock(&pager->pool_mutex);
+}
+
+void pager_checkpoint(Pager* pager){
+    /* Fold the log into the main file: once every logged page has been
+       written back and synced, the log can start over */
+    Wal* wal = pager->wal;
+
+    if (wal == NULL || wal->num_frames == 0){
+        return;
+    }
+
+    wal_wait_durable(wal, wal->end_lsn);
+    pager_copy_logged_pages(pager);
+    pager_flush_dirty(pager);
+
+    if (pager->store != NULL){
+        store_commit(pager->store);
+    } else if (fdatasync(pager->file_descriptor) == -1){
+        printf("Error syncing the db file: %d\n", errno);
+        exit(0);
+    }
+
+    pthread_mutex_lock(&wal->mutex);
+    wal_reset(wal);
+    wal->checkpoints += 1;
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+void* checkpoint_thread(void* arg){
+    /* Checkpoint when the log passes WAL_CHECKPOINT_FRAMES frames, or
+       every WAL_CHECKPOINT_INTERVAL_MS if anything has been logged */
+    Table* table = arg;
+    Wal* wal = table->pager->wal;
+
+    pthread_mutex_lock(&wal->mutex);
+
+    while (!wal->stop){
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += WAL_CHECKPOINT_INTERVAL_MS / 1000;
+        deadline.tv_nsec += (WAL_CHECKPOINT_INTERVAL_MS % 1000) * 1000000L;
+
+        if (deadline.tv_nsec >= 1000000000L){
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        while (!wal->stop && wal->num_frames < WAL_CHECKPOINT_FRAMES){
+            if (pthread_cond_timedwait(&wal->checkpoint_cond, &wal->mutex, &deadline) == ETIMEDOUT){
+                break;
+            }
+        }
+
+        if (wal->stop || wal->num_frames == 0){
+            continue;
+        }
+
+        pthread_mutex_unlock(&wal->mutex);
+        pthread_mutex_lock(&table->lock);
+        pager_checkpoint(table->pager);
+        pthread_mutex_unlock(&table->lock);
+        pthread_mutex_lock(&wal->mutex);
+    }
+
+    pthread_mutex_unlock(&wal->mutex);
+
+    return NULL;
+}
+
+void wal_close(Wal* wal){
+    close(wal->file_descriptor);
+    unlink(wal->path);
+    free(wal->spilled);
+    pthread_mutex_destroy(&wal->mutex);
+    pthread_cond_destroy(&wal->synced_cond);
+    pthread_cond_destroy(&wal->checkpoint_cond);
+    free(wal->path);
+    free(wal);
+}
+
+uint32_t pager_stored_page_size(int fd, const char* filename){
+    /* The page size an existing database was created with, from the
+       header of a compressed file, or the db header at the start of a
+       plain one. A database that never reached its first checkpoint has
+       only the log to go by, whether or not this run uses one. Returns 0
+       if there is nothing */
+    StoreHeader store_header;
+
+    for (uint32_t slot = 0; slot < STORE_HEADER_SLOTS; slot++){
+        if (store_read_header(fd, slot, &store_header)
+            && store_header.checksum == store_header_checksum(&store_header)){
+            return store_header.page_size;
+        }
+    }
+
+    uint32_t magic;
+    uint32_t page_size;
+
+    if (pread(fd, &magic, sizeof(magic), DB_HEADER_MAGIC_OFFSET) == sizeof(magic)
+        && pread(fd, &page_size, sizeof(page_size), DB_HEADER_PAGE_SIZE_OFFSET) == sizeof(page_size)
+        && magic == DB_HEADER_MAGIC){
+        return page_size != 0 ? page_size : PAGE_DEFAULT_SIZE;
+    }
+
+    char path[strlen(filename) + sizeof("-wal")];
+    sprintf(path, "%s-wal", filename);
+    int wal_fd = open(path, O_RDONLY);
+    WalHeader wal_header;
+    page_size = 0;
+
+    if (wal_fd != -1){
+        if (pread(wal_fd, &wal_header, sizeof(wal_header), 0) == sizeof(wal_header)
+            && wal_header.magic == WAL_MAGIC){
+            page_size = wal_header.page_size;
+        }
+
+        close(wal_fd);
+    }
+
+    return page_size;
+}
+
+bool pager_set_page_size(uint32_t page_size){
+    /* Lay pages out for page_size when no database is open, or check that
+       the open ones use it. The layout is only written while nothing can
+       be reading it. Returns false, having said why, for a size that
+       cannot be used */
+    bool usable = false;
+    pthread_mutex_lock(&page_layout_mutex);
+
+    if (page_size < PAGE_MIN_SIZE || page_size > PAGE_MAX_SIZE || (page_size & (page_size - 1)) != 0){
+        printf("Page size must be a power of two from %d to %d.\n", PAGE_MIN_SIZE, PAGE_MAX_SIZE);
+    } else if (open_pagers > 0 && page_size != PAGE_SIZE){
+        printf("Databases open at once must share a page size, %d here.\n", PAGE_SIZE);
+    } else {
+        if (open_pagers == 0){
+            page_layout_init(page_size);
+        }
+
+        open_pagers += 1;
+        usable = true;
+    }
+
+    pthread_mutex_unlock(&page_layout_mutex);
+
+    return usable;
+}
+
+Pager* pager_open(const char* filename, PagerOptions* options){
+    uint32_t max_frames = options->max_frames;
+
+    int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+
+    if (fd == -1){
+        printf("Unable to open file\n");
+        exit(0);
+    }
+
+    if (options->use_wal && options->use_mmap){
+        printf("The write-ahead log cannot be used with --mmap.\n");
+        exit(0);
+    }
+
+    pthread_once(&crc32c_once, crc32c_init);
+
+    /* Like compression, the page size is decided when a file is created */
+    uint32_t page_size = pager_stored_page_size(fd, filename);
+
+    if (page_size == 0){
+        page_size = options->page_size != 0 ? options->page_size : PAGE_DEFAULT_SIZE;
+    }
+
+    if (!pager_set_page_size(page_size)){
+        close(fd);
+        return NULL;
+    }
+
+    /* Whether a file is compressed is decided when it is created */
+    PageStore* store = store_open(fd, options->use_compression);
+
+    if (store != NULL && options->use_mmap){
+        printf("A compressed db file cannot be used with --mmap.\n");
+        exit(0);
+    }
+
+    /* Replay the log before sizing the file, recovery may extend it */
+    Wal* wal = NULL;
+
+    if (options->use_wal){
+        wal = wal_open(filename, fd, store);
+    } else {
+        wal_recover_leftover(filename, fd, store);
+    }
+
+    /* Switched on only now, the header and the log's pages are read and
+       written through buffers of any alignment */
+    if (options->use_direct_io){
+        int flags = fcntl(fd, F_GETFL);
+
+        if (store != NULL || options->use_mmap){
+            printf("O_DIRECT cannot be used with --mmap or a compressed db file.\n");
+            exit(0);
+        }
+
+        if (flags == -1 || fcntl(fd, F_SETFL, flags | O_DIRECT) == -1){
+            printf("Unable to open the db file with O_DIRECT: %d\n", errno);
+            exit(0);
+        }
+    }
+
+    off_t file_length = store != NULL
+        ? (off_t) store->num_pages * PAGE_SIZE
+        : lseek(fd, 0, SEEK_END);
+
+    Pager* pager = malloc(sizeof(Pager));
+    pager->file_descriptor = fd;
+    pager->file_length = file_length;
+    pager->num_pages = (file_length / PAGE_SIZE);
+    pager->store = store;
+    pager->direct_io = options->use_direct_io;
+    pager->stamped_pages = 0;
+
+    if (file_length % PAGE_SIZE != 0){
+        printf("Db file is not a whole number of pages. Corrupt file.\n");
+        exit(0);
+    }
+
+    if (max_frames == 0){
+        printf("Buffer pool needs at least one frame.\n");
+        exit(0);
+    }
+
+    pager->frames = NULL;
+    pager->num_frames = 0;
+    pager->max_frames = max_frames;
+    pager->clock_hand = 0;
+
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&pager->pool_mutex, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+
+    pthread_mutex_init(&pager->version_mutex, NULL);
+    pthread_cond_init(&pager->version_cond, NULL);
+    pager->version = 0;
+    pager->write_unversioned = false;
+    pager->snapshots = NULL;
+    pager->num_snapshots = 0;
+    pager->snapshots_capacity = 0;
+    memset(pager->version_table, 0, sizeof(pager->version_table));
+
+    uint32_t buckets = 1;
+    while (buckets < 2 * max_frames){
+        buckets <<= 1;
+    }
+
+    pager->page_table = malloc(buckets * sizeof(int32_t));
+    pager->page_table_mask = buckets - 1;
+
+    for (uint32_t i = 0; i < buckets; i++){
+        pager->page_table[i] = INVALID_FRAME;
+    }
+
+    pager->wal = wal;
+    pager->txn_frames = NULL;
+    pager->num_txn_frames = 0;
+    pager->txn_frames_capacity = 0;
+    pager->txn_spilled = false;
+
+    pager->hits = 0;
+    pager->misses = 0;
+    pager->pages_read = 0;
+    pager->pages_written = 0;
+    pager->writes_begun = 0;
+    pager->writes_done = 0;
+    pager->evictions = 0;
+    pager->prefetches = 0;
+
+    pager->use_mmap = options->use_mmap;
+    pager->map = NULL;
+    pager->mapped_pages = 0;
+    pager->advice = MADV_NORMAL;
+    pager->map_dirty = NULL;
+    pager->num_map_dirty = 0;
+    pager->map_dirty_capacity = 0;
+
+    pager->slab = NULL;
+    pager->registered_frames = 0;
+    pager->read_ring = NULL;
+    pager->write_ring = NULL;
+    pthread_mutex_init(&pager->write_ring_mutex, NULL);
+
+    if (!pager->use_mmap){
+        /* Reserved only, the kernel backs the slab as frames are used.
+           Page aligned, as O_DIRECT requires, and backed by transparent
+           huge pages where the kernel allows, which saves TLB misses when
+           scanning a large pool */
+        size_t slab_size = (size_t) max_frames * PAGE_SIZE;
+        pager->slab = mmap(NULL, slab_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (pager->slab == MAP_FAILED){
+            printf("Unable to allocate the buffer pool.\n");
+            exit(0);
+        }
+
+        madvise(pager->slab, slab_size, MADV_HUGEPAGE);
+    }
+
+    /* Compressed pages are decompressed on the way in, not read straight
+       into frames */
+    if (!pager->use_mmap && options->use_uring && store == NULL){
+        pager->registered_frames = max_frames;
+
+        if ((size_t) max_frames * PAGE_SIZE > PAGER_MAX_REGISTERED_BYTES){
+            pager->registered_frames = PAGER_MAX_REGISTERED_BYTES / PAGE_SIZE;
+        }
+
+        pager->read_ring = ring_open(pager);
+        pager->write_ring = pager->read_ring != NULL ? ring_open(pager) : NULL;
+
+        if (pager->write_ring == NULL){
+            ring_close(pager->read_ring);
+            pager->read_ring = NULL;
+            pager->registered_frames = 0;
+        }
+    }
+
+    if (pager->use_mmap){
+        pager->map = mmap(NULL, PAGER_MMAP_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (pager->map == MAP_FAILED){
+            printf("Unable to reserve address space for mmap.\n");
+            exit(0);
+        }
+
+        if (pager->num_pages > 0){
+            pager_map_grow(pager, pager->num_pages - 1);
+        }
+    }
+
+    return pager;
+}
+
+Table* table_new(Pager* pager, uint32_t root_page_num){
+    Table* table = (Table*) malloc(sizeof(Table));
+    table->root_page_num = root_page_num;
+    table->pager = pager;
+    table->rightmost_leaf = INVALID_PAGE_NUM;
+    table->path_length = 0;
+    table->scan_threads = 1;
+    table->scrubber = NULL;
+    pthread_mutex_init(&table->lock, NULL);
+
+    for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++){
+        table->indexes[i] = NULL;
+    }
+
+    return table;
+}
+
+Table* db_open(const char* filename, PagerOptions* options){
+    Pager* pager = pager_open(filename, options);
+
+    if (pager == NULL){
+        return NULL;
+    }
+
+    Table* table = table_new(pager, INVALID_PAGE_NUM);
+    pthread_once(&key_search_once, key_search_init);
+    bool created = pager->num_pages == 0;
+
+    if (created){
+        void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+        pager_mark_dirty(pager, DB_HEADER_PAGE_NUM);
+        *db_header_magic(header) = DB_HEADER_MAGIC;
+        *db_header_freelist_head(header) = INVALID_PAGE_NUM;
+        *db_header_freelist_count(header) = 0;
+        *db_header_index_root(header, COLUMN_USERNAME) = INVALID_PAGE_NUM;
+        *db_header_index_root(header, COLUMN_EMAIL) = INVALID_PAGE_NUM;
+        *db_header_page_size(header) = PAGE_SIZE;
+
+        uint32_t root_page_num = get_unused_page_num(pager);
+        void* root_node = get_page(pager, root_page_num);
+        pager_mark_dirty(pager, root_page_num);
+        init_leaf_node(root_node);
+        set_node_root(root_node, true);
+        *db_header_root_page(header) = root_page_num;
+
+        /* Publish the new pages even without a log, or the first snapshot
+           would wait for them */
+        uint64_t commit_lsn = pager_commit(pager);
+
+        if (commit_lsn != 0){
+            wal_wait_durable(pager->wal, commit_lsn);
+        }
+
+        pager_release_pins(pager);
+    }
+
+    void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+
+    if (*db_header_magic(header) != DB_HEADER_MAGIC){
+        printf("Db file has no valid header. Corrupt or unsupported file.\n");
+        exit(0);
+    }
+
+    if (*db_header_page_size(header) != 0 && *db_header_page_size(header) != PAGE_SIZE){
+        printf("Db header gives %d byte pages, not %d. Corrupt file.\n", *db_header_page_size(header), PAGE_SIZE);
+        exit(0);
+    }
+
+    /* Trust the header over the file's length, which can run past the
+       last commit, as after a crash while a mapping had grown the file */
+    uint32_t file_pages = pager->num_pages;
+
+    if (*db_header_page_count(header) != 0){
+        pager->num_pages = *db_header_page_count(header);
+    }
+
+    /* Once the log is recovered an existing file holds every page its
+       header counts. A new one may not until the first checkpoint, as
+       pages evicted from the pool are written around the logged ones.
+       The header itself was read before its count was known */
+    if (!created){
+        pager->stamped_pages = *db_header_page_count(header);
+        page_verify(pager, header, DB_HEADER_PAGE_NUM);
+
+        if (pager->stamped_pages > file_pages){
+            printf("Db header counts %d pages, the file holds %d. The db file is corrupt.\n",
+                   pager->stamped_pages, file_pages);
+            exit(0);
+        }
+    }
+
+    table->root_page_num = *db_header_root_page(header);
+
+    for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++){
+        table->indexes[i] = table_new(pager, *db_header_index_root(header, COLUMN_USERNAME + i));
+    }
+
+    pager_release_pins(pager);
+
+    if (pager->wal != NULL){
+        pager->wal->checkpointer_running = true;
+        pthread_create(&pager->wal->checkpointer, NULL, checkpoint_thread, table);
+    }
+
+    return table;
+}
+
+InputBuffer* init_input_buffer(){
+    InputBuffer* ib = (InputBuffer*) malloc(sizeof(InputBuffer));
+    ib->buffer = NULL;
+    ib->buffer_length = 0;
+    ib->input_length = 0;
+
+    return ib;
+}
+
+void print_prompt() {
+    printf("db > ");
+}
+
+void read_input(InputBuffer* ib){
+    ssize_t bytes = getline(&(ib->buffer), &(ib->buffer_length), stdin);
+
+    if (bytes <= 0){
+        printf("Error, please try again");
+        exit(0);
+    }
+
+    ib->input_length = bytes - 1;
+    ib->buffer[bytes - 1] = 0;
+}
+
+void close_input_buffer(InputBuffer* ib){
+    free(ib->buffer);
+    free(ib);
+}
+
+void pager_flush(Pager* pager, uint32_t page_num){
+    if (pager->use_mmap){
+        /* Stores go straight into the shared mapping */
+        return;
+    }
+
+    int32_t frame_index = pager_lookup(pager, page_num);
+
+    if (frame_index == INVALID_FRAME){
+        printf("Tried to flush null page.\n");
+        exit(0);
+    }
+
+    DirtyPage page = { page_num, frame_index, pager->frames[frame_index].page };
+    pager_write_pages(pager, &page, 1);
+    pager->frames[frame_index].dirty = false;
+}
+
+
+int compare_dirty_pages(const void* a, const void* b){
+    uint32_t page_a = ((const DirtyPage*) a)->page_num;
+    uint32_t page_b = ((const DirtyPage*) b)->page_num;
+
+    return (page_a > page_b) - (page_a < page_b);
+}
+
+void pager_write_run(Pager* pager, DirtyPage* run, uint32_t run_length){
+    /* Write frames holding consecutive page numbers with a single pwritev */
+    struct iovec iov[run_length];
+    uint32_t first_page_num = run[0].page_num;
+
+    for (uint32_t i = 0; i < run_length; i++){
+        iov[i].iov_base = run[i].page;
+        iov[i].iov_len = PAGE_SIZE;
+    }
+
+    off_t offset = (off_t) first_page_num * PAGE_SIZE;
+    size_t remaining = (size_t) run_length * PAGE_SIZE;
+    struct iovec* next = iov;
+    int count = run_length;
+
+    while (remaining > 0){
+        ssize_t bytes = pwritev(pager->file_descriptor, next, count, offset);
+
+        if (bytes == -1){
+            printf("Error writing.\n");
+            exit(0);
+        }
+
+        /* Pick up after a short write */
+        offset += bytes;
+        remaining -= bytes;
+
+        while (count > 0 && (size_t) bytes >= next->iov_len){
+            bytes -= next->iov_len;
+            next++;
+            count--;
+        }
+
+        if (count > 0){
+            next->iov_base = (char*) next->iov_base + bytes;
+            next->iov_len -= bytes;
+        }
+    }
+}
+
+void pager_write_ring(Pager* pager, DirtyPage* pages, uint32_t count){
+    /* Queue a write per page, as many as the ring holds, and submit each
+       batch with one system call. The kernel is free to complete them in
+       any order; a short write is finished synchronously */
+    Ring* ring = pager->write_ring;
+    struct io_uring_cqe cqe;
+    uint32_t queued = 0;
+    uint32_t completed = 0;
+
+    pthread_mutex_lock(&pager->write_ring_mutex);
+
+    while (completed < count){
+        struct io_uring_sqe* sqe;
+
+        while (queued < count && (sqe = ring_sqe(ring)) != NULL){
+            ring_prepare(pager, sqe, true, pages[queued].page, pages[queued].page_num, queued);
+            queued += 1;
+        }
+
+        ring_enter(ring, 1);
+
+        while (ring_complete(ring, &cqe)){
+            DirtyPage* page = &(pages[cqe.user_data]);
+
+            if (cqe.res < 0){
+                printf("Error writing.\n");
+                exit(0);
+            }
+
+            if (cqe.res < (int32_t) PAGE_SIZE){
+                pwrite_page(pager, page->page_num, page->page, cqe.res);
+            }
+
+            completed += 1;
+        }
+    }
+
+    pthread_mutex_unlock(&pager->write_ring_mutex);
+}
+
+void pager_write_pages(Pager* pager, DirtyPage* pages, uint32_t count){
+    /* Write pages back to the main file through the I/O backend. Pages
+       must be sorted by page number; without io_uring, runs of consecutive
+       pages are coalesced so each run costs one system call */
+    if (count == 0){
+        return;
+    }
+
+    __atomic_add_fetch(&pager->writes_begun, 1, __ATOMIC_SEQ_CST);
+
+    for (uint32_t i = 0; i < count; i++){
+        page_stamp_checksum(pages[i].page);
+    }
+
+    uint64_t bytes_written = (uint64_t) count * PAGE_SIZE;
+
+    if (pager->store != NULL){
+        bytes_written = 0;
+
+        for (uint32_t i = 0; i < count; i++){
+            bytes_written += store_write_page(pager->store, pages[i].page_num, pages[i].page);
+        }
+    } else if (pager->write_ring != NULL){
+        pager_write_ring(pager, pages, count);
+    } else {
+        uint32_t run_start = 0;
+
+        for (uint32_t i = 1; i <= count; i++){
+            bool contiguous = i < count
+                && pages[i].page_num == pages[i - 1].page_num + 1
+                && i - run_start < IOV_MAX;
+
+            if (!contiguous){
+                pager_write_run(pager, pages + run_start, i - run_start);
+                run_start = i;
+            }
+        }
+    }
+
+    __atomic_add_fetch(&pager->writes_done, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&pager->pool_mutex);
+    pager->pages_written += count;
+    stats_add(&(stats_counters()->bytes_written), bytes_written);
+
+    for (uint32_t i = 0; i < count; i++){
+        uint32_t end = (pages[i].page_num + 1) * PAGE_SIZE;
+
+        if (end > pager->file_length){
+            pager->file_length = end;
+        }
+    }
+
+    pthread_mutex_unlock(&pager->pool_mutex);
+}
+
+void pager_flush_dirty(Pager* pager){
+    /* Write back only modified frames, in page order. Called by the
+       writer or with writers locked out, so the pages cannot change; the
+       frames are pinned and marked clean up front, and the writes run
+       without the pool lock so readers are not held up */
+    pthread_mutex_lock(&pager->pool_mutex);
+    DirtyPage* dirty = malloc(pager->num_frames * sizeof(DirtyPage));
+    uint32_t num_dirty = 0;
+
+    for (uint32_t i = 0; i < pager->num_frames; i++){
+        Frame* frame = &(pager->frames[i]);
+
+        if (frame->dirty){
+            frame->dirty = false;
+            frame->pin_count += 1;
+            dirty[num_dirty].page_num = frame->page_num;
+            dirty[num_dirty].frame_index = i;
+            dirty[num_dirty].page = frame->page;
+            num_dirty += 1;
+        }
+    }
+
+    pthread_mutex_unlock(&pager->pool_mutex);
+
+    qsort(dirty, num_dirty, sizeof(DirtyPage), compare_dirty_pages);
+    pager_write_pages(pager, dirty, num_dirty);
+
+    pthread_mutex_lock(&pager->pool_mutex);
+
+    for (uint32_t i = 0; i < num_dirty; i++){
+        pager->frames[dirty[i].frame_index].pin_count -= 1;
+    }
+
+    pthread_mutex_unlock(&pager->pool_mutex);
+    free(dirty);
+}
+
+void db_close(Table* table){
+    Pager* pager = table->pager;
+    Wal* wal = pager->wal;
+
+    check_stop_background(table);
+
+    if (wal != NULL){
+        pthread_mutex_lock(&wal->mutex);
+        wal->stop = true;
+        pthread_cond_signal(&wal->checkpoint_cond);
+        pthread_mutex_unlock(&wal->mutex);
+
+        if (wal->checkpointer_running){
+            pthread_join(wal->checkpointer, NULL);
+        }
+
+        pager_checkpoint(pager);
+        wal_close(wal);
+    }
+
+    if (pager->use_mmap){
+        /* Stamp pages changed outside any statement, then drop the unused
+           tail that growing the mapping preallocated */
+        pager_stamp_modified(pager);
+        free(pager->map_dirty);
+        munmap(pager->map, PAGER_MMAP_RESERVE);
+
+        if (ftruncate(pager->file_descriptor, (off_t) pager->num_pages * PAGE_SIZE) == -1){
+            printf("Error truncating the db file.\n");
+            exit(0);
+        }
+    } else {
+        pager_flush_dirty(pager);
+
+        /* Without a log the map is only committed here */
+        if (pager->store != NULL){
+            store_commit(pager->store);
+            store_compact(pager->store);
+        }
+
+        /* Read-ahead may still have reads in flight into the slab */
+        if (pager->read_ring != NULL){
+            pthread_mutex_lock(&pager->pool_mutex);
+
+            while (pager->read_ring->in_flight > 0){
+                pager_read_reap(pager, 1);
+            }
+
+            pthread_mutex_unlock(&pager->pool_mutex);
+        }
+
+        ring_close(pager->read_ring);
+        ring_close(pager->write_ring);
+    }
+
+    int res = close(pager->file_descriptor);
+
+    if (res == -1){
+        printf("Error closing the db file.\n");
+        exit(0);
+    }
+
+    store_close(pager->store);
+
+    for (uint32_t i = 0; i < pager->num_frames; i++){
+        /* Frames past the budget were allocated on their own */
+        if (i >= pager->max_frames){
+            free(pager->frames[i].page);
+        }
+
+        pthread_rwlock_destroy(pager->frames[i].latch);
+        free(pager->frames[i].latch);
+    }
+
+    pager->num_snapshots = 0;
+    pager->version = UINT64_MAX;
+    pager_collect_versions(pager);
+
+    if (pager->slab != NULL){
+        munmap(pager->slab, (size_t) pager->max_frames * PAGE_SIZE);
+    }
+
+    free(pager->frames);
+    free(pager->page_table);
+    free(pager->txn_frames);
+    free(pager->snapshots);
+    pthread_mutex_destroy(&pager->pool_mutex);
+    pthread_mutex_destroy(&pager->version_mutex);
+    pthread_cond_destroy(&pager->version_cond);
+    pthread_mutex_destroy(&pager->write_ring_mutex);
+    free(pager);
+
+    pthread_mutex_lock(&page_layout_mutex);
+    open_pagers -= 1;
+    pthread_mutex_unlock(&page_layout_mutex);
+
+    for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++){
+        pthread_mutex_destroy(&table->indexes[i]->lock);
+        free(table->indexes[i]);
+    }
+
+    pthread_mutex_destroy(&table->lock);
+    free(table);
+}
+
+void print_pool_stats(Pager* pager){
+    printf("Buffer pool:\n");
+    printf("frames: %d / %d\n", pager->num_frames, pager->max_frames);
+    printf("hits: %llu\n", (unsigned long long) pager->hits);
+    printf("misses: %llu\n", (unsigned long long) pager->misses);
+    printf("evictions: %llu\n", (unsigned long long) pager->evictions);
+    printf("prefetches: %llu\n", (unsigned long long) pager->prefetches);
+    printf("pages read: %llu\n", (unsigned long long) pager->pages_read);
+    printf("pages written: %llu\n", (unsigned long long) pager->pages_written);
+    printf("io: %s%s\n", pager->use_mmap ? "mmap" : pager->read_ring != NULL ? "io_uring" : "pread",
+           pager->direct_io ? ", O_DIRECT" : "");
+    printf("page size: %d\n", PAGE_SIZE);
+
+    if (pager->store != NULL){
+        PageStore* store = pager->store;
+        struct stat file_stat;
+        fstat(store->file_descriptor, &file_stat);
+        pthread_mutex_lock(&store->mutex);
+        printf("compressed: %d pages in %llu bytes, %d sectors\n", store->num_pages,
+               (unsigned long long) store->stored_bytes, store->num_sectors);
+        printf("file: %llu bytes, %llu on disk\n", (unsigned long long) file_stat.st_size,
+               (unsigned long long) file_stat.st_blocks * 512);
+        pthread_mutex_unlock(&store->mutex);
+    }
+}
+
+void print_wal_stats(Wal* wal){
+    printf("Write-ahead log:\n");
+
+    if (wal == NULL){
+        printf("disabled\n");
+        return;
+    }
+
+    printf("frames: %d\n", wal->num_frames);
+    printf("commits: %llu\n", (unsigned long long) wal->commits);
+    printf("syncs: %llu\n", (unsigned long long) wal->syncs);
+    printf("checkpoints: %llu\n", (unsigned long long) wal->checkpoints);
+    printf("frames written: %llu\n", (unsigned long long) wal->frames_written);
+}
+
+const char* statement_type_names[NUM_STATEMENT_TYPES] = {"insert", "select", "delete", "update", "create_index"};
+
+uint64_t stats_latency_percentile(const uint64_t* buckets, uint64_t count, double fraction){
+    /* The upper bound, in microseconds, of the bucket holding the rank */
+    uint64_t rank = (uint64_t) (fraction * count);
+    uint64_t seen = 0;
+
+    for (uint32_t bucket = 0; bucket < STATS_LATENCY_BUCKETS; bucket++){
+        seen += buckets[bucket];
+
+        if (seen > rank){
+            return 1ULL << bucket;
+        }
+    }
+
+    return 1ULL << (STATS_LATENCY_BUCKETS - 1);
+}
+
+uint64_t stats_latency_count(const uint64_t* buckets){
+    uint64_t count = 0;
+
+    for (uint32_t bucket = 0; bucket < STATS_LATENCY_BUCKETS; bucket++){
+        count += buckets[bucket];
+    }
+
+    return count;
+}
+
+void print_stats(){
+    /* Counters summed over every thread since the program started */
+    StatsCounters stats;
+    stats_collect(&stats);
+
+    printf("Statistics:\n");
+    printf("cache hits: %llu\n", (unsigned long long) stats.cache_hits);
+    printf("cache misses: %llu\n", (unsigned long long) stats.cache_misses);
+    printf("bytes read: %llu\n", (unsigned long long) stats.bytes_read);
+    printf("bytes written: %llu\n", (unsigned long long) stats.bytes_written);
+    printf("leaf splits: %llu\n", (unsigned long long) stats.leaf_splits);
+    printf("internal splits: %llu\n", (unsigned long long) stats.internal_splits);
+    printf("descents: %llu\n", (unsigned long long) stats.descents);
+
+    for (uint32_t depth = 1; depth < STATS_MAX_DEPTH; depth++){
+        if (stats.descent_depths[depth] > 0){
+            printf("descents of depth %d: %llu\n", depth, (unsigned long long) stats.descent_depths[depth]);
+        }
+    }
+
+    for (uint32_t type = 0; type < NUM_STATEMENT_TYPES; type++){
+        uint64_t* buckets = stats.latencies[type];
+        uint64_t count = stats_latency_count(buckets);
+
+        if (count == 0){
+            continue;
+        }
+
+        printf("%s: %llu, p50 < %lluus, p99 < %lluus, p999 < %lluus\n", statement_type_names[type],
+               (unsigned long long) count,
+               (unsigned long long) stats_latency_percentile(buckets, count, 0.5),
+               (unsigned long long) stats_latency_percentile(buckets, count, 0.99),
+               (unsigned long long) stats_latency_percentile(buckets, count, 0.999));
+    }
+}
+
+void print_stats_json(){
+    /* The same counters on one line, with every histogram bucket: bucket
+       b of a latency histogram counts statements under 2^b microseconds */
+    StatsCounters stats;
+    stats_collect(&stats);
+
+    printf("{\"cache_hits\": %llu, \"cache_misses\": %llu, \"bytes_read\": %llu, \"bytes_written\": %llu, "
+           "\"leaf_splits\": %llu, \"internal_splits\": %llu, \"descents\": %llu, \"descent_depths\": [",
+           (unsigned long long) stats.cache_hits, (unsigned long long) stats.cache_misses,
+           (unsigned long long) stats.bytes_read, (unsigned long long) stats.bytes_written,
+           (unsigned long long) stats.leaf_splits, (unsigned long long) stats.internal_splits,
+           (unsigned long long) stats.descents);
+
+    for (uint32_t depth = 0; depth < STATS_MAX_DEPTH; depth++){
+        printf("%s%llu", depth > 0 ? ", " : "", (unsigned long long) stats.descent_depths[depth]);
+    }
+
+    printf("], \"latency_us\": {");
+
+    for (uint32_t type = 0; type < NUM_STATEMENT_TYPES; type++){
+        printf("%s\"%s\": [", type > 0 ? ", " : "", statement_type_names[type]);
+
+        for (uint32_t bucket = 0; bucket < STATS_LATENCY_BUCKETS; bucket++){
+            printf("%s%llu", bucket > 0 ? ", " : "", (unsigned long long) stats.latencies[type][bucket]);
+        }
+
+        printf("]");
+    }
+
+    printf("}}\n");
+}
+
+void print_constants(){
+    printf("Constants:\n");
+    printf("PAGE_SIZE: %d\n", PAGE_SIZE);
+    printf("ROW_SIZE: %d\n", ROW_SIZE);
+    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+    printf("LEAF_NODE_SLOT_SIZE: %d\n", LEAF_NODE_SLOT_SIZE);
+    printf("LEAF_NODE_MAX_VALUE_SIZE: %d\n", LEAF_NODE_MAX_VALUE_SIZE);
+    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+    printf("INTERNAL_NODE_HEADER_SIZE: %d\n", INTERNAL_NODE_HEADER_SIZE);
+    printf("INTERNAL_NODE_MAX_CELLS: %d\n", INTERNAL_NODE_MAX_CELLS);
+}
+
+void indent(uint32_t level){
+    for (uint32_t i = 0; i < level; i++){
+        printf("   ");
+    }
+}
+
+void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level){
+    void* node = get_page(pager, page_num);
+    uint32_t num_keys, child;
+
+    switch(get_node_type(node)){
+        case(NODE_LEAF):
+            num_keys = *leaf_node_num_cells(node);
+            indent(indentation_level);
+            printf("- leaf (size %d)\n", num_keys);
+
+            for (uint32_t i = 0; i < num_keys; i++){
+                indent(indentation_level + 1);
+                printf("- %d\n", *leaf_node_key(node, i));
+            }
+
+            /* Nothing above holds on to a leaf, so the pool can reuse it */
+            pager_release_pins(pager);
+            break;
+        case(NODE_INTERNAL):
+            num_keys = *internal_node_num_keys(node);
+            indent(indentation_level);
+            printf("- internal (size %d)\n", num_keys);
+
+            if (num_keys > 0){
+                for (uint32_t i = 0; i < num_keys; i++){
+                    child = *internal_node_child(node, i);
+                    print_tree(pager, child, indentation_level + 1);
+                    node = get_page(pager, page_num);
+
+                    indent(indentation_level + 1);
+                    printf("- key %d\n", *internal_node_key(node, i));
+                }
+
+                child = *internal_node_right_child(node);
+                print_tree(pager, child, indentation_level + 1);
+            }
+
+            break;
+    }
+}
+
+void perform_load(InputBuffer* ib, Table* table){
+    /* .load <file> [fill percent] */
+    char* save;
+    strtok_r(ib->buffer, " ", &save);
+    char* path = strtok_r(NULL, " ", &save);
+    char* fill_string = strtok_r(NULL, " ", &save);
+    uint32_t fill_percent = 100;
+
+    if (path == NULL){
+        printf("Must supply a load filename: .load <file> [fill percent]\n");
+        return;
+    }
+
+    if (fill_string != NULL){
+        bool digits = strspn(fill_string, "0123456789") == strlen(fill_string) && strlen(fill_string) <= 3;
+        fill_percent = digits ? atoi(fill_string) : 0;
+
+        if (fill_percent == 0 || fill_percent > 100){
+            printf("Fill percent must be between 1 and 100.\n");
+            return;
+        }
+    }
+
+    FILE* input = fopen(path, "r");
+
+    if (input == NULL){
+        printf("Unable to open load file.\n");
+        return;
+    }
+
+    uint64_t num_loaded = 0;
+    ExecuteResult result = load_file(table, input, fill_percent, &num_loaded);
+    fclose(input);
+
+    uint64_t commit_lsn = pager_commit(table->pager);
+    pager_release_pins(table->pager);
+
+    if (commit_lsn != 0){
+        wal_wait_durable(table->pager->wal, commit_lsn);
+    }
+
+    switch (result){
+        case (EXECUTE_SUCCESS):
+            printf("Loaded %llu rows.\n", (unsigned long long) num_loaded);
+            break;
+        case (EXECUTE_TABLE_NOT_EMPTY):
+            printf("Error: Table must be empty to bulk load.\n");
+            break;
+        case (EXECUTE_DUPLICATE_KEY):
+            printf("Error: Duplicate key.\n");
+            break;
+        case (EXECUTE_INVALID_ROW):
+            printf("Error: Could not parse row in load file.\n");
+            break;
+        default:
+            printf("Error: Bulk load failed.\n");
+            break;
+    }
+}
+
+/* Integrity check
+   A check first reads every page of the file back and verifies its
+   checksum, then walks each tree from the header as of one snapshot, so
+   it sees a consistent file while queries carry on. The walk checks that
+   keys are ordered and within the range their parent routes to them,
+   that root flags are right, that every leaf is at the same depth, that
+   the leaf chain visits the leaves in key order and that no page is
+   reachable twice. With writers locked out, as .check runs, it also
+   finds pages that are neither reachable nor free.
+
+   In the background the same check runs pass after pass, pausing after
+   every CHECK_BATCH_PAGES pages. A pass holds its snapshot open, so pages
+   written meanwhile keep their old images until it ends */
+#define CHECK_BATCH_PAGES 64
+#define CHECK_MAX_DEPTH 32
+#define CHECK_PASS_INTERVAL_MS 1000
+#define CHECK_DEFAULT_PAUSE_MS 10
+#define CHECK_PROBLEM_SIZE 160
+
+typedef struct Scrubber_Struct {
+    Table* table;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool stop;
+    uint32_t pause_ms;
+
+    /* Totals over the finished passes */
+    uint64_t passes;
+    uint64_t pages_checked;
+    uint64_t problems;
+    char last_problem[CHECK_PROBLEM_SIZE];
+} Scrubber;
+
+typedef struct Checker_Struct {
+    Pager* pager;
+    Scrubber* scrubber;     /* paces a background check, NULL otherwise */
+    bool strict;            /* writers are locked out: look for leaks too */
+
+    uint64_t snapshot;
+    uint32_t num_pages;
+    uint8_t* seen;
+    uint64_t steps;
+
+    /* The walk of the current tree, and whether it is an index */
+    bool index;
+    uint32_t leaf_depth;
+    uint32_t previous_leaf;
+    uint32_t previous_next_leaf;
+
+    uint64_t pages_checked;
+    uint64_t nodes_checked;
+    uint64_t problems;
+    char last_problem[CHECK_PROBLEM_SIZE];
+} Checker;
+
+void check_problem(Checker* checker, const char* format, ...){
+    /* A check in the foreground prints what it finds; in the background
+       the last problem is kept for .check status */
+    va_list args;
+    va_start(args, format);
+    vsnprintf(checker->last_problem, CHECK_PROBLEM_SIZE, format, args);
+    va_end(args);
+
+    checker->problems += 1;
+
+    if (checker->scrubber == NULL){
+        printf("%s\n", checker->last_problem);
+    }
+}
+
+bool scrubber_wait(Scrubber* scrubber, uint32_t ms){
+    /* Sleep for ms unless asked to stop. Returns false once stopping */
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000000L;
+
+    if (deadline.tv_nsec >= 1000000000L){
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&scrubber->mutex);
+
+    while (!scrubber->stop){
+        if (pthread_cond_timedwait(&scrubber->cond, &scrubber->mutex, &deadline) == ETIMEDOUT){
+            break;
+        }
+    }
+
+    bool running = !scrubber->stop;
+    pthread_mutex_unlock(&scrubber->mutex);
+
+    return running;
+}
+
+bool check_step(Checker* checker){
+    /* Count one page of work, letting go of the pins it took: pages are
+       checked from copies, and holding them would grow the pool. A
+       background check pauses every CHECK_BATCH_PAGES pages. Returns
+       false once stopping */
+    checker->steps += 1;
+    pager_release_pins(checker->pager);
+
+    if (checker->scrubber == NULL || checker->steps % CHECK_BATCH_PAGES != 0){
+        return true;
+    }
+
+    return scrubber_wait(checker->scrubber, checker->scrubber->pause_ms);
+}
+
+bool check_file_page(Checker* checker, uint32_t page_num, void* page){
+    /* Read a page back from the file and verify its checksum. A write can
+       land in the middle of the read; if one overlapped, read again */
+    Pager* pager = checker->pager;
+
+    for (uint32_t attempt = 0; attempt < 3; attempt++){
+        uint64_t done = __atomic_load_n(&pager->writes_done, __ATOMIC_SEQ_CST);
+        uint64_t begun = __atomic_load_n(&pager->writes_begun, __ATOMIC_SEQ_CST);
+
+        bool decoded = true;
+
+        if (pager->store != NULL){
+            uint32_t bytes_read;
+            decoded = store_read_page(pager->store, page_num, page, &bytes_read);
+        } else {
+            pread_page(pager, page_num, page, 0);
+        }
+
+        if (decoded && page_checksum_valid(pager, page, page_num)){
+            return true;
+        }
+
+        if (done == begun && __atomic_load_n(&pager->writes_begun, __ATOMIC_SEQ_CST) == begun){
+            check_problem(checker, decoded ? "Page %d failed its checksum." : "Page %d does not decompress.",
+                          page_num);
+            return false;
+        }
+    }
+
+    /* Rewritten under every read: leave it to the next pass */
+    return true;
+}
+
+bool check_file(Checker* checker){
+    Pager* pager = checker->pager;
+    void* page = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+
+    /* A mapping grows the file ahead of the pages in use */
+    pthread_mutex_lock(&pager->pool_mutex);
+    uint32_t file_pages = pager->file_length / PAGE_SIZE;
+
+    if (file_pages > pager->num_pages){
+        file_pages = pager->num_pages;
+    }
+
+    pthread_mutex_unlock(&pager->pool_mutex);
+
+    bool running = true;
+
+    for (uint32_t page_num = 0; page_num < file_pages && running; page_num++){
+        check_file_page(checker, page_num, page);
+        checker->pages_checked += 1;
+        running = check_step(checker);
+    }
+
+    free(page);
+
+    return running;
+}
+
+bool check_visit(Checker* checker, uint32_t page_num, const char* what){
+    /* Claim a page for the walk. Returns false if it cannot be read */
+    if (page_num >= checker->num_pages){
+        check_problem(checker, "%s page %d is past the end of the file.", what, page_num);
+        return false;
+    }
+
+    if (checker->seen[page_num]){
+        check_problem(checker, "%s page %d is reachable twice.", what, page_num);
+        return false;
+    }
+
+    checker->seen[page_num] = 1;
+    checker->nodes_checked += 1;
+
+    return true;
+}
+
+bool check_overflow(Checker* checker, uint32_t page_num){
+    /* Walk the overflow chain of an index cell: nonempty leaves outside
+       the tree, holding ids in order with nothing stored under them.
+       Returns false once a background check is stopping */
+    void* page = malloc(PAGE_SIZE);
+    bool running = true;
+
+    while (page_num != INVALID_PAGE_NUM && running && check_visit(checker, page_num, "Overflow")){
+        running = check_step(checker);
+        pager_read_version(checker->pager, page_num, checker->snapshot, page);
+        uint32_t num_cells = *leaf_node_num_cells(page);
+
+        if (get_node_type(page) != NODE_LEAF || is_node_root(page) || num_cells == 0 ||
+            LEAF_NODE_HEADER_SIZE + (uint64_t) num_cells * LEAF_NODE_SLOT_SIZE > *leaf_node_heap_start(page)){
+            check_problem(checker, "Overflow page %d is unreadable.", page_num);
+            break;
+        }
+
+        for (uint32_t i = 0; i < num_cells; i++){
+            if ((i > 0 && *leaf_node_key(page, i) <= *leaf_node_key(page, i - 1)) ||
+                *leaf_node_value_length(page, i) != 0){
+                check_problem(checker, "Overflow page %d has id %d out of order.", page_num,
+                              *leaf_node_key(page, i));
+                break;
+            }
+        }
+
+        page_num = *leaf_node_next_leaf(page);
+    }
+
+    free(page);
+
+    return running;
+}
+
+bool check_leaf(Checker* checker, uint32_t page_num, void* node, bool is_root, int64_t low, int64_t high,
+                uint32_t depth){
+    /* Returns false once a background check is stopping */
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t heap_start = *leaf_node_heap_start(node);
+    bool running = true;
+
+    if (LEAF_NODE_HEADER_SIZE + (uint64_t) num_cells * LEAF_NODE_SLOT_SIZE > heap_start ||
+        heap_start > PAGE_USABLE_SIZE){
+        check_problem(checker, "Leaf page %d has %d cells that overrun its heap.", page_num, num_cells);
+        return true;
+    }
+
+    if (num_cells == 0 && !is_root){
+        check_problem(checker, "Leaf page %d is empty.", page_num);
+    }
+
+    for (uint32_t i = 0; i < num_cells; i++){
+        int64_t key = *leaf_node_key(node, i);
+        uint32_t value_start = *leaf_node_value_pointer(node, i);
+
+        if (key <= low || key > high || (i > 0 && key <= *leaf_node_key(node, i - 1))){
+            check_problem(checker, "Leaf page %d has key %lld out of order.", page_num, (long long) key);
+            break;
+        }
+
+        if (value_start < heap_start || value_start + *leaf_node_value_length(node, i) > PAGE_USABLE_SIZE){
+            check_problem(checker, "Leaf page %d has cell %d outside its heap.", page_num, i);
+            break;
+        }
+
+        if (checker->index && *leaf_node_value_length(node, i) == INDEX_OVERFLOW_LENGTH && running){
+            running = check_overflow(checker, ((uint32_t*) leaf_node_value(node, i))[INDEX_MAX_IDS]);
+        }
+    }
+
+    if (checker->leaf_depth == UINT32_MAX){
+        checker->leaf_depth = depth;
+    } else if (depth != checker->leaf_depth){
+        check_problem(checker, "Leaf page %d is at depth %d, other leaves at %d.", page_num, depth,
+                      checker->leaf_depth);
+    }
+
+    if (checker->previous_leaf != INVALID_PAGE_NUM && checker->previous_next_leaf != page_num){
+        check_problem(checker, "Leaf page %d links to page %d instead of %d.", checker->previous_leaf,
+                      checker->previous_next_leaf, page_num);
+    }
+
+    checker->previous_leaf = page_num;
+    checker->previous_next_leaf = *leaf_node_next_leaf(node);
+
+    return running;
+}
+
+bool check_node(Checker* checker, uint32_t page_num, bool is_root, int64_t low, int64_t high, uint32_t depth){
+    /* Check the subtree at page_num, whose keys must lie in (low, high].
+       Returns false once a background check is stopping */
+    if (!check_visit(checker, page_num, "Tree")){
+        return true;
+    }
+
+    if (!check_step(checker)){
+        return false;
+    }
+
+    void* node = malloc(PAGE_SIZE);
+    pager_read_version(checker->pager, page_num, checker->snapshot, node);
+    bool running = true;
+
+    if (is_node_root(node) != is_root){
+        check_problem(checker, "Page %d has the wrong root flag.", page_num);
+    }
+
+    if (get_node_type(node) == NODE_LEAF){
+        running = check_leaf(checker, page_num, node, is_root, low, high, depth);
+    } else if (*internal_node_num_keys(node) > INTERNAL_NODE_MAX_CELLS || depth >= CHECK_MAX_DEPTH){
+        check_problem(checker, "Internal page %d is unreadable.", page_num);
+    } else {
+        uint32_t num_keys = *internal_node_num_keys(node);
+        int64_t previous = low;
+
+        if (num_keys == 0 && is_root){
+            check_problem(checker, "Internal root page %d has no keys.", page_num);
+        }
+
+        for (uint32_t i = 0; i <= num_keys && running; i++){
+            int64_t key = i < num_keys ? *internal_node_key(node, i) : high;
+
+            if (i < num_keys && (key <= previous || key > high)){
+                check_problem(checker, "Internal page %d has key %lld out of order.", page_num, (long long) key);
+                break;
+            }
+
+            running = check_node(checker, *internal_node_child(node, i), false, previous, key, depth + 1);
+            previous = key;
+        }
+    }
+
+    free(node);
+
+    return running;
+}
+
+bool check_tree(Checker* checker, uint32_t root_page_num, bool index){
+    if (root_page_num == INVALID_PAGE_NUM){
+        return true;
+    }
+
+    checker->index = index;
+    checker->leaf_depth = UINT32_MAX;
+    checker->previous_leaf = INVALID_PAGE_NUM;
+
+    if (!check_node(checker, root_page_num, true, -1, UINT32_MAX, 0)){
+        return false;
+    }
+
+    if (checker->previous_leaf != INVALID_PAGE_NUM && checker->previous_next_leaf != INVALID_PAGE_NUM){
+        check_problem(checker, "Last leaf page %d links on to page %d.", checker->previous_leaf,
+                      checker->previous_next_leaf);
+    }
+
+    return true;
+}
+
+bool check_freelist(Checker* checker, void* header){
+    uint32_t page_num = *db_header_freelist_head(header);
+    uint32_t count = 0;
+    void* page = malloc(PAGE_SIZE);
+    bool running = true;
+
+    while (page_num != INVALID_PAGE_NUM && check_visit(checker, page_num, "Free")){
+        pager_read_version(checker->pager, page_num, checker->snapshot, page);
+        page_num = *free_page_next(page);
+        count += 1;
+
+        if (!(running = check_step(checker))){
+            break;
+        }
+    }
+
+    if (running && page_num == INVALID_PAGE_NUM && count != *db_header_freelist_count(header)){
+        check_problem(checker, "The freelist holds %d pages, the header says %d.", count,
+                      *db_header_freelist_count(header));
+    }
+
+    free(page);
+
+    return running;
+}
+
+bool check_run(Checker* checker){
+    /* One whole check. Returns false if a background check was stopped
+       before it finished */
+    Pager* pager = checker->pager;
+
+    checker->steps = 0;
+    checker->pages_checked = 0;
+    checker->nodes_checked = 0;
+    checker->problems = 0;
+    checker->last_problem[0] = '\0';
+
+    if (!check_file(checker)){
+        return false;
+    }
+
+    /* Reading a corrupt page into the pool would end the program */
+    if (checker->problems > 0){
+        if (checker->scrubber == NULL){
+            printf("Skipped checking the trees.\n");
+        }
+
+        return true;
+    }
+
+    checker->snapshot = pager_snapshot_begin(pager);
+
+    pthread_mutex_lock(&pager->pool_mutex);
+    checker->num_pages = pager->num_pages;
+    pthread_mutex_unlock(&pager->pool_mutex);
+
+    checker->seen = calloc(checker->num_pages > 0 ? checker->num_pages : 1, 1);
+    checker->seen[DB_HEADER_PAGE_NUM] = 1;
+
+    void* header = malloc(PAGE_SIZE);
+    pager_read_version(pager, DB_HEADER_PAGE_NUM, checker->snapshot, header);
+    bool running = true;
+
+    if (*db_header_magic(header) != DB_HEADER_MAGIC){
+        check_problem(checker, "The header page has no valid magic number.");
+    } else {
+        running = check_tree(checker, *db_header_root_page(header), false);
+
+        for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS && running; i++){
+            running = check_tree(checker, *db_header_index_root(header, COLUMN_USERNAME + i), true);
+        }
+
+        running = running && check_freelist(checker, header);
+
+        for (uint32_t page_num = 0; page_num < checker->num_pages && running && checker->strict; page_num++){
+            if (!checker->seen[page_num]){
+                check_problem(checker, "Page %d is neither reachable nor free.", page_num);
+            }
+        }
+    }
+
+    free(header);
+    free(checker->seen);
+    pager_snapshot_end(pager, checker->snapshot);
+    pager_release_pins(pager);
+
+    return running;
+}
+
+void checker_init(Checker* checker, Pager* pager, Scrubber* scrubber){
+    checker->pager = pager;
+    checker->scrubber = scrubber;
+    checker->strict = scrubber == NULL;
+}
+
+void perform_check(Table* table){
+    /* .check, with writers locked out by the caller */
+    Checker checker;
+    checker_init(&checker, table->pager, NULL);
+    check_run(&checker);
+
+    printf("Checked %llu pages in the file, %llu in the trees: ", (unsigned long long) checker.pages_checked,
+           (unsigned long long) checker.nodes_checked);
+
+    if (checker.problems == 0){
+        printf("ok.\n");
+    } else {
+        printf("%llu problems.\n", (unsigned long long) checker.problems);
+    }
+}
+
+void* scrub_thread(void* arg){
+    Scrubber* scrubber = arg;
+    Checker checker;
+    checker_init(&checker, scrubber->table->pager, scrubber);
+
+    do {
+        if (!check_run(&checker)){
+            break;
+        }
+
+        pthread_mutex_lock(&scrubber->mutex);
+        scrubber->passes += 1;
+        scrubber->pages_checked += checker.pages_checked;
+        scrubber->problems += checker.problems;
+
+        if (checker.problems > 0){
+            strcpy(scrubber->last_problem, checker.last_problem);
+        }
+
+        pthread_mutex_unlock(&scrubber->mutex);
+    } while (scrubber_wait(scrubber, CHECK_PASS_INTERVAL_MS));
+
+    return NULL;
+}
+
+void check_start_background(Table* table, uint32_t pause_ms){
+    if (table->scrubber != NULL){
+        printf("A background check is already running.\n");
+        return;
+    }
+
+    /* Without snapshots a check would have to lock writers out */
+    if (table->pager->use_mmap){
+        printf("Background checks need the buffer pool; they are not available in mmap mode.\n");
+        return;
+    }
+
+    Scrubber* scrubber = malloc(sizeof(Scrubber));
+    scrubber->table = table;
+    pthread_mutex_init(&scrubber->mutex, NULL);
+    pthread_cond_init(&scrubber->cond, NULL);
+    scrubber->stop = false;
+    scrubber->pause_ms = pause_ms;
+    scrubber->passes = 0;
+    scrubber->pages_checked = 0;
+    scrubber->problems = 0;
+    scrubber->last_problem[0] = '\0';
+
+    table->scrubber = scrubber;
+    pthread_create(&scrubber->thread, NULL, scrub_thread, scrubber);
+}
+
+void check_stop_background(Table* table){
+    Scrubber* scrubber = table->scrubber;
+
+    if (scrubber == NULL){
+        return;
+    }
+
+    pthread_mutex_lock(&scrubber->mutex);
+    scrubber->stop = true;
+    pthread_cond_signal(&scrubber->cond);
+    pthread_mutex_unlock(&scrubber->mutex);
+
+    pthread_join(scrubber->thread, NULL);
+    pthread_mutex_destroy(&scrubber->mutex);
+    pthread_cond_destroy(&scrubber->cond);
+    free(scrubber);
+    table->scrubber = NULL;
+}
+
+void print_check_status(Table* table){
+    Scrubber* scrubber = table->scrubber;
+
+    printf("Background check:\n");
+
+    if (scrubber == NULL){
+        printf("stopped\n");
+        return;
+    }
+
+    pthread_mutex_lock(&scrubber->mutex);
+    printf("passes: %llu\n", (unsigned long long) scrubber->passes);
+    printf("pages checked: %llu\n", (unsigned long long) scrubber->pages_checked);
+    printf("problems: %llu\n", (unsigned long long) scrubber->problems);
+
+    if (scrubber->problems > 0){
+        printf("last problem: %s\n", scrubber->last_problem);
+    }
+
+    pthread_mutex_unlock(&scrubber->mutex);
+}
+
+void perform_check_command(InputBuffer* ib, Table* table){
+    /* .check                  check now, with writers waiting
+       .check start [pause ms] keep checking in the background
+       .check stop
+       .check status */
+    char* save;
+    strtok_r(ib->buffer, " ", &save);
+    char* action = strtok_r(NULL, " ", &save);
+    char* pause_string = strtok_r(NULL, " ", &save);
+
+    if (action == NULL){
+        perform_check(table);
+    } else if (strcmp(action, "start") == 0){
+        check_start_background(table, pause_string ? atoi(pause_string) : CHECK_DEFAULT_PAUSE_MS);
+    } else if (strcmp(action, "stop") == 0){
+        check_stop_background(table);
+    } else if (strcmp(action, "status") == 0){
+        print_check_status(table);
+    } else {
+        printf("Unrecognized check command '%s'.\n", action);
+    }
+}
+
+/* Online backup
+   A backup writes the database as of one snapshot to a file descriptor,
+   a file or a socket, as a plain file of the same page size, while
+   statements carry on. Pages are copied as the snapshot saw them, see
+   pager_read_version(), and the snapshot's header gives how many there
+   are. Each copy is stamped afresh, since pages in the pool are only
+   stamped on their way to disk. In mmap mode there are no snapshots, so
+   writers are locked out for the length of the copy instead */
+#define BACKUP_BATCH_PAGES 64
+
+bool backup_write(int fd, const void* data, size_t length){
+    /* Sockets are written with MSG_NOSIGNAL, like connection_write(), so
+       a peer that hung up fails the backup with EPIPE instead of raising
+       SIGPIPE. Anything else gets a plain write */
+    bool is_socket = true;
+
+    for (size_t done = 0; done < length; ){
+        ssize_t bytes = is_socket
+            ? send(fd, (const char*) data + done, length - done, MSG_NOSIGNAL)
+            : write(fd, (const char*) data + done, length - done);
+
+        if (bytes == -1 && errno == ENOTSOCK && is_socket){
+            is_socket = false;
+            continue;
+        }
+
+        if (bytes == -1 && errno == EINTR){
+            continue;
+        }
+
+        if (bytes <= 0){
+            return false;
+        }
+
+        done += bytes;
+    }
+
+    return true;
+}
+
+bool backup_is_database(Pager* pager, int fd){
+    /* Whether fd is the database's own file, under any name */
+    struct stat target;
+    struct stat database;
+
+    return fstat(fd, &target) == 0 && fstat(pager->file_descriptor, &database) == 0
+        && target.st_dev == database.st_dev && target.st_ino == database.st_ino;
+}
+
+int64_t db_backup(Table* table, int fd){
+    Pager* pager = table->pager;
+
+    if (backup_is_database(pager, fd)){
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (pager->use_mmap){
+        pthread_mutex_lock(&table->lock);
+    }
+
+    uint64_t snapshot = pager_snapshot_begin(pager);
+    void* page = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+    pager_read_version(pager, DB_HEADER_PAGE_NUM, snapshot, page);
+    uint32_t num_pages = *db_header_page_count(page);
+
+    /* A file not written since before the header kept its page count */
+    if (num_pages == 0){
+        pthread_mutex_lock(&pager->pool_mutex);
+        num_pages = pager->num_pages;
+        pthread_mutex_unlock(&pager->pool_mutex);
+    }
+
+    int64_t result = num_pages;
+
+    for (uint32_t page_num = 0; page_num < num_pages; page_num++){
+        if (page_num > 0){
+            pager_read_version(pager, page_num, snapshot, page);
+        }
+
+        page_stamp_checksum(page);
+
+        if (!backup_write(fd, page, PAGE_SIZE)){
+            result = -1;
+            break;
+        }
+
+        /* Let the pages copied go, the copy may be larger than the pool */
+        if (page_num % BACKUP_BATCH_PAGES == BACKUP_BATCH_PAGES - 1){
+            pager_release_pins(pager);
+        }
+    }
+
+    pager_release_pins(pager);
+    pager_snapshot_end(pager, snapshot);
+    free(page);
+
+    if (pager->use_mmap){
+        pthread_mutex_unlock(&table->lock);
+    }
+
+    return result;
+}
+
+void perform_backup(InputBuffer* ib, Table* table){
+    /* .backup PATH: the file at PATH is replaced by the copy, and a log
+       left beside it by an earlier database is removed, or opening the
+       copy would replay it. Nothing is touched until PATH is known not to
+       be the database itself */
+    char* save;
+    strtok_r(ib->buffer, " ", &save);
+    char* path = strtok_r(NULL, " ", &save);
+
+    if (path == NULL){
+        printf("Must supply a backup filename.\n");
+        return;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT, S_IWUSR | S_IRUSR);
+
+    if (fd == -1){
+        printf("Unable to open backup file: %d\n", errno);
+        return;
+    }
+
+    if (backup_is_database(table->pager, fd)){
+        printf("Cannot back up the database onto itself.\n");
+        close(fd);
+        return;
+    }
+
+    if (ftruncate(fd, 0) == -1){
+        printf("Unable to truncate backup file: %d\n", errno);
+        close(fd);
+        return;
+    }
+
+    char wal_path[strlen(path) + sizeof("-wal")];
+    sprintf(wal_path, "%s-wal", path);
+    unlink(wal_path);
+
+    int64_t num_pages = db_backup(table, fd);
+
+    if (num_pages < 0 || fdatasync(fd) == -1){
+        printf("Error writing backup: %d\n", errno);
+    } else {
+        printf("Backed up %lld pages.\n", (long long) num_pages);
+    }
+
+    close(fd);
+}
+
+void print_header(Pager* pager){
+    void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+
+    printf("Header:\n");
+    printf("page size: %d\n", *db_header_page_size(header));
+    printf("pages: %d\n", *db_header_page_count(header));
+    printf("root page: %d\n", *db_header_root_page(header));
+    printf("free pages: %d\n", *db_header_freelist_count(header));
+
+    for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++){
+        uint32_t root = *db_header_index_root(header, COLUMN_USERNAME + i);
+
+        if (root == INVALID_PAGE_NUM){
+            printf("%s index: none\n", i == 0 ? "username" : "email");
+        } else {
+            printf("%s index root: %d\n", i == 0 ? "username" : "email", root);
+        }
+    }
+
+    printf("schema version: %d\n", *db_header_schema_version(header));
+    pager_release_pins(pager);
+}
+
+MetaCommandResult perform_meta_command(InputBuffer* ib, Table* table){
+    if (strcmp(ib->buffer, ".exit") == 0){
+        db_close(table);
+        exit(0);
+    }
+
+    /* A backup reads a snapshot, writers need not wait for it */
+    if (strncmp(ib->buffer, ".backup", 7) == 0 && (ib->buffer[7] == ' ' || ib->buffer[7] == 0)){
+        perform_backup(ib, table);
+        return META_COMMAND_SUCCESS;
+    }
+
+    MetaCommandResult result = META_COMMAND_SUCCESS;
+    pthread_mutex_lock(&table->lock);
+
+    if (strcmp(ib->buffer, ".btree") == 0){
+        print_tree(table->pager, table->root_page_num, 0);
+        pager_release_pins(table->pager);
+    } else if (strcmp(ib->buffer, ".constants") == 0){
+        print_constants();
+    } else if (strcmp(ib->buffer, ".header") == 0){
+        print_header(table->pager);
+    } else if (strcmp(ib->buffer, ".pool") == 0){
+        print_pool_stats(table->pager);
+    } else if (strcmp(ib->buffer, ".wal") == 0){
+        print_wal_stats(table->pager->wal);
+    } else if (strcmp(ib->buffer, ".stats") == 0){
+        print_stats();
+    } else if (strcmp(ib->buffer, ".stats json") == 0){
+        print_stats_json();
+    } else if (strcmp(ib->buffer, ".checkpoint") == 0){
+        pager_checkpoint(table->pager);
+    } else if (strncmp(ib->buffer, ".load", 5) == 0 && (ib->buffer[5] == ' ' || ib->buffer[5] == 0)){
+        perform_load(ib, table);
+    } else if (strcmp(ib->buffer, ".check") == 0 || strncmp(ib->buffer, ".check ", 7) == 0){
+        perform_check_command(ib, table);
+    } else {
+        result = META_COMMAND_UNRECOGNIZED;
+    }
+
+    pthread_mutex_unlock(&table->lock);
+
+    return result;
+}
+
+bool is_param(const char* token){
+    return token != NULL && strcmp(token, "?") == 0;
+}
+
+PrepareResult add_param(Statement* statement, ParamTarget target, uint32_t row){
+    if (statement->num_params == MAX_STATEMENT_PARAMS){
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    StatementParam* param = &(statement->params[statement->num_params++]);
+    param->target = target;
+    param->row = row;
+
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_row_params(Statement* statement, const char* id_string, const char* username,
+                                 const char* email, uint32_t row){
+    /* Placeholders among the fields of an inserted row, which prepare_row()
+       has already stored as literals */
+    PrepareResult result = PREPARE_SUCCESS;
+
+    if (is_param(id_string)){
+        result = add_param(statement, PARAM_ROW_ID, row);
+    }
+
+    if (result == PREPARE_SUCCESS && is_param(username)){
+        result = add_param(statement, PARAM_ROW_USERNAME, row);
+    }
+
+    if (result == PREPARE_SUCCESS && is_param(email)){
+        result = add_param(statement, PARAM_ROW_EMAIL, row);
+    }
+
+    return result;
+}
+
+PrepareResult prepare_row(char* id_string, char* username, char* email, Row* row){
+    if (id_string == NULL || username == NULL || email == NULL){
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    int id = atoi(id_string);
+
+    if (id < 0){
+        return PREPARE_NEGATIVE_ID;
+    }
+
+    if (strlen(username) > COLUMN_USERNAME_SIZE){
+        return PREPARE_STRING_TOO_LONG;
+    }
+
+    if (strlen(email) > COLUMN_EMAIL_SIZE){
+        return PREPARE_STRING_TOO_LONG;
+    }
+
+    row->id = id;
+    strcpy(row->username, username);
+    strcpy(row->email, email);
+
+    return PREPARE_SUCCESS;
+}
+
+char* trim_spaces(char* string){
+    string += strspn(string, " ");
+    char* end = string + strlen(string);
+
+    while (end > string && end[-1] == ' '){
+        *(--end) = 0;
+    }
+
+    return string;
+}
+
+PrepareResult prepare_insert_values(char* values, Statement* statement){
+    /* insert (id, username, email), (id, username, email), ... */
+    uint32_t capacity = 16;
+    statement->rows = malloc(capacity * sizeof(Row));
+    statement->num_rows = 0;
+
+    char* cursor = values;
+    PrepareResult result = PREPARE_SUCCESS;
+
+    while (result == PREPARE_SUCCESS){
+        cursor += strspn(cursor, " ");
+        char* close = strchr(cursor, ')');
+
+        if (*cursor != '(' || close == NULL){
+            result = PREPARE_SYNTAX_ERROR;
+            break;
+        }
+
+        *close = 0;
+        char* id_string = cursor + 1;
+        char* username = strchr(id_string, ',');
+        char* email = username ? strchr(username + 1, ',') : NULL;
+
+        if (email == NULL || strchr(email + 1, ',') != NULL){
+            result = PREPARE_SYNTAX_ERROR;
+            break;
+        }
+
+        *username++ = 0;
+        *email++ = 0;
+
+        if (statement->num_rows == capacity){
+            capacity *= 2;
+            statement->rows = realloc(statement->rows, capacity * sizeof(Row));
+        }
+
+        id_string = trim_spaces(id_string);
+        username = trim_spaces(username);
+        email = trim_spaces(email);
+        result = prepare_row(id_string, username, email, &(statement->rows[statement->num_rows]));
+
+        if (result == PREPARE_SUCCESS){
+            result = prepare_row_params(statement, id_string, username, email, statement->num_rows);
+        }
+
+        statement->num_rows += 1;
+
+        cursor = close + 1;
+        cursor += strspn(cursor, " ");
+
+        if (*cursor == 0){
+            break;
+        }
+
+        if (*cursor != ','){
+            result = PREPARE_SYNTAX_ERROR;
+        }
+
+        cursor += 1;
+    }
+
+    if (result != PREPARE_SUCCESS){
+        free(statement->rows);
+        statement->rows = NULL;
+        statement->num_rows = 0;
+    }
+
+    return result;
+}
+
+PrepareResult prepare_insert(InputBuffer* ib, Statement* statement){
+    statement->type = STATEMENT_INSERT;
+
+    char* values = ib->buffer + strlen("insert");
+    values += strspn(values, " ");
+
+    if (*values == '('){
+        return prepare_insert_values(values, statement);
+    }
+
+    char* save;
+    strtok_r(ib->buffer, " ", &save);
+    char* id_string = strtok_r(NULL, " ", &save);
+    char* username = strtok_r(NULL, " ", &save);
+    char* email = strtok_r(NULL, " ", &save);
+    PrepareResult result = prepare_row(id_string, username, email, &(statement->row));
+
+    if (result == PREPARE_SUCCESS){
+        result = prepare_row_params(statement, id_string, username, email, UINT32_MAX);
+    }
+
+    return result;
+}
+
+uint32_t tokenize_select(const char* input, char* scratch, char** tokens, uint32_t max_tokens){
+    /* Split on spaces, and around comparison operators so that both
+       "id >= 5" and "id>=5" work; a comma is always a token of its own.
+       Tokens are copied into scratch, which must hold 2 * strlen(input) + 1
+       bytes */
+    const char* operators = "<>=";
+    uint32_t num_tokens = 0;
+
+    while (*input){
+        if (*input == ' '){
+            input++;
+            continue;
+        }
+
+        if (num_tokens == max_tokens){
+            return max_tokens + 1;
+        }
+
+        tokens[num_tokens++] = scratch;
+        bool is_operator = strchr(operators, *input) != NULL;
+
+        if (*input == ','){
+            *scratch++ = *input++;
+        }
+
+        while (*input && *input != ' ' && *input != ',' && (strchr(operators, *input) != NULL) == is_operator){
+            *scratch++ = *input++;
+        }
+
+        *scratch++ = 0;
+    }
+
+    return num_tokens;
+}
+
+PrepareResult parse_where_id(const char* token, int64_t* value){
+    if (*token == '-'){
+        return PREPARE_NEGATIVE_ID;
+    }
+
+    if (strspn(token, "0123456789") != strlen(token) || strlen(token) > 10){
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    *value = strtoll(token, NULL, 10);
+
+    return *value <= UINT32_MAX ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+}
+
+PrepareResult parse_where_string(char* token, char* dest, uint32_t max_length){
+    /* Values may be written bare or in single quotes */
+    size_t length = strlen(token);
+
+    if (length >= 2 && token[0] == '\'' && token[length - 1] == '\''){
+        token[length - 1] = 0;
+        token += 1;
+        length -= 2;
+    }
+
+    if (length > max_length){
+        return PREPARE_STRING_TOO_LONG;
+    }
+
+    strcpy(dest, token);
+
+    return PREPARE_SUCCESS;
+}
+
+void predicate_restrict_string(Predicate* where, bool* match, char* dest, const char* value){
+    /* Add column = value. A column already held to a different value
+       matches nothing, so the id range is emptied */
+    if (*match && strcmp(dest, value) != 0){
+        where->id_low = 1;
+        where->id_high = 0;
+    }
+
+    *match = true;
+    strcpy(dest, value);
+}
+
+PrepareResult parse_where(char** tokens, uint32_t num_tokens, Statement* statement){
+    /* condition [and condition]..., where a condition is one of
+       id = | < | <= | > | >= N, id between A and B,
+       username = value, email = value. Any value may be a ? placeholder */
+    Predicate* where = &(statement->where);
+    uint32_t i = 0;
+
+    while (i < num_tokens){
+        if (num_tokens - i < 3){
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        char* column = tokens[i];
+        char* op = tokens[i + 1];
+        PrepareResult result;
+
+        if (strcmp(column, "id") == 0 && strcmp(op, "between") == 0){
+            int64_t low = 0;
+            int64_t high = UINT32_MAX;
+
+            if (num_tokens - i < 5 || strcmp(tokens[i + 3], "and") != 0){
+                return PREPARE_SYNTAX_ERROR;
+            }
+
+            if ((result = is_param(tokens[i + 2]) ? add_param(statement, PARAM_ID_AT_LEAST, 0)
+                                                  : parse_where_id(tokens[i + 2], &low)) != PREPARE_SUCCESS ||
+                (result = is_param(tokens[i + 4]) ? add_param(statement, PARAM_ID_AT_MOST, 0)
+                                                  : parse_where_id(tokens[i + 4], &high)) != PREPARE_SUCCESS){
+                return result;
+            }
+
+            where->id_low = low > where->id_low ? low : where->id_low;
+            where->id_high = high < where->id_high ? high : where->id_high;
+            i += 5;
+        } else if (strcmp(column, "id") == 0 && is_param(tokens[i + 2])){
+            ParamTarget target;
+
+            if (strcmp(op, "=") == 0){
+                target = PARAM_ID_EQUAL;
+            } else if (strcmp(op, ">") == 0){
+                target = PARAM_ID_ABOVE;
+            } else if (strcmp(op, ">=") == 0){
+                target = PARAM_ID_AT_LEAST;
+            } else if (strcmp(op, "<") == 0){
+                target = PARAM_ID_BELOW;
+            } else if (strcmp(op, "<=") == 0){
+                target = PARAM_ID_AT_MOST;
+            } else {
+                return PREPARE_SYNTAX_ERROR;
+            }
+
+            if ((result = add_param(statement, target, 0)) != PREPARE_SUCCESS){
+                return result;
+            }
+
+            i += 3;
+        } else if (strcmp(column, "id") == 0){
+            int64_t value;
+
+            if ((result = parse_where_id(tokens[i + 2], &value)) != PREPARE_SUCCESS){
+                return result;
+            }
+
+            int64_t low = 0;
+            int64_t high = UINT32_MAX;
+
+            if (strcmp(op, "=") == 0){
+                low = high = value;
+            } else if (strcmp(op, ">") == 0){
+                low = value + 1;
+            } else if (strcmp(op, ">=") == 0){
+                low = value;
+            } else if (strcmp(op, "<") == 0){
+                high = value - 1;
+            } else if (strcmp(op, "<=") == 0){
+                high = value;
+            } else {
+                return PREPARE_SYNTAX_ERROR;
+            }
+
+            where->id_low = low > where->id_low ? low : where->id_low;
+            where->id_high = high < where->id_high ? high : where->id_high;
+            i += 3;
+        } else if (strcmp(op, "=") == 0 && strcmp(column, "username") == 0){
+            char value[COLUMN_USERNAME_SIZE + 1];
+
+            if (is_param(tokens[i + 2])){
+                result = add_param(statement, PARAM_WHERE_USERNAME, 0);
+            } else if ((result = parse_where_string(tokens[i + 2], value, COLUMN_USERNAME_SIZE)) == PREPARE_SUCCESS){
+                predicate_restrict_string(where, &(where->match_username), where->username, value);
+            }
+
+            if (result != PREPARE_SUCCESS){
+                return result;
+            }
+
+            i += 3;
+        } else if (strcmp(op, "=") == 0 && strcmp(column, "email") == 0){
+            char value[COLUMN_EMAIL_SIZE + 1];
+
+            if (is_param(tokens[i + 2])){
+                result = add_param(statement, PARAM_WHERE_EMAIL, 0);
+            } else if ((result = parse_where_string(tokens[i + 2], value, COLUMN_EMAIL_SIZE)) == PREPARE_SUCCESS){
+                predicate_restrict_string(where, &(where->match_email), where->email, value);
+            }
+
+            if (result != PREPARE_SUCCESS){
+                return result;
+            }
+
+            i += 3;
+        } else {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        if (i < num_tokens){
+            if (strcmp(tokens[i], "and") != 0 || i + 1 == num_tokens){
+                return PREPARE_SYNTAX_ERROR;
+            }
+
+            i += 1;
+        }
+    }
+
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult parse_column(const char* token, Column* column){
+    if (strcmp(token, "id") == 0){
+        *column = COLUMN_ID;
+    } else if (strcmp(token, "username") == 0){
+        *column = COLUMN_USERNAME;
+    } else if (strcmp(token, "email") == 0){
+        *column = COLUMN_EMAIL;
+    } else {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult parse_projection(char** tokens, uint32_t num_tokens, Statement* statement){
+    /* *, count(*), or a comma separated list of column names and the
+       aggregates count(*), min(id), max(id) and sum(id) */
+    if (num_tokens == 1 && strcmp(tokens[0], "*") == 0){
+        return PREPARE_SUCCESS;
+    }
+
+    if (num_tokens == 1 && strcmp(tokens[0], "count(*)") == 0){
+        statement->count_only = true;
+        return PREPARE_SUCCESS;
+    }
+
+    statement->num_columns = 0;
+
+    for (uint32_t i = 0; i < num_tokens; i += 2){
+        if (statement->num_columns == MAX_PROJECTED_COLUMNS ||
+            (i + 1 < num_tokens && strcmp(tokens[i + 1], ",") != 0) || i + 1 == num_tokens - 1){
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        Column column = COLUMN_ID;
+        Aggregate aggregate = AGGREGATE_NONE;
+
+        if (strcmp(tokens[i], "count(*)") == 0){
+            aggregate = AGGREGATE_COUNT;
+        } else if (strcmp(tokens[i], "min(id)") == 0){
+            aggregate = AGGREGATE_MIN;
+        } else if (strcmp(tokens[i], "max(id)") == 0){
+            aggregate = AGGREGATE_MAX;
+        } else if (strcmp(tokens[i], "sum(id)") == 0){
+            aggregate = AGGREGATE_SUM;
+        } else if (parse_column(tokens[i], &column) != PREPARE_SUCCESS){
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        statement->aggregates[statement->num_columns] = aggregate;
+        statement->aggregate = statement->aggregate || aggregate != AGGREGATE_NONE;
+        statement->columns[statement->num_columns++] = column;
+    }
+
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult check_aggregation(Statement* statement){
+    /* A group by turns a lone count(*) into a per group aggregate. Once
+       rows are grouped, a plain column can only be the grouped one */
+    if (statement->group_by && statement->count_only){
+        statement->count_only = false;
+        statement->num_columns = 1;
+        statement->columns[0] = COLUMN_ID;
+        statement->aggregates[0] = AGGREGATE_COUNT;
+    }
+
+    if (statement->group_by){
+        statement->aggregate = true;
+    }
+
+    if (!statement->aggregate){
+        return PREPARE_SUCCESS;
+    }
+
+    for (uint32_t i = 0; i < statement->num_columns; i++){
+        if (statement->aggregates[i] == AGGREGATE_NONE &&
+            (!statement->group_by || statement->columns[i] != statement->group_column)){
+            return PREPARE_SYNTAX_ERROR;
+        }
+    }
+
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_select(InputBuffer* ib, Statement* statement){
+    statement->type = STATEMENT_SELECT;
+
+    char* scratch = malloc(2 * strlen(ib->buffer) + 1);
+    char* tokens[64];
+    uint32_t num_tokens = tokenize_select(ib->buffer + strlen("select"), scratch, tokens, 64);
+    PrepareResult result = PREPARE_SUCCESS;
+
+    if (num_tokens > 64){
+        free(scratch);
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (num_tokens > 0 && strcmp(tokens[num_tokens - 1], "unordered") == 0){
+        statement->unordered = true;
+        num_tokens -= 1;
+    }
+
+    if (num_tokens >= 3 && strcmp(tokens[num_tokens - 3], "group") == 0 && strcmp(tokens[num_tokens - 2], "by") == 0){
+        statement->group_by = true;
+        result = parse_column(tokens[num_tokens - 1], &(statement->group_column));
+        num_tokens -= 3;
+    }
+
+    uint32_t i = 0;
+
+    while (i < num_tokens && strcmp(tokens[i], "where") != 0){
+        i++;
+    }
+
+    if (result == PREPARE_SUCCESS && i > 0){
+        result = parse_projection(tokens, i, statement);
+    }
+
+    if (result == PREPARE_SUCCESS && i < num_tokens){
+        result = i + 1 < num_tokens ? parse_where(tokens + i + 1, num_tokens - i - 1, statement)
+                                    : PREPARE_SYNTAX_ERROR;
+    }
+
+    if (result == PREPARE_SUCCESS){
+        result = check_aggregation(statement);
+    }
+
+    free(scratch);
+
+    return result;
+}
+
+PrepareResult prepare_where_clause(char** tokens, uint32_t num_tokens, Statement* statement){
+    /* Nothing, or where followed by conditions */
+    if (num_tokens == 0){
+        return PREPARE_SUCCESS;
+    }
+
+    if (strcmp(tokens[0], "where") != 0 || num_tokens == 1){
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    return parse_where(tokens + 1, num_tokens - 1, statement);
+}
+
+PrepareResult prepare_delete(InputBuffer* ib, Statement* statement){
+    /* delete [where condition [and condition]...] */
+    statement->type = STATEMENT_DELETE;
+
+    char* scratch = malloc(2 * strlen(ib->buffer) + 1);
+    char* tokens[64];
+    uint32_t num_tokens = tokenize_select(ib->buffer + strlen("delete"), scratch, tokens, 64);
+    PrepareResult result = num_tokens > 64 ? PREPARE_SYNTAX_ERROR
+                                           : prepare_where_clause(tokens, num_tokens, statement);
+
+    free(scratch);
+
+    return result;
+}
+
+PrepareResult prepare_update(InputBuffer* ib, Statement* statement){
+    /* update set column = value [, column = value] [where ...], where the
+       columns are username and email: the id is the key */
+    statement->type = STATEMENT_UPDATE;
+
+    char* scratch = malloc(2 * strlen(ib->buffer) + 1);
+    char* tokens[64];
+    uint32_t num_tokens = tokenize_select(ib->buffer + strlen("update"), scratch, tokens, 64);
+    PrepareResult result = PREPARE_SUCCESS;
+    uint32_t i = 1;
+
+    if (num_tokens > 64 || num_tokens < 4 || strcmp(tokens[0], "set") != 0){
+        free(scratch);
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    while (result == PREPARE_SUCCESS){
+        if (num_tokens - i < 3 || strcmp(tokens[i + 1], "=") != 0){
+            result = PREPARE_SYNTAX_ERROR;
+        } else if (strcmp(tokens[i], "username") == 0 && !statement->set_username){
+            result = is_param(tokens[i + 2]) ? add_param(statement, PARAM_SET_USERNAME, 0)
+                     : parse_where_string(tokens[i + 2], statement->row.username, COLUMN_USERNAME_SIZE);
+            statement->set_username = true;
+        } else if (strcmp(tokens[i], "email") == 0 && !statement->set_email){
+            result = is_param(tokens[i + 2]) ? add_param(statement, PARAM_SET_EMAIL, 0)
+                     : parse_where_string(tokens[i + 2], statement->row.email, COLUMN_EMAIL_SIZE);
+            statement->set_email = true;
+        } else {
+            result = PREPARE_SYNTAX_ERROR;
+        }
+
+        i += 3;
+
+        if (i == num_tokens || strcmp(tokens[i], ",") != 0){
+            break;
+        }
+
+        i += 1;
+    }
+
+    if (result == PREPARE_SUCCESS){
+        result = prepare_where_clause(tokens + i, num_tokens - i, statement);
+    }
+
+    free(scratch);
+
+    return result;
+}
+
+PrepareResult prepare_create_index(InputBuffer* ib, Statement* statement){
+    /* create index on username|email */
+    statement->type = STATEMENT_CREATE_INDEX;
+
+    char* save;
+    strtok_r(ib->buffer, " ", &save);
+    char* object = strtok_r(NULL, " ", &save);
+    char* on = strtok_r(NULL, " ", &save);
+    char* column = strtok_r(NULL, " ", &save);
+
+    if (object == NULL || on == NULL || column == NULL || strtok_r(NULL, " ", &save) != NULL ||
+        strcmp(object, "index") != 0 || strcmp(on, "on") != 0){
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (strcmp(column, "username") == 0){
+        statement->index_column = COLUMN_USERNAME;
+    } else if (strcmp(column, "email") == 0){
+        statement->index_column = COLUMN_EMAIL;
+    } else {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_statement_params(InputBuffer* ib, Statement* statement){
+    /* Parse a statement that may hold ? placeholders, see db_prepare() */
+    statement->rows = NULL;
+    statement->num_rows = 0;
+    statement->num_params = 0;
+
+    memset(&(statement->where), 0, sizeof(Predicate));
+    statement->where.id_high = UINT32_MAX;
+
+    statement->columns[0] = COLUMN_ID;
+    statement->columns[1] = COLUMN_USERNAME;
+    statement->columns[2] = COLUMN_EMAIL;
+    statement->num_columns = 3;
+    memset(statement->aggregates, 0, sizeof(statement->aggregates));
+    statement->count_only = false;
+    statement->aggregate = false;
+    statement->group_by = false;
+    statement->unordered = false;
+    statement->set_username = false;
+    statement->set_email = false;
+    statement->output = stdout;
+    statement->format = OUTPUT_TEXT;
+
+    if (strncmp(ib->buffer, "insert", 6) == 0){
+        return prepare_insert(ib, statement);
+    }
+
+    if (strncmp(ib->buffer, "select", 6) == 0 && (ib->buffer[6] == 0 || ib->buffer[6] == ' ')){
+        return prepare_select(ib, statement);
+    }
+
+    if (strncmp(ib->buffer, "delete", 6) == 0 && (ib->buffer[6] == 0 || ib->buffer[6] == ' ')){
+        return prepare_delete(ib, statement);
+    }
+
+    if (strncmp(ib->buffer, "update", 6) == 0 && ib->buffer[6] == ' '){
+        return prepare_update(ib, statement);
+    }
+
+    if (strncmp(ib->buffer, "create", 6) == 0 && ib->buffer[6] == ' '){
+        return prepare_create_index(ib, statement);
+    }
+
+    return PREPARE_UNRECOGNIZED;
+}
+
+PrepareResult prepare_statement(InputBuffer* ib, Statement* statement){
+    /* Parse a statement to run as it is, which has nothing to bind */
+    PrepareResult result = prepare_statement_params(ib, statement);
+
+    if (result == PREPARE_SUCCESS && statement->num_params > 0){
+        free(statement->rows);
+        statement->rows = NULL;
+        result = PREPARE_SYNTAX_ERROR;
+    }
+
+    return result;
+}
+
+uint32_t get_unused_page_num(Pager* pager){
+    /* Reuse the most recently freed page, else append to the file. Only
+       called by writers, which are serialized, so the freelist needs no
+       lock of its own; through pager_mark_dirty its changes are logged
+       and versioned like any other page */
+    void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+    uint32_t free_page_num = *db_header_freelist_head(header);
+
+    if (free_page_num != INVALID_PAGE_NUM){
+        void* page = get_page(pager, free_page_num);
+        pager_mark_dirty(pager, DB_HEADER_PAGE_NUM);
+        *db_header_freelist_head(header) = *free_page_next(page);
+        *db_header_freelist_count(header) -= 1;
+        return free_page_num;
+    }
+
+    pthread_mutex_lock(&pager->pool_mutex);
+    uint32_t unused = pager->num_pages;
+    pager->num_pages += 1;
+    pthread_mutex_unlock(&pager->pool_mutex);
+    return unused;
+}
+
+void pager_free_page(Pager* pager, uint32_t page_num){
+    /* Push a page no longer reachable from the tree onto the freelist.
+       Its old image stays with any snapshot that could still read it */
+    void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+    void* page = get_page(pager, page_num);
+    pager_mark_dirty(pager, page_num);
+    pager_mark_dirty(pager, DB_HEADER_PAGE_NUM);
+    memset(page, 0, PAGE_SIZE);
+    *free_page_next(page) = *db_header_freelist_head(header);
+    *db_header_freelist_head(header) = page_num;
+    *db_header_freelist_count(header) += 1;
+}
+
+void create_new_root(Table* table, uint32_t right_child_page_num){
+    /* Handle splitting the root
+       Old root is copied to the new page and becomes the left child
+       Address of the right child is passed in, already initialized
+       Re-initialize root page to contain the new root node
+       New root node points to two children */
+    void* root = get_page(table->pager, table->root_page_num);
+    uint32_t left_child_page_num = get_unused_page_num(table->pager);
+    void* left_child = get_page(table->pager, left_child_page_num);
+    pager_mark_dirty(table->pager, table->root_page_num);
+    pager_mark_dirty(table->pager, left_child_page_num);
+
+    /* Left child has data copied from old root */
+    memcpy(left_child, root, PAGE_SIZE);
+    set_node_root(left_child, false);
+
+    if (table->rightmost_leaf == table->root_page_num){
+        table->rightmost_leaf = left_child_page_num;
+    }
+
+    /* Root node is a new internal node with one key and two children */
+    init_internal_node(root);
+    set_node_root(root, true);
+    *internal_node_num_keys(root) = 1;
+    *internal_node_child(root, 0) = left_child_page_num;
+    uint32_t left_child_max_key = get_node_max_key(table->pager, left_child);
+    *internal_node_key(root, 0) = left_child_max_key;
+    *internal_node_right_child(root) = right_child_page_num;
+}
+
+bool node_is_rightmost(Pager* pager, void* node){
+    /* A subtree is on the right edge of the tree when the leaf at the end
+       of its right spine ends the leaf chain */
+    while (get_node_type(node) == NODE_INTERNAL){
+        node = get_page(pager, *internal_node_right_child(node));
+    }
+
+    return *leaf_node_next_leaf(node) == INVALID_PAGE_NUM;
+}
+
+void internal_node_split_finish(Table* table, uint32_t old_page_num, uint32_t new_page_num, uint32_t old_max){
+    /* Hook the new sibling of a split internal node into the tree */
+    Pager* pager = table->pager;
+    void* old_node = get_page(pager, old_page_num);
+
+    if (is_node_root(old_node)){
+        create_new_root(table, new_page_num);
+    } else {
+        uint32_t grandparent_page_num = table_find_parent(table, old_page_num, old_max);
+        void* grandparent = get_page(pager, grandparent_page_num);
+        pager_mark_dirty(pager, grandparent_page_num);
+
+        update_internal_node_key(grandparent, old_max, get_node_max_key(pager, old_node));
+        internal_node_insert(table, grandparent_page_num, new_page_num);
+    }
+}
+
+void internal_node_split_and_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num){
+    /* The node is full. Move the upper half of its children into a new
+       sibling, insert the child into whichever half it belongs to, then
+       add the sibling to the grandparent (or grow a new root) */
+    Pager* pager = table->pager;
+    void* old_node = get_page(pager, parent_page_num);
+    pager_mark_dirty(pager, parent_page_num);
+    stats_add(&(stats_counters()->internal_splits), 1);
+    uint32_t old_max = get_node_max_key(pager, old_node);
+
+    void* child = get_page(pager, child_page_num);
+    uint32_t child_max = get_node_max_key(pager, child);
+
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void* new_node = get_page(pager, new_page_num);
+    pager_mark_dirty(pager, new_page_num);
+    init_internal_node(new_node);
+
+    if (child_max > old_max && node_is_rightmost(pager, child)){
+        /* Appending past the end of the tree: leave this node full and
+           start the sibling with just the new child */
+        internal_node_insert(table, new_page_num, child_page_num);
+        internal_node_split_finish(table, parent_page_num, new_page_num, old_max);
+        return;
+    }
+
+    /* Children 0..split stay, with child split becoming the right child.
+       Key split is dropped: it was the max of that child, which the
+       grandparent now records for the old node as a whole */
+    uint32_t num_keys = *internal_node_num_keys(old_node);
+    uint32_t split = num_keys / 2;
+    uint32_t num_moved = num_keys - split - 1;
+
+    memcpy(internal_node_keys(new_node), internal_node_keys(old_node) + split + 1, num_moved * INTERNAL_NODE_KEY_SIZE);
+    memcpy(internal_node_children(new_node), internal_node_children(old_node) + split + 1,
+           num_moved * INTERNAL_NODE_CHILD_SIZE);
+    *internal_node_num_keys(new_node) = num_moved;
+    *internal_node_right_child(new_node) = *internal_node_right_child(old_node);
+
+    *internal_node_right_child(old_node) = *internal_node_child(old_node, split);
+    *internal_node_num_keys(old_node) = split;
+
+    uint32_t max_after_split = get_node_max_key(pager, old_node);
+    uint32_t destination_page_num = child_max < max_after_split ? parent_page_num : new_page_num;
+    internal_node_insert(table, destination_page_num, child_page_num);
+
+    internal_node_split_finish(table, parent_page_num, new_page_num, old_max);
+}
+
+void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num){
+    /* Add a new child/key pair to parent that corresponds to child*/
+
+    void* parent = get_page(table->pager, parent_page_num);
+    void* child = get_page(table->pager, child_page_num);
+    pager_mark_dirty(table->pager, parent_page_num);
+
+    uint32_t child_max_key = get_node_max_key(table->pager, child);
+    uint32_t index = internal_node_find_child(parent, child_max_key);
+
+    uint32_t original_num_keys = *internal_node_num_keys(parent);
+
+    if (original_num_keys >= INTERNAL_NODE_MAX_CELLS){
+        internal_node_split_and_insert(table, parent_page_num, child_page_num);
+        return;
+    }
+
+    uint32_t right_child_page_num = *internal_node_right_child(parent);
+
+    /* An internal node with a right child of INVALID_PAGE_NUM is empty */
+    if (right_child_page_num == INVALID_PAGE_NUM){
+        *internal_node_right_child(parent) = child_page_num;
+        return;
+    }
+
+    void* right_child = get_page(table->pager, right_child_page_num);
+
+    /* If we are already at the max number of cells for a node, we cannot increment before 
+       splitting. Incrementing without inserting a new key/child pair and immediately
+       calling internal_node_split_and_insert() has the effect of creating a new key at 
+       (max_cells + 1) with an uninitialized value */
+    *internal_node_num_keys(parent) = original_num_keys + 1;
+
+    if (child_max_key > get_node_max_key(table->pager, right_child)){
+        *internal_node_child(parent, original_num_keys) = right_child_page_num;
+        *internal_node_key(parent, original_num_keys) = get_node_max_key(table->pager, right_child);
+        *internal_node_right_child(parent) = child_page_num;
+    } else {
+        memmove(internal_node_keys(parent) + index + 1, internal_node_keys(parent) + index,
+                (original_num_keys - index) * INTERNAL_NODE_KEY_SIZE);
+        memmove(internal_node_children(parent) + index + 1, internal_node_children(parent) + index,
+                (original_num_keys - index) * INTERNAL_NODE_CHILD_SIZE);
+
+        *internal_node_child(parent, index) = child_page_num;
+        *internal_node_key(parent, index) = child_max_key;
+    }
+}
+
+void leaf_node_split_and_insert (Cursor* cursor, uint32_t key, const void* value, uint32_t value_size){
+    /* Create a new node and move half the cells over
+       Insert the new value in one of the two nodes
+       Update parent or create a new paren */
+
+    void* old = cursor_node(cursor);
+    pager_mark_dirty(cursor->table->pager, cursor->page_num);
+    stats_add(&(stats_counters()->leaf_splits), 1);
+    uint32_t old_num_cells = *leaf_node_num_cells(old);
+    uint32_t old_max = get_node_max_key(cursor->table->pager, old);
+
+    uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
+
+    assert(cursor->cell_num <= old_num_cells);
+
+    void* new = get_page(cursor->table->pager, new_page_num);
+    pager_mark_dirty(cursor->table->pager, new_page_num);
+    init_leaf_node(new);
+
+    bool rightmost = *leaf_node_next_leaf(old) == INVALID_PAGE_NUM;
+    *leaf_node_next_leaf(new) = *leaf_node_next_leaf(old);
+    *leaf_node_next_leaf(old) = new_page_num;
+
+    if (rightmost){
+        cursor->table->rightmost_leaf = new_page_num;
+    }
+
+    if (rightmost && cursor->cell_num == old_num_cells){
+        /* Appending past the largest key: a 50/50 split would leave every
+           leaf half empty under sequential inserts, so keep the old leaf
+           full and start the new one with just this row */
+        memcpy(leaf_node_allocate(new, 0, key, value_size), value, value_size);
+
+        leaf_node_split_finish(cursor, new_page_num, old_max);
+        return;
+    }
+
+    /* All existing cells plus the new one are divided between the old and
+       new nodes by bytes rather than by count, since values vary in size.
+       Copy the old node aside, empty it, and deal the cells back out in
+       key order, moving to the new node once the old one holds half */
+    char* scratch = malloc(PAGE_SIZE);
+    memcpy(scratch, old, PAGE_SIZE);
+
+    uint32_t total_cells = old_num_cells + 1;
+    uint32_t total_bytes = PAGE_USABLE_SIZE - *leaf_node_heap_start(scratch) - *leaf_node_fragmented(scratch) +
+                           value_size + total_cells * LEAF_NODE_SLOT_SIZE;
+    uint32_t used_bytes = 0;
+    void* dest_node = old;
+
+    *leaf_node_num_cells(old) = 0;
+    *leaf_node_heap_start(old) = PAGE_USABLE_SIZE;
+    *leaf_node_fragmented(old) = 0;
+
+    for (uint32_t i = 0; i < total_cells; i++){
+        uint32_t source = i < cursor->cell_num ? i : i - 1;
+        uint32_t length = i == cursor->cell_num ? value_size : *leaf_node_value_length(scratch, source);
+        uint32_t cost = LEAF_NODE_SLOT_SIZE + length;
+
+        if (dest_node == old && i > 0 && (used_bytes + cost > total_bytes / 2 || i == total_cells - 1)){
+            dest_node = new;
+        }
+
+        uint32_t dest_cell = *leaf_node_num_cells(dest_node);
+
+        if (i == cursor->cell_num){
+            memcpy(leaf_node_allocate(dest_node, dest_cell, key, length), value, length);
+        } else {
+            memcpy(leaf_node_allocate(dest_node, dest_cell, *leaf_node_key(scratch, source), length),
+                   leaf_node_value(scratch, source), length);
+        }
+
+        used_bytes += cost;
+    }
+
+    free(scratch);
+
+    leaf_node_split_finish(cursor, new_page_num, old_max);
+}
+
+void leaf_node_split_finish(Cursor* cursor, uint32_t new_page_num, uint32_t old_max){
+    void* old = cursor_node(cursor);
+
+    /* Update the nodes' parents. If the original node was the 
+        root, it had no parents. In that case, create a new root
+        node to act as the parent */
+    if (is_node_root(old)){
+        return create_new_root(cursor->table, new_page_num);
+    } else {
+        uint32_t parent_page_num = table_find_parent(cursor->table, cursor->page_num, old_max);
+        uint32_t new_max = get_node_max_key(cursor->table->pager, old);
+        void* parent = get_page(cursor->table->pager, parent_page_num);
+        pager_mark_dirty(cursor->table->pager, parent_page_num);
+
+        update_internal_node_key(parent, old_max, new_max);
+        internal_node_insert(cursor->table, parent_page_num, new_page_num);
+        return;
+    }
+}
+
+void leaf_node_insert_value(Cursor* cursor, uint32_t key, const void* value, uint32_t value_size){
+    /* Insert value_size bytes under key at the cursor, splitting the leaf
+       when they do not fit */
+    void* node = cursor_node(cursor);
+    pager_mark_dirty(cursor->table->pager, cursor->page_num);
+
+    uint32_t num_cells = *leaf_node_num_cells(node);
+
+    assert(cursor->cell_num <= num_cells);
+
+    if (leaf_node_free_space(node) < LEAF_NODE_SLOT_SIZE + value_size){
+        leaf_node_split_and_insert(cursor, key, value, value_size);
+        return;
+    }
+
+    memcpy(leaf_node_allocate(node, cursor->cell_num, key, value_size), value, value_size);
+}
+
+void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value){
+    char serialized[sizeof(Row)];
+    serialize_row(value, serialized);
+    leaf_node_insert_value(cursor, key, serialized, row_value_size(value));
+}
+
+bool table_find_append(Table* table, uint32_t key, LatchMode mode, uint32_t value_size, Cursor* cursor){
+    /* Place the cursor past the last row when key is larger than every key
+       in the table, using the rightmost leaf hint instead of a descent.
+       A latched append only takes the shortcut when the leaf has room,
+       since a split has to hold the ancestors from the top. Returns false
+       when the shortcut does not apply */
+    if (table->rightmost_leaf == INVALID_PAGE_NUM){
+        return false;
+    }
+
+    void* node = descend_to(table->pager, table->rightmost_leaf, mode);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+
+    if (get_node_type(node) != NODE_LEAF || *leaf_node_next_leaf(node) != INVALID_PAGE_NUM ||
+        num_cells == 0 || key <= *leaf_node_key(node, num_cells - 1) ||
+        (mode == LATCH_EXCLUSIVE && !node_is_safe(node, value_size))){
+        pager_unlatch(table->pager, table->rightmost_leaf);
+        return false;
+    }
+
+    cursor_init(cursor, table, table->rightmost_leaf);
+    cursor->cell_num = num_cells;
+    cursor->end_of_table = true;
+
+    return true;
+}
+
+void leaf_node_insert_run(Table* table, uint32_t page_num, Row* rows, uint32_t count){
+    /* Merge count sorted rows into a leaf that has room for them. Each
+       stretch of existing keys between two insertion points is shifted
+       with one memmove, and likewise for the value pointers */
+    void* node = get_page(table->pager, page_num);
+    pager_mark_dirty(table->pager, page_num);
+
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t value_bytes = 0;
+
+    for (uint32_t r = 0; r < count; r++){
+        value_bytes += row_value_size(&rows[r]);
+    }
+
+    assert(leaf_node_free_space(node) >= count * LEAF_NODE_SLOT_SIZE + value_bytes);
+
+    if (*leaf_node_heap_start(node) < LEAF_NODE_HEADER_SIZE + (num_cells + count) * LEAF_NODE_SLOT_SIZE + value_bytes){
+        leaf_node_compact(node);
+    }
+
+    /* below[r] is the number of existing keys smaller than row r, so row
+       r lands at below[r] + r */
+    uint32_t* keys = leaf_node_keys(node);
+    uint32_t* below = malloc(count * sizeof(uint32_t));
+    uint32_t start = 0;
+
+    for (uint32_t r = 0; r < count; r++){
+        start += key_lower_bound(keys + start, num_cells - start, rows[r].id);
+        below[r] = start;
+    }
+
+    /* Move the pointer array before the keys grow over its old place.
+       Within each array go back to front, so stretches only move up over
+       entries that have already been moved */
+    void* old_pointers = leaf_node_pointer_entry(node, 0);
+    void* new_pointers = (void*) (keys + num_cells + count);
+
+    for (int32_t r = count - 1; r >= 0; r--){
+        uint32_t run_end = (uint32_t) r + 1 < count ? below[r + 1] : num_cells;
+        memmove(new_pointers + (below[r] + r + 1) * LEAF_NODE_POINTER_ENTRY_SIZE,
+                old_pointers + below[r] * LEAF_NODE_POINTER_ENTRY_SIZE,
+                (run_end - below[r]) * LEAF_NODE_POINTER_ENTRY_SIZE);
+    }
+
+    memmove(new_pointers, old_pointers, below[0] * LEAF_NODE_POINTER_ENTRY_SIZE);
+
+    for (int32_t r = count - 1; r >= 0; r--){
+        uint32_t run_end = (uint32_t) r + 1 < count ? below[r + 1] : num_cells;
+        memmove(keys + below[r] + r + 1, keys + below[r], (run_end - below[r]) * LEAF_NODE_KEY_SIZE);
+    }
+
+    *leaf_node_num_cells(node) = num_cells + count;
+
+    for (uint32_t r = 0; r < count; r++){
+        uint32_t dest = below[r] + r;
+        uint32_t length = row_value_size(&rows[r]);
+        *leaf_node_heap_start(node) -= length;
+
+        keys[dest] = rows[r].id;
+        *leaf_node_value_pointer(node, dest) = *leaf_node_heap_start(node);
+        *leaf_node_value_length(node, dest) = length;
+        serialize_row(&rows[r], leaf_node_value(node, dest));
+    }
+
+    free(below);
+}
+
+void batch_seek(Table* table, uint32_t key, LatchMode mode, uint32_t value_size, uint32_t* upper_bound,
+                Cursor* cursor){
+    if (table_find_append(table, key, mode, value_size, cursor)){
+        *upper_bound = UINT32_MAX;
+        return;
+    }
+
+    table_descend(table, key, mode, value_size, upper_bound, cursor);
+}
+
+ExecuteResult execute_insert_batch(Table* table, Row* rows, uint32_t num_rows){
+    /* Insert rows sorted by key. One descent finds the leaf for the next
+       row along with the largest key routed there, and every following
+       row up to that bound goes into the same leaf in one merge */
+    qsort(rows, num_rows, sizeof(Row), compare_rows_by_id);
+
+    for (uint32_t i = 1; i < num_rows; i++){
+        if (rows[i].id == rows[i - 1].id){
+            return EXECUTE_DUPLICATE_KEY;
+        }
+    }
+
+    /* Check every key before changing anything, so a duplicate rejects
+       the whole batch */
+    uint32_t upper_bound;
+
+    for (uint32_t i = 0; i < num_rows; ){
+        Cursor cursor;
+        batch_seek(table, rows[i].id, LATCH_NONE, 0, &upper_bound, &cursor);
+        void* node = cursor_node(&cursor);
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        uint32_t cell_num = cursor.cell_num;
+        cursor_close(&cursor);
+
+        for (; i < num_rows && rows[i].id <= upper_bound; i++){
+            while (cell_num < num_cells && *leaf_node_key(node, cell_num) < rows[i].id){
+                cell_num++;
+            }
+
+            if (cell_num < num_cells && *leaf_node_key(node, cell_num) == rows[i].id){
+                return EXECUTE_DUPLICATE_KEY;
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < num_rows; ){
+        Cursor cursor;
+        batch_seek(table, rows[i].id, LATCH_EXCLUSIVE, row_value_size(&rows[i]), &upper_bound, &cursor);
+        void* node = cursor_node(&cursor);
+        uint32_t free_space = leaf_node_free_space(node);
+        uint32_t end = i;
+
+        while (end < num_rows && rows[end].id <= upper_bound &&
+               LEAF_NODE_SLOT_SIZE + row_value_size(&rows[end]) <= free_space){
+            free_space -= LEAF_NODE_SLOT_SIZE + row_value_size(&rows[end]);
+            end++;
+        }
+
+        if (*leaf_node_next_leaf(node) == INVALID_PAGE_NUM){
+            table->rightmost_leaf = cursor.page_num;
+        }
+
+        if (end == i){
+            /* Split the leaf through the single-row path; the next
+               descent lands in one of the halves */
+            leaf_node_insert(&cursor, rows[i].id, &rows[i]);
+            pager_unlatch_all(table->pager);
+            cursor_close(&cursor);
+            table_statement_checkpoint(table->pager);
+            i++;
+            continue;
+        }
+
+        leaf_node_insert_run(table, cursor.page_num, rows + i, end - i);
+        pager_unlatch_all(table->pager);
+        cursor_close(&cursor);
+        table_statement_checkpoint(table->pager);
+        i = end;
+    }
+
+    if (table_has_indexes(table)){
+        for (uint32_t i = 0; i < num_rows; i++){
+            index_add_row(table, &rows[i]);
+            table_statement_checkpoint(table->pager);
+        }
+    }
+
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult table_insert_batch(Table* table, Row* rows, uint32_t num_rows){
+    /* Binary batch API: insert rows straight from memory as one statement */
+    Statement statement;
+    statement.type = STATEMENT_INSERT;
+    statement.rows = rows;
+    statement.num_rows = num_rows;
+
+    return execute_statement(&statement, table);
+}
+
+ExecuteResult execute_insert(Statement* statement, Table* table){
+    if (statement->rows != NULL){
+        return execute_insert_batch(table, statement->rows, statement->num_rows);
+    }
+
+    Row* row = &(statement->row);
+    uint32_t key_to_insert = row->id;
+    uint32_t value_size = row_value_size(row);
+    Cursor cursor;
+
+    if (!table_find_append(table, key_to_insert, LATCH_EXCLUSIVE, value_size, &cursor)){
+        table_descend(table, key_to_insert, LATCH_EXCLUSIVE, value_size, NULL, &cursor);
+    }
+
+    void* node = cursor_node(&cursor);
+    uint32_t num_cells = (*leaf_node_num_cells(node));
+
+    if (*leaf_node_next_leaf(node) == INVALID_PAGE_NUM){
+        table->rightmost_leaf = cursor.page_num;
+    }
+
+    if (cursor.cell_num < num_cells){
+        uint32_t key_at_index = *leaf_node_key(node, cursor.cell_num);
+        if (key_at_index == key_to_insert){
+            cursor_close(&cursor);
+            return EXECUTE_DUPLICATE_KEY;
+        }
+    }
+
+    leaf_node_insert(&cursor, row->id, row);
+
+    cursor_close(&cursor);
+
+    if (table_has_indexes(table)){
+        /* Index descents let go of every latch but their own */
+        pager_unlatch_all(table->pager);
+        index_add_row(table, row);
+    }
+
+    return EXECUTE_SUCCESS;
+}
+
+/* Deleting
+   A delete can leave a node underfull: a leaf using less than a third of
+   its space, or an internal node with fewer than half its keys. It then
+   borrows from a sibling under the same parent, or merges with it when
+   both fit in one node. A merge takes a key out of the parent, which may
+   leave the parent underfull in turn, and a root left with a single
+   child takes that child's place. Separators are only rewritten when
+   cells move between nodes: after a plain delete a separator is still a
+   valid upper bound for the keys below it */
+
+bool node_is_underfull(void* node){
+    if (get_node_type(node) == NODE_LEAF){
+        return leaf_node_used_space(node) < LEAF_NODE_MIN_USED;
+    }
+
+    return *internal_node_num_keys(node) < INTERNAL_NODE_MIN_KEYS;
+}
+
+bool node_is_safe_for_remove(void* node){
+    /* Rebalancing below an internal node takes at most one key out of it.
+       The root only has to keep one key, and leaves are decided once the
+       delete is done */
+    if (get_node_type(node) == NODE_LEAF){
+        return false;
+    }
+
+    uint32_t num_keys = *internal_node_num_keys(node);
+
+    return is_node_root(node) ? num_keys > 1 : num_keys > INTERNAL_NODE_MIN_KEYS;
+}
+
+void table_descend_remove(Table* table, uint32_t key, uint32_t* upper_bound, Cursor* cursor){
+    /* An exclusive descent that keeps every ancestor rebalancing could
+       reach, see table_descend() */
+    Pager* pager = table->pager;
+    uint32_t page_num = table->root_page_num;
+    void* node = pager_latch(pager, page_num, true);
+    uint32_t bound = UINT32_MAX;
+    uint32_t depth = 1;
+
+    table->path_length = 0;
+    table_path_push(table, page_num);
+
+    while (get_node_type(node) == NODE_INTERNAL){
+        uint32_t child_index = internal_node_find_child(node, key);
+
+        if (child_index < *internal_node_num_keys(node)){
+            bound = *internal_node_key(node, child_index);
+        }
+
+        page_num = *internal_node_child(node, child_index);
+        node = pager_latch(pager, page_num, true);
+        depth += 1;
+        table_path_push(table, page_num);
+
+        if (node_is_safe_for_remove(node)){
+            pager_unlatch_ancestors(pager);
+        }
+    }
+
+    *upper_bound = bound;
+
+    stats_count_descent(depth);
+    leaf_node_find(table, page_num, key, cursor);
+}
+
+void internal_node_remove(void* node, uint32_t key_num){
+    /* Children key_num and key_num + 1 were merged into child key_num:
+       drop the key between them and point the combined range at it */
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t left_page_num = *internal_node_child(node, key_num);
+
+    memmove(internal_node_keys(node) + key_num, internal_node_keys(node) + key_num + 1,
+            (num_keys - key_num - 1) * INTERNAL_NODE_KEY_SIZE);
+    memmove(internal_node_children(node) + key_num, internal_node_children(node) + key_num + 1,
+            (num_keys - key_num - 1) * INTERNAL_NODE_CHILD_SIZE);
+    *internal_node_num_keys(node) = num_keys - 1;
+    *internal_node_child(node, key_num) = left_page_num;
+}
+
+void table_free_node(Table* table, uint32_t page_num, uint32_t replacement){
+    if (table->rightmost_leaf == page_num){
+        table->rightmost_leaf = replacement;
+    }
+
+    /* The page may be reused as any node, so the path ends above it */
+    for (uint32_t i = 0; i < table->path_length && i < TABLE_MAX_PATH; i++){
+        if (table->path[i] == page_num){
+            table->path_length = i;
+            break;
+        }
+    }
+
+    pager_free_page(table->pager, page_num);
+}
+
+void leaf_node_merge(Table* table, uint32_t parent_page_num, uint32_t key_num){
+    /* Append the right leaf's cells to the left one and unlink the right */
+    Pager* pager = table->pager;
+    void* parent = get_page(pager, parent_page_num);
+    uint32_t left_page_num = *internal_node_child(parent, key_num);
+    uint32_t right_page_num = *internal_node_child(parent, key_num + 1);
+    void* left = get_page(pager, left_page_num);
+    void* right = get_page(pager, right_page_num);
+
+    while (*leaf_node_num_cells(right) > 0){
+        leaf_node_move_cell(right, 0, left, *leaf_node_num_cells(left));
+    }
+
+    *leaf_node_next_leaf(left) = *leaf_node_next_leaf(right);
+    internal_node_remove(parent, key_num);
+    table_free_node(table, right_page_num, left_page_num);
+}
+
+void leaf_node_borrow(Table* table, uint32_t parent_page_num, uint32_t key_num){
+    /* Move cells across the boundary until the underfull side is full
+       enough, then move the separator to the new boundary */
+    Pager* pager = table->pager;
+    void* parent = get_page(pager, parent_page_num);
+    void* left = get_page(pager, *internal_node_child(parent, key_num));
+    void* right = get_page(pager, *internal_node_child(parent, key_num + 1));
+
+    if (leaf_node_used_space(left) < LEAF_NODE_MIN_USED){
+        while (leaf_node_used_space(left) < LEAF_NODE_MIN_USED && *leaf_node_num_cells(right) > 1){
+            leaf_node_move_cell(right, 0, left, *leaf_node_num_cells(left));
+        }
+    } else {
+        while (leaf_node_used_space(right) < LEAF_NODE_MIN_USED && *leaf_node_num_cells(left) > 1){
+            leaf_node_move_cell(left, *leaf_node_num_cells(left) - 1, right, 0);
+        }
+    }
+
+    update_internal_node_key(parent, *internal_node_key(parent, key_num), get_node_max_key(pager, left));
+}
+
+void internal_node_merge(Table* table, uint32_t parent_page_num, uint32_t key_num){
+    /* Pull the separator down between the left node's children and the
+       right node's, and drop the right node */
+    Pager* pager = table->pager;
+    void* parent = get_page(pager, parent_page_num);
+    uint32_t left_page_num = *internal_node_child(parent, key_num);
+    uint32_t right_page_num = *internal_node_child(parent, key_num + 1);
+    void* left = get_page(pager, left_page_num);
+    void* right = get_page(pager, right_page_num);
+    uint32_t left_keys = *internal_node_num_keys(left);
+    uint32_t right_keys = *internal_node_num_keys(right);
+
+    *internal_node_key(left, left_keys) = *internal_node_key(parent, key_num);
+    internal_node_children(left)[left_keys] = *internal_node_right_child(left);
+    memcpy(internal_node_keys(left) + left_keys + 1, internal_node_keys(right), right_keys * INTERNAL_NODE_KEY_SIZE);
+    memcpy(internal_node_children(left) + left_keys + 1, internal_node_children(right),
+           right_keys * INTERNAL_NODE_CHILD_SIZE);
+    *internal_node_num_keys(left) = left_keys + 1 + right_keys;
+    *internal_node_right_child(left) = *internal_node_right_child(right);
+
+    internal_node_remove(parent, key_num);
+    table_free_node(table, right_page_num, left_page_num);
+}
+
+void internal_node_borrow(Table* table, uint32_t parent_page_num, uint32_t key_num){
+    /* Rotate one child through the parent, from the fuller node into the
+       underfull one */
+    Pager* pager = table->pager;
+    void* parent = get_page(pager, parent_page_num);
+    uint32_t left_page_num = *internal_node_child(parent, key_num);
+    uint32_t right_page_num = *internal_node_child(parent, key_num + 1);
+    void* left = get_page(pager, left_page_num);
+    void* right = get_page(pager, right_page_num);
+    uint32_t left_keys = *internal_node_num_keys(left);
+    uint32_t right_keys = *internal_node_num_keys(right);
+    uint32_t separator = *internal_node_key(parent, key_num);
+    uint32_t new_separator;
+
+    if (left_keys < right_keys){
+        *internal_node_key(left, left_keys) = separator;
+        internal_node_children(left)[left_keys] = *internal_node_right_child(left);
+        *internal_node_num_keys(left) = left_keys + 1;
+        *internal_node_right_child(left) = internal_node_children(right)[0];
+        new_separator = *internal_node_key(right, 0);
+
+        memmove(internal_node_keys(right), internal_node_keys(right) + 1, (right_keys - 1) * INTERNAL_NODE_KEY_SIZE);
+        memmove(internal_node_children(right), internal_node_children(right) + 1,
+                (right_keys - 1) * INTERNAL_NODE_CHILD_SIZE);
+        *internal_node_num_keys(right) = right_keys - 1;
+    } else {
+        memmove(internal_node_keys(right) + 1, internal_node_keys(right), right_keys * INTERNAL_NODE_KEY_SIZE);
+        memmove(internal_node_children(right) + 1, internal_node_children(right), right_keys * INTERNAL_NODE_CHILD_SIZE);
+        *internal_node_key(right, 0) = separator;
+        internal_node_children(right)[0] = *internal_node_right_child(left);
+        *internal_node_num_keys(right) = right_keys + 1;
+
+        new_separator = *internal_node_key(left, left_keys - 1);
+        *internal_node_right_child(left) = internal_node_children(left)[left_keys - 1];
+        *internal_node_num_keys(left) = left_keys - 1;
+    }
+
+    update_internal_node_key(parent, separator, new_separator);
+}
+
+void root_collapse(Table* table){
+    /* The root is down to one child: move the child into the root page,
+       which never changes, and free the child's page */
+    Pager* pager = table->pager;
+    void* root = get_page(pager, table->root_page_num);
+    uint32_t child_page_num = *internal_node_right_child(root);
+    void* child = get_page(pager, child_page_num);
+
+    memcpy(root, child, PAGE_SIZE);
+    set_node_root(root, true);
+    table_free_node(table, child_page_num, table->root_page_num);
+}
+
+void node_rebalance(Table* table, uint32_t page_num, uint32_t key){
+    /* Repair a node after removing from it. When it is underfull, its
+       parent and every ancestor that could be affected are still latched
+       from the descent, see node_is_safe_for_remove(). key is the one the
+       descent followed, which still routes to the node and its parents */
+    Pager* pager = table->pager;
+    void* node = get_page(pager, page_num);
+
+    if (is_node_root(node)){
+        if (get_node_type(node) == NODE_INTERNAL && *internal_node_num_keys(node) == 0){
+            root_collapse(table);
+        }
+
+        return;
+    }
+
+    if (!node_is_underfull(node)){
+        return;
+    }
+
+    uint32_t parent_page_num = table_find_parent(table, page_num, key);
+    void* parent = get_page(pager, parent_page_num);
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    uint32_t index = 0;
+
+    if (num_keys == 0){
+        /* An append split can leave an internal node with a single child.
+           Repair the parent first, which gives the node a sibling */
+        node_rebalance(table, parent_page_num, key);
+        node_rebalance(table, page_num, key);
+        return;
+    }
+
+    while (index < num_keys && internal_node_children(parent)[index] != page_num){
+        index++;
+    }
+
+    /* Pair the node with its right sibling, or its left one if it has none.
+       Siblings are latched left to right, the order readers follow the
+       leaf chain in, so a node with only a left sibling lets go of its
+       latch first. An earlier step of the same repair may hold either */
+    uint32_t key_num = index < num_keys ? index : index - 1;
+    uint32_t left_page_num = *internal_node_child(parent, key_num);
+    uint32_t right_page_num = *internal_node_child(parent, key_num + 1);
+
+    if (!pager_holds_latch(pager, left_page_num)){
+        pager_unlatch(pager, right_page_num);
+        pager_latch(pager, left_page_num, true);
+    }
+
+    if (!pager_holds_latch(pager, right_page_num)){
+        pager_latch(pager, right_page_num, true);
+    }
+
+    void* left = get_page(pager, left_page_num);
+    void* right = get_page(pager, right_page_num);
+    pager_mark_dirty(pager, parent_page_num);
+    pager_mark_dirty(pager, left_page_num);
+    pager_mark_dirty(pager, right_page_num);
+
+    if (get_node_type(node) == NODE_LEAF){
+        if (leaf_node_used_space(left) + leaf_node_used_space(right) <= LEAF_NODE_SPACE_FOR_CELLS){
+            leaf_node_merge(table, parent_page_num, key_num);
+            node_rebalance(table, parent_page_num, key);
+        } else {
+            leaf_node_borrow(table, parent_page_num, key_num);
+        }
+    } else {
+        if (*internal_node_num_keys(left) + *internal_node_num_keys(right) + 1 <= INTERNAL_NODE_MAX_CELLS){
+            internal_node_merge(table, parent_page_num, key_num);
+            node_rebalance(table, parent_page_num, key);
+        } else {
+            internal_node_borrow(table, parent_page_num, key_num);
+        }
+    }
+}
+
+void table_statement_checkpoint(Pager* pager){
+    /* Between leaves of a long delete, update or index build, and between
+       the index changes of their rows: let go of the latches and pins,
+       and spill what is done so far once it would crowd the pool. The
+       statement still commits as a whole when it ends */
+    pager_unlatch_all(pager);
+    pager_spill(pager);
+    pager_release_pins(pager);
+}
+
+ExecuteResult execute_delete(Statement* statement, Table* table){
+    /* Visit the leaves covering the id range one at a time. Each visit
+       descends afresh, so whatever rebalancing did to the tree, the next
+       one starts at the first key past those already handled */
+    Pager* pager = table->pager;
+    const Predicate* where = &(statement->where);
+    int64_t key = where->id_low;
+
+    /* Rows removed from the current leaf, to take out of the indexes once
+       the leaf is done with */
+    Row* removed_rows = NULL;
+    uint32_t num_removed = 0;
+
+    if (table_has_indexes(table)){
+        removed_rows = malloc(LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_SLOT_SIZE * sizeof(Row));
+    }
+
+    while (key <= where->id_high){
+        uint32_t bound;
+        Cursor cursor;
+        table_descend_remove(table, (uint32_t) key, &bound, &cursor);
+        void* node = cursor_node(&cursor);
+        uint32_t cell_num = cursor.cell_num;
+        bool removed = false;
+
+        while (cell_num < *leaf_node_num_cells(node) && *leaf_node_key(node, cell_num) <= where->id_high){
+            if (!row_matches(leaf_node_row_view(node, cell_num), where)){
+                cell_num++;
+                continue;
+            }
+
+            if (!removed){
+                pager_mark_dirty(pager, cursor.page_num);
+                removed = true;
+            }
+
+            if (removed_rows != NULL){
+                deserialize_row(leaf_node_row_view(node, cell_num), &removed_rows[num_removed++]);
+            }
+
+            leaf_node_remove(node, cell_num);
+        }
+
+        if (removed){
+            node_rebalance(table, cursor.page_num, (uint32_t) key);
+        }
+
+        cursor_close(&cursor);
+        pager_unlatch_all(pager);
+
+        for (uint32_t i = 0; i < num_removed; i++){
+            index_remove_row(table, &removed_rows[i]);
+            table_statement_checkpoint(pager);
+        }
+
+        num_removed = 0;
+        table_statement_checkpoint(pager);
+        key = (int64_t) bound + 1;
+    }
+
+    free(removed_rows);
+
+    return EXECUTE_SUCCESS;
+}
+
+void update_row(Statement* statement, Row* row){
+    if (statement->set_username){
+        strcpy(row->username, statement->row.username);
+    }
+
+    if (statement->set_email){
+        strcpy(row->email, statement->row.email);
+    }
+}
+
+ExecuteResult execute_update(Statement* statement, Table* table){
+    /* Rewrite matching rows in place, leaf by leaf like execute_delete().
+       A row that grows is rewritten in its slot while the leaf has room;
+       one that no longer fits is reinserted, splitting the leaf */
+    Pager* pager = table->pager;
+    const Predicate* where = &(statement->where);
+    int64_t key = where->id_low;
+
+    /* Each updated row of the current leaf before and after, to apply to
+       the indexes once the leaf is done with */
+    Row* updated_rows = NULL;
+    uint32_t num_updated = 0;
+
+    if (table_has_indexes(table)){
+        updated_rows = malloc(2 * (LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_SLOT_SIZE) * sizeof(Row));
+    }
+
+    while (key <= where->id_high){
+        uint32_t bound;
+        Cursor cursor;
+        table_descend(table, (uint32_t) key, LATCH_EXCLUSIVE, LEAF_NODE_MAX_VALUE_SIZE, &bound, &cursor);
+        void* node = cursor_node(&cursor);
+        key = (int64_t) bound + 1;
+
+        for (uint32_t i = cursor.cell_num; i < *leaf_node_num_cells(node) && *leaf_node_key(node, i) <= where->id_high; i++){
+            RowView view = leaf_node_row_view(node, i);
+
+            if (!row_matches(view, where)){
+                continue;
+            }
+
+            Row row;
+            deserialize_row(view, &row);
+
+            if (updated_rows != NULL){
+                updated_rows[2 * num_updated] = row;
+            }
+
+            update_row(statement, &row);
+
+            if (updated_rows != NULL){
+                updated_rows[2 * num_updated + 1] = row;
+                num_updated++;
+            }
+
+            uint32_t old_length = *leaf_node_value_length(node, i);
+            uint32_t length = row_value_size(&row);
+            pager_mark_dirty(pager, cursor.page_num);
+
+            if (length <= old_length){
+                serialize_row(&row, leaf_node_value(node, i));
+                *leaf_node_value_length(node, i) = length;
+                *leaf_node_fragmented(node) += old_length - length;
+            } else if (leaf_node_free_space(node) + old_length >= length){
+                leaf_node_remove(node, i);
+                serialize_row(&row, leaf_node_allocate(node, i, row.id, length));
+            } else {
+                /* The descent may have let go of the ancestors a split
+                   needs, so descend again for this row's size */
+                cursor_close(&cursor);
+                pager_unlatch_all(pager);
+                table_descend(table, row.id, LATCH_EXCLUSIVE, length, NULL, &cursor);
+                node = cursor_node(&cursor);
+                pager_mark_dirty(pager, cursor.page_num);
+                leaf_node_remove(node, cursor.cell_num);
+                leaf_node_insert(&cursor, row.id, &row);
+                key = (int64_t) row.id + 1;
+                break;
+            }
+        }
+
+        cursor_close(&cursor);
+        pager_unlatch_all(pager);
+
+        for (uint32_t i = 0; i < num_updated; i++){
+            index_update_row(table, &updated_rows[2 * i], &updated_rows[2 * i + 1]);
+            table_statement_checkpoint(pager);
+        }
+
+        num_updated = 0;
+        table_statement_checkpoint(pager);
+    }
+
+    free(updated_rows);
+
+    return EXECUTE_SUCCESS;
+}
+
+/* Secondary indexes
+   An index is a tree of its own in the same file, built from the same
+   leaf and internal nodes as the table. Keys are 32 bits, so a leaf cell
+   is keyed by a hash of the column value and holds the ids of the rows
+   with that hash. Values that share a hash share a cell, and lookups
+   check every row they fetch. Once more rows share a hash than a cell
+   can name, the cell keeps INDEX_MAX_IDS of them and, in one more word,
+   the first page of a chain of overflow pages holding the rest.
+
+   An overflow page is a leaf outside the tree, keyed by row id with
+   empty values, and the chain is linked through the leaves' next leaf
+   pointers. New ids go into the first page, and a fresh page goes in
+   front once that one is full. Files written before chains existed may
+   hold an empty cell instead, saturated for good, and lookups of its
+   hash fall back to a scan */
+
+uint32_t index_key(const char* value){
+    /* 32-bit FNV-1a */
+    uint32_t hash = 2166136261u;
+
+    for (; *value != 0; value++){
+        hash = (hash ^ (uint8_t) *value) * 16777619u;
+    }
+
+    return hash;
+}
+
+const char* row_column_value(Row* row, Column column){
+    return column == COLUMN_USERNAME ? row->username : row->email;
+}
+
+bool index_exists(Table* index){
+    return index->root_page_num != INVALID_PAGE_NUM;
+}
+
+bool table_has_indexes(Table* table){
+    for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++){
+        if (index_exists(table->indexes[i])){
+            return true;
+        }
+    }
+
+    return false;
+}
+
+uint32_t index_overflow_add(Pager* pager, uint32_t head_page_num, uint32_t id){
+    /* Add id to the overflow chain starting at head_page_num, which may be
+       INVALID_PAGE_NUM for a chain yet to start. Returns the chain's first
+       page, which is a new one when the old first page was full. Only the
+       serialized writer touches the chain, and readers copy its pages out
+       at their snapshot, so it takes no latches */
+    if (head_page_num != INVALID_PAGE_NUM){
+        void* page = get_page(pager, head_page_num);
+
+        if (leaf_node_free_space(page) >= LEAF_NODE_SLOT_SIZE){
+            uint32_t cell_num = key_lower_bound(leaf_node_keys(page), *leaf_node_num_cells(page), id);
+            pager_mark_dirty(pager, head_page_num);
+            leaf_node_allocate(page, cell_num, id, 0);
+            return head_page_num;
+        }
+    }
+
+    uint32_t page_num = get_unused_page_num(pager);
+    void* page = get_page(pager, page_num);
+    pager_mark_dirty(pager, page_num);
+    init_leaf_node(page);
+    *leaf_node_next_leaf(page) = head_page_num;
+    leaf_node_allocate(page, 0, id, 0);
+
+    return page_num;
+}
+
+void index_overflow_remove(Pager* pager, uint32_t link_page_num, uint32_t* link, uint32_t cell_num){
+    /* Take cell cell_num out of the overflow page *link points to, and the
+       page out of its chain once it is empty. link lies in link_page_num:
+       the index leaf holding the cell, or the page before in the chain */
+    uint32_t page_num = *link;
+    void* page = get_page(pager, page_num);
+    pager_mark_dirty(pager, page_num);
+    leaf_node_remove(page, cell_num);
+
+    if (*leaf_node_num_cells(page) == 0){
+        pager_mark_dirty(pager, link_page_num);
+        *link = *leaf_node_next_leaf(page);
+        pager_free_page(pager, page_num);
+    }
+}
+
+void index_add(Table* index, uint32_t key, uint32_t id){
+    /* Add id to the cell for key, creating the cell if needed. Called with
+       no latches held, and lets go of its own before returning */
+    Pager* pager = index->pager;
+    Cursor cursor;
+    table_descend(index, key, LATCH_EXCLUSIVE, LEAF_NODE_MAX_VALUE_SIZE, NULL, &cursor);
+    void* node = cursor_node(&cursor);
+    uint32_t cell_num = cursor.cell_num;
+
+    if (cell_num < *leaf_node_num_cells(node) && *leaf_node_key(node, cell_num) == key){
+        uint32_t length = *leaf_node_value_length(node, cell_num);
+        uint32_t ids[INDEX_MAX_IDS + 1];
+
+        if (length == INDEX_OVERFLOW_LENGTH){
+            uint32_t* head = (uint32_t*) leaf_node_value(node, cell_num) + INDEX_MAX_IDS;
+            uint32_t head_page_num = index_overflow_add(pager, *head, id);
+
+            if (head_page_num != *head){
+                pager_mark_dirty(pager, cursor.page_num);
+                *head = head_page_num;
+            }
+        } else if (length > 0){
+            memcpy(ids, leaf_node_value(node, cell_num), length);
+
+            /* A full cell starts a chain, growing by the word naming it */
+            if (length == INDEX_MAX_IDS * sizeof(uint32_t)){
+                ids[INDEX_MAX_IDS] = index_overflow_add(pager, INVALID_PAGE_NUM, id);
+            } else {
+                ids[length / sizeof(uint32_t)] = id;
+            }
+
+            length += sizeof(uint32_t);
+
+            /* The descent kept the ancestors whenever the longer cell might
+               not fit, so the leaf can split */
+            pager_mark_dirty(pager, cursor.page_num);
+            leaf_node_remove(node, cell_num);
+            leaf_node_insert_value(&cursor, key, ids, length);
+        }
+    } else {
+        leaf_node_insert_value(&cursor, key, &id, sizeof(uint32_t));
+    }
+
+    cursor_close(&cursor);
+    pager_unlatch_all(pager);
+}
+
+void index_remove(Table* index, uint32_t key, uint32_t id){
+    /* Take id out of the cell for key, removing the cell with the last id.
+       An id leaving a cell with a chain is replaced by one from the chain,
+       and the cell drops the chain's word once the chain is empty. A
+       saturated cell stays as it is */
+    Pager* pager = index->pager;
+    uint32_t bound;
+    Cursor cursor;
+    table_descend_remove(index, key, &bound, &cursor);
+    void* node = cursor_node(&cursor);
+    uint32_t cell_num = cursor.cell_num;
+
+    if (cell_num < *leaf_node_num_cells(node) && *leaf_node_key(node, cell_num) == key){
+        uint32_t length = *leaf_node_value_length(node, cell_num);
+        bool chained = length == INDEX_OVERFLOW_LENGTH;
+        uint32_t num_ids = chained ? INDEX_MAX_IDS : length / sizeof(uint32_t);
+        uint32_t* ids = leaf_node_value(node, cell_num);
+        uint32_t* head = ids + INDEX_MAX_IDS;
+        uint32_t i = 0;
+
+        while (i < num_ids && ids[i] != id){
+            i++;
+        }
+
+        if (i < num_ids){
+            pager_mark_dirty(pager, cursor.page_num);
+        }
+
+        if (i < num_ids && chained){
+            void* page = get_page(pager, *head);
+            uint32_t last = *leaf_node_num_cells(page) - 1;
+            ids[i] = *leaf_node_key(page, last);
+            index_overflow_remove(pager, cursor.page_num, head, last);
+        } else if (i < num_ids && num_ids == 1){
+            leaf_node_remove(node, cell_num);
+            node_rebalance(index, cursor.page_num, key);
+        } else if (i < num_ids){
+            ids[i] = ids[num_ids - 1];
+            *leaf_node_value_length(node, cell_num) = length - sizeof(uint32_t);
+            *leaf_node_fragmented(node) += sizeof(uint32_t);
+        } else if (chained){
+            /* Not in the cell: look along the chain */
+            uint32_t link_page_num = cursor.page_num;
+            uint32_t* link = head;
+
+            while (*link != INVALID_PAGE_NUM){
+                void* page = get_page(pager, *link);
+                uint32_t num_cells = *leaf_node_num_cells(page);
+                uint32_t found = key_lower_bound(leaf_node_keys(page), num_cells, id);
+
+                if (found < num_cells && *leaf_node_key(page, found) == id){
+                    index_overflow_remove(pager, link_page_num, link, found);
+                    break;
+                }
+
+                link_page_num = *link;
+                link = leaf_node_next_leaf(page);
+            }
+        }
+
+        if (chained && *head == INVALID_PAGE_NUM){
+            pager_mark_dirty(pager, cursor.page_num);
+            *leaf_node_value_length(node, cell_num) = INDEX_MAX_IDS * sizeof(uint32_t);
+            *leaf_node_fragmented(node) += sizeof(uint32_t);
+        }
+    }
+
+    cursor_close(&cursor);
+    pager_unlatch_all(pager);
+}
+
+/* Index maintenance for a row stored in, taken out of or changed in the
+   table. The caller holds no latches, since each index descent lets go
+   of every latch but its own */
+void index_add_row(Table* table, Row* row){
+    for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++){
+        if (index_exists(table->indexes[i])){
+            index_add(table->indexes[i], index_key(row_column_value(row, COLUMN_USERNAME + i)), row->id);
+        }
+    }
+}
+
+void index_remove_row(Table* table, Row* row){
+    for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++){
+        if (index_exists(table->indexes[i])){
+            index_remove(table->indexes[i], index_key(row_column_value(row, COLUMN_USERNAME + i)), row->id);
+        }
+    }
+}
+
+void index_update_row(Table* table, Row* old_row, Row* new_row){
+    for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++){
+        const char* old_value = row_column_value(old_row, COLUMN_USERNAME + i);
+        const char* new_value = row_column_value(new_row, COLUMN_USERNAME + i);
+
+        if (index_exists(table->indexes[i]) && strcmp(old_value, new_value) != 0){
+            index_remove(table->indexes[i], index_key(old_value), old_row->id);
+            index_add(table->indexes[i], index_key(new_value), new_row->id);
+        }
+    }
+}
+
+void index_populate(Table* table, Column column){
+    /* Add every row of the table to one index, walking the leaves. Each
+       row may dirty an index leaf of its own, so the statement checkpoints
+       after every row and fetches the table leaf again */
+    Pager* pager = table->pager;
+    Table* index = table->indexes[column - COLUMN_USERNAME];
+    Cursor cursor;
+    table_find(table, 0, &cursor);
+    uint32_t page_num = cursor.page_num;
+    cursor_close(&cursor);
+
+    while (page_num != INVALID_PAGE_NUM){
+        void* node = get_page(pager, page_num);
+
+        for (uint32_t i = 0; i < *leaf_node_num_cells(node); i++){
+            RowView view = leaf_node_row_view(node, i);
+            const char* value = column == COLUMN_USERNAME ? row_view_username(view) : row_view_email(view);
+            index_add(index, index_key(value), row_view_id(view));
+            table_statement_checkpoint(pager);
+            node = get_page(pager, page_num);
+        }
+
+        page_num = *leaf_node_next_leaf(node);
+        table_statement_checkpoint(pager);
+    }
+}
+
+void index_populate_all(Table* table){
+    for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++){
+        if (index_exists(table->indexes[i])){
+            index_populate(table, COLUMN_USERNAME + i);
+        }
+    }
+}
+
+ExecuteResult execute_create_index(Statement* statement, Table* table){
+    /* Build the index from the table, and only then record its root in
+       the header, which is where readers look for it */
+    Pager* pager = table->pager;
+    Column column = statement->index_column;
+    Table* index = table->indexes[column - COLUMN_USERNAME];
+
+    if (index_exists(index)){
+        return EXECUTE_INDEX_EXISTS;
+    }
+
+    uint32_t root_page_num = get_unused_page_num(pager);
+    void* root = get_page(pager, root_page_num);
+    pager_mark_dirty(pager, root_page_num);
+    init_leaf_node(root);
+    set_node_root(root, true);
+
+    index->root_page_num = root_page_num;
+    index->rightmost_leaf = INVALID_PAGE_NUM;
+    index->path_length = 0;
+    index_populate(table, column);
+
+    void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+    pager_mark_dirty(pager, DB_HEADER_PAGE_NUM);
+    *db_header_index_root(header, column) = root_page_num;
+    *db_header_schema_version(header) += 1;
+
+    return EXECUTE_SUCCESS;
+}
+
+/* Bulk loading
+   Rows arrive in key order and are packed into leaves left to right. Each
+   finished node is pushed into the open node one level up, so the tree
+   grows bottom-up without any descents or splits */
+
+#define BULK_LOAD_MAX_LEVELS 32
+#define BULK_LOAD_SORT_ROWS (1 << 16)
+
+typedef struct BulkLoader_Struct {
+    Table* table;
+    uint32_t leaf_fill;
+    uint32_t internal_fill;
+    uint32_t leaf_page_num;
+    uint32_t num_levels;
+    uint32_t level_page_num[BULK_LOAD_MAX_LEVELS];
+    uint32_t level_max_key[BULK_LOAD_MAX_LEVELS];
+    uint32_t last_key;
+    uint64_t num_rows;
+} BulkLoader;
+
+ExecuteResult bulk_load_begin(BulkLoader* loader, Table* table, uint32_t fill_percent){
+    void* root = get_page(table->pager, table->root_page_num);
+
+    if (get_node_type(root) != NODE_LEAF || *leaf_node_num_cells(root) != 0){
+        return EXECUTE_TABLE_NOT_EMPTY;
+    }
+
+    if (fill_percent == 0 || fill_percent > 100){
+        fill_percent = 100;
+    }
+
+    loader->table = table;
+    loader->leaf_fill = LEAF_NODE_SPACE_FOR_CELLS * fill_percent / 100;
+    loader->internal_fill = INTERNAL_NODE_MAX_CELLS * fill_percent / 100;
+    loader->leaf_fill = loader->leaf_fill ? loader->leaf_fill : 1;
+    loader->internal_fill = loader->internal_fill ? loader->internal_fill : 1;
+    loader->leaf_page_num = INVALID_PAGE_NUM;
+    loader->num_levels = 0;
+    loader->last_key = 0;
+    loader->num_rows = 0;
+
+    return EXECUTE_SUCCESS;
+}
+
+void bulk_load_push(BulkLoader* loader, uint32_t level, uint32_t child_page_num, uint32_t child_max_key){
+    /* Append a finished child to the open internal node at this level,
+       closing that node and starting a new one once it is full */
+    Pager* pager = loader->table->pager;
+
+    if (level == loader->num_levels){
+        if (level == BULK_LOAD_MAX_LEVELS){
+            printf("Bulk load tree is too deep.\n");
+            exit(0);
+        }
+
+        uint32_t page_num = get_unused_page_num(pager);
+        void* node = get_page(pager, page_num);
+        pager_mark_dirty(pager, page_num);
+        init_internal_node(node);
+        loader->level_page_num[level] = page_num;
+        loader->num_levels += 1;
+    }
+
+    void* node = get_page(pager, loader->level_page_num[level]);
+    pager_mark_dirty(pager, loader->level_page_num[level]);
+
+    if (*internal_node_right_child(node) != INVALID_PAGE_NUM){
+        uint32_t num_keys = *internal_node_num_keys(node);
+
+        if (num_keys >= loader->internal_fill){
+            bulk_load_push(loader, level + 1, loader->level_page_num[level], loader->level_max_key[level]);
+
+            uint32_t page_num = get_unused_page_num(pager);
+            node = get_page(pager, page_num);
+            pager_mark_dirty(pager, page_num);
+            init_internal_node(node);
+            loader->level_page_num[level] = page_num;
+        } else {
+            *internal_node_num_keys(node) = num_keys + 1;
+            *internal_node_child(node, num_keys) = *internal_node_right_child(node);
+            *internal_node_key(node, num_keys) = loader->level_max_key[level];
+        }
+    }
+
+    *internal_node_right_child(node) = child_page_num;
+    loader->level_max_key[level] = child_max_key;
+}
+
+ExecuteResult bulk_load_add(BulkLoader* loader, Row* row){
+    Pager* pager = loader->table->pager;
+
+    if (loader->num_rows > 0 && row->id <= loader->last_key){
+        return row->id == loader->last_key ? EXECUTE_DUPLICATE_KEY : EXECUTE_UNSORTED;
+    }
+
+    void* leaf = NULL;
+
+    if (loader->leaf_page_num != INVALID_PAGE_NUM){
+        leaf = get_page(pager, loader->leaf_page_num);
+    }
+
+    /* Leaves fill by bytes: start a new one once this row would take the
+       leaf past its fill target, or would not fit at all */
+    uint32_t cost = LEAF_NODE_SLOT_SIZE + row_value_size(row);
+
+    if (leaf == NULL || (*leaf_node_num_cells(leaf) > 0 &&
+        (LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(leaf) + cost > loader->leaf_fill ||
+         leaf_node_free_space(leaf) < cost))){
+        uint32_t page_num = get_unused_page_num(pager);
+        void* new_leaf = get_page(pager, page_num);
+        pager_mark_dirty(pager, page_num);
+        init_leaf_node(new_leaf);
+
+        if (leaf != NULL){
+            *leaf_node_next_leaf(leaf) = page_num;
+            bulk_load_push(loader, 0, loader->leaf_page_num, loader->last_key);
+
+            /* Only the open node on each level is needed from here on.
+               Spill what has been built so far once it would crowd the
+               pool, so finished pages become evictable while the load
+               stays one uncommitted write */
+            pager_spill(pager);
+            pager_release_pins(pager);
+            new_leaf = get_page(pager, page_num);
+        }
+
+        loader->leaf_page_num = page_num;
+        leaf = new_leaf;
+    }
+
+    pager_mark_dirty(pager, loader->leaf_page_num);
+    uint32_t cell_num = *leaf_node_num_cells(leaf);
+    serialize_row(row, leaf_node_allocate(leaf, cell_num, row->id, row_value_size(row)));
+
+    loader->last_key = row->id;
+    loader->num_rows += 1;
+
+    return EXECUTE_SUCCESS;
+}
+
+void bulk_load_finish(BulkLoader* loader){
+    /* Close the open node on every level, then move the single node left
+       at the top into the root page */
+    Table* table = loader->table;
+    Pager* pager = table->pager;
+
+    if (loader->num_rows == 0){
+        return;
+    }
+
+    uint32_t top_page_num = loader->leaf_page_num;
+
+    if (loader->num_levels > 0){
+        bulk_load_push(loader, 0, loader->leaf_page_num, loader->last_key);
+
+        for (uint32_t level = 0; level + 1 < loader->num_levels; level++){
+            bulk_load_push(loader, level + 1, loader->level_page_num[level], loader->level_max_key[level]);
+        }
+
+        top_page_num = loader->level_page_num[loader->num_levels - 1];
+    }
+
+    table->rightmost_leaf = INVALID_PAGE_NUM;
+    table->path_length = 0;
+
+    /* Readers see the empty root until the whole tree appears at once */
+    void* top = get_page(pager, top_page_num);
+    void* root = pager_latch(pager, table->root_page_num, true);
+    pager_mark_dirty(pager, table->root_page_num);
+    memcpy(root, top, PAGE_SIZE);
+    set_node_root(root, true);
+    pager_unlatch_all(pager);
+
+    /* The top node now lives in the root page */
+    pager_free_page(pager, top_page_num);
+
+    index_populate_all(table);
+}
+
+void bulk_load_free_node(BulkLoader* loader, uint32_t page_num){
+    /* Free a node the loader built and every node under it. The children
+       are copied out first, since freeing clears the page */
+    Pager* pager = loader->table->pager;
+    void* node = get_page(pager, page_num);
+    uint32_t num_children = 0;
+    uint32_t* children = NULL;
+
+    if (get_node_type(node) == NODE_INTERNAL){
+        num_children = *internal_node_num_keys(node) + 1;
+        children = malloc(num_children * sizeof(uint32_t));
+
+        for (uint32_t i = 0; i < num_children; i++){
+            children[i] = *internal_node_child(node, i);
+        }
+    }
+
+    pager_free_page(pager, page_num);
+    pager_spill(pager);
+    pager_release_pins(pager);
+
+    for (uint32_t i = 0; i < num_children; i++){
+        bulk_load_free_node(loader, children[i]);
+    }
+
+    free(children);
+}
+
+void bulk_load_abort(BulkLoader* loader){
+    /* Give back every page a failed load allocated, including those
+       already spilled by bulk_load_add. Each closed node
+       hangs under the open node one level up, so freeing the open node on
+       every level and the open leaf reaches them all. The caller commits,
+       as after a load that succeeds */
+    for (uint32_t level = 0; level < loader->num_levels; level++){
+        bulk_load_free_node(loader, loader->level_page_num[level]);
+    }
+
+    if (loader->leaf_page_num != INVALID_PAGE_NUM){
+        bulk_load_free_node(loader, loader->leaf_page_num);
+    }
+}
+
+int compare_rows_by_id(const void* a, const void* b){
+    uint32_t id_a = ((const Row*) a)->id;
+    uint32_t id_b = ((const Row*) b)->id;
+
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+ExecuteResult table_bulk_load(Table* table, Row* rows, uint32_t num_rows, uint32_t fill_percent){
+    /* Load an in-memory batch into an empty table, sorting it first. It
+       commits as one write, the way execute_statement() runs a statement */
+    BulkLoader loader;
+    pthread_mutex_lock(&table->lock);
+    ExecuteResult result = bulk_load_begin(&loader, table, fill_percent);
+
+    if (result == EXECUTE_SUCCESS){
+        qsort(rows, num_rows, sizeof(Row), compare_rows_by_id);
+
+        for (uint32_t i = 0; i < num_rows && result == EXECUTE_SUCCESS; i++){
+            result = bulk_load_add(&loader, &rows[i]);
+        }
+
+        if (result == EXECUTE_SUCCESS){
+            bulk_load_finish(&loader);
+        } else {
+            bulk_load_abort(&loader);
+        }
+    }
+
+    uint64_t commit_lsn = pager_commit(table->pager);
+    pager_release_pins(table->pager);
+    pthread_mutex_unlock(&table->lock);
+
+    if (commit_lsn != 0){
+        wal_wait_durable(table->pager->wal, commit_lsn);
+    }
+
+    return result;
+}
+
+typedef struct SortRun_Struct {
+    FILE* file;
+    Row row;
+} SortRun;
+
+bool sort_run_next(SortRun* run){
+    return fread(&(run->row), sizeof(Row), 1, run->file) == 1;
+}
+
+void sort_heap_sift_down(SortRun** heap, uint32_t size, uint32_t i){
+    while (true){
+        uint32_t smallest = i;
+        uint32_t left = 2 * i + 1;
+        uint32_t right = 2 * i + 2;
+
+        if (left < size && heap[left]->row.id < heap[smallest]->row.id){
+            smallest = left;
+        }
+
+        if (right < size && heap[right]->row.id < heap[smallest]->row.id){
+            smallest = right;
+        }
+
+        if (smallest == i){
+            return;
+        }
+
+        SortRun* tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+ExecuteResult bulk_load_merge_runs(BulkLoader* loader, SortRun* runs, uint32_t num_runs){
+    /* k-way merge of the sorted runs with a min-heap keyed on id */
+    SortRun** heap = malloc(num_runs * sizeof(SortRun*));
+    uint32_t size = 0;
+    ExecuteResult result = EXECUTE_SUCCESS;
+
+    for (uint32_t i = 0; i < num_runs; i++){
+        rewind(runs[i].file);
+
+        if (sort_run_next(&runs[i])){
+            heap[size++] = &runs[i];
+        }
+    }
+
+    for (int32_t i = (int32_t) size / 2 - 1; i >= 0; i--){
+        sort_heap_sift_down(heap, size, i);
+    }
+
+    while (size > 0 && result == EXECUTE_SUCCESS){
+        result = bulk_load_add(loader, &(heap[0]->row));
+
+        if (!sort_run_next(heap[0])){
+            heap[0] = heap[--size];
+        }
+
+        sort_heap_sift_down(heap, size, 0);
+    }
+
+    free(heap);
+
+    return result;
+}
+
+ExecuteResult prepare_load_line(char* line, Row* row){
+    line[strcspn(line, "\r\n")] = 0;
+
+    char* save;
+    char* id_string = strtok_r(line, " ", &save);
+    char* username = strtok_r(NULL, " ", &save);
+    char* email = strtok_r(NULL, " ", &save);
+
+    return prepare_row(id_string, username, email, row) == PREPARE_SUCCESS ? EXECUTE_SUCCESS : EXECUTE_INVALID_ROW;
+}
+
+ExecuteResult load_file(Table* table, FILE* input, uint32_t fill_percent, uint64_t* num_loaded){
+    /* Load "id username email" lines. Input that is already in key order is
+       streamed straight into the tree; anything else is sorted first, in
+       memory when it fits in BULK_LOAD_SORT_ROWS rows and through sorted
+       runs in temporary files otherwise */
+    BulkLoader loader;
+    ExecuteResult result = bulk_load_begin(&loader, table, fill_percent);
+
+    if (result != EXECUTE_SUCCESS){
+        return result;
+    }
+
+    char* line = NULL;
+    size_t line_capacity = 0;
+    Row row;
+    bool sorted = true;
+    bool first = true;
+    uint32_t last_id = 0;
+
+    while (getline(&line, &line_capacity, input) > 0 && result == EXECUTE_SUCCESS){
+        result = prepare_load_line(line, &row);
+
+        if (!first && row.id <= last_id){
+            sorted = false;
+        }
+
+        first = false;
+        last_id = row.id;
+    }
+
+    rewind(input);
+
+    if (result != EXECUTE_SUCCESS){
+        free(line);
+        return result;
+    }
+
+    Row* buffer = sorted ? NULL : malloc(BULK_LOAD_SORT_ROWS * sizeof(Row));
+    uint32_t buffered = 0;
+    SortRun* runs = NULL;
+    uint32_t num_runs = 0;
+
+    while (getline(&line, &line_capacity, input) > 0 && result == EXECUTE_SUCCESS){
+        prepare_load_line(line, &row);
+
+        if (sorted){
+            result = bulk_load_add(&loader, &row);
+            continue;
+        }
+
+        buffer[buffered++] = row;
+
+        if (buffered == BULK_LOAD_SORT_ROWS){
+            qsort(buffer, buffered, sizeof(Row), compare_rows_by_id);
+            runs = realloc(runs, (num_runs + 1) * sizeof(SortRun));
+            runs[num_runs].file = tmpfile();
+
+            if (runs[num_runs].file == NULL || fwrite(buffer, sizeof(Row), buffered, runs[num_runs].file) != buffered){
+                printf("Error writing sort run.\n");
+                exit(0);
+            }
+
+            num_runs += 1;
+            buffered = 0;
+        }
+    }
+
+    if (!sorted){
+        qsort(buffer, buffered, sizeof(Row), compare_rows_by_id);
+
+        if (num_runs == 0){
+            for (uint32_t i = 0; i < buffered && result == EXECUTE_SUCCESS; i++){
+                result = bulk_load_add(&loader, &buffer[i]);
+            }
+        } else {
+            runs = realloc(runs, (num_runs + 1) * sizeof(SortRun));
+            runs[num_runs].file = tmpfile();
+
+            if (runs[num_runs].file == NULL || fwrite(buffer, sizeof(Row), buffered, runs[num_runs].file) != buffered){
+                printf("Error writing sort run.\n");
+                exit(0);
+            }
+
+            num_runs += 1;
+            result = bulk_load_merge_runs(&loader, runs, num_runs);
+        }
+    }
+
+    for (uint32_t i = 0; i < num_runs; i++){
+        fclose(runs[i].file);
+    }
+
+    free(runs);
+    free(buffer);
+    free(line);
+
+    if (result == EXECUTE_SUCCESS){
+        bulk_load_finish(&loader);
+        *num_loaded = loader.num_rows;
+    } else {
+        bulk_load_abort(&loader);
+    }
+
+    return result;
+}
+
+/* Batch execution
+   A select runs as a pipeline over batches of rows. The scan takes the
+   cells of a leaf that fall in the id range, finding the end of the range
+   with the vector key search instead of comparing row by row, and loads
+   them as an array of ids and an array of pointers to the values. The
+   filter narrows a batch to the positions of the rows that match the
+   string predicates, and the sink then writes the selected rows out,
+   counts them, or folds their ids into the aggregates of their groups */
+
+#define ROW_BATCH_SIZE 512
+#define SINK_INITIAL_SLOTS 64
+
+typedef struct RowBatch_Struct {
+    uint32_t num_rows;
+    uint32_t ids[ROW_BATCH_SIZE];
+    const char* values[ROW_BATCH_SIZE];
+
+    /* Positions of the rows that passed the filter, in order */
+    uint16_t selected[ROW_BATCH_SIZE];
+    uint32_t num_selected;
+} RowBatch;
+
+typedef struct AggregateGroup_Struct {
+    uint64_t count;
+    uint64_t sum;
+    uint32_t min;
+    uint32_t max;
+
+    /* The grouped username or email */
+    char key[COLUMN_EMAIL_SIZE + 1];
+} AggregateGroup;
+
+typedef struct SelectSink_Struct {
+    const Statement* statement;
+    FILE* output;
+
+    /* Whether batches need the values, or the ids alone will do */
+    bool needs_values;
+
+    /* Rows counted for a lone count(*) */
+    uint64_t count;
+
+    /* Aggregates: a single group without group by, else one per distinct
+       username or email, found through an open addressing table holding
+       group numbers plus one. Grouping on id needs no groups, since every
+       row is a group of its own */
+    AggregateGroup* groups;
+    uint32_t num_groups;
+    uint32_t groups_capacity;
+    uint32_t* slots;
+    uint32_t num_slots;
+} SelectSink;
+
+/* A select handing out its rows one at a time, see select_stream_open() */
+typedef struct SelectStream_Struct {
+    Statement statement;
+    Cursor cursor;
+    uint64_t start;
+
+    /* The cursor is still on the row the last call handed out */
+    bool returned;
+} SelectStream;
+
+bool select_streams_rows(const Statement* statement){
+    /* Whether a select writes each row as the scan reaches it, rather than
+       a result once the scan is over */
+    if (statement->count_only){
+        return false;
+    }
+
+    return !statement->aggregate || (statement->group_by && statement->group_column == COLUMN_ID);
+}
+
+void aggregate_group_init(AggregateGroup* group, uint32_t count, uint32_t id){
+    /* A group over no rows, or over the one row with the id */
+    group->count = count;
+    group->sum = count ? id : 0;
+    group->min = count ? id : UINT32_MAX;
+    group->max = count ? id : 0;
+    group->key[0] = 0;
+}
+
+void aggregate_group_merge(AggregateGroup* dest, const AggregateGroup* src){
+    dest->count += src->count;
+    dest->sum += src->sum;
+    dest->min = src->min < dest->min ? src->min : dest->min;
+    dest->max = src->max > dest->max ? src->max : dest->max;
+}
+
+void row_batch_load(RowBatch* batch, void* node, uint32_t first, uint32_t end, bool values){
+    batch->num_rows = end - first;
+    memcpy(batch->ids, leaf_node_keys(node) + first, batch->num_rows * sizeof(uint32_t));
+
+    if (values){
+        for (uint32_t i = 0; i < batch->num_rows; i++){
+            batch->values[i] = leaf_node_value(node, first + i);
+        }
+    }
+}
+
+void row_batch_filter(RowBatch* batch, const Predicate* where){
+    /* The scan already kept to the id range, so only the strings are left
+       to compare. Every row is written to the selection, and the count
+       only moves past those that match */
+    uint32_t num_selected = 0;
+
+    if (!where->match_username && !where->match_email){
+        for (uint32_t i = 0; i < batch->num_rows; i++){
+            batch->selected[i] = i;
+        }
+
+        batch->num_selected = batch->num_rows;
+        return;
+    }
+
+    for (uint32_t i = 0; i < batch->num_rows; i++){
+        RowView view = { batch->ids[i], batch->values[i] };
+        batch->selected[num_selected] = i;
+        num_selected += row_matches(view, where);
+    }
+
+    batch->num_selected = num_selected;
+}
+
+void select_sink_init(SelectSink* sink, const Statement* statement, FILE* output){
+    const Predicate* where = &(statement->where);
+
+    sink->statement = statement;
+    sink->output = output;
+    sink->needs_values = where->match_username || where->match_email || select_streams_rows(statement) ||
+                         (statement->group_by && statement->group_column != COLUMN_ID);
+    sink->count = 0;
+    sink->groups = NULL;
+    sink->num_groups = 0;
+    sink->groups_capacity = 0;
+    sink->slots = NULL;
+    sink->num_slots = 0;
+
+    if (statement->aggregate && !statement->group_by){
+        sink->groups = malloc(sizeof(AggregateGroup));
+        sink->num_groups = sink->groups_capacity = 1;
+        aggregate_group_init(&(sink->groups[0]), 0, 0);
+    }
+}
+
+void select_sink_free(SelectSink* sink){
+    free(sink->groups);
+    free(sink->slots);
+}
+
+AggregateGroup* select_sink_group(SelectSink* sink, const char* key){
+    /* Find the group of a username or email, adding it if it is new */
+    if (2 * (sink->num_groups + 1) > sink->num_slots){
+        uint32_t num_slots = sink->num_slots == 0 ? SINK_INITIAL_SLOTS : 2 * sink->num_slots;
+        free(sink->slots);
+        sink->slots = calloc(num_slots, sizeof(uint32_t));
+        sink->num_slots = num_slots;
+
+        for (uint32_t i = 0; i < sink->num_groups; i++){
+            uint32_t slot = index_key(sink->groups[i].key) & (num_slots - 1);
+
+            while (sink->slots[slot] != 0){
+                slot = (slot + 1) & (num_slots - 1);
+            }
+
+            sink->slots[slot] = i + 1;
+        }
+    }
+
+    uint32_t slot = index_key(key) & (sink->num_slots - 1);
+
+    while (sink->slots[slot] != 0){
+        AggregateGroup* group = &(sink->groups[sink->slots[slot] - 1]);
+
+        if (strcmp(group->key, key) == 0){
+            return group;
+        }
+
+        slot = (slot + 1) & (sink->num_slots - 1);
+    }
+
+    if (sink->num_groups == sink->groups_capacity){
+        sink->groups_capacity = sink->groups_capacity == 0 ? SINK_INITIAL_SLOTS : 2 * sink->groups_capacity;
+        sink->groups = realloc(sink->groups, sink->groups_capacity * sizeof(AggregateGroup));
+    }
+
+    AggregateGroup* group = &(sink->groups[sink->num_groups++]);
+    aggregate_group_init(group, 0, 0);
+    strcpy(group->key, key);
+    sink->slots[slot] = sink->num_groups;
+
+    return group;
+}
+
+void write_aggregate_row(FILE* out, const Statement* statement, const AggregateGroup* group, uint32_t id){
+    /* Write one group's row: the grouped column, which is id when grouping
+       on it and the group's key otherwise, and the aggregates. Over no
+       rows min, max and sum are NULL, sent as all ones on the wire */
+    bool text = statement->format == OUTPUT_TEXT;
+
+    if (text){
+        putc('(', out);
+    }
+
+    for (uint32_t i = 0; i < statement->num_columns; i++){
+        uint64_t value = 0;
+        bool null = false;
+
+        if (text && i > 0){
+            fputs(", ", out);
+        }
+
+        switch (statement->aggregates[i]){
+            case (AGGREGATE_NONE):
+                if (statement->columns[i] == COLUMN_ID && text){
+                    fprintf(out, "%d", id);
+                } else if (statement->columns[i] == COLUMN_ID){
+                    wire_put_u32(out, id);
+                } else if (text){
+                    fputs(group->key, out);
+                } else {
+                    wire_put_string(out, group->key);
+                }
+
+                continue;
+            case (AGGREGATE_COUNT):
+                value = group->count;
+                break;
+            case (AGGREGATE_MIN):
+                value = group->min;
+                null = group->count == 0;
+                break;
+            case (AGGREGATE_MAX):
+                value = group->max;
+                null = group->count == 0;
+                break;
+            case (AGGREGATE_SUM):
+                value = group->sum;
+                null = group->count == 0;
+                break;
+        }
+
+        if (!text){
+            wire_put_u64(out, null ? UINT64_MAX : value);
+        } else if (null){
+            fputs("NULL", out);
+        } else {
+            fprintf(out, "%llu", (unsigned long long) value);
+        }
+    }
+
+    if (text){
+        fputs(")\n", out);
+    }
+}
+
+void select_sink_consume(SelectSink* sink, const RowBatch* batch){
+    const Statement* statement = sink->statement;
+    uint32_t num_selected = batch->num_selected;
+
+    if (statement->count_only){
+        sink->count += num_selected;
+        return;
+    }
+
+    if (!statement->aggregate){
+        for (uint32_t i = 0; i < num_selected; i++){
+            uint32_t row = batch->selected[i];
+            RowView view = { batch->ids[row], batch->values[row] };
+            write_row_view(sink->output, statement->format, view, statement->columns, statement->num_columns);
+        }
+
+        return;
+    }
+
+    if (statement->group_by && statement->group_column == COLUMN_ID){
+        for (uint32_t i = 0; i < num_selected; i++){
+            uint32_t id = batch->ids[batch->selected[i]];
+            AggregateGroup group;
+            aggregate_group_init(&group, 1, id);
+            write_aggregate_row(sink->output, statement, &group, id);
+        }
+
+        return;
+    }
+
+    if (!statement->group_by){
+        /* Fold the batch's ids in one pass */
+        AggregateGroup* group = &(sink->groups[0]);
+        uint64_t sum = 0;
+        uint32_t min = group->min;
+        uint32_t max = group->max;
+
+        for (uint32_t i = 0; i < num_selected; i++){
+            uint32_t id = batch->ids[batch->selected[i]];
+            sum += id;
+            min = id < min ? id : min;
+            max = id > max ? id : max;
+        }
+
+        group->count += num_selected;
+        group->sum += sum;
+        group->min = min;
+        group->max = max;
+        return;
+    }
+
+    for (uint32_t i = 0; i < num_selected; i++){
+        uint32_t row = batch->selected[i];
+        RowView view = { batch->ids[row], batch->values[row] };
+        const char* key = statement->group_column == COLUMN_USERNAME ? row_view_username(view)
+                                                                       : row_view_email(view);
+        AggregateGroup single;
+        aggregate_group_init(&single, 1, view.id);
+        aggregate_group_merge(select_sink_group(sink, key), &single);
+    }
+}
+
+void select_sink_merge(SelectSink* dest, const SelectSink* src){
+    /* Add to the total what one parallel scan piece held back */
+    const Statement* statement = dest->statement;
+    dest->count += src->count;
+
+    if (!statement->aggregate || select_streams_rows(statement)){
+        return;
+    }
+
+    if (!statement->group_by){
+        aggregate_group_merge(&(dest->groups[0]), &(src->groups[0]));
+        return;
+    }
+
+    for (uint32_t i = 0; i < src->num_groups; i++){
+        aggregate_group_merge(select_sink_group(dest, src->groups[i].key), &(src->groups[i]));
+    }
+}
+
+int compare_groups(const void* a, const void* b){
+    return strcmp(((const AggregateGroup*) a)->key, ((const AggregateGroup*) b)->key);
+}
+
+void select_sink_finish(SelectSink* sink){
+    /* Write out what was held back to the end of the scan, groups in the
+       order of their keys, and free the sink */
+    const Statement* statement = sink->statement;
+
+    if (statement->count_only){
+        write_count(sink->output, statement->format, sink->count);
+    } else if (statement->aggregate && !select_streams_rows(statement) && sink->num_groups > 0){
+        qsort(sink->groups, sink->num_groups, sizeof(AggregateGroup), compare_groups);
+
+        for (uint32_t i = 0; i < sink->num_groups; i++){
+            write_aggregate_row(sink->output, statement, &(sink->groups[i]), 0);
+        }
+    }
+
+    select_sink_free(sink);
+}
+
+void select_scan(SelectSink* sink, Cursor* cursor, uint32_t high){
+    /* Feed the sink the rows from a snapshot cursor on, up to id high, a
+       leaf at a time */
+    Pager* pager = cursor->table->pager;
+    const Predicate* where = &(sink->statement->where);
+    RowBatch batch;
+
+    while (!(cursor->end_of_table)){
+        void* node = cursor->node;
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        uint32_t end = num_cells;
+
+        if (high != UINT32_MAX){
+            end = cursor->cell_num + key_lower_bound(leaf_node_keys(node) + cursor->cell_num,
+                                                     num_cells - cursor->cell_num, high + 1);
+        }
+
+        for (uint32_t first = cursor->cell_num; first < end; first += ROW_BATCH_SIZE){
+            uint32_t last = end - first > ROW_BATCH_SIZE ? first + ROW_BATCH_SIZE : end;
+            row_batch_load(&batch, node, first, last, sink->needs_values);
+            row_batch_filter(&batch, where);
+            select_sink_consume(sink, &batch);
+        }
+
+        if (end < num_cells){
+            break;
+        }
+
+        uint32_t page_num = cursor->page_num;
+        cursor->cell_num = num_cells > 0 ? num_cells - 1 : 0;
+        cursor_advance(cursor);
+
+        /* Let the pool recycle leaves that the scan has moved past */
+        if (cursor->page_num != page_num){
+            pager_release_pins(pager);
+        }
+    }
+}
+
+void select_sink_consume_view(SelectSink* sink, RowView view){
+    /* Feed the sink a single row found by a point lookup */
+    RowBatch batch;
+    batch.num_rows = 1;
+    batch.ids[0] = view.id;
+    batch.values[0] = view.data;
+    row_batch_filter(&batch, &(sink->statement->where));
+    select_sink_consume(sink, &batch);
+}
+
+/* Parallel scans
+   The id range is cut at separator keys near the top of the tree, and
+   worker threads claim the pieces in turn, each with its own cursor on one
+   shared snapshot. A piece's rows are buffered until it is done, then
+   written out in key order, or straight away for unordered statements */
+
+#define SCAN_PARTITIONS_PER_THREAD 4
+#define SCAN_MAX_SPLIT_NODES 4096
+
+typedef struct ScanPartition_Struct {
+    uint32_t low;
+    uint32_t high;
+    SelectSink sink;
+    char* output;
+    size_t output_length;
+    bool done;
+} ScanPartition;
+
+typedef struct ParallelScan_Struct {
+    Table* table;
+    const Statement* statement;
+    uint64_t snapshot;
+    ScanPartition* partitions;
+    uint32_t num_partitions;
+    uint32_t next_partition;
+    uint32_t next_output;
+    pthread_mutex_t output_mutex;
+} ParallelScan;
+
+int compare_keys(const void* a, const void* b){
+    uint32_t key_a = *(const uint32_t*) a;
+    uint32_t key_b = *(const uint32_t*) b;
+
+    return (key_a > key_b) - (key_a < key_b);
+}
+
+uint32_t scan_split_keys(Table* table, uint64_t snapshot, uint32_t wanted, uint32_t* split_keys){
+    /* Collect up to wanted separator keys, evenly spread. Take the keys of
+       the root, then of each level below it until there are enough; the
+       keys of a level include those above it, since a separator is the
+       largest key under its child */
+    Pager* pager = table->pager;
+    void* node = malloc(PAGE_SIZE);
+    uint32_t* level = malloc(sizeof(uint32_t));
+    uint32_t level_size = 1;
+    uint32_t* keys = NULL;
+    uint32_t num_keys = 0;
+
+    level[0] = table->root_page_num;
+
+    while (num_keys < wanted && level_size <= SCAN_MAX_SPLIT_NODES){
+        uint32_t* next_level = NULL;
+        uint32_t next_level_size = 0;
+        uint32_t* level_keys = NULL;
+        uint32_t num_level_keys = 0;
+
+        for (uint32_t i = 0; i < level_size; i++){
+            pager_read_version(pager, level[i], snapshot, node);
+
+            if (get_node_type(node) != NODE_INTERNAL){
+                continue;
+            }
+
+            uint32_t node_keys = *internal_node_num_keys(node);
+            level_keys = realloc(level_keys, (num_level_keys + node_keys) * sizeof(uint32_t));
+            memcpy(level_keys + num_level_keys, internal_node_keys(node), node_keys * INTERNAL_NODE_KEY_SIZE);
+            num_level_keys += node_keys;
+
+            next_level = realloc(next_level, (next_level_size + node_keys + 1) * sizeof(uint32_t));
+
+            for (uint32_t child = 0; child <= node_keys; child++){
+                next_level[next_level_size++] = *internal_node_child(node, child);
+            }
+        }
+
+        pager_release_pins(pager);
+        free(level);
+        level = next_level;
+        level_size = next_level_size;
+
+        if (num_level_keys == 0){
+            free(level_keys);
+            break;
+        }
+
+        free(keys);
+        keys = level_keys;
+        num_keys = num_level_keys;
+    }
+
+    free(level);
+    free(node);
+
+    if (num_keys == 0){
+        return 0;
+    }
+
+    /* A level is in key order, but an internal node's last child has no
+       key of its own, so sort in the separators above it */
+    qsort(keys, num_keys, sizeof(uint32_t), compare_keys);
+
+    uint32_t num_split_keys = num_keys < wanted ? num_keys : wanted;
+
+    for (uint32_t i = 0; i < num_split_keys; i++){
+        split_keys[i] = keys[(uint64_t) i * num_keys / num_split_keys];
+    }
+
+    free(keys);
+
+    return num_split_keys;
+}
+
+void parallel_scan_partition(ParallelScan* scan, uint32_t index){
+    const Statement* statement = scan->statement;
+    ScanPartition* partition = &(scan->partitions[index]);
+    Pager* pager = scan->table->pager;
+    FILE* out = NULL;
+
+    if (select_streams_rows(statement)){
+        out = open_memstream(&(partition->output), &(partition->output_length));
+    }
+
+    select_sink_init(&(partition->sink), statement, out);
+    Cursor cursor;
+    snapshot_seek(scan->table, pager_snapshot_share(pager, scan->snapshot), partition->low, true, &cursor);
+    select_scan(&(partition->sink), &cursor, partition->high);
+    cursor_close(&cursor);
+    pager_release_pins(pager);
+
+    /* Results held back to the end are merged once every piece is done */
+    if (out == NULL){
+        return;
+    }
+
+    fclose(out);
+
+    /* Write out every finished piece the output order has reached */
+    pthread_mutex_lock(&scan->output_mutex);
+    partition->done = true;
+
+    if (statement->unordered){
+        fwrite(partition->output, 1, partition->output_length, statement->output);
+    } else {
+        while (scan->next_output < scan->num_partitions && scan->partitions[scan->next_output].done){
+            ScanPartition* next = &(scan->partitions[scan->next_output++]);
+            fwrite(next->output, 1, next->output_length, statement->output);
+        }
+    }
+
+    pthread_mutex_unlock(&scan->output_mutex);
+}
+
+void* parallel_scan_worker(void* arg){
+    ParallelScan* scan = arg;
+
+    while (1){
+        uint32_t index = __atomic_fetch_add(&scan->next_partition, 1, __ATOMIC_RELAXED);
+
+        if (index >= scan->num_partitions){
+            return NULL;
+        }
+
+        parallel_scan_partition(scan, index);
+    }
+}
+
+ExecuteResult execute_select_parallel(Statement* statement, Table* table){
+    /* Scan the id range with table->scan_threads threads, the calling
+       thread being one of them */
+    const Predicate* where = &(statement->where);
+    Pager* pager = table->pager;
+    uint32_t num_threads = table->scan_threads;
+    uint32_t wanted = num_threads * SCAN_PARTITIONS_PER_THREAD;
+
+    ParallelScan scan;
+    scan.table = table;
+    scan.statement = statement;
+    scan.snapshot = pager_snapshot_begin(pager);
+    scan.next_partition = 0;
+    scan.next_output = 0;
+    pthread_mutex_init(&scan.output_mutex, NULL);
+
+    /* One piece per separator inside the range, plus the last one */
+    uint32_t* split_keys = malloc(wanted * sizeof(uint32_t));
+    uint32_t num_split_keys = scan_split_keys(table, scan.snapshot, wanted, split_keys);
+    scan.partitions = calloc(num_split_keys + 1, sizeof(ScanPartition));
+    scan.num_partitions = 0;
+
+    uint32_t low = (uint32_t) where->id_low;
+
+    for (uint32_t i = 0; i <= num_split_keys; i++){
+        uint32_t high = i < num_split_keys ? split_keys[i] : UINT32_MAX;
+
+        if (high < low){
+            continue;
+        }
+
+        if (high >= where->id_high){
+            high = (uint32_t) where->id_high;
+        }
+
+        ScanPartition* partition = &(scan.partitions[scan.num_partitions++]);
+        partition->low = low;
+        partition->high = high;
+
+        if (high == (uint32_t) where->id_high){
+            break;
+        }
+
+        low = high + 1;
+    }
+
+    free(split_keys);
+
+    pthread_t threads[SCAN_MAX_THREADS];
+    uint32_t num_workers = num_threads - 1;
+
+    if (num_workers > scan.num_partitions - 1){
+        num_workers = scan.num_partitions - 1;
+    }
+
+    fflush(statement->output);
+
+    for (uint32_t i = 0; i < num_workers; i++){
+        pthread_create(&threads[i], NULL, parallel_scan_worker, &scan);
+    }
+
+    parallel_scan_worker(&scan);
+
+    for (uint32_t i = 0; i < num_workers; i++){
+        pthread_join(threads[i], NULL);
+    }
+
+    SelectSink sink;
+    select_sink_init(&sink, statement, statement->output);
+
+    for (uint32_t i = 0; i < scan.num_partitions; i++){
+        select_sink_merge(&sink, &(scan.partitions[i].sink));
+        select_sink_free(&(scan.partitions[i].sink));
+        free(scan.partitions[i].output);
+    }
+
+    select_sink_finish(&sink);
+
+    free(scan.partitions);
+    pthread_mutex_destroy(&scan.output_mutex);
+    pager_snapshot_end(pager, scan.snapshot);
+
+    return EXECUTE_SUCCESS;
+}
+
+Column select_index_column(Pager* pager, uint64_t snapshot, const Predicate* where){
+    /* The column whose index can answer the equalities in where, as the
+       header names indexes at the snapshot, or COLUMN_ID when none can */
+    void* header = malloc(PAGE_SIZE);
+    Column column = COLUMN_ID;
+
+    pager_read_version(pager, DB_HEADER_PAGE_NUM, snapshot, header);
+
+    if (where->match_username && *db_header_index_root(header, COLUMN_USERNAME) != INVALID_PAGE_NUM){
+        column = COLUMN_USERNAME;
+    } else if (where->match_email && *db_header_index_root(header, COLUMN_EMAIL) != INVALID_PAGE_NUM){
+        column = COLUMN_EMAIL;
+    }
+
+    free(header);
+
+    return column;
+}
+
+bool execute_select_indexed(Statement* statement, Table* table){
+    /* Answer an equality on an indexed column through its index: one
+       descent finds the ids under the value's hash, along with any
+       overflow chain, then a point lookup fetches each row, in id order as
+       a scan would print them. Both trees are read at one snapshot, and
+       whether the index exists is read from the header at that snapshot
+       too. Returns false without printing anything when there is no index
+       to use or the hash is saturated */
+    const Predicate* where = &(statement->where);
+    Pager* pager = table->pager;
+    uint64_t snapshot = pager_snapshot_begin(pager);
+    Column column = select_index_column(pager, snapshot, where);
+
+    if (column == COLUMN_ID){
+        pager_snapshot_end(pager, snapshot);
+        return false;
+    }
+
+    uint32_t key = index_key(column == COLUMN_USERNAME ? where->username : where->email);
+    Cursor cursor;
+    snapshot_seek(table->indexes[column - COLUMN_USERNAME], snapshot, key, false, &cursor);
+    uint32_t* ids = malloc(INDEX_MAX_IDS * sizeof(uint32_t));
+    uint32_t num_ids = 0;
+
+    if (!cursor.end_of_table && *leaf_node_key(cursor.node, cursor.cell_num) == key){
+        uint32_t length = *leaf_node_value_length(cursor.node, cursor.cell_num);
+        uint32_t* value = leaf_node_value(cursor.node, cursor.cell_num);
+
+        if (length == 0){
+            free(ids);
+            cursor_close(&cursor);
+            return false;
+        }
+
+        num_ids = length == INDEX_OVERFLOW_LENGTH ? INDEX_MAX_IDS : length / sizeof(uint32_t);
+        memcpy(ids, value, num_ids * sizeof(uint32_t));
+
+        /* The rest of the ids are along the chain, read at the snapshot */
+        if (length == INDEX_OVERFLOW_LENGTH){
+            void* page = malloc(PAGE_SIZE);
+            uint32_t capacity = num_ids;
+
+            for (uint32_t page_num = value[INDEX_MAX_IDS]; page_num != INVALID_PAGE_NUM;
+                 page_num = *leaf_node_next_leaf(page)){
+                pager_read_version(pager, page_num, snapshot, page);
+                uint32_t num_cells = *leaf_node_num_cells(page);
+
+                if (num_ids + num_cells > capacity){
+                    capacity = (num_ids + num_cells) * 2;
+                    ids = realloc(ids, capacity * sizeof(uint32_t));
+                }
+
+                memcpy(ids + num_ids, leaf_node_keys(page), num_cells * sizeof(uint32_t));
+                num_ids += num_cells;
+            }
+
+            free(page);
+        }
+    }
+
+    qsort(ids, num_ids, sizeof(uint32_t), compare_keys);
+    SelectSink sink;
+    select_sink_init(&sink, statement, statement->output);
+
+    for (uint32_t i = 0; i < num_ids; i++){
+        if (ids[i] < where->id_low || ids[i] > where->id_high){
+            continue;
+        }
+
+        Cursor row_cursor;
+        snapshot_seek(table, pager_snapshot_share(pager, snapshot), ids[i], false, &row_cursor);
+
+        if (!row_cursor.end_of_table && *leaf_node_key(row_cursor.node, row_cursor.cell_num) == ids[i]){
+            select_sink_consume_view(&sink, leaf_node_row_view(row_cursor.node, row_cursor.cell_num));
+        }
+
+        cursor_close(&row_cursor);
+        pager_release_pins(pager);
+    }
+
+    free(ids);
+    cursor_close(&cursor);
+    select_sink_finish(&sink);
+
+    return true;
+}
+
+ExecuteResult execute_select(Statement* statement, Table* table){
+    const Predicate* where = &(statement->where);
+
+    if (where->id_low <= where->id_high && (where->match_username || where->match_email) &&
+        execute_select_indexed(statement, table)){
+        return EXECUTE_SUCCESS;
+    }
+
+    /* Point lookups touch one leaf, and mmap mode serializes readers */
+    if (table->scan_threads > 1 && where->id_low < where->id_high && !table->pager->use_mmap){
+        return execute_select_parallel(statement, table);
+    }
+
+    SelectSink sink;
+    select_sink_init(&sink, statement, statement->output);
+
+    /* Seek to the low end of the id range and stop past the high end,
+       so a range costs one descent plus the leaves it covers. The scan
+       reads a snapshot, so it neither waits for nor holds up the writer */
+    if (where->id_low <= where->id_high){
+        Cursor cursor;
+        table_snapshot_seek(table, (uint32_t)where->id_low, where->id_low != where->id_high, &cursor);
+
+        if (where->id_low != where->id_high){
+            pager_advise(table->pager, MADV_SEQUENTIAL);
+        }
+
+        select_scan(&sink, &cursor, (uint32_t)where->id_high);
+        cursor_close(&cursor);
+    }
+
+    select_sink_finish(&sink);
+
+    return EXECUTE_SUCCESS;
+}
+
+/* Streaming selects
+   A select that writes out rows as a scan reaches them can instead hand
+   them out one at a time, for a prepared statement's steps or a server
+   reply sent in chunks, so no caller has to hold the whole result. The
+   stream keeps a snapshot cursor open between rows, which pins nothing
+   but keeps the snapshot's page versions until the stream is closed */
+
+bool select_stream_open(SelectStream* stream, Table* table, const Statement* statement){
+    /* Start streaming a plain select of rows. Returns false, having done
+       nothing, for a select that is not one to stream: counts and
+       aggregates come out once the scan is over, an index answers its
+       equalities faster than a scan, and mmap mode has no snapshots */
+    Pager* pager = table->pager;
+    const Predicate* where = &(statement->where);
+
+    if (statement->type != STATEMENT_SELECT || statement->count_only || statement->aggregate || pager->use_mmap){
+        return false;
+    }
+
+    uint64_t snapshot = pager_snapshot_begin(pager);
+
+    if ((where->match_username || where->match_email) && select_index_column(pager, snapshot, where) != COLUMN_ID){
+        pager_snapshot_end(pager, snapshot);
+        return false;
+    }
+
+    stream->statement = *statement;
+    stream->start = stats_now();
+    stream->returned = false;
+
+    /* An empty range still opens a cursor, one that is already done */
+    snapshot_seek(table, snapshot, (uint32_t) where->id_low, where->id_low < where->id_high, &(stream->cursor));
+    stream->cursor.end_of_table = stream->cursor.end_of_table || where->id_low > where->id_high;
+    pager_release_pins(pager);
+
+    return true;
+}
+
+bool select_stream_next(SelectStream* stream, RowView* view){
+    /* Find the next row the select matches. The view stays valid until
+       the next call. Returns false once the rows run out */
+    Cursor* cursor = &(stream->cursor);
+    const Predicate* where = &(stream->statement.where);
+    bool found = false;
+
+    if (stream->returned && !cursor->end_of_table){
+        cursor_advance(cursor);
+    }
+
+    while (!cursor->end_of_table && *leaf_node_key(cursor->node, cursor->cell_num) <= where->id_high){
+        RowView row = leaf_node_row_view(cursor->node, cursor->cell_num);
+
+        if (row_matches(row, where)){
+            *view = row;
+            found = true;
+            break;
+        }
+
+        cursor_advance(cursor);
+    }
+
+    stream->returned = found;
+    pager_release_pins(cursor->table->pager);
+
+    return found;
+}
+
+void select_stream_close(SelectStream* stream){
+    cursor_close(&(stream->cursor));
+    stats_count_statement(STATEMENT_SELECT, stats_now() - stream->start);
+}
+
+ExecuteResult execute_statement(Statement* statement, Table* table){
+    /* Readers run concurrently with each other and with the writer,
+       reading snapshots. Without a buffer pool there are no page versions,
+       so in mmap mode every statement is a writer */
+    ExecuteResult result = EXECUTE_SUCCESS;
+    bool writer = statement->type != STATEMENT_SELECT || table->pager->use_mmap;
+    uint64_t commit_lsn = 0;
+    uint64_t start = stats_now();
+
+    if (writer){
+        pthread_mutex_lock(&table->lock);
+    }
+
+    switch (statement->type){
+        case (STATEMENT_INSERT):
+            result = execute_insert(statement, table);
+            break;
+        case (STATEMENT_SELECT):
+            result = execute_select(statement, table);
+            break;
+        case (STATEMENT_DELETE):
+            result = execute_delete(statement, table);
+            break;
+        case (STATEMENT_UPDATE):
+            result = execute_update(statement, table);
+            break;
+        case (STATEMENT_CREATE_INDEX):
+            result = execute_create_index(statement, table);
+            break;
+    }
+
+    pager_unlatch_all(table->pager);
+
+    if (writer){
+        commit_lsn = pager_commit(table->pager);
+    }
+
+    pager_release_pins(table->pager);
+
+    if (writer){
+        pthread_mutex_unlock(&table->lock);
+    }
+
+    /* Wait for the log outside the lock so that concurrent commits can
+       share a single sync */
+    if (commit_lsn != 0){
+        wal_wait_durable(table->pager->wal, commit_lsn);
+    }
+
+    stats_count_statement(statement->type, stats_now() - start);
+
+    return result;
+}
+
+/* Library API, see db.h */
+
+void db_set_scan_threads(Table* table, uint32_t scan_threads){
+    table->scan_threads = scan_threads;
+}
+
+bool db_get(Table* table, uint32_t id, Row* row){
+    /* A point lookup that skips the parser. Like a select it reads a
+       snapshot, and in mmap mode it takes the writer's lock instead, see
+       execute_statement() */
+    Pager* pager = table->pager;
+    Cursor cursor;
+
+    if (pager->use_mmap){
+        pthread_mutex_lock(&table->lock);
+    }
+
+    table_snapshot_seek(table, id, false, &cursor);
+    bool found = !cursor.end_of_table && *leaf_node_key(cursor.node, cursor.cell_num) == id;
+
+    if (found){
+        deserialize_row(leaf_node_row_view(cursor.node, cursor.cell_num), row);
+    }
+
+    cursor_close(&cursor);
+    pager_release_pins(pager);
+
+    if (pager->use_mmap){
+        pthread_mutex_unlock(&table->lock);
+    }
+
+    return found;
+}
+
+void db_stats(Table* table, DbStats* stats){
+    Pager* pager = table->pager;
+    Wal* wal = pager->wal;
+
+    pthread_mutex_lock(&pager->pool_mutex);
+    stats->pages_read = pager->pages_read;
+    stats->pages_written = pager->pages_written;
+    stats->pool_hits = pager->hits;
+    stats->pool_misses = pager->misses;
+    stats->num_pages = pager->num_pages;
+    pthread_mutex_unlock(&pager->pool_mutex);
+
+    stats->log_frames_written = 0;
+
+    if (wal != NULL){
+        pthread_mutex_lock(&wal->mutex);
+        stats->log_frames_written = wal->frames_written;
+        pthread_mutex_unlock(&wal->mutex);
+    }
+
+    /* The descent to the first leaf counts the internal levels */
+    Cursor cursor;
+
+    if (pager->use_mmap){
+        pthread_mutex_lock(&table->lock);
+    }
+
+    table_snapshot_seek(table, 0, false, &cursor);
+    stats->tree_depth = cursor.depth + 1;
+    cursor_close(&cursor);
+    pager_release_pins(pager);
+
+    if (pager->use_mmap){
+        pthread_mutex_unlock(&table->lock);
+    }
+}
+
+const char* prepare_result_message(PrepareResult result){
+    switch (result){
+        case (PREPARE_SUCCESS):
+            return "Prepared.";
+        case (PREPARE_NEGATIVE_ID):
+            return "ID must be positive.";
+        case (PREPARE_STRING_TOO_LONG):
+            return "String is too long.";
+        case (PREPARE_UNRECOGNIZED):
+            return "Unrecognized keyword at start of statement.";
+        case (PREPARE_SYNTAX_ERROR):
+            return "Syntax error. Could not parse statement.";
+    }
+
+    return "Could not prepare statement.";
+}
+
+const char* execute_result_message(ExecuteResult result){
+    switch (result){
+        case (EXECUTE_SUCCESS):
+            return "Executed.";
+        case (EXECUTE_DUPLICATE_KEY):
+            return "Error: Duplicate key.";
+        case (EXECUTE_TABLE_FULL):
+            return "Error: Table is full.";
+        case (EXECUTE_INDEX_EXISTS):
+            return "Error: Index already exists.";
+        case (EXECUTE_UNBOUND_PARAMETER):
+            return "Error: Parameter not bound.";
+        default:
+            return "Error: Statement failed.";
+    }
+}
+
+ExecuteResult db_execute(Table* table, const char* sql, FILE* output, OutputFormat format,
+                         PrepareResult* prepare_result){
+    /* The parser tokenizes in place, so work on a copy */
+    InputBuffer ib;
+    ib.input_length = strlen(sql);
+    ib.buffer_length = ib.input_length + 1;
+    ib.buffer = malloc(ib.buffer_length);
+    memcpy(ib.buffer, sql, ib.buffer_length);
+
+    Statement statement;
+    *prepare_result = prepare_statement(&ib, &statement);
+    free(ib.buffer);
+
+    if (*prepare_result != PREPARE_SUCCESS){
+        return EXECUTE_PREPARE_FAILED;
+    }
+
+    statement.output = output;
+    statement.format = format;
+
+    ExecuteResult result = execute_statement(&statement, table);
+    free(statement.rows);
+
+    return result;
+}
+
+/* Prepared statements
+   The plan is the parsed statement with its placeholders left as they
+   were written. A run copies it, fills in the bound values and executes
+   the copy. A select of rows streams them, one step finding the next,
+   see select_stream_open(). Any other select, answered through an index
+   or held back to the end of the scan, leaves its rows wire encoded in
+   memory, and each step decodes the next one */
+
+typedef struct ParamValue_Struct {
+    bool bound;
+    bool is_text;
+    int64_t int_value;
+    char text_value[COLUMN_EMAIL_SIZE + 1];
+} ParamValue;
+
+struct PreparedStatement_Struct {
+    Table* table;
+    Statement plan;
+    ParamValue values[MAX_STATEMENT_PARAMS];
+
+    /* The current run, streaming or written out in full */
+    bool started;
+    ExecuteResult result;
+    bool streaming;
+    SelectStream stream;
+    char* output;
+    size_t output_length;
+    size_t output_offset;
+
+    /* The row the last step stopped at, with any aggregates by column */
+    Row row;
+    uint64_t count;
+    uint64_t aggregates[MAX_PROJECTED_COLUMNS];
+};
+
+PreparedStatement* db_prepare(Table* table, const char* sql, PrepareResult* prepare_result){
+    InputBuffer ib;
+    ib.input_length = strlen(sql);
+    ib.buffer_length = ib.input_length + 1;
+    ib.buffer = malloc(ib.buffer_length);
+    memcpy(ib.buffer, sql, ib.buffer_length);
+
+    PreparedStatement* stmt = calloc(1, sizeof(PreparedStatement));
+    *prepare_result = prepare_statement_params(&ib, &(stmt->plan));
+    free(ib.buffer);
+
+    if (*prepare_result != PREPARE_SUCCESS){
+        free(stmt->plan.rows);
+        free(stmt);
+        return NULL;
+    }
+
+    stmt->table = table;
+
+    return stmt;
+}
+
+uint32_t db_param_count(PreparedStatement* stmt){
+    return stmt->plan.num_params;
+}
+
+bool param_is_text(ParamTarget target){
+    return target != PARAM_ID_EQUAL && target != PARAM_ID_ABOVE && target != PARAM_ID_AT_LEAST &&
+           target != PARAM_ID_BELOW && target != PARAM_ID_AT_MOST && target != PARAM_ROW_ID;
+}
+
+PrepareResult db_bind_int(PreparedStatement* stmt, uint32_t index, int64_t value){
+    if (index >= stmt->plan.num_params || param_is_text(stmt->plan.params[index].target)){
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (value < 0){
+        return PREPARE_NEGATIVE_ID;
+    }
+
+    if (value > UINT32_MAX){
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    stmt->values[index].bound = true;
+    stmt->values[index].is_text = false;
+    stmt->values[index].int_value = value;
+
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult db_bind_text(PreparedStatement* stmt, uint32_t index, const char* value){
+    if (index >= stmt->plan.num_params || !param_is_text(stmt->plan.params[index].target)){
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    ParamTarget target = stmt->plan.params[index].target;
+    bool username = target == PARAM_WHERE_USERNAME || target == PARAM_SET_USERNAME ||
+                    target == PARAM_ROW_USERNAME;
+
+    if (strlen(value) > (username ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE)){
+        return PREPARE_STRING_TOO_LONG;
+    }
+
+    stmt->values[index].bound = true;
+    stmt->values[index].is_text = true;
+    strcpy(stmt->values[index].text_value, value);
+
+    return PREPARE_SUCCESS;
+}
+
+void predicate_restrict_id(Predicate* where, int64_t low, int64_t high){
+    where->id_low = low > where->id_low ? low : where->id_low;
+    where->id_high = high < where->id_high ? high : where->id_high;
+}
+
+void bind_statement(PreparedStatement* stmt, Statement* statement){
+    /* Copy the plan, giving the run its own rows, and fill in the values */
+    *statement = stmt->plan;
+
+    if (stmt->plan.rows != NULL){
+        statement->rows = malloc(stmt->plan.num_rows * sizeof(Row));
+        memcpy(statement->rows, stmt->plan.rows, stmt->plan.num_rows * sizeof(Row));
+    }
+
+    for (uint32_t i = 0; i < stmt->plan.num_params; i++){
+        StatementParam* param = &(stmt->plan.params[i]);
+        int64_t value = stmt->values[i].int_value;
+        const char* text = stmt->values[i].text_value;
+        Row* row = param->row == UINT32_MAX ? &(statement->row) : &(statement->rows[param->row]);
+
+        switch (param->target){
+            case (PARAM_ID_EQUAL):
+                predicate_restrict_id(&(statement->where), value, value);
+                break;
+            case (PARAM_ID_ABOVE):
+                predicate_restrict_id(&(statement->where), value + 1, UINT32_MAX);
+                break;
+            case (PARAM_ID_AT_LEAST):
+                predicate_restrict_id(&(statement->where), value, UINT32_MAX);
+                break;
+            case (PARAM_ID_BELOW):
+                predicate_restrict_id(&(statement->where), 0, value - 1);
+                break;
+            case (PARAM_ID_AT_MOST):
+                predicate_restrict_id(&(statement->where), 0, value);
+                break;
+            case (PARAM_WHERE_USERNAME):
+                predicate_restrict_string(&(statement->where), &(statement->where.match_username),
+                                          statement->where.username, text);
+                break;
+            case (PARAM_WHERE_EMAIL):
+                predicate_restrict_string(&(statement->where), &(statement->where.match_email),
+                                          statement->where.email, text);
+                break;
+            case (PARAM_SET_USERNAME):
+                strcpy(statement->row.username, text);
+                break;
+            case (PARAM_SET_EMAIL):
+                strcpy(statement->row.email, text);
+                break;
+            case (PARAM_ROW_ID):
+                row->id = value;
+                break;
+            case (PARAM_ROW_USERNAME):
+                strcpy(row->username, text);
+                break;
+            case (PARAM_ROW_EMAIL):
+                strcpy(row->email, text);
+                break;
+        }
+    }
+}
+
+StepResult db_step(PreparedStatement* stmt){
+    if (!stmt->started){
+        stmt->started = true;
+
+        for (uint32_t i = 0; i < stmt->plan.num_params; i++){
+            if (!stmt->values[i].bound){
+                stmt->result = EXECUTE_UNBOUND_PARAMETER;
+                return STEP_ERROR;
+            }
+        }
+
+        Statement statement;
+        bind_statement(stmt, &statement);
+        FILE* output = NULL;
+
+        if (select_stream_open(&(stmt->stream), stmt->table, &statement)){
+            stmt->streaming = true;
+            stmt->result = EXECUTE_SUCCESS;
+        } else if (statement.type == STATEMENT_SELECT){
+            output = open_memstream(&stmt->output, &stmt->output_length);
+            statement.output = output;
+            statement.format = OUTPUT_WIRE;
+        }
+
+        if (!stmt->streaming){
+            stmt->result = execute_statement(&statement, stmt->table);
+        }
+
+        free(statement.rows);
+
+        if (output != NULL){
+            fclose(output);
+        }
+    }
+
+    if (stmt->result != EXECUTE_SUCCESS){
+        return STEP_ERROR;
+    }
+
+    if (stmt->streaming){
+        RowView view;
+
+        if (select_stream_next(&(stmt->stream), &view)){
+            deserialize_row(view, &(stmt->row));
+            return STEP_ROW;
+        }
+
+        select_stream_close(&(stmt->stream));
+        stmt->streaming = false;
+    }
+
+    if (stmt->output == NULL || stmt->output_offset == stmt->output_length){
+        return STEP_DONE;
+    }
+
+    /* Decode the next row as write_row_view() or write_count() encoded it */
+    const char* data = stmt->output + stmt->output_offset;
+
+    if (stmt->plan.count_only){
+        stmt->count = wire_get_u32(data) | ((uint64_t) wire_get_u32(data + sizeof(uint32_t)) << 32);
+        stmt->output_offset += sizeof(uint64_t);
+        return STEP_ROW;
+    }
 
-                    indent(indentation_level + 1);
-                    printf("- key %d\n", *internal_node_key(node, i));
-                }
+    for (uint32_t i = 0; i < stmt->plan.num_columns; i++){
+        if (stmt->plan.aggregates[i] != AGGREGATE_NONE){
+            stmt->aggregates[i] = wire_get_u32(data) | ((uint64_t) wire_get_u32(data + sizeof(uint32_t)) << 32);
+            data += sizeof(uint64_t);
+            continue;
+        }
 
-                child = *internal_node_right_child(node);
-                print_tree(pager, child, indentation_level + 1);
-            }
+        if (stmt->plan.columns[i] == COLUMN_ID){
+            stmt->row.id = wire_get_u32(data);
+            data += sizeof(uint32_t);
+            continue;
+        }
 
-            break;
+        char* dest = stmt->plan.columns[i] == COLUMN_USERNAME ? stmt->row.username : stmt->row.email;
+        const uint8_t* b = (const uint8_t*) data;
+        uint16_t length = b[0] | (b[1] << 8);
+        memcpy(dest, data + 2, length);
+        dest[length] = 0;
+        data += 2 + length;
     }
+
+    stmt->output_offset = data - stmt->output;
+
+    return STEP_ROW;
 }
 
-MetaCommandResult perform_meta_command(InputBuffer* ib, Table* table){
-    if (strcmp(ib->buffer, ".exit") == 0){
-        db_close(table);
-        exit(0);
-    } else if (strcmp(ib->buffer, ".btree") == 0){
-        print_tree(table->pager, 0, 0);
-        return META_COMMAND_SUCCESS;
-    } else if (strcmp(ib->buffer, ".constants") == 0){
-        print_constants();
-        return META_COMMAND_SUCCESS;
-    } else {
-        return META_COMMAND_UNRECOGNIZED;
-    }
+ExecuteResult db_statement_result(PreparedStatement* stmt){
+    return stmt->result;
 }
 
-PrepareResult prepare_insert(InputBuffer* ib, Statement* statement){
-    statement->type = STATEMENT_INSERT;
+uint32_t db_column_count(PreparedStatement* stmt){
+    return stmt->plan.count_only ? 1 : stmt->plan.num_columns;
+}
 
-    char* keyword = strtok(ib->buffer, " ");
-    char* id_string = strtok(NULL, " ");
-    char* username = strtok(NULL, " ");
-    char* email = strtok(NULL, " ");
+int64_t db_column_int(PreparedStatement* stmt, uint32_t index){
+    if (stmt->plan.count_only){
+        return index == 0 ? (int64_t)stmt->count : 0;
+    }
 
-    if (id_string == NULL || username == NULL || email == NULL){
-        return PREPARE_SYNTAX_ERROR;
+    if (index >= stmt->plan.num_columns){
+        return 0;
     }
 
-    int id = atoi(id_string);
+    if (stmt->plan.aggregates[index] != AGGREGATE_NONE){
+        return (int64_t) stmt->aggregates[index];
+    }
 
-    if (id < 0){
-        return PREPARE_NEGATIVE_ID;
+    return stmt->plan.columns[index] == COLUMN_ID ? stmt->row.id : 0;
+}
+
+const char* db_column_text(PreparedStatement* stmt, uint32_t index){
+    if (stmt->plan.count_only || index >= stmt->plan.num_columns || stmt->plan.aggregates[index] != AGGREGATE_NONE){
+        return NULL;
     }
 
-    if (strlen(username) > COLUMN_USERNAME_SIZE){
-        return PREPARE_STRING_TOO_LONG;
+    switch (stmt->plan.columns[index]){
+        case (COLUMN_USERNAME):
+            return stmt->row.username;
+        case (COLUMN_EMAIL):
+            return stmt->row.email;
+        default:
+            return NULL;
     }
+}
 
-    if (strlen(email) > COLUMN_EMAIL_SIZE){
-        return PREPARE_STRING_TOO_LONG;
+void db_reset(PreparedStatement* stmt){
+    if (stmt->streaming){
+        select_stream_close(&(stmt->stream));
+        stmt->streaming = false;
     }
 
-    statement->row.id = id;
-    strcpy(statement->row.username, username);
-    strcpy(statement->row.email, email);
+    free(stmt->output);
+    stmt->output = NULL;
+    stmt->output_length = 0;
+    stmt->output_offset = 0;
+    stmt->started = false;
+    stmt->result = EXECUTE_SUCCESS;
+}
 
-    return PREPARE_SUCCESS;
+void db_finalize(PreparedStatement* stmt){
+    if (stmt == NULL){
+        return;
+    }
+
+    db_reset(stmt);
+    free(stmt->plan.rows);
+    free(stmt);
 }
 
-PrepareResult prepare_statement(InputBuffer* ib, Statement* statement){
-    if (strncmp(ib->buffer, "insert", 6) == 0){
-        return prepare_insert(ib, statement);
+/* Server
+   One thread runs an epoll loop over nonblocking sockets. Requests are
+   handled in arrival order as soon as they are complete, and every reply
+   to what one read brought in goes out in as few writes as the socket
+   takes, so a client that pipelines pays for the round trip once. A
+   connection whose replies pile up is not read from until they drain.
+   A select of rows goes out in chunks as the socket takes them, its
+   stream kept open on the connection in between, and the requests after
+   it wait until its last chunk is out */
+
+#define SERVER_MAX_EVENTS 64
+#define SERVER_READ_SIZE 65536
+#define SERVER_MAX_PENDING_OUTPUT (4u << 20)
+#define SERVER_CHUNK_SIZE 65536
+
+typedef struct Connection_Struct {
+    int fd;
+
+    /* Bytes received and not yet handled */
+    char* input;
+    size_t input_length;
+    size_t input_capacity;
+
+    /* Replies not yet sent, from output_sent up to output_length */
+    char* output;
+    size_t output_length;
+    size_t output_sent;
+    size_t output_capacity;
+
+    /* The select whose rows are still going out, or NULL */
+    SelectStream* stream;
+
+    /* The client has finished sending, or the connection failed */
+    bool end_of_input;
+    bool failed;
+    bool want_write;
+} Connection;
+
+volatile sig_atomic_t server_stop = 0;
+/* Written by the signal handler and watched by the event loop, so a stop
+   that lands between checking server_stop and waiting still wakes it */
+int server_wake_fd = -1;
+
+void server_on_signal(int signal_number){
+    (void) signal_number;
+    int saved_errno = errno;
+    uint64_t one = 1;
+
+    server_stop = 1;
+
+    if (write(server_wake_fd, &one, sizeof(one)) == -1){
+        /* No server is waiting, or it has been woken already */
     }
 
-    if (strcmp(ib->buffer, "select") == 0){
-        statement->type = STATEMENT_SELECT;
+    errno = saved_errno;
+}
 
-        return PREPARE_SUCCESS;
+void buffer_reserve(char** buffer, size_t* capacity, size_t needed){
+    if (needed <= *capacity){
+        return;
     }
 
-    return PREPARE_UNRECOGNIZED;
+    size_t new_capacity = *capacity ? *capacity : 4096;
+
+    while (new_capacity < needed){
+        new_capacity *= 2;
+    }
+
+    *buffer = realloc(*buffer, new_capacity);
+    *capacity = new_capacity;
 }
 
-uint32_t get_unused_page_num(Pager* pager){
-    uint32_t unused = pager->num_pages;
-    pager->num_pages += 1;
-    return unused;
+void connection_reply(Connection* connection, uint8_t status, const char* body, size_t body_length){
+    size_t length = 4 + 1 + body_length;
+    buffer_reserve(&(connection->output), &(connection->output_capacity), connection->output_length + length);
+
+    uint32_t payload_length = 1 + body_length;
+    uint8_t header[5] = { payload_length, payload_length >> 8, payload_length >> 16, payload_length >> 24, status };
+    char* dest = connection->output + connection->output_length;
+    memcpy(dest, header, sizeof(header));
+    memcpy(dest + sizeof(header), body, body_length);
+    connection->output_length += length;
 }
 
-void create_new_root(Table* table, uint32_t right_child_page_num){
-    /* Handle splitting the root
-       Old root is copied to the new page and becomes the left child
-       Address of the right child is passed in 
-       Re-initialize root page to contain the new root node
-       New root node points to two children */
-    void* root = get_page(table->pager, table->root_page_num);
-    void* right_child = get_page(table->pager, right_child_page_num);
-    uint32_t left_child_page_num = get_unused_page_num(table->pager);
-    void* left_child = get_page(table->pager, left_child_page_num);
+void connection_reply_error(Connection* connection, const char* message){
+    connection_reply(connection, DB_STATUS_ERROR, message, strlen(message));
+}
+
+bool wire_get_string(const char** cursor, const char* end, char* dest, size_t max_length){
+    /* Copy a NUL terminated string out of a request, failing when it runs
+       past the end or is longer than the column */
+    const char* nul = memchr(*cursor, 0, end - *cursor);
 
-    if (get_node_type(root) == NODE_INTERNAL){
-        init_internal_node(right_child);
-        init_internal_node(left_child);
+    if (nul == NULL || (size_t) (nul - *cursor) > max_length){
+        return false;
     }
 
-    /* Left child has data copied from old root */
-    memcpy(left_child, root, PAGE_SIZE);
-    set_node_root(left_child, false);
+    memcpy(dest, *cursor, nul - *cursor + 1);
+    *cursor = nul + 1;
+
+    return true;
+}
+
+void connection_stream_rows(Connection* connection){
+    /* Reply with the open select's rows a chunk at a time while the output
+       has room, closing the stream after its last chunk */
+    SelectStream* stream = connection->stream;
+    const Statement* statement = &(stream->statement);
 
-    if (get_node_type(left_child) == NODE_INTERNAL){
-        void* child;
+    while (connection->output_length - connection->output_sent < SERVER_MAX_PENDING_OUTPUT){
+        char* body = NULL;
+        size_t body_length = 0;
+        FILE* out = open_memstream(&body, &body_length);
+        RowView view;
+        bool more = true;
 
-        for (int i = 0; i < *internal_node_num_keys(left_child); i++){
-            child = get_page(table->pager, *internal_node_child(left_child, i));
-            *node_parent(child) = left_child_page_num;    
+        while (more && ftell(out) < SERVER_CHUNK_SIZE){
+            more = select_stream_next(stream, &view);
+
+            if (more){
+                write_row_view(out, OUTPUT_WIRE, view, statement->columns, statement->num_columns);
+            }
         }
-    }
 
-    /* Root node is a new internal node with one key and two children */
-    init_internal_node(root);
-    set_node_root(root, true);
-    *internal_node_num_keys(root) = 1;
-    *internal_node_child(root, 0) = left_child_page_num;
-    uint32_t left_child_max_key = get_node_max_key(table->pager, left_child);
-    *internal_node_key(root, 0) = left_child_max_key;
-    *internal_node_right_child(root) = right_child_page_num;
-    *node_parent(left_child) = table->root_page_num;
-    *node_parent(right_child) =table->root_page_num;
-}
-
-void internal_node_split_and_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num) {
-  uint32_t old_page_num = parent_page_num;
-  void* old_node = get_page(table->pager,parent_page_num);
-  uint32_t old_max = get_node_max_key(table->pager, old_node);
-
-  void* child = get_page(table->pager, child_page_num); 
-  uint32_t child_max = get_node_max_key(table->pager, child);
-  uint32_t new_page_num = get_unused_page_num(table->pager);
-  uint32_t splitting_root = is_node_root(old_node);
-
-  void* parent;
-  void* new_node;
-  if (splitting_root) {
-    create_new_root(table, new_page_num);
-    parent = get_page(table->pager,table->root_page_num);
-
-    /* If we are splitting the root, we need to update old_node to point
-    to the new root's left child, new_page_num will already point to
-    the new root's right child */
-    old_page_num = *internal_node_child(parent,0);
-    old_node = get_page(table->pager, old_page_num);
-  } else {
-    parent = get_page(table->pager,*node_parent(old_node));
-    new_node = get_page(table->pager, new_page_num);
-    init_internal_node(new_node);
-  }
-  
-  uint32_t* old_num_keys = internal_node_num_keys(old_node);
+        fclose(out);
+        connection_reply(connection, more ? DB_STATUS_ROWS : DB_STATUS_OK, body, body_length);
+        free(body);
 
-  uint32_t cur_page_num = *internal_node_right_child(old_node);
-  void* cur = get_page(table->pager, cur_page_num);
+        if (!more){
+            select_stream_close(stream);
+            free(stream);
+            connection->stream = NULL;
+            return;
+        }
+    }
+}
 
-  /* First put right child into new node and set right child of old node to invalid page number */
-  internal_node_insert(table, new_page_num, cur_page_num);
-  *node_parent(cur) = new_page_num;
-  *internal_node_right_child(old_node) = INVALID_PAGE_NUM;
+void server_handle_request(Table* table, Connection* connection, const char* payload, uint32_t length){
+    if (length == 0){
+        connection_reply_error(connection, "Empty request.");
+        return;
+    }
 
-  /* For each key until you get to the middle key, move the key and the child to the new node */
-  for (int i = INTERNAL_NODE_MAX_CELLS - 1; i > INTERNAL_NODE_MAX_CELLS / 2; i--) {
-    cur_page_num = *internal_node_child(old_node, i);
-    cur = get_page(table->pager, cur_page_num);
+    char* body = NULL;
+    size_t body_length = 0;
+    FILE* out = open_memstream(&body, &body_length);
+    ExecuteResult result = EXECUTE_SUCCESS;
+    PrepareResult prepare_result = PREPARE_SUCCESS;
+    const char* end = payload + length;
+    Statement statement;
+
+    switch ((uint8_t) payload[0]){
+        case (DB_OP_QUERY): {
+            /* The parser tokenizes in place, so work on a copy */
+            InputBuffer ib;
+            ib.input_length = length - 1;
+            ib.buffer_length = length;
+            ib.buffer = malloc(length);
+            memcpy(ib.buffer, payload + 1, length - 1);
+            ib.buffer[length - 1] = 0;
+            prepare_result = prepare_statement(&ib, &statement);
+            free(ib.buffer);
+
+            if (prepare_result != PREPARE_SUCCESS){
+                break;
+            }
 
-    internal_node_insert(table, new_page_num, cur_page_num);
-    *node_parent(cur) = new_page_num;
+            SelectStream* stream = malloc(sizeof(SelectStream));
 
-    (*old_num_keys)--;
-  }
+            if (select_stream_open(stream, table, &statement)){
+                connection->stream = stream;
+            } else {
+                free(stream);
+                statement.output = out;
+                statement.format = OUTPUT_WIRE;
+                result = execute_statement(&statement, table);
+            }
 
-  /* Set child before middle key, which is now the highest key, to be node's right child, and decrement number of keys */
-  *internal_node_right_child(old_node) = *internal_node_child(old_node,*old_num_keys - 1);
-  (*old_num_keys)--;
+            free(statement.rows);
+            break;
+        }
+        case (DB_OP_GET):
+            if (length != 1 + sizeof(uint32_t)){
+                prepare_result = PREPARE_SYNTAX_ERROR;
+                break;
+            }
 
-  /* Determine which of the two nodes after the split should contain the child to be inserted, and insert the child */
-  uint32_t max_after_split = get_node_max_key(table->pager, old_node);
+            memset(&statement, 0, sizeof(Statement));
+            statement.type = STATEMENT_SELECT;
+            statement.where.id_low = statement.where.id_high = wire_get_u32(payload + 1);
+            statement.columns[0] = COLUMN_ID;
+            statement.columns[1] = COLUMN_USERNAME;
+            statement.columns[2] = COLUMN_EMAIL;
+            statement.num_columns = 3;
+            statement.output = out;
+            statement.format = OUTPUT_WIRE;
+            result = execute_statement(&statement, table);
+            break;
+        case (DB_OP_INSERT): {
+            const char* cursor = payload + 1 + sizeof(uint32_t);
+
+            memset(&statement, 0, sizeof(Statement));
+            statement.type = STATEMENT_INSERT;
+
+            if (length < 1 + sizeof(uint32_t)){
+                prepare_result = PREPARE_SYNTAX_ERROR;
+            } else if (!wire_get_string(&cursor, end, statement.row.username, COLUMN_USERNAME_SIZE) ||
+                       !wire_get_string(&cursor, end, statement.row.email, COLUMN_EMAIL_SIZE) || cursor != end){
+                prepare_result = PREPARE_STRING_TOO_LONG;
+            } else {
+                statement.row.id = wire_get_u32(payload + 1);
+                result = execute_statement(&statement, table);
+            }
 
-  uint32_t destination_page_num = child_max < max_after_split ? old_page_num : new_page_num;
+            break;
+        }
+        default: {
+            /* A protocol error rather than a statement's, so say which */
+            char message[64];
+            snprintf(message, sizeof(message), "Unknown request opcode %u.", (uint8_t) payload[0]);
+            fclose(out);
+            free(body);
+            connection_reply_error(connection, message);
+            return;
+        }
+    }
 
-  internal_node_insert(table, destination_page_num, child_page_num);
-  *node_parent(child) = destination_page_num;
+    fclose(out);
 
-  update_internal_node_key(parent, old_max, get_node_max_key(table->pager, old_node));
+    if (connection->stream != NULL){
+        connection_stream_rows(connection);
+    } else if (prepare_result != PREPARE_SUCCESS){
+        connection_reply_error(connection, prepare_result_message(prepare_result));
+    } else if (result != EXECUTE_SUCCESS){
+        connection_reply_error(connection, execute_result_message(result));
+    } else {
+        connection_reply(connection, DB_STATUS_OK, body, body_length);
+    }
 
-  if (!splitting_root) {
-    internal_node_insert(table,*node_parent(old_node),new_page_num);
-    *node_parent(new_node) = *node_parent(old_node);
-  }
+    free(body);
 }
 
-void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num){
-    /* Add a new child/key pair to parent that corresponds to child*/
+void connection_handle_input(Table* table, Connection* connection){
+    /* Go on with a select's rows, then handle every complete request
+       received so far */
+    size_t offset = 0;
 
-    void* parent = get_page(table->pager, parent_page_num);
-    void* child = get_page(table->pager, child_page_num);
+    if (connection->stream != NULL){
+        connection_stream_rows(connection);
+    }
 
-    uint32_t child_max_key = get_node_max_key(table->pager, child);
-    uint32_t index = internal_node_find_child(parent, child_max_key);
+    while (connection->stream == NULL && connection->input_length - offset >= sizeof(uint32_t) &&
+           connection->output_length - connection->output_sent < SERVER_MAX_PENDING_OUTPUT){
+        uint32_t length = wire_get_u32(connection->input + offset);
 
-    uint32_t original_num_keys = *internal_node_num_keys(parent);
+        if (length > DB_MAX_REQUEST_SIZE){
+            connection->failed = true;
+            break;
+        }
 
-    if (original_num_keys >= INTERNAL_NODE_MAX_CELLS){
-        internal_node_split_and_insert(table, parent_page_num, child_page_num);
-        return;
+        if (connection->input_length - offset - sizeof(uint32_t) < length){
+            break;
+        }
+
+        server_handle_request(table, connection, connection->input + offset + sizeof(uint32_t), length);
+        offset += sizeof(uint32_t) + length;
     }
 
-    uint32_t right_child_page_num = *internal_node_right_child(parent);
+    memmove(connection->input, connection->input + offset, connection->input_length - offset);
+    connection->input_length -= offset;
+}
 
-    /* An internal node with a right child of INVALID_PAGE_NUM is empty */
-    if (right_child_page_num == INVALID_PAGE_NUM){
-        *internal_node_right_child(parent) = child_page_num;
-        *node_parent(child) = parent_page_num;
-        return;
+void connection_read(Connection* connection){
+    /* Read what has arrived, leaving the rest in the socket once a full
+       request's worth is buffered */
+    while (!connection->end_of_input && connection->input_length < DB_MAX_REQUEST_SIZE + sizeof(uint32_t)){
+        buffer_reserve(&(connection->input), &(connection->input_capacity), connection->input_length + SERVER_READ_SIZE);
+        ssize_t bytes = read(connection->fd, connection->input + connection->input_length, SERVER_READ_SIZE);
+
+        if (bytes > 0){
+            connection->input_length += bytes;
+        } else if (bytes == 0){
+            connection->end_of_input = true;
+        } else if (errno != EINTR){
+            if (errno != EAGAIN){
+                connection->failed = true;
+            }
+
+            return;
+        }
     }
+}
 
-    void* right_child = get_page(table->pager, right_child_page_num);
+bool connection_has_request(Connection* connection){
+    return connection->input_length >= sizeof(uint32_t) &&
+           connection->input_length - sizeof(uint32_t) >= wire_get_u32(connection->input);
+}
 
-    /* If we are already at the max number of cells for a node, we cannot increment before 
-       splitting. Incrementing without inserting a new key/child pair and immediately
-       calling internal_node_split_and_insert() has the effect of creating a new key at 
-       (max_cells + 1) with an uninitialized value */
-    *internal_node_num_keys(parent) = original_num_keys + 1;
+void connection_write(Connection* connection){
+    while (connection->output_sent < connection->output_length){
+        ssize_t bytes = send(connection->fd, connection->output + connection->output_sent,
+                             connection->output_length - connection->output_sent, MSG_NOSIGNAL);
 
-    if (child_max_key > get_node_max_key(table->pager, right_child)){
-        *internal_node_child(parent, original_num_keys) = right_child_page_num;
-        *internal_node_key(parent, original_num_keys) = get_node_max_key(table->pager, right_child);
-        *internal_node_right_child(parent) = child_page_num;
-        *node_parent(child) = parent_page_num;
-        *node_parent(right_child) = parent_page_num;
-    } else {
-        for (uint32_t i = original_num_keys; i > index; i--){
-            void* dest = internal_node_cell(parent, i);
-            void* source = internal_node_cell(parent, i - 1);
-            memcpy(dest, source, INTERNAL_NODE_CELL_SIZE);
+        if (bytes < 0){
+            if (errno == EINTR){
+                continue;
+            }
+
+            if (errno != EAGAIN){
+                connection->failed = true;
+            }
+
+            return;
         }
 
-        *internal_node_child(parent, index) = child_page_num;
-        *internal_node_key(parent, index) = child_max_key;
-        *node_parent(child) = parent_page_num;
+        connection->output_sent += bytes;
     }
+
+    connection->output_sent = 0;
+    connection->output_length = 0;
 }
 
-void leaf_node_split_and_insert (Cursor* cursor, uint32_t key, Row* value){
-    /* Create a new node and move half the cells over
-       Insert the new value in one of the two nodes
-       Update parent or create a new paren */
+void connection_close(int epoll_fd, Connection* connection){
+    if (connection->stream != NULL){
+        select_stream_close(connection->stream);
+        free(connection->stream);
+    }
 
-    void* old = get_page(cursor->table->pager, cursor->page_num);
-    uint32_t old_num_cells = *leaf_node_num_cells(old);
-    uint32_t old_max = get_node_max_key(cursor->table->pager, old);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    free(connection->input);
+    free(connection->output);
+    free(connection);
+}
 
-    uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
+void server_accept(int epoll_fd, int listener){
+    while (1){
+        int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
 
-    assert(old_num_cells == LEAF_NODE_MAX_CELLS);
-    assert(cursor->cell_num <= old_num_cells);
+        if (fd == -1){
+            return;
+        }
 
-    void* new = get_page(cursor->table->pager, new_page_num);
-    init_leaf_node(new);
-    *node_parent(new) = *node_parent(old);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
-    *leaf_node_next_leaf(new) = *leaf_node_next_leaf(old);
-    *leaf_node_next_leaf(old) = new_page_num;
+        Connection* connection = calloc(1, sizeof(Connection));
+        connection->fd = fd;
 
-    /* All existing keys plus new key should be divided 
-        evenly betweenthe old and new nodes. Starting from
-        the right, move each key to the correct position */
-    for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--){
-        void* dest_node;
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = connection;
 
-        if (i >= LEAF_NODE_LEFT_SPLIT_COUNT){
-            dest_node = new;
-        } else {
-            dest_node = old;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1){
+            close(fd);
+            free(connection);
         }
+    }
+}
 
-        uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-        void* dest = leaf_node_cell(dest_node, index_within_node);
+int db_serve(Table* table, uint16_t port){
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+
+    if (listener == -1 || bind(listener, (struct sockaddr*) &address, sizeof(address)) == -1 ||
+        listen(listener, SOMAXCONN) == -1){
+        printf("Could not listen on port %d: %s\n", port, strerror(errno));
+        return -1;
+    }
 
-        if (i == cursor->cell_num){
-            serialize_row(value, leaf_node_value(dest_node, index_within_node));
-            *leaf_node_key(dest_node, index_within_node) = key;
-        } else if (i > cursor->cell_num){
-            memmove(dest, leaf_node_cell(old, i - 1), LEAF_NODE_CELL_SIZE);
-        } else {
-            memmove(dest, leaf_node_cell(old, i), LEAF_NODE_CELL_SIZE);
-        }
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener, &event);
+
+    /* The signal may be taken by any thread, the checkpointer's say, so
+       the wait is woken through the eventfd rather than by EINTR */
+    server_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (server_wake_fd == -1){
+        printf("Could not create the server's eventfd: %s\n", strerror(errno));
+        close(epoll_fd);
+        close(listener);
+        return -1;
     }
 
-    /* Update cell count on both leaf nodes */
-    *(leaf_node_num_cells(old)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-    *(leaf_node_num_cells(new)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+    event.data.ptr = &server_wake_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_wake_fd, &event);
 
-    /* Update the nodes' parents. If the original node was the 
-        root, it had no parents. In that case, create a new root
-        node to act as the parent */
-    if (is_node_root(old)){
-        return create_new_root(cursor->table, new_page_num);
-    } else {
-        uint32_t parent_page_num = *node_parent(old);
-        uint32_t new_max = get_node_max_key(cursor->table->pager, old);
-        void* parent = get_page(cursor->table->pager, parent_page_num);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = server_on_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
 
-        update_internal_node_key(parent, old_max, new_max);
-        internal_node_insert(cursor->table, parent_page_num, new_page_num);
-        return;
-    }
-}
+    printf("Listening on port %d.\n", port);
+    fflush(stdout);
 
-void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value){
-    void* node = get_page(cursor->table->pager, cursor->page_num);
+    struct epoll_event events[SERVER_MAX_EVENTS];
 
-    uint32_t num_cells = *leaf_node_num_cells(node);
+    while (!server_stop){
+        int num_events = epoll_wait(epoll_fd, events, SERVER_MAX_EVENTS, -1);
 
-    assert(num_cells <= LEAF_NODE_MAX_CELLS);
-    assert(cursor->cell_num <= num_cells);
+        for (int i = 0; i < num_events; i++){
+            if (events[i].data.ptr == &server_wake_fd){
+                continue;
+            }
 
-    if (num_cells >= LEAF_NODE_MAX_CELLS){
-        leaf_node_split_and_insert(cursor, key, value);
-        return;
-    }
+            Connection* connection = events[i].data.ptr;
 
-    if (cursor->cell_num < num_cells){
-        for (uint32_t i = num_cells; i > cursor->cell_num; i--){
-            memmove(leaf_node_cell(node, i), leaf_node_cell(node, i - 1), LEAF_NODE_CELL_SIZE);
-        }
-    }
+            if (connection == NULL){
+                server_accept(epoll_fd, listener);
+                continue;
+            }
 
-    *(leaf_node_num_cells(node)) += 1;
-    *(leaf_node_key(node, cursor->cell_num))= key;
-    serialize_row(value, leaf_node_value(node, cursor->cell_num));
-}
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+                connection_read(connection);
+            }
 
-ExecuteResult execute_insert(Statement* statement, Table* table){
-    void* node = get_page(table->pager, table->root_page_num);
-    uint32_t num_cells = (*leaf_node_num_cells(node));
+            /* Requests held back while replies piled up, and the rest of a
+               select's rows, are handled as soon as the socket has taken
+               the replies */
+            do {
+                connection_handle_input(table, connection);
+                connection_write(connection);
+            } while (!connection->failed && connection->output_length == 0 &&
+                     (connection->stream != NULL || connection_has_request(connection)));
+
+            if (connection->failed ||
+                (connection->end_of_input && connection->output_length == 0 && connection->stream == NULL)){
+                connection_close(epoll_fd, connection);
+                continue;
+            }
 
-    Row* row = &(statement->row);
-    uint32_t key_to_insert = row->id;
-    Cursor* cursor = table_find(table, key_to_insert);
+            bool want_write = connection->output_length > 0;
 
-    if (cursor->cell_num < num_cells){
-        uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-        if (key_at_index == key_to_insert){
-            return EXECUTE_DUPLICATE_KEY;
+            if (want_write != connection->want_write){
+                event.events = want_write ? EPOLLOUT : EPOLLIN;
+                event.data.ptr = connection;
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+                connection->want_write = want_write;
+            }
         }
     }
 
-    leaf_node_insert(cursor, row->id, row);
+    /* The handler stays installed, keep it off the closed descriptor */
+    int wake_fd = server_wake_fd;
+    server_wake_fd = -1;
+    close(wake_fd);
+    close(epoll_fd);
+    close(listener);
 
-    free(cursor);
-
-    return EXECUTE_SUCCESS;
+    return 0;
 }
 
-ExecuteResult execute_select(Statement* statement, Table* table){
-    Row row;
-    Cursor* cursor = table_start(table);
-    
-    while (!(cursor->end_of_table)){
-        deserialize_row(cursor_value(cursor), &row);
-        print_row(&row);
-        cursor_advance(cursor);
+#ifndef DB_NO_MAIN
+int main(int argc, char* argv[]){
+    char* filename = NULL;
+    PagerOptions options = { .max_frames = PAGER_DEFAULT_MAX_FRAMES, .use_wal = true, .use_uring = true };
+    uint32_t scan_threads = 1;
+    int port = -1;
+
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc){
+            options.max_frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mmap") == 0){
+            options.use_mmap = true;
+            options.use_wal = false;
+        } else if (strcmp(argv[i], "--no-wal") == 0){
+            options.use_wal = false;
+        } else if (strcmp(argv[i], "--no-uring") == 0){
+            options.use_uring = false;
+        } else if (strcmp(argv[i], "--compress") == 0){
+            options.use_compression = true;
+        } else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc){
+            options.page_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--direct") == 0){
+            options.use_direct_io = true;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc){
+            scan_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc){
+            port = atoi(argv[++i]);
+        } else {
+            filename = argv[i];
+        }
     }
 
-    free(cursor);
+    if (filename == NULL){
+        printf("Must supply a database filename.\n");
+        exit(0);
+    }
 
-    return EXECUTE_SUCCESS;
-}
+    if (scan_threads == 0 || scan_threads > SCAN_MAX_THREADS){
+        printf("Thread count must be between 1 and %d.\n", SCAN_MAX_THREADS);
+        exit(0);
+    }
 
-ExecuteResult execute_statement(Statement* statement, Table* table){
-    switch (statement->type){
-        case (STATEMENT_INSERT):
-            return execute_insert(statement, table);
-        case (STATEMENT_SELECT):
-            return execute_select(statement, table);
+    if (port > 65535){
+        printf("Port must be between 0 and 65535.\n");
+        exit(0);
     }
-}
 
-int main(int argc, char* argv[]){
-    if (argc < 2){
-        printf("Must supply a database filename.\n");
+    Table* table = db_open(filename, &options);
+
+    if (table == NULL){
         exit(0);
     }
 
-    char* filename = argv[1];
-    Table* table = db_open(filename);
+    db_set_scan_threads(table, scan_threads);
+
+    if (port >= 0){
+        int status = db_serve(table, port);
+        db_close(table);
+        return status == 0 ? 0 : 1;
+    }
+
     InputBuffer* ib = init_input_buffer();
 
     while (1){
@@ -987,33 +10340,19 @@ int main(int argc, char* argv[]){
 
         Statement statement;
 
-        switch (prepare_statement(ib, &statement)){
-            case (PREPARE_SUCCESS):
-                break;
-            case (PREPARE_NEGATIVE_ID):
-                printf("ID must be positive.\n");
-                continue;
-            case (PREPARE_STRING_TOO_LONG):
-                printf("String is too long.\n");
-                continue;
-            case (PREPARE_SYNTAX_ERROR):
-                printf("Syntax error. Could not parse statement.\n");
-                continue;
-            case (PREPARE_UNRECOGNIZED):
-                printf("Unrecognized keyword at start of '%s'.\n", ib->buffer);
-                continue;
-        }
+        PrepareResult prepare_result = prepare_statement(ib, &statement);
 
-        switch(execute_statement(&statement, table)){
-            case (EXECUTE_SUCCESS):
-                printf("Executed.\n");
-                break;
-            case (EXECUTE_DUPLICATE_KEY):
-                printf("Error: Duplicate key.\n");
-                break;
-            case (EXECUTE_TABLE_FULL):
-                printf("Error: Table is full");
-                break;
+        if (prepare_result == PREPARE_UNRECOGNIZED){
+            printf("Unrecognized keyword at start of '%s'.\n", ib->buffer);
+            continue;
+        } else if (prepare_result != PREPARE_SUCCESS){
+            printf("%s\n", prepare_result_message(prepare_result));
+            continue;
         }
+
+        ExecuteResult result = execute_statement(&statement, table);
+        free(statement.rows);
+        printf("%s\n", execute_result_message(result));
     }
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,299 @@
+/* Tests
+   Each test opens a scratch file through db.h, prints one line when it
+   passes, and the run exits with status 1 at the first failure. Built by
+   make test and run by make check */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "db.h"
+
+#define TEST_FILE "test.db"
+
+#define TEST_ASSERT(condition) \
+    do { \
+        if (!(condition)){ \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+void test_remove_files(){
+    unlink(TEST_FILE);
+    unlink(TEST_FILE "-wal");
+}
+
+PagerOptions test_options(){
+    return (PagerOptions) { .max_frames = PAGER_DEFAULT_MAX_FRAMES, .use_wal = true, .use_uring = true };
+}
+
+Table* test_open_empty(PagerOptions* options){
+    test_remove_files();
+
+    return db_open(TEST_FILE, options);
+}
+
+void test_make_row(uint32_t id, Row* row){
+    row->id = id;
+    sprintf(row->username, "user%u", id);
+    sprintf(row->email, "user%u@example.com", id);
+}
+
+Table* test_open_filled(PagerOptions* options, uint32_t num_rows, void (*make_row)(uint32_t id, Row* row)){
+    /* A fresh database holding ids 1 to num_rows, inserted as one batch */
+    Table* table = test_open_empty(options);
+    Row* rows = malloc(num_rows * sizeof(Row));
+
+    for (uint32_t i = 0; i < num_rows; i++){
+        make_row(i + 1, &rows[i]);
+    }
+
+    TEST_ASSERT(table_insert_batch(table, rows, num_rows) == EXECUTE_SUCCESS);
+    free(rows);
+
+    return table;
+}
+
+void test_execute(Table* table, const char* sql){
+    PrepareResult prepare_result;
+    TEST_ASSERT(db_execute(table, sql, NULL, OUTPUT_TEXT, &prepare_result) == EXECUTE_SUCCESS);
+}
+
+int64_t test_count(Table* table, const char* sql){
+    /* The single value a count(*) returns */
+    PrepareResult prepare_result;
+    PreparedStatement* stmt = db_prepare(table, sql, &prepare_result);
+    TEST_ASSERT(stmt != NULL);
+    TEST_ASSERT(db_step(stmt) == STEP_ROW);
+
+    int64_t count = db_column_int(stmt, 0);
+    TEST_ASSERT(db_step(stmt) == STEP_DONE);
+    db_finalize(stmt);
+
+    return count;
+}
+
+uint64_t test_page_fetches(Table* table){
+    DbStats stats;
+    db_stats(table, &stats);
+
+    return stats.pool_hits + stats.pool_misses;
+}
+
+#define TEST_DUPLICATE_EVERY 1000
+
+void test_make_duplicate_row(uint32_t id, Row* row){
+    test_make_row(id, row);
+
+    if (id % TEST_DUPLICATE_EVERY == 0){
+        strcpy(row->email, "same@example.com");
+    }
+}
+
+void test_index_duplicates(){
+    /* More rows share an email than an index cell names, so the index
+       chains overflow pages for them. Lookups must still find every row
+       through the index, touching far fewer pages than a scan would */
+    const uint32_t num_rows = 200000;
+    const uint32_t every = TEST_DUPLICATE_EVERY;
+    PagerOptions options = test_options();
+    Table* table = test_open_filled(&options, num_rows, test_make_duplicate_row);
+    test_execute(table, "create index on email");
+
+    const char* count_same = "select count(*) where email = same@example.com";
+    DbStats stats;
+    db_stats(table, &stats);
+    uint64_t fetches = test_page_fetches(table);
+
+    TEST_ASSERT(test_count(table, count_same) == num_rows / every);
+    TEST_ASSERT(test_page_fetches(table) - fetches < stats.num_pages / 2);
+
+    /* Take rows out of the cell and the chain alike, then put some back */
+    test_execute(table, "delete where id <= 100000 and email = same@example.com");
+    TEST_ASSERT(test_count(table, count_same) == num_rows / every / 2);
+
+    test_execute(table, "update set email = same@example.com where id > 500 and id <= 520");
+    TEST_ASSERT(test_count(table, count_same) == num_rows / every / 2 + 20);
+
+    db_close(table);
+    table = db_open(TEST_FILE, &options);
+    TEST_ASSERT(test_count(table, count_same) == num_rows / every / 2 + 20);
+
+    test_execute(table, "delete where email = same@example.com");
+    TEST_ASSERT(test_count(table, count_same) == 0);
+    TEST_ASSERT(test_count(table, "select count(*)") == num_rows - num_rows / every - 20);
+
+    db_close(table);
+    test_remove_files();
+    printf("ok test_index_duplicates\n");
+}
+
+void test_prepared_stream(){
+    /* A prepared select reads a row per step rather than the whole result
+       on the first one, and keeps to its snapshot while a write goes in
+       between steps */
+    const uint32_t num_rows = 200000;
+    PagerOptions options = test_options();
+    Table* table = test_open_filled(&options, num_rows, test_make_row);
+
+    PrepareResult prepare_result;
+    PreparedStatement* stmt = db_prepare(table, "select id, username where id > ?", &prepare_result);
+    TEST_ASSERT(stmt != NULL);
+    TEST_ASSERT(db_bind_int(stmt, 0, 10) == PREPARE_SUCCESS);
+
+    DbStats stats;
+    db_stats(table, &stats);
+    uint64_t fetches = test_page_fetches(table);
+
+    TEST_ASSERT(db_step(stmt) == STEP_ROW);
+    TEST_ASSERT(db_column_int(stmt, 0) == 11);
+    TEST_ASSERT(strcmp(db_column_text(stmt, 1), "user11") == 0);
+    TEST_ASSERT(test_page_fetches(table) - fetches < stats.num_pages / 2);
+
+    test_execute(table, "insert 300000 late late@example.com");
+    test_execute(table, "delete where id = 20");
+
+    uint32_t num_stepped = 1;
+    int64_t last_id = 11;
+
+    while (db_step(stmt) == STEP_ROW){
+        TEST_ASSERT(db_column_int(stmt, 0) == last_id + 1);
+        last_id = db_column_int(stmt, 0);
+        num_stepped += 1;
+    }
+
+    TEST_ASSERT(db_statement_result(stmt) == EXECUTE_SUCCESS);
+    TEST_ASSERT(num_stepped == num_rows - 10);
+
+    /* A run left partway is let go of by a reset, and the next run sees
+       the writes */
+    TEST_ASSERT(db_step(stmt) == STEP_DONE);
+    db_reset(stmt);
+    TEST_ASSERT(db_step(stmt) == STEP_ROW);
+    db_reset(stmt);
+    TEST_ASSERT(db_bind_int(stmt, 0, 199999) == PREPARE_SUCCESS);
+    TEST_ASSERT(db_step(stmt) == STEP_ROW);
+    TEST_ASSERT(db_column_int(stmt, 0) == 200000);
+    TEST_ASSERT(db_step(stmt) == STEP_ROW);
+    TEST_ASSERT(db_column_int(stmt, 0) == 300000);
+    TEST_ASSERT(db_step(stmt) == STEP_DONE);
+    db_finalize(stmt);
+
+    db_close(table);
+    test_remove_files();
+    printf("ok test_prepared_stream\n");
+}
+
+void test_check_aggregates(Table* table, const char* sql, int64_t min, int64_t max, int64_t sum){
+    PrepareResult prepare_result;
+    PreparedStatement* stmt = db_prepare(table, sql, &prepare_result);
+    TEST_ASSERT(stmt != NULL);
+    TEST_ASSERT(db_step(stmt) == STEP_ROW);
+    TEST_ASSERT(db_column_count(stmt) == 3);
+    TEST_ASSERT(db_column_int(stmt, 0) == min);
+    TEST_ASSERT(db_column_int(stmt, 1) == max);
+    TEST_ASSERT(db_column_int(stmt, 2) == sum);
+    TEST_ASSERT(db_step(stmt) == STEP_DONE);
+    db_finalize(stmt);
+}
+
+void test_aggregates_of_no_rows(){
+    /* min, max and sum of no rows are all NULL, -1 from db_column_int(),
+       whether the table is empty or the where matches nothing */
+    const char* aggregates = "select min(id), max(id), sum(id)";
+    PagerOptions options = test_options();
+    Table* table = test_open_empty(&options);
+    test_check_aggregates(table, aggregates, -1, -1, -1);
+    db_close(table);
+
+    table = test_open_filled(&options, 100, test_make_row);
+    test_check_aggregates(table, aggregates, 1, 100, 5050);
+    test_check_aggregates(table, "select min(id), max(id), sum(id) where id > 100", -1, -1, -1);
+    test_check_aggregates(table, "select min(id), max(id), sum(id) where username = nobody", -1, -1, -1);
+
+    db_close(table);
+    test_remove_files();
+    printf("ok test_aggregates_of_no_rows\n");
+}
+
+void test_page_size_mismatch(){
+    /* Databases open at once share the page layout, so opening one with
+       another page size, or with a size that cannot be used, fails
+       without disturbing the database already open */
+    PagerOptions options = test_options();
+    Table* table = test_open_empty(&options);
+    test_execute(table, "insert 1 user1 user1@example.com");
+
+    PagerOptions other = options;
+    other.page_size = 8192;
+    unlink(TEST_FILE "2");
+    TEST_ASSERT(db_open(TEST_FILE "2", &other) == NULL);
+
+    other.page_size = 5000;
+    TEST_ASSERT(db_open(TEST_FILE "2", &other) == NULL);
+    TEST_ASSERT(test_count(table, "select count(*)") == 1);
+
+    db_close(table);
+    unlink(TEST_FILE "2");
+    test_remove_files();
+    printf("ok test_page_size_mismatch\n");
+}
+
+off_t test_file_size(const char* filename){
+    struct stat file_stat;
+    TEST_ASSERT(stat(filename, &file_stat) == 0);
+
+    return file_stat.st_size;
+}
+
+void test_make_compressible_row(uint32_t id, Row* row){
+    test_make_row(id, row);
+    sprintf(row->email, "user%u@aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa.example.com", id);
+}
+
+off_t test_build_compressible(PagerOptions* options){
+    /* Fill a table with rows that compress well, rewrite every row, take
+       most of them out again, and return the size of the closed file */
+    Table* table = test_open_filled(options, 50000, test_make_compressible_row);
+    test_execute(table, "update set username = bbbbbbbbbbbbbbbbbbbbbbbb where id > 0");
+    test_execute(table, "delete where id > 10000");
+    TEST_ASSERT(test_count(table, "select count(*)") == 10000);
+    db_close(table);
+
+    off_t size = test_file_size(TEST_FILE);
+    table = db_open(TEST_FILE, options);
+    TEST_ASSERT(test_count(table, "select count(*) where username = bbbbbbbbbbbbbbbbbbbbbbbb") == 10000);
+    db_close(table);
+    test_remove_files();
+
+    return size;
+}
+
+void test_compressed_file_size(){
+    /* The same compressible table takes under a quarter of the space in
+       a compressed file, even once rewrites and deletes have left holes
+       that a plain file keeps on its freelist */
+    PagerOptions plain = test_options();
+    PagerOptions compressed = test_options();
+    compressed.use_compression = true;
+    off_t plain_size = test_build_compressible(&plain);
+    off_t compressed_size = test_build_compressible(&compressed);
+
+    TEST_ASSERT(compressed_size * 4 < plain_size);
+    printf("ok test_compressed_file_size\n");
+}
+
+int main(){
+    test_index_duplicates();
+    test_prepared_stream();
+    test_aggregates_of_no_rows();
+    test_page_size_mismatch();
+    test_compressed_file_size();
+
+    return 0;
+}